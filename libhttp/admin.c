@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Interval at which the admin handler checks for workers which could not
+ * send their description, in milliseconds */
+#define HTTP_ADMIN_POLL_INTERVAL 100
+
+/* Connections belong to the thread running their event loop and cannot be
+ * read by other threads. The admin handler describes the connections of
+ * its own thread, and posts a task to every other worker; each task
+ * describes the connections of its worker and is posted back to the admin
+ * connection, whose handler is suspended until all descriptions have been
+ * received.
+ *
+ * Descriptions can arrive after the handler returned (e.g. if the admin
+ * connection was closed), so the collection is reference counted. It is
+ * only accessed by the thread of the admin connection, except for its
+ * reference count and failure fields: a worker which cannot post its
+ * description back (full mailbox) records the failure and drops its
+ * reference itself. Since no message can signal it, the handler checks
+ * for failures periodically while it waits. */
+
+struct http_admin_snapshot {
+    struct bf_buffer *buf;
+
+    /* Indexed as the routes of the route base */
+    size_t *nb_in_flight;
+    size_t *nb_parked;
+};
+
+struct http_admin_collection {
+    size_t refcount; /* atomic */
+    bool abandoned; /* the handler returned */
+
+    size_t nb_routes;
+    size_t nb_pending;
+
+    /* Indexed by thread; written by workers before nb_failed is
+     * incremented */
+    bool *failed;
+    size_t nb_failed; /* atomic */
+
+    struct http_admin_snapshot snapshot;
+};
+
+struct http_admin_request {
+    struct http_admin_collection *collection;
+    struct http_connection_handle handle;
+
+    size_t thread_idx;
+    struct http_admin_snapshot snapshot;
+};
+
+static void http_admin_snapshot_init(struct http_admin_snapshot *, size_t);
+static void http_admin_snapshot_free(struct http_admin_snapshot *);
+static void http_admin_snapshot_merge(struct http_admin_snapshot *,
+                                      const struct http_admin_snapshot *,
+                                      size_t);
+static void http_admin_snapshot_collect(struct http_admin_snapshot *,
+                                        struct http_server *, size_t);
+
+static struct http_admin_collection *http_admin_collection_new(size_t,
+                                                               size_t);
+static void http_admin_collection_release(struct http_admin_collection *);
+
+static void http_admin_on_worker_task(struct http_server *, void *);
+static void http_admin_on_snapshot(struct http_connection *, void *);
+static void http_admin_on_poll_timer(evutil_socket_t, short, void *);
+
+static void http_admin_write_routes(struct bf_buffer *,
+                                    const struct http_route_base *,
+                                    const struct http_admin_snapshot *);
+
+static const char *http_admin_connection_state(const struct http_connection *);
+
+void
+http_admin_on_request(struct http_connection *connection,
+                      const struct http_msg *msg, void *arg) {
+    struct http_admin_collection *collection;
+    struct http_server *server, *main_server;
+    struct http_route_base *base;
+    struct http_headers *headers;
+    struct event *poll_timer;
+    struct bf_buffer *buf;
+
+    server = connection->server;
+    main_server = server->main_server ? server->main_server : server;
+    base = server->route_base;
+
+    collection = http_admin_collection_new(base->nb_routes,
+                                           main_server->nb_workers);
+    buf = collection->snapshot.buf;
+
+    poll_timer = NULL;
+
+    if (main_server->nb_workers == 0)
+        http_admin_snapshot_collect(&collection->snapshot, server, 0);
+
+    for (size_t i = 0; i < main_server->nb_workers; i++) {
+        struct http_admin_request *request;
+        struct http_worker *worker;
+
+        worker = main_server->workers[i];
+
+        if (worker == server->worker) {
+            http_admin_snapshot_collect(&collection->snapshot, server, i);
+            continue;
+        }
+
+        request = http_malloc0(sizeof(struct http_admin_request));
+
+        request->collection = collection;
+        http_connection_get_handle(connection, &request->handle);
+        request->thread_idx = i;
+
+        if (http_worker_post(worker, http_admin_on_worker_task,
+                             request) == -1) {
+            bf_buffer_add_printf(buf, "thread %zu: unavailable: %s\n",
+                                 i, http_get_error());
+            http_free(request);
+            continue;
+        }
+
+        __atomic_add_fetch(&collection->refcount, 1, __ATOMIC_RELAXED);
+        collection->nb_pending++;
+    }
+
+    if (collection->nb_pending > 0) {
+        struct timeval tv;
+
+        tv.tv_sec = HTTP_ADMIN_POLL_INTERVAL / 1000;
+        tv.tv_usec = (HTTP_ADMIN_POLL_INTERVAL % 1000) * 1000;
+
+        poll_timer = event_new(server->ev_base, -1, EV_PERSIST,
+                               http_admin_on_poll_timer, connection);
+        if (!poll_timer || evtimer_add(poll_timer, &tv) == -1) {
+            http_connection_error(connection, "cannot start timer: %s",
+                                  strerror(errno));
+        }
+    }
+
+    while (collection->nb_pending
+           > __atomic_load_n(&collection->nb_failed, __ATOMIC_ACQUIRE)) {
+        if (http_connection_suspend(connection) == -1)
+            goto end;
+    }
+
+    for (size_t i = 0; i < main_server->nb_workers; i++) {
+        if (collection->failed[i])
+            bf_buffer_add_printf(buf, "thread %zu: unavailable\n", i);
+    }
+
+    http_admin_write_routes(buf, base, &collection->snapshot);
+
+    headers = http_headers_new();
+    http_headers_add_header(headers, "Content-Type", "text/plain");
+
+    if (http_connection_send_response_with_body(connection, HTTP_OK,
+                                                headers,
+                                                bf_buffer_data(buf),
+                                                bf_buffer_length(buf)) == -1) {
+        http_connection_error(connection, "cannot send response: %s",
+                              http_get_error());
+    }
+
+end:
+    if (poll_timer)
+        event_free(poll_timer);
+
+    collection->abandoned = true;
+    http_admin_collection_release(collection);
+}
+
+static void
+http_admin_snapshot_init(struct http_admin_snapshot *snapshot,
+                         size_t nb_routes) {
+    memset(snapshot, 0, sizeof(struct http_admin_snapshot));
+
+    snapshot->buf = bf_buffer_new(0);
+
+    snapshot->nb_in_flight = http_calloc(nb_routes + 1, sizeof(size_t));
+    snapshot->nb_parked = http_calloc(nb_routes + 1, sizeof(size_t));
+}
+
+static void
+http_admin_snapshot_free(struct http_admin_snapshot *snapshot) {
+    bf_buffer_delete(snapshot->buf);
+
+    http_free(snapshot->nb_in_flight);
+    http_free(snapshot->nb_parked);
+
+    memset(snapshot, 0, sizeof(struct http_admin_snapshot));
+}
+
+static void
+http_admin_snapshot_merge(struct http_admin_snapshot *snapshot,
+                          const struct http_admin_snapshot *thread_snapshot,
+                          size_t nb_routes) {
+    bf_buffer_add(snapshot->buf, bf_buffer_data(thread_snapshot->buf),
+                  bf_buffer_length(thread_snapshot->buf));
+
+    for (size_t i = 0; i < nb_routes; i++) {
+        snapshot->nb_in_flight[i] += thread_snapshot->nb_in_flight[i];
+        snapshot->nb_parked[i] += thread_snapshot->nb_parked[i];
+    }
+}
+
+static void
+http_admin_snapshot_collect(struct http_admin_snapshot *snapshot,
+                            struct http_server *server, size_t thread_idx) {
+    struct http_route_base *base;
+    struct http_connection *connection;
+    struct bf_buffer *buf;
+    uint64_t now;
+
+    base = server->route_base;
+    buf = snapshot->buf;
+
+    if (http_now_ms(&now) == -1) {
+        bf_buffer_add_printf(buf, "thread %zu: %s\n",
+                             thread_idx, http_get_error());
+        return;
+    }
+
+    bf_buffer_add_printf(buf, "thread %zu: %zu connections\n",
+                         thread_idx, server->nb_connections);
+
+    for (connection = server->connections_first; connection;
+         connection = connection->next) {
+        const struct http_request_info *info;
+        const struct http_msg *msg;
+        size_t nb_requests;
+
+        nb_requests = 0;
+        for (info = connection->requests_first; info; info = info->next)
+            nb_requests++;
+
+        bf_buffer_add_printf(buf,
+                             "  %s age=%" PRIu64 "ms state=%s"
+                             " in=%" PRIu64 " out=%" PRIu64 " requests=%zu"
+                             " rbuf=%zu wstream=%zu inactive=%" PRIu64 "ms\n",
+                             connection->address,
+                             now - connection->creation_time,
+                             http_admin_connection_state(connection),
+                             connection->nb_bytes_read,
+                             connection->nb_bytes_written,
+                             nb_requests,
+                             bf_buffer_length(connection->rbuf),
+                             http_stream_buffered_size(connection->wstream),
+                             now - connection->last_activity);
+
+        msg = connection->current_msg;
+        if (!msg || !connection->current_route)
+            continue;
+
+        if (msg->u.request.response_sent && !connection->is_streaming_response)
+            continue;
+
+        for (size_t i = 0; i < base->nb_routes; i++) {
+            if (base->routes[i] != connection->current_route)
+                continue;
+
+            if (connection->is_parked) {
+                snapshot->nb_parked[i]++;
+            } else {
+                snapshot->nb_in_flight[i]++;
+            }
+
+            break;
+        }
+    }
+}
+
+static struct http_admin_collection *
+http_admin_collection_new(size_t nb_routes, size_t nb_threads) {
+    struct http_admin_collection *collection;
+
+    collection = http_malloc0(sizeof(struct http_admin_collection));
+
+    collection->refcount = 1;
+    collection->nb_routes = nb_routes;
+
+    collection->failed = http_calloc(nb_threads + 1, sizeof(bool));
+
+    http_admin_snapshot_init(&collection->snapshot, nb_routes);
+
+    return collection;
+}
+
+static void
+http_admin_collection_release(struct http_admin_collection *collection) {
+    if (__atomic_sub_fetch(&collection->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    http_admin_snapshot_free(&collection->snapshot);
+    http_free(collection->failed);
+
+    memset(collection, 0, sizeof(struct http_admin_collection));
+    http_free(collection);
+}
+
+static void
+http_admin_on_worker_task(struct http_server *server, void *arg) {
+    struct http_admin_request *request;
+
+    request = arg;
+
+    /* Runs in the worker thread: the collection must not be accessed */
+    http_admin_snapshot_init(&request->snapshot,
+                             server->route_base->nb_routes);
+    http_admin_snapshot_collect(&request->snapshot, server,
+                                request->thread_idx);
+
+    if (http_connection_post(&request->handle, http_admin_on_snapshot,
+                             request) == -1) {
+        struct http_admin_collection *collection;
+
+        http_server_error(server, "cannot post admin snapshot: %s",
+                          http_get_error());
+
+        collection = request->collection;
+
+        /* The admin handler notices the failure the next time it polls */
+        collection->failed[request->thread_idx] = true;
+        __atomic_add_fetch(&collection->nb_failed, 1, __ATOMIC_RELEASE);
+
+        http_admin_snapshot_free(&request->snapshot);
+        http_free(request);
+
+        http_admin_collection_release(collection);
+    }
+}
+
+static void
+http_admin_on_snapshot(struct http_connection *connection, void *arg) {
+    struct http_admin_collection *collection;
+    struct http_admin_request *request;
+    bool wake_up;
+
+    request = arg;
+    collection = request->collection;
+
+    if (!collection->abandoned) {
+        http_admin_snapshot_merge(&collection->snapshot, &request->snapshot,
+                                  collection->nb_routes);
+        collection->nb_pending--;
+    }
+
+    http_admin_snapshot_free(&request->snapshot);
+    http_free(request);
+
+    /* If the connection still exists, its handler has not returned, and
+     * still holds a reference to the collection. */
+    wake_up = connection && !collection->abandoned
+           && collection->nb_pending
+              <= __atomic_load_n(&collection->nb_failed, __ATOMIC_ACQUIRE);
+
+    http_admin_collection_release(collection);
+
+    if (wake_up)
+        http_connection_wake_up(connection);
+}
+
+static void
+http_admin_on_poll_timer(evutil_socket_t fd, short events, void *arg) {
+    struct http_connection *connection;
+
+    connection = arg;
+
+    /* The handler checks whether all descriptions were received or could
+     * not be sent, and suspends itself again if not */
+    http_connection_wake_up(connection);
+}
+
+static void
+http_admin_write_routes(struct bf_buffer *buf,
+                        const struct http_route_base *base,
+                        const struct http_admin_snapshot *snapshot) {
+    bf_buffer_add_string(buf, "routes:\n");
+
+    for (size_t i = 0; i < base->nb_routes; i++) {
+        const struct http_route *route;
+
+        route = base->routes[i];
+
+        bf_buffer_add_printf(buf, "  %s %s in_flight=%zu",
+                             http_method_to_string(route->method),
+                             route->path, snapshot->nb_in_flight[i]);
+
+        if (route->limiter) {
+            struct http_route_stats stats;
+
+            http_route_limiter_get_stats(route->limiter, &stats);
+
+            /* Slots are counted by the limiter for all threads */
+            bf_buffer_add_printf(buf, " queued=%zu slots=%zu/%zu",
+                                 snapshot->nb_parked[i], stats.nb_in_flight,
+                                 route->options.max_concurrency);
+        }
+
+        bf_buffer_add_string(buf, "\n");
+    }
+}
+
+static const char *
+http_admin_connection_state(const struct http_connection *connection) {
+    const struct http_msg *msg;
+
+    msg = connection->current_msg;
+
+    if (connection->shutting_down)
+        return "closing";
+
+    if (connection->ssl && !SSL_is_init_finished(connection->ssl))
+        return "handshake";
+
+    if (connection->is_parked)
+        return "queued";
+
+    if (msg && (connection->msg_handler_called || msg->is_complete)
+     && (!msg->u.request.response_sent || connection->is_streaming_response)) {
+        return "handler";
+    }
+
+    /* The idle state is only updated once input has been processed */
+    if (connection->is_idle && !msg)
+        return "idle";
+
+    if (!msg && !http_stream_is_empty(connection->wstream))
+        return "writing";
+
+    switch (connection->parser.state) {
+    case HTTP_PARSER_BODY:
+    case HTTP_PARSER_TRAILER:
+        return "body";
+
+    default:
+        break;
+    }
+
+    if (msg && msg->u.request.response_sent)
+        return "writing";
+
+    return "headers";
+}
@@ -29,6 +29,8 @@ http_cfg_init_server(struct http_cfg *cfg) {
 
     cfg->u.server.connection_backlog = 5;
     cfg->u.server.max_request_uri_length = 2048;
+    cfg->u.server.max_ranges = 64;
+    cfg->u.server.min_idle_timeout = 1000;
     cfg->u.server.error_sender = http_default_error_sender;
 }
 
@@ -37,6 +39,10 @@ http_cfg_init_client(struct http_cfg *cfg) {
     http_cfg_init_base(cfg);
 
     cfg->u.client.max_reason_phrase_length = 128;
+    cfg->u.client.expect_continue_timeout = 1000;
+    cfg->u.client.dns_cache_ttl = 60 * 1000;
+    cfg->u.client.dns_negative_cache_ttl = 5 * 1000;
+    cfg->u.client.connection_attempt_delay = 250;
 }
 
 void
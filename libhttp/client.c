@@ -21,6 +21,7 @@
 
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -31,6 +32,19 @@
 
 static void http_client_disconnect(struct http_client *);
 
+static void http_client_order_addresses(struct http_client *,
+                                        struct http_address *, size_t);
+static int http_client_connect(struct http_client *,
+                               const struct http_address *, size_t,
+                               size_t *);
+static int http_client_start_attempt(struct http_client *,
+                                     const struct http_address *);
+
+static bool http_client_expects_continue(const struct http_client *, size_t);
+static void http_client_wait_for_continue(struct http_client *);
+static void http_client_release_body(struct http_client *);
+static void http_client_on_continue_timer(evutil_socket_t, short, void *);
+
 static void  http_client_init_request_headers(struct http_client *,
                                               const struct http_uri *,
                                               struct http_headers *);
@@ -38,7 +52,10 @@ static void  http_client_init_request_headers(struct http_client *,
 struct http_client *
 http_client_new(struct http_cfg *cfg, struct event_base *ev_base) {
     struct http_client *client;
-    struct addrinfo hints, *res;
+    const struct http_address *address;
+    const struct sockaddr *addr;
+    struct http_address *addresses;
+    size_t nb_addresses, idx;
     int ret;
 
     client = http_malloc0(sizeof(struct http_client));
@@ -46,81 +63,52 @@ http_client_new(struct http_cfg *cfg, struct event_base *ev_base) {
     client->cfg = cfg;
     client->ev_base = ev_base;
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_flags = 0;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_addrlen = 0;
+    client->sock = -1;
 
-    ret = getaddrinfo(cfg->host, cfg->port, &hints, &res);
-    if (ret != 0) {
-        http_set_error("cannot resolve address %s:%s: %s",
-                       cfg->host, cfg->port, gai_strerror(ret));
+    if (http_resolve(cfg->host, cfg->port, AF_UNSPEC,
+                     cfg->u.client.dns_cache_ttl,
+                     cfg->u.client.dns_negative_cache_ttl,
+                     &addresses, &nb_addresses) == -1) {
         goto error;
     }
 
-    client->sock = -1;
-    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
-        client->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (client->sock == -1) {
-            http_client_error(client, "cannot create socket: %s",
-                              strerror(errno));
-            continue;
-        }
+    http_client_order_addresses(client, addresses, nb_addresses);
 
-        ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-                          client->numeric_host, NI_MAXHOST,
-                          client->port, NI_MAXSERV,
-                          NI_NUMERICHOST | NI_NUMERICSERV);
-        if (ret != 0) {
-            http_set_error("cannot resolve address: %s", gai_strerror(ret));
-            freeaddrinfo(res);
-            goto error;
-        }
+    if (http_client_connect(client, addresses, nb_addresses, &idx) == -1) {
+        http_free(addresses);
+        goto error;
+    }
 
-        ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-                          client->host, NI_MAXHOST,
-                          NULL, 0,
-                          0);
-        if (ret != 0) {
-            http_set_error("cannot resolve address: %s", gai_strerror(ret));
-            freeaddrinfo(res);
-            goto error;
-        }
+    address = addresses + idx;
+    addr = (const struct sockaddr *)&address->addr;
 
-        snprintf(client->host_port, HTTP_HOST_PORT_BUFSZ,
-                 "%s:%s", client->host, client->port);
+    ret = getnameinfo(addr, address->addrlen,
+                      client->numeric_host, NI_MAXHOST,
+                      client->port, NI_MAXSERV,
+                      NI_NUMERICHOST | NI_NUMERICSERV);
+    if (ret != 0) {
+        http_set_error("cannot resolve address: %s", gai_strerror(ret));
+        http_free(addresses);
+        goto error;
+    }
 
-        if (ai->ai_family == AF_INET) {
-            snprintf(client->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
-                     "%s:%s", client->numeric_host, client->port);
-        } else if (ai->ai_family == AF_INET6) {
-            snprintf(client->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
-                     "[%s]:%s", client->numeric_host, client->port);
-        } else {
-            http_set_error("unknown address family %d", ai->ai_family);
-            freeaddrinfo(res);
-            goto error;
-        }
+    memcpy(client->host, address->host, NI_MAXHOST);
 
-        if (connect(client->sock, ai->ai_addr, ai->ai_addrlen) == -1) {
-            http_client_error(client, "cannot connect to %s",
-                              client->numeric_host_port);
-            close(client->sock);
-            client->sock = -1;
-            continue;
-        }
+    snprintf(client->host_port, HTTP_HOST_PORT_BUFSZ,
+             "%s:%s", client->host, client->port);
 
-        break;
+    if (address->family == AF_INET6) {
+        snprintf(client->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
+                 "[%s]:%s", client->numeric_host, client->port);
+    } else {
+        snprintf(client->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
+                 "%s:%s", client->numeric_host, client->port);
     }
 
-    freeaddrinfo(res);
+    http_resolver_set_preferred_family(cfg->host, cfg->port, AF_UNSPEC,
+                                       address->family);
 
-    if (client->sock == -1) {
-        http_set_error("cannot connect to %s:%s", cfg->host, cfg->port);
-        goto error;
-    }
+    http_free(addresses);
 
     client->connection = http_connection_new(HTTP_CONNECTION_CLIENT, client,
                                              client->sock);
@@ -141,13 +129,19 @@ http_client_delete(struct http_client *client) {
     if (!client)
         return;
 
+    if (client->hedger)
+        http_hedger_remove_client(client->hedger, client);
+
+    /* The connection owns the socket once it has been created */
+    http_connection_delete(client->connection);
+
     if (client->sock >= 0)
         close(client->sock);
 
     if (client->ev_sock)
         event_free(client->ev_sock);
-
-    http_connection_delete(client->connection);
+    if (client->ev_continue)
+        event_free(client->ev_continue);
 
     memset(client, 0, sizeof(struct http_client));
     http_free(client);
@@ -164,6 +158,12 @@ http_client_send_request(struct http_client *client, enum http_method method,
                          struct http_headers *headers) {
     char *path;
 
+    if (!client->connection) {
+        http_set_error("client is not connected");
+        http_headers_delete(headers);
+        return -1;
+    }
+
     path = http_uri_encode_path_and_query(uri);
     if (!path)
         return -1;
@@ -198,8 +198,15 @@ http_client_send_request_with_body(struct http_client *client,
                                    const struct http_uri *uri,
                                    struct http_headers *headers,
                                    const char *body, size_t bodysz) {
+    bool expect_continue;
     char *path;
 
+    if (!client->connection) {
+        http_set_error("client is not connected");
+        http_headers_delete(headers);
+        return -1;
+    }
+
     path = http_uri_encode_path_and_query(uri);
     if (!path)
         return -1;
@@ -211,15 +218,25 @@ http_client_send_request_with_body(struct http_client *client,
 
     http_headers_format_header(headers, "Content-Length", "%zu", bodysz);
 
+    expect_continue = http_client_expects_continue(client, bodysz);
+    if (expect_continue)
+        http_headers_set_header(headers, "Expect", "100-continue");
+
     if (http_connection_write_request(client->connection, method, path) == -1)
         goto error;
 
     http_connection_write_headers(client->connection, headers);
     http_connection_write(client->connection, "\r\n", 2);
+
+    if (expect_continue)
+        http_stream_hold_next_entry(client->connection->wstream);
     http_connection_write(client->connection, body, bodysz);
 
     http_connection_track_request_send(client->connection, method, path);
 
+    if (expect_continue)
+        http_client_wait_for_continue(client);
+
     http_free(path);
     http_headers_delete(headers);
     return 0;
@@ -238,8 +255,16 @@ http_client_send_request_with_file(struct http_client *client,
                                    struct http_headers *headers,
                                    const char *file_path, int fd,
                                    size_t file_sz) {
+    bool expect_continue;
     char *path;
 
+    if (!client->connection) {
+        http_set_error("client is not connected");
+        close(fd);
+        http_headers_delete(headers);
+        return -1;
+    }
+
     path = http_uri_encode_path_and_query(uri);
     if (!path)
         return -1;
@@ -251,15 +276,25 @@ http_client_send_request_with_file(struct http_client *client,
 
     http_headers_format_header(headers, "Content-Length", "%zu", file_sz);
 
+    expect_continue = http_client_expects_continue(client, file_sz);
+    if (expect_continue)
+        http_headers_set_header(headers, "Expect", "100-continue");
+
     if (http_connection_write_request(client->connection, method, path) == -1)
         goto error;
 
     http_connection_write_headers(client->connection, headers);
     http_connection_write(client->connection, "\r\n", 2);
+
+    if (expect_continue)
+        http_stream_hold_next_entry(client->connection->wstream);
     http_stream_add_file(client->connection->wstream, fd, file_sz, file_path);
 
     http_connection_track_request_send(client->connection, method, path);
 
+    if (expect_continue)
+        http_client_wait_for_continue(client);
+
     http_free(path);
     http_headers_delete(headers);
     return 0;
@@ -271,6 +306,46 @@ error:
     return -1;
 }
 
+void
+http_client_set_last_request_handler(struct http_client *client,
+                                     http_response_handler handler,
+                                     void *arg) {
+    struct http_request_info *info;
+
+    info = client->connection->requests_last;
+
+    info->response_handler = handler;
+    info->response_handler_arg = arg;
+}
+
+void
+http_client_on_continue(struct http_client *client) {
+    if (!client->continue_request)
+        return;
+
+    http_client_trace(client, "100 continue received, sending body");
+    http_client_release_body(client);
+}
+
+void
+http_client_on_final_response(struct http_client *client,
+                              const struct http_request_info *info) {
+    if (!info || info != client->continue_request)
+        return;
+
+    /* The server answered without waiting for the body. It announced the
+     * length of the body, so the connection cannot be reused. */
+    http_client_trace(client, "early response received, dropping body");
+
+    if (client->ev_continue)
+        evtimer_del(client->ev_continue);
+
+    http_stream_drop_held_entry(client->connection->wstream);
+
+    client->continue_request = NULL;
+    client->continue_body_dropped = true;
+}
+
 void
 http_client_error(const struct http_client *client, const char *fmt, ...) {
     char buf[HTTP_ERROR_BUFSZ];
@@ -307,6 +382,317 @@ http_client_disconnect(struct http_client *client) {
     client->connection = NULL;
 }
 
+static void
+http_client_order_addresses(struct http_client *client,
+                            struct http_address *addresses,
+                            size_t nb_addresses) {
+    struct http_address *preferred, *others;
+    size_t nb_preferred, nb_others, i;
+    int family;
+
+    if (nb_addresses == 0)
+        return;
+
+    /* Without any previous connection, trust the order of the resolver,
+     * which follows the address selection rules of the system. */
+    family = http_resolver_preferred_family(client->cfg->host,
+                                            client->cfg->port, AF_UNSPEC);
+    if (family == AF_UNSPEC)
+        family = addresses[0].family;
+
+    preferred = http_calloc(nb_addresses, sizeof(struct http_address));
+    others = http_calloc(nb_addresses, sizeof(struct http_address));
+
+    nb_preferred = 0;
+    nb_others = 0;
+
+    for (i = 0; i < nb_addresses; i++) {
+        if (addresses[i].family == family) {
+            preferred[nb_preferred++] = addresses[i];
+        } else {
+            others[nb_others++] = addresses[i];
+        }
+    }
+
+    /* Alternate between families so that a broken family only ever delays
+     * the connection by a single attempt. */
+    i = 0;
+    for (size_t p = 0, o = 0; p < nb_preferred || o < nb_others;) {
+        if (p < nb_preferred)
+            addresses[i++] = preferred[p++];
+        if (o < nb_others)
+            addresses[i++] = others[o++];
+    }
+
+    http_free(preferred);
+    http_free(others);
+}
+
+static int
+http_client_connect(struct http_client *client,
+                    const struct http_address *addresses,
+                    size_t nb_addresses, size_t *pidx) {
+    const struct http_cfg *cfg;
+    struct pollfd *fds;
+    size_t *fd_addresses;
+    size_t nb_fds, next_address, winner;
+    uint64_t now, deadline, next_attempt;
+    int flags;
+
+    cfg = client->cfg;
+
+    fds = http_calloc(nb_addresses, sizeof(struct pollfd));
+    fd_addresses = http_calloc(nb_addresses, sizeof(size_t));
+
+    nb_fds = 0;
+    next_address = 0;
+
+    if (http_now_ms(&now) == -1)
+        goto error;
+
+    deadline = now + cfg->connection_timeout;
+    next_attempt = now;
+
+    for (;;) {
+        uint64_t timeout;
+        bool attempt_failed;
+        int ret;
+
+        /* Start a new attempt if the previous one has been running for
+         * long enough, or if there is none left running */
+        while (next_address < nb_addresses
+               && (now >= next_attempt || nb_fds == 0)) {
+            int sock;
+
+            sock = http_client_start_attempt(client,
+                                             addresses + next_address);
+            next_address++;
+
+            if (sock == -1)
+                continue;
+
+            fds[nb_fds].fd = sock;
+            fds[nb_fds].events = POLLOUT;
+            fd_addresses[nb_fds] = next_address - 1;
+            nb_fds++;
+
+            next_attempt = now + cfg->u.client.connection_attempt_delay;
+            break;
+        }
+
+        if (nb_fds == 0) {
+            http_set_error("cannot connect to %s:%s", cfg->host, cfg->port);
+            goto error;
+        }
+
+        if (now >= deadline) {
+            http_set_error("cannot connect to %s:%s: timeout",
+                           cfg->host, cfg->port);
+            goto error;
+        }
+
+        timeout = deadline - now;
+        if (next_address < nb_addresses)
+            timeout = MIN(timeout, next_attempt - now);
+
+        ret = poll(fds, (nfds_t)nb_fds, (int)timeout);
+        if (ret == -1 && errno != EINTR) {
+            http_set_error("cannot poll sockets: %s", strerror(errno));
+            goto error;
+        }
+
+        attempt_failed = false;
+
+        for (size_t i = 0; ret > 0 && i < nb_fds;) {
+            socklen_t len;
+            int error;
+
+            if (fds[i].revents == 0) {
+                i++;
+                continue;
+            }
+
+            len = sizeof(int);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR,
+                           &error, &len) == -1) {
+                error = errno;
+            }
+
+            if (error == 0) {
+                winner = i;
+                goto connected;
+            }
+
+            http_client_error(client, "cannot connect to %s: %s",
+                              addresses[fd_addresses[i]].numeric_host,
+                              strerror(error));
+
+            close(fds[i].fd);
+
+            nb_fds--;
+            fds[i] = fds[nb_fds];
+            fd_addresses[i] = fd_addresses[nb_fds];
+
+            attempt_failed = true;
+        }
+
+        if (http_now_ms(&now) == -1)
+            goto error;
+
+        /* There is no reason to wait once an attempt failed */
+        if (attempt_failed)
+            next_attempt = now;
+    }
+
+connected:
+    for (size_t i = 0; i < nb_fds; i++) {
+        if (i != winner)
+            close(fds[i].fd);
+    }
+
+    client->sock = fds[winner].fd;
+    *pidx = fd_addresses[winner];
+
+    http_free(fds);
+    http_free(fd_addresses);
+
+    /* The rest of the client uses blocking sockets */
+    flags = fcntl(client->sock, F_GETFL, 0);
+    if (flags == -1
+     || fcntl(client->sock, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        http_set_error("cannot set socket blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+
+error:
+    for (size_t i = 0; i < nb_fds; i++)
+        close(fds[i].fd);
+
+    http_free(fds);
+    http_free(fd_addresses);
+    return -1;
+}
+
+static int
+http_client_start_attempt(struct http_client *client,
+                          const struct http_address *address) {
+    const struct sockaddr *addr;
+    int sock, flags;
+
+    addr = (const struct sockaddr *)&address->addr;
+
+    sock = socket(address->family, address->socktype, address->protocol);
+    if (sock == -1) {
+        http_client_error(client, "cannot create socket: %s",
+                          strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        http_client_error(client, "cannot set socket non-blocking: %s",
+                          strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    http_client_trace(client, "connecting to %s", address->numeric_host);
+
+    if (connect(sock, addr, address->addrlen) == -1
+     && errno != EINPROGRESS) {
+        http_client_error(client, "cannot connect to %s: %s",
+                          address->numeric_host, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static bool
+http_client_expects_continue(const struct http_client *client,
+                             size_t body_sz) {
+    size_t threshold;
+
+    threshold = client->cfg->u.client.expect_continue_threshold;
+    if (threshold == 0 || body_sz < threshold)
+        return false;
+
+    /* Only one body is held at a time; requests sent in the meantime are
+     * written after it anyway. */
+    return !client->continue_request;
+}
+
+static void
+http_client_wait_for_continue(struct http_client *client) {
+    struct http_connection *connection;
+    uint64_t timeout;
+    struct timeval tv;
+
+    connection = client->connection;
+
+    client->continue_request = connection->requests_last;
+
+    if (!client->ev_continue) {
+        client->ev_continue = evtimer_new(client->ev_base,
+                                          http_client_on_continue_timer,
+                                          client);
+        if (!client->ev_continue) {
+            http_client_error(client, "cannot create timer: %s",
+                              strerror(errno));
+            http_client_release_body(client);
+            return;
+        }
+    }
+
+    timeout = client->cfg->u.client.expect_continue_timeout;
+
+    tv.tv_sec = (time_t)(timeout / 1000);
+    tv.tv_usec = (suseconds_t)((timeout % 1000) * 1000);
+
+    if (evtimer_add(client->ev_continue, &tv) == -1) {
+        http_client_error(client, "cannot start timer: %s", strerror(errno));
+        http_client_release_body(client);
+        return;
+    }
+}
+
+static void
+http_client_release_body(struct http_client *client) {
+    struct http_connection *connection;
+
+    connection = client->connection;
+
+    if (client->ev_continue)
+        evtimer_del(client->ev_continue);
+
+    client->continue_request = NULL;
+
+    http_stream_release_held_entry(connection->wstream);
+
+    if (!connection->is_ev_write_enabled) {
+        if (event_add(connection->ev_write, NULL) == -1) {
+            http_client_error(client, "cannot add write event handler: %s",
+                              strerror(errno));
+            return;
+        }
+
+        connection->is_ev_write_enabled = true;
+    }
+}
+
+static void
+http_client_on_continue_timer(evutil_socket_t sock, short events, void *arg) {
+    struct http_client *client;
+
+    client = arg;
+
+    http_client_trace(client, "no 100 continue received, sending body");
+    http_client_release_body(client);
+}
+
 static void
 http_client_init_request_headers(struct http_client *client,
                                  const struct http_uri *uri,
@@ -315,6 +701,6 @@ http_client_init_request_headers(struct http_client *client,
 
     cfg = client->cfg;
 
-    http_headers_set_header(headers, "Host", uri->host);
+    http_headers_set_header(headers, "Host", http_uri_host(uri));
     http_headers_add_headers(headers, cfg->default_headers);
 }
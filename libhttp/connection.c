@@ -26,8 +26,24 @@
 #include "http.h"
 #include "internal.h"
 
+/* Amount of body data waiting to be read by a coroutine handler above which
+ * we stop reading the connection, and amount of pending output data above
+ * which http_connection_write_body() waits for data to be sent. */
+#define HTTP_COROUTINE_BODY_BUFSZ (64 * 1024)
+#define HTTP_COROUTINE_OUTPUT_BUFSZ (64 * 1024)
+
 static int http_connection_find_route(struct http_connection *,
                                       struct http_msg *);
+
+static void http_connection_process_input(struct http_connection *);
+
+static int http_connection_admit_request(struct http_connection *,
+                                         const struct http_route *);
+static void http_connection_release_route_slot(struct http_route_limiter *);
+static int http_connection_notify_slot(const struct http_connection_handle *,
+                                       void *);
+static void http_connection_on_route_slot(struct http_connection *, void *);
+static void http_connection_leave_route(struct http_connection *);
 static int http_connection_preprocess_msg(struct http_connection *,
                                           struct http_msg *);
 static int http_connection_preprocess_request(struct http_connection *,
@@ -38,9 +54,20 @@ static void http_connection_on_response_sent(struct http_connection *,
                                              enum http_status_code);
 static void http_connection_call_request_handler(struct http_connection *,
                                                  struct http_msg *);
+static void http_connection_fail_response_handlers(struct http_connection *);
 static void http_connection_call_response_handler(struct http_connection *,
                                                   struct http_msg *);
-static void http_connection_on_msg_processed(struct http_connection *);
+static void http_connection_run_coroutine_handler(struct http_connection *,
+                                                  struct http_msg *);
+static void http_connection_coroutine_main(void *);
+static void http_connection_resume_coroutine(struct http_connection *);
+static void http_connection_on_coroutine_finished(struct http_connection *);
+static int http_connection_check_coroutine(struct http_connection *);
+static bool http_connection_on_msg_processed(struct http_connection *);
+static bool http_connection_is_last_request(const struct http_connection *);
+static bool http_connection_will_close(const struct http_connection *);
+static void http_connection_disable_keep_alive(struct http_connection *);
+static bool http_msg_keeps_connection_alive(const struct http_msg *);
 
 static int http_connection_init_response_headers(struct http_connection *,
                                                  struct http_headers *);
@@ -48,6 +75,13 @@ static int http_connection_write_options_response(struct http_connection *,
                                                   struct http_msg *);
 static int http_connection_write_405_error(struct http_connection *,
                                            struct http_msg *);
+static int http_connection_write_error(struct http_connection *,
+                                       enum http_status_code,
+                                       const struct http_error_response *);
+
+static const char *
+http_connection_guess_file_content_type(struct http_connection *,
+                                        const char *, int);
 
 struct http_connection *
 http_connection_new(enum http_connection_type type, void *client_or_server,
@@ -129,6 +163,8 @@ http_connection_new(enum http_connection_type type, void *client_or_server,
     if (http_now_ms(&connection->last_activity) == -1)
         goto error;
 
+    connection->creation_time = connection->last_activity;
+
     return connection;
 
 error:
@@ -143,6 +179,28 @@ http_connection_delete(struct http_connection *connection) {
     if (!connection)
         return;
 
+    assert(!connection->coroutine
+        || http_coroutine_current() != connection->coroutine);
+
+    if (connection->coroutine) {
+        /* Let the handler return before its stack is reused */
+        if (!http_coroutine_is_finished(connection->coroutine)) {
+            connection->coroutine_aborted = true;
+            http_coroutine_resume(connection->coroutine);
+        }
+
+        http_coroutine_delete(connection->coroutine);
+        bf_buffer_delete(connection->coroutine_body);
+    }
+
+    http_connection_leave_route(connection);
+
+    if (connection->waits_for_batch)
+        http_server_remove_batch_request(connection->server, connection);
+
+    if (connection->is_idle)
+        http_server_remove_idle_connection(connection->server, connection);
+
     if (connection->ev_read)
         event_free(connection->ev_read);
     if (connection->ev_write)
@@ -161,6 +219,27 @@ http_connection_delete(struct http_connection *connection) {
     if (connection->ssl)
         SSL_free(connection->ssl);
 
+    if (connection->type == HTTP_CONNECTION_CLIENT
+     && connection->client->connection == connection) {
+        struct http_client *client;
+
+        client = connection->client;
+
+        /* The socket was closed with the connection */
+        client->connection = NULL;
+        client->sock = -1;
+
+        client->continue_request = NULL;
+        if (client->ev_continue)
+            evtimer_del(client->ev_continue);
+
+        if (client->hedger)
+            http_hedger_on_client_closed(client->hedger, client);
+    }
+
+    if (connection->type == HTTP_CONNECTION_CLIENT)
+        http_connection_fail_response_handlers(connection);
+
     info = connection->requests_first;
     while (info) {
         struct http_request_info *next;
@@ -194,6 +273,47 @@ http_connection_check_for_timeout(struct http_connection *connection,
 
     cfg = http_connection_get_cfg(connection);
 
+    if (connection->is_parked && now >= connection->route_waiter.deadline) {
+        /* If the waiter is not waiting anymore, it was given a slot and
+         * will be resumed soon. */
+        if (http_route_limiter_cancel(connection->route_limiter,
+                                      &connection->route_waiter, true, now)) {
+            http_connection_trace(connection, "route queue timeout");
+
+            connection->is_parked = false;
+            connection->route_limiter = NULL;
+
+            /* The body of the request was not read, the connection cannot
+             * be reused. */
+            http_connection_disable_keep_alive(connection);
+            http_connection_send_error(connection, HTTP_SERVICE_UNAVAILABLE,
+                                       NULL);
+
+            if (http_connection_shutdown(connection) == -1) {
+                http_connection_error(connection,
+                                      "cannot shutdown connection: %s",
+                                      http_get_error());
+            }
+
+            return;
+        }
+    }
+
+    if (connection->is_idle) {
+        diff = now - connection->idle_since;
+        if (diff > connection->server->idle_timeout) {
+            http_connection_trace(connection, "idle timeout");
+
+            if (http_connection_shutdown(connection) == -1) {
+                http_connection_error(connection,
+                                      "cannot shutdown connection: %s",
+                                      http_get_error());
+            }
+        }
+
+        return;
+    }
+
     diff = now - connection->last_activity;
     if (diff > cfg->connection_timeout) {
         http_connection_trace(connection, "timeout");
@@ -202,6 +322,7 @@ http_connection_check_for_timeout(struct http_connection *connection,
          && (connection->parser.state == HTTP_PARSER_HEADER
           || connection->parser.state == HTTP_PARSER_BODY
           || connection->parser.state == HTTP_PARSER_TRAILER)) {
+            http_connection_disable_keep_alive(connection);
             http_connection_send_error(connection, HTTP_REQUEST_TIMEOUT, NULL);
         }
 
@@ -214,6 +335,48 @@ http_connection_check_for_timeout(struct http_connection *connection,
     }
 }
 
+void
+http_connection_update_idle_state(struct http_connection *connection) {
+    bool is_idle;
+
+    assert(connection->type == HTTP_CONNECTION_SERVER);
+
+    /* A connection is idle when it is waiting for a new request with
+     * nothing left to send: closing it does not lose anything. */
+    is_idle = !connection->shutting_down
+           && !connection->current_msg
+           && connection->parser.state == HTTP_PARSER_START
+           && bf_buffer_length(connection->rbuf) == 0
+           && http_stream_is_empty(connection->wstream);
+
+    if (is_idle == connection->is_idle)
+        return;
+
+    if (is_idle) {
+        if (http_now_ms(&connection->idle_since) == -1) {
+            http_connection_error(connection, "%s", http_get_error());
+            return;
+        }
+
+        http_server_add_idle_connection(connection->server, connection);
+    } else {
+        http_server_remove_idle_connection(connection->server, connection);
+    }
+}
+
+size_t
+http_connection_buffered_size(const struct http_connection *connection) {
+    size_t sz;
+
+    sz = bf_buffer_length(connection->rbuf);
+    sz += http_stream_buffered_size(connection->wstream);
+
+    if (connection->current_msg)
+        sz += connection->current_msg->body_length;
+
+    return sz;
+}
+
 void
 http_connection_write(struct http_connection *connection,
                       const void *data, size_t sz) {
@@ -254,6 +417,23 @@ http_connection_printf(struct http_connection *connection,
 
 void
 http_connection_discard(struct http_connection *connection) {
+    if (connection->in_batch) {
+        connection->discard_deferred = true;
+        return;
+    }
+
+    if (connection->coroutine
+     && http_coroutine_current() == connection->coroutine) {
+        /* The handler must return before the connection is deleted; it is
+         * discarded from the next write event, run by the event loop. */
+        connection->coroutine_aborted = true;
+        connection->discard_deferred = true;
+
+        event_del(connection->ev_read);
+        event_active(connection->ev_write, EV_WRITE, 0);
+        return;
+    }
+
     if (connection->sock >= 0) {
         if (connection->type == HTTP_CONNECTION_SERVER)
             http_server_unregister_connection(connection->server, connection);
@@ -396,10 +576,23 @@ http_connection_send_response_with_file(struct http_connection *connection,
     if (ranges) {
         http_ranges_simplify(ranges, file_sz, &simplified_ranges);
 
-        if (!http_ranges_is_satisfiable(&simplified_ranges, file_sz)) {
-            /* TODO HTTP_REQUEST_RANGE_NOT_SATISFIABLE */
-            http_set_error("range not satisfiable");
-            goto error;
+        if (simplified_ranges.nb_ranges == 0) {
+            http_ranges_free(&simplified_ranges);
+            close(fd);
+
+            if (!headers)
+                headers = http_headers_new();
+
+            /* RFC 7233 4.4: When this status code is generated in response
+             * to a byte-range request, the sender SHOULD generate a
+             * Content-Range header field specifying the current length of
+             * the selected representation. */
+            http_headers_format_header(headers, "Content-Range",
+                                       "bytes */%zu", file_sz);
+
+            return http_connection_send_response(connection,
+                                         HTTP_REQUEST_RANGE_NOT_SATISFIABLE,
+                                         headers);
         }
 
         ranges = &simplified_ranges;
@@ -424,6 +617,9 @@ http_connection_send_response_with_file(struct http_connection *connection,
     return 0;
 
 error:
+    if (ranges)
+        http_ranges_free(&simplified_ranges);
+
     close(fd);
     http_headers_delete(headers);
     return -1;
@@ -443,6 +639,17 @@ http_connection_send_error(struct http_connection *connection,
 
     cfg = http_connection_get_cfg(connection);
 
+    if (!fmt) {
+        const struct http_error_response *response;
+
+        response = http_server_error_response(connection->server,
+                                              status_code);
+        if (response) {
+            return http_connection_write_error(connection, status_code,
+                                               response);
+        }
+    }
+
     if (fmt) {
         va_start(ap, fmt);
         vsnprintf(errmsg, HTTP_ERROR_BUFSZ, fmt, ap);
@@ -456,6 +663,190 @@ http_connection_send_error(struct http_connection *connection,
     return ret;
 }
 
+int
+http_connection_read_body(struct http_connection *connection,
+                          void *buf, size_t sz, size_t *psz) {
+    struct bf_buffer *body;
+    size_t len;
+
+    if (http_connection_check_coroutine(connection) == -1)
+        return -1;
+
+    body = connection->coroutine_body;
+
+    for (;;) {
+        if (connection->coroutine_aborted) {
+            http_set_error("request aborted");
+            return -1;
+        }
+
+        len = bf_buffer_length(body);
+        if (len > 0)
+            break;
+
+        if (connection->current_msg->is_complete)
+            return 0;
+
+        connection->coroutine_waits_for_body = true;
+        http_coroutine_yield();
+    }
+
+    len = MIN(len, sz);
+
+    memcpy(buf, bf_buffer_data(body), len);
+    bf_buffer_skip(body, len);
+
+    *psz = len;
+
+    /* Once the request has been entirely read, the read event is only
+     * enabled again when the handler returns. */
+    if (connection->coroutine_blocks_input
+     && !connection->current_msg->is_complete
+     && bf_buffer_length(body) < HTTP_COROUTINE_BODY_BUFSZ) {
+        if (event_add(connection->ev_read, NULL) == -1) {
+            http_set_error("cannot add read event handler: %s",
+                           strerror(errno));
+            return -1;
+        }
+
+        connection->coroutine_blocks_input = false;
+    }
+
+    return 1;
+}
+
+int
+http_connection_start_response(struct http_connection *connection,
+                               enum http_status_code status_code,
+                               struct http_headers *headers) {
+    if (headers == NULL)
+        headers = http_headers_new();
+
+    if (http_connection_check_coroutine(connection) == -1)
+        goto error;
+
+    if (connection->coroutine_aborted) {
+        http_set_error("request aborted");
+        goto error;
+    }
+
+    if (connection->is_streaming_response
+     || connection->current_msg->u.request.response_sent) {
+        http_set_error("response already sent");
+        goto error;
+    }
+
+    if (http_connection_init_response_headers(connection, headers) == -1)
+        goto error;
+
+    if (connection->http_version == HTTP_1_1) {
+        http_headers_set_header(headers, "Transfer-Encoding", "chunked");
+    } else {
+        /* The end of the body is indicated by closing the connection */
+        http_headers_set_header(headers, "Connection", "close");
+        connection->current_msg->connection_options &=
+            ~(uint32_t)HTTP_CONNECTION_KEEP_ALIVE;
+    }
+
+    if (http_connection_write_response(connection, status_code, NULL) == -1)
+        goto error;
+
+    http_connection_write_headers(connection, headers);
+    http_connection_write(connection, "\r\n", 2);
+
+    connection->is_streaming_response = true;
+    connection->streaming_status_code = status_code;
+
+    http_headers_delete(headers);
+    return 0;
+
+error:
+    http_headers_delete(headers);
+    return -1;
+}
+
+int
+http_connection_write_body(struct http_connection *connection,
+                           const void *data, size_t sz) {
+    if (http_connection_check_coroutine(connection) == -1)
+        return -1;
+
+    if (!connection->is_streaming_response) {
+        http_set_error("no response started");
+        return -1;
+    }
+
+    /* An empty chunk would end the body */
+    if (sz == 0)
+        return 0;
+
+    if (connection->http_version == HTTP_1_1) {
+        http_connection_printf(connection, "%zx\r\n", sz);
+        http_connection_write(connection, data, sz);
+        http_connection_write(connection, "\r\n", 2);
+    } else {
+        http_connection_write(connection, data, sz);
+    }
+
+    while (http_stream_buffered_size(connection->wstream)
+           > HTTP_COROUTINE_OUTPUT_BUFSZ) {
+        if (connection->coroutine_aborted) {
+            http_set_error("request aborted");
+            return -1;
+        }
+
+        connection->coroutine_waits_for_output = true;
+        http_coroutine_yield();
+    }
+
+    return 0;
+}
+
+int
+http_connection_end_response(struct http_connection *connection) {
+    if (http_connection_check_coroutine(connection) == -1)
+        return -1;
+
+    if (!connection->is_streaming_response) {
+        http_set_error("no response started");
+        return -1;
+    }
+
+    if (connection->http_version == HTTP_1_1)
+        http_connection_write(connection, "0\r\n\r\n", 5);
+
+    connection->is_streaming_response = false;
+
+    http_connection_on_response_sent(connection,
+                                     connection->streaming_status_code);
+    return 0;
+}
+
+int
+http_connection_suspend(struct http_connection *connection) {
+    if (http_connection_check_coroutine(connection) == -1)
+        return -1;
+
+    if (!connection->coroutine_aborted) {
+        connection->coroutine_suspended = true;
+        http_coroutine_yield();
+    }
+
+    if (connection->coroutine_aborted) {
+        http_set_error("request aborted");
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+http_connection_wake_up(struct http_connection *connection) {
+    /* The connection may have been deleted when this function returns */
+    if (connection->coroutine_suspended)
+        http_connection_resume_coroutine(connection);
+}
+
 void
 http_connection_on_read_event(evutil_socket_t sock, short events, void *arg) {
     struct http_connection *connection;
@@ -519,159 +910,64 @@ http_connection_on_read_event(evutil_socket_t sock, short events, void *arg) {
         return;
     }
 
-    for (;;) {
-        struct http_parser *parser;
-        struct http_msg *msg;
-        int ret;
+    if (ret > 0)
+        connection->nb_bytes_read += (uint64_t)ret;
 
-        parser = &connection->parser;
-        msg = &parser->msg;
+    http_connection_process_input(connection);
+}
 
-        ret = http_msg_parse(connection->rbuf, parser);
-        if (ret == -1) {
-            http_connection_error(connection, "cannot parse message: %s",
-                                  http_get_error());
-            http_connection_send_error(connection, HTTP_INTERNAL_SERVER_ERROR,
-                                       "%s", http_get_error());
-            goto error;
-        }
+void
+http_connection_on_write_event(evutil_socket_t sock, short events, void *arg) {
+    struct http_connection *connection;
+    int ret;
+    size_t sz;
 
-        if (http_parser_are_headers_read(parser) && !parser->msg_preprocessed) {
-            int ret;
+    connection = arg;
 
-            if (connection->type == HTTP_CONNECTION_SERVER) {
-                http_connection_track_request_received(connection, msg);
-            } else if (connection->type == HTTP_CONNECTION_CLIENT) {
-                http_connection_track_response_received(connection, msg);
-            }
+    if (connection->discard_deferred) {
+        connection->discard_deferred = false;
+        http_connection_discard(connection);
+        return;
+    }
 
-            ret = http_connection_preprocess_msg(connection, msg);
-            if (ret == -1) {
-                http_connection_error(connection, "%s", http_get_error());
-                http_connection_send_error(connection,
-                                           HTTP_INTERNAL_SERVER_ERROR,
-                                           "%s", http_get_error());
-                goto error;
-            }
+    sz = 0;
+    ret = http_stream_write(connection->wstream, connection->sock, &sz);
+    if (ret == -1) {
+        if (!connection->closed_by_peer) {
+            http_connection_abort(connection);
+            http_connection_error(connection, "cannot write to socket: %s",
+                                  strerror(errno));
+        }
 
-            if (ret == 1) {
-                /* We already responded to the message */
-                http_connection_on_msg_processed(connection);
-                break;
-            }
+        http_connection_discard(connection);
+        return;
+    }
 
-            parser->msg_preprocessed = true;
+    connection->nb_bytes_written += sz;
+
+    if (ret == 0) {
+        /* Stream consumed */
+        event_del(connection->ev_write);
+        connection->is_ev_write_enabled = false;
+
+        if (connection->shutting_down) {
+            http_connection_discard(connection);
+            return;
         }
 
-        if (ret == 0) {
-            /* The message was not entirely read */
+        if (connection->type == HTTP_CONNECTION_SERVER)
+            http_connection_update_idle_state(connection);
+    }
 
-            /* If we are not bufferizing the whole message, we can call the
-             * message handler right now.
-             *
-             * Of course we do not call the handler if nothing was read since
-             * the last time (it can happen with chunked coding when a chunk
-             * was not entirely read). */
+    if (connection->coroutine_waits_for_output
+     && http_stream_buffered_size(connection->wstream)
+        <= HTTP_COROUTINE_OUTPUT_BUFSZ) {
+        if (http_now_ms(&connection->last_activity) == -1)
+            http_connection_error(connection, "%s", http_get_error());
 
-            if (connection->current_msg
-             && parser->msg_preprocessed
-             && !msg->is_bufferized && msg->body_length > 0) {
-                if (connection->type == HTTP_CONNECTION_SERVER) {
-                    http_connection_call_request_handler(connection, msg);
-                } else {
-                    http_connection_call_response_handler(connection, msg);
-                }
-
-                /* For bufferized messages, msg->body only contains data
-                 * received since the last call to the handler, so we delete
-                 * them to be ready for the next time we receive some. */
-                http_free(msg->body);
-                msg->body = NULL;
-                msg->body_length = 0;
-            }
-
-            break;
-        }
-
-        if (parser->state == HTTP_PARSER_ERROR) {
-            http_connection_error(connection, "cannot parse message: %s",
-                                  parser->errmsg);
-            if (connection->type == HTTP_CONNECTION_SERVER) {
-                http_connection_send_error(connection, parser->status_code,
-                                           "%s", parser->errmsg);
-            }
-            goto error;
-        } else if (parser->state == HTTP_PARSER_DONE) {
-            msg->is_complete = true;
-
-            if (connection->type == HTTP_CONNECTION_SERVER) {
-                http_connection_call_request_handler(connection, msg);
-            } else {
-                http_connection_call_response_handler(connection, msg);
-            }
-
-            if (cfg->request_received_hook)
-                cfg->request_received_hook(connection, msg, cfg->hook_arg);
-
-            if (!connection->msg_handler_called) {
-                /* The request was fully processed */
-                break;
-            }
-
-            http_connection_on_msg_processed(connection);
-        }
-    }
-
-    if (http_now_ms(&connection->last_activity) == -1) {
-        http_connection_error(connection, "%s", http_get_error());
-        goto error;
-    }
-
-    return;
-
-error:
-    /* At this point we do not know whether we started responsing to the
-     * message or not; since we do not want to let the connection in an
-     * unknown state, we close it. */
-    if (http_connection_shutdown(connection) == -1) {
-        http_connection_error(connection,
-                              "cannot shutdown connection: %s",
-                              http_get_error());
-        return;
-    }
-}
-
-void
-http_connection_on_write_event(evutil_socket_t sock, short events, void *arg) {
-    struct http_connection *connection;
-    int ret;
-    size_t sz;
-
-    connection = arg;
-
-    ret = http_stream_write(connection->wstream, connection->sock, &sz);
-    if (ret == -1) {
-        if (!connection->closed_by_peer) {
-            http_connection_abort(connection);
-            http_connection_error(connection, "cannot write to socket: %s",
-                                  strerror(errno));
-        }
-
-        http_connection_discard(connection);
-        return;
-    }
-
-    if (ret == 0) {
-        /* Stream consumed */
-        event_del(connection->ev_write);
-        connection->is_ev_write_enabled = false;
-
-        if (connection->shutting_down) {
-            http_connection_discard(connection);
-            return;
-        }
-    }
-}
+        http_connection_resume_coroutine(connection);
+    }
+}
 
 void
 http_connection_abort(struct http_connection *connection) {
@@ -787,8 +1083,7 @@ http_connection_write_headers_and_file(struct http_connection *connection,
                                        struct http_headers *headers,
                                        const char *path, int fd, size_t file_sz,
                                        const struct http_ranges *ranges) {
-    char **mime_part_headers;
-    size_t nb_mime_parts;
+    char *mime_part_prefix;
     char *mime_footer;
     size_t content_length;
 
@@ -798,13 +1093,22 @@ http_connection_write_headers_and_file(struct http_connection *connection,
         content_length = file_sz;
     }
 
-    nb_mime_parts = 0;
-    mime_part_headers = NULL;
+    mime_part_prefix = NULL;
     mime_footer = NULL;
 
+    if (!http_headers_get_header(headers, "Content-Type")) {
+        const char *content_type;
+
+        content_type = http_connection_guess_file_content_type(connection,
+                                                               path, fd);
+        if (content_type)
+            http_headers_set_header(headers, "Content-Type", content_type);
+    }
+
     if (ranges && ranges->nb_ranges > 1) {
         char boundary[HTTP_MIME_BOUNDARY_SZ];
         const char *content_type;
+        size_t prefix_len;
         int ret;
 
         /* Generate a MIME document of type multipart/byteranges. */
@@ -814,25 +1118,22 @@ http_connection_write_headers_and_file(struct http_connection *connection,
         if (!content_type)
             content_type = "application/octet-stream";
 
-        /* Generate MIME headers and footer using a random boundary */
+        /* All part headers share the same prefix and only differ by their
+         * Content-Range value, so they are generated when the part is
+         * written and their length is computed here. */
         http_mime_generate_boundary(boundary, HTTP_MIME_BOUNDARY_SZ);
 
-        nb_mime_parts = ranges->nb_ranges;
-        mime_part_headers = http_calloc(nb_mime_parts, sizeof(char *));
-
-        for (size_t i = 0; i < nb_mime_parts; i++) {
-            struct http_range *range;
-
-            range = ranges->ranges + i;
-
-            ret = http_asprintf(&mime_part_headers[i],
-                                "\r\n--%s\r\n"
-                                "Content-Type: %s\r\n"
-                                "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
-                                boundary, content_type,
-                                range->first, range->last, file_sz);
-
-            content_length += (size_t)ret;
+        ret = http_asprintf(&mime_part_prefix,
+                            "\r\n--%s\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Range: bytes ",
+                            boundary, content_type);
+        prefix_len = (size_t)ret;
+
+        for (size_t i = 0; i < ranges->nb_ranges; i++) {
+            content_length += prefix_len
+                + http_ranges_content_range_length(ranges->ranges + i, file_sz)
+                + 4; /* "\r\n\r\n" */
         }
 
         ret = http_asprintf(&mime_footer, "\r\n--%s--\r\n", boundary);
@@ -844,13 +1145,15 @@ http_connection_write_headers_and_file(struct http_connection *connection,
                                    "multipart/byteranges; boundary=%s",
                                    boundary);
     } else if (ranges && ranges->nb_ranges == 1) {
-        struct http_range *range;
+        char content_range[HTTP_SIZE_BUFSZ * 3 + 2 + 1];
+        size_t len;
 
-        range = ranges->ranges;
+        len = http_ranges_format_content_range(content_range, ranges->ranges,
+                                               file_sz);
+        content_range[len] = '\0';
 
         http_headers_format_header(headers, "Content-Range",
-                                   "bytes %zu-%zu/%zu",
-                                   range->first, range->last, file_sz);
+                                   "bytes %s", content_range);
     }
 
     http_headers_format_header(headers, "Content-Length",
@@ -861,8 +1164,7 @@ http_connection_write_headers_and_file(struct http_connection *connection,
 
     if (ranges) {
         http_stream_add_partial_file(connection->wstream, fd, file_sz, path,
-                                     ranges, mime_part_headers, nb_mime_parts,
-                                     mime_footer);
+                                     ranges, mime_part_prefix, mime_footer);
     } else {
         http_stream_add_file(connection->wstream, fd, file_sz, path);
     }
@@ -994,8 +1296,10 @@ http_connection_track_response_received(struct http_connection *connection,
 
     response = &msg->u.response;
 
-    if (response->status_code == HTTP_CONTINUE)
+    if (response->status_code == HTTP_CONTINUE) {
+        http_client_on_continue(connection->client);
         return;
+    }
 
     if (!connection->requests_first) {
         http_connection_error(connection,
@@ -1005,8 +1309,13 @@ http_connection_track_response_received(struct http_connection *connection,
 
     info = connection->requests_first;
 
+    http_client_on_final_response(connection->client, info);
+
     info->status_code = response->status_code;
 
+    connection->response_handler = info->response_handler;
+    connection->response_handler_arg = info->response_handler_arg;
+
     if (cfg->request_hook)
         cfg->request_hook(connection, info, cfg->hook_arg);
 
@@ -1022,17 +1331,15 @@ http_connection_find_route(struct http_connection *connection,
     struct http_request *request;
     enum http_route_match_result match_result;
     enum http_method method;
-    struct http_uri *uri;
 
     assert(msg->type == HTTP_MSG_REQUEST);
 
     route_base = connection->server->route_base;
     request = &msg->u.request;
     method = msg->u.request.method;
-    uri = msg->u.request.uri;
 
     if (http_route_base_find_route(route_base,
-                                   method, uri->path,
+                                   method, request->path,
                                    &route, &match_result,
                                    &request->named_parameters,
                                    &request->nb_named_parameters) == -1) {
@@ -1074,6 +1381,172 @@ http_connection_find_route(struct http_connection *connection,
     return 0;
 }
 
+static void
+http_connection_process_input(struct http_connection *connection) {
+    const struct http_cfg *cfg;
+
+    cfg = http_connection_get_cfg(connection);
+
+    for (;;) {
+        struct http_parser *parser;
+        struct http_msg *msg;
+        int ret;
+
+        parser = &connection->parser;
+        msg = &parser->msg;
+
+        if (parser->state == HTTP_PARSER_DONE) {
+            /* The message was entirely parsed before the connection was
+             * parked */
+            ret = 1;
+        } else {
+            ret = http_msg_parse(connection->rbuf, parser);
+            if (ret == -1) {
+                http_connection_error(connection,
+                                      "cannot parse message: %s",
+                                      http_get_error());
+                http_connection_send_error(connection,
+                                           HTTP_INTERNAL_SERVER_ERROR,
+                                           "%s", http_get_error());
+                goto error;
+            }
+        }
+
+        if (http_parser_are_headers_read(parser) && !parser->msg_preprocessed) {
+            int ret;
+
+            if (connection->type == HTTP_CONNECTION_SERVER) {
+                http_connection_track_request_received(connection, msg);
+            } else if (connection->type == HTTP_CONNECTION_CLIENT) {
+                http_connection_track_response_received(connection, msg);
+            }
+
+            ret = http_connection_preprocess_msg(connection, msg);
+            if (ret == -1) {
+                http_connection_error(connection, "%s", http_get_error());
+                http_connection_send_error(connection,
+                                           HTTP_INTERNAL_SERVER_ERROR,
+                                           "%s", http_get_error());
+                goto error;
+            }
+
+            if (ret == 1) {
+                /* We already responded to the message */
+                if (!http_connection_on_msg_processed(connection))
+                    return;
+                break;
+            }
+
+            parser->msg_preprocessed = true;
+
+            if (ret == 2) {
+                /* The request waits for its route to accept it; we do not
+                 * read anything until then. */
+                break;
+            }
+        }
+
+        if (ret == 0) {
+            /* The message was not entirely read */
+
+            /* If we are not bufferizing the whole message, we can call the
+             * message handler right now.
+             *
+             * Of course we do not call the handler if nothing was read since
+             * the last time (it can happen with chunked coding when a chunk
+             * was not entirely read). */
+
+            if (connection->current_msg
+             && parser->msg_preprocessed
+             && !msg->is_bufferized && msg->body_length > 0) {
+                if (connection->type == HTTP_CONNECTION_SERVER) {
+                    http_connection_call_request_handler(connection, msg);
+                } else {
+                    http_connection_call_response_handler(connection, msg);
+                }
+
+                /* For bufferized messages, msg->body only contains data
+                 * received since the last call to the handler, so we delete
+                 * them to be ready for the next time we receive some. */
+                http_free(msg->body);
+                msg->body = NULL;
+                msg->body_length = 0;
+            }
+
+            break;
+        }
+
+        if (parser->state == HTTP_PARSER_ERROR) {
+            http_connection_error(connection, "cannot parse message: %s",
+                                  parser->errmsg);
+            if (connection->type == HTTP_CONNECTION_SERVER) {
+                http_connection_send_error(connection, parser->status_code,
+                                           "%s", parser->errmsg);
+            }
+            goto error;
+        } else if (parser->state == HTTP_PARSER_DONE) {
+            msg->is_complete = true;
+
+            if (connection->type == HTTP_CONNECTION_SERVER) {
+                http_connection_call_request_handler(connection, msg);
+            } else {
+                http_connection_call_response_handler(connection, msg);
+            }
+
+            if (cfg->request_received_hook)
+                cfg->request_received_hook(connection, msg, cfg->hook_arg);
+
+            if (!connection->msg_handler_called) {
+                /* The request was fully processed */
+                break;
+            }
+
+            if (connection->waits_for_batch) {
+                /* The request will be processed at the end of the current
+                 * iteration of the event loop. */
+                event_del(connection->ev_read);
+                break;
+            }
+
+            if (connection->coroutine) {
+                /* The handler is still running; we will process the next
+                 * message when it returns. */
+                if (!connection->coroutine_blocks_input) {
+                    event_del(connection->ev_read);
+                    connection->coroutine_blocks_input = true;
+                }
+
+                connection->waits_for_coroutine = true;
+                break;
+            }
+
+            if (!http_connection_on_msg_processed(connection))
+                return;
+        }
+    }
+
+    if (http_now_ms(&connection->last_activity) == -1) {
+        http_connection_error(connection, "%s", http_get_error());
+        goto error;
+    }
+
+    if (connection->type == HTTP_CONNECTION_SERVER)
+        http_connection_update_idle_state(connection);
+
+    return;
+
+error:
+    /* At this point we do not know whether we started responsing to the
+     * message or not; since we do not want to let the connection in an
+     * unknown state, we close it. */
+    if (http_connection_shutdown(connection) == -1) {
+        http_connection_error(connection,
+                              "cannot shutdown connection: %s",
+                              http_get_error());
+        return;
+    }
+}
+
 static int
 http_connection_preprocess_msg(struct http_connection *connection,
                                struct http_msg *msg) {
@@ -1101,6 +1574,8 @@ http_connection_preprocess_request(struct http_connection *connection,
 
     cfg = http_connection_get_cfg(connection);
 
+    connection->nb_requests++;
+
     method = msg->u.request.method;
     uri_string = msg->u.request.uri_string;
 
@@ -1123,9 +1598,10 @@ http_connection_preprocess_request(struct http_connection *connection,
         /* We have to accept absolute URIs (RFC 2616 5.1.2) but since we do
          * not act as a proxy, we only accept them when the host and port of
          * URI is an address we are listening on. */
-        if (uri->host) {
+        if (http_uri_host(uri)) {
             if (!http_server_does_listen_on(connection->server,
-                                            uri->host, uri->port)) {
+                                            http_uri_host(uri),
+                                            http_uri_port(uri))) {
                 if (http_connection_send_error(connection, HTTP_BAD_REQUEST,
                                                "absolute uri is not "
                                                "associated with an address "
@@ -1178,35 +1654,158 @@ http_connection_preprocess_request(struct http_connection *connection,
     /* Is the body of the request bufferized ? */
     msg->is_bufferized = route->options.bufferize_body;
 
+    /* Concurrency limit */
+    if (route->limiter)
+        return http_connection_admit_request(connection, route);
+
     return 0;
 }
 
 static int
-http_connection_preprocess_response(struct http_connection *connection,
-                                    struct http_msg *msg) {
-    const struct http_cfg *cfg;
+http_connection_admit_request(struct http_connection *connection,
+                              const struct http_route *route) {
+    struct http_route_waiter *waiter;
+    uint64_t now;
 
-    cfg = http_connection_get_cfg(connection);
+    if (http_now_ms(&now) == -1)
+        return -1;
 
-    /* Is the body of the response bufferized ? */
-    msg->is_bufferized = cfg->bufferize_body;
+    waiter = &connection->route_waiter;
+    http_connection_get_handle(connection, &waiter->handle);
 
-    return 0;
-}
+    switch (http_route_limiter_admit(route->limiter, waiter, now)) {
+    case HTTP_ROUTE_ADMITTED:
+        connection->route_limiter = route->limiter;
+        connection->holds_route_slot = true;
+        return 0;
 
-static void
-http_connection_on_response_sent(struct http_connection *connection,
-                                 enum http_status_code status_code) {
-    if (connection->current_msg) {
-        struct http_msg *msg;
+    case HTTP_ROUTE_QUEUED:
+        connection->route_limiter = route->limiter;
+        connection->is_parked = true;
 
-        msg = connection->current_msg;
+        if (event_del(connection->ev_read) == -1) {
+            http_set_error("cannot remove read event handler: %s",
+                           strerror(errno));
+            return -1;
+        }
+
+        return 2;
+
+    case HTTP_ROUTE_REJECTED:
+        break;
+    }
+
+    /* We do not read the body of the request, so the connection cannot be
+     * reused. */
+    http_connection_disable_keep_alive(connection);
+
+    if (http_connection_send_error(connection, HTTP_SERVICE_UNAVAILABLE,
+                                   NULL) == -1) {
+        return -1;
+    }
+
+    if (http_connection_shutdown(connection) == -1)
+        return -1;
+
+    return 1;
+}
+
+static void
+http_connection_release_route_slot(struct http_route_limiter *limiter) {
+    uint64_t now;
+
+    if (http_now_ms(&now) == -1)
+        now = 0;
+
+    http_route_limiter_release(limiter, now, http_connection_notify_slot,
+                               limiter);
+}
+
+static int
+http_connection_notify_slot(const struct http_connection_handle *handle,
+                            void *arg) {
+    return http_connection_post(handle, http_connection_on_route_slot, arg);
+}
+
+static void
+http_connection_on_route_slot(struct http_connection *connection,
+                              void *arg) {
+    struct http_route_limiter *limiter;
+
+    limiter = arg;
+
+    if (!connection || !connection->is_parked
+     || connection->route_limiter != limiter) {
+        /* The connection was closed while the slot was given to it */
+        http_connection_release_route_slot(limiter);
+        return;
+    }
+
+    connection->is_parked = false;
+    connection->holds_route_slot = true;
+
+    if (event_add(connection->ev_read, NULL) == -1) {
+        http_connection_error(connection, "cannot add read event: %s",
+                              strerror(errno));
+        http_connection_discard(connection);
+        return;
+    }
+
+    http_connection_process_input(connection);
+}
+
+static void
+http_connection_leave_route(struct http_connection *connection) {
+    struct http_route_limiter *limiter;
+
+    limiter = connection->route_limiter;
+    if (!limiter)
+        return;
+
+    if (connection->holds_route_slot) {
+        http_connection_release_route_slot(limiter);
+    } else if (connection->is_parked) {
+        /* If the waiter is not waiting anymore, the slot is being given to
+         * the connection; it will be released when the notification is
+         * processed. */
+        http_route_limiter_cancel(limiter, &connection->route_waiter,
+                                  false, 0);
+    }
+
+    connection->route_limiter = NULL;
+    connection->holds_route_slot = false;
+    connection->is_parked = false;
+}
+
+static int
+http_connection_preprocess_response(struct http_connection *connection,
+                                    struct http_msg *msg) {
+    const struct http_cfg *cfg;
+
+    cfg = http_connection_get_cfg(connection);
+
+    /* Is the body of the response bufferized ? */
+    msg->is_bufferized = cfg->bufferize_body;
+
+    return 0;
+}
+
+static void
+http_connection_on_response_sent(struct http_connection *connection,
+                                 enum http_status_code status_code) {
+    if (connection->current_msg) {
+        struct http_msg *msg;
+
+        msg = connection->current_msg;
         assert(msg->type == HTTP_MSG_REQUEST);
 
         msg->u.request.response_sent = true;
 
         http_connection_track_response_sent(connection, status_code);
     }
+
+    if (connection->holds_route_slot)
+        http_connection_leave_route(connection);
 }
 
 static void
@@ -1218,6 +1817,26 @@ http_connection_call_request_handler(struct http_connection *connection,
     assert(connection->current_msg);
     assert(connection->current_route);
 
+    if (connection->current_route->options.use_coroutine) {
+        http_connection_run_coroutine_handler(connection, msg);
+        connection->msg_handler_called = true;
+        return;
+    }
+
+    if (connection->current_route->batch_handler) {
+        if (msg->is_complete && !msg->aborted) {
+            if (http_server_add_batch_request(connection->server,
+                                              connection) == -1) {
+                http_connection_error(connection, "%s", http_get_error());
+                http_connection_send_error(connection,
+                                           HTTP_INTERNAL_SERVER_ERROR, NULL);
+            }
+        }
+
+        connection->msg_handler_called = true;
+        return;
+    }
+
     arg = connection->server->route_base->msg_handler_arg;
     connection->current_route->msg_handler(connection, msg, arg);
 
@@ -1231,6 +1850,191 @@ http_connection_call_request_handler(struct http_connection *connection,
     connection->msg_handler_called = true;
 }
 
+static void
+http_connection_run_coroutine_handler(struct http_connection *connection,
+                                      struct http_msg *msg) {
+    bool start;
+
+    if (connection->coroutine
+     && http_coroutine_current() == connection->coroutine) {
+        /* Called from the handler itself, for example when it shuts down
+         * its connection; it sees the abort once it blocks or returns. */
+        if (msg->aborted)
+            connection->coroutine_aborted = true;
+        return;
+    }
+
+    start = false;
+
+    if (!connection->coroutine) {
+        /* Either the handler already returned, or the request was aborted
+         * before it was started. */
+        if (msg->u.request.response_sent || msg->aborted)
+            return;
+
+        connection->coroutine =
+            http_coroutine_new(http_connection_coroutine_main, connection);
+        if (!connection->coroutine) {
+            http_connection_error(connection, "cannot create coroutine: %s",
+                                  http_get_error());
+            http_connection_send_error(connection, HTTP_INTERNAL_SERVER_ERROR,
+                                       NULL);
+            return;
+        }
+
+        connection->coroutine_body = bf_buffer_new(0);
+        start = true;
+    }
+
+    if (msg->body_length > 0)
+        bf_buffer_add(connection->coroutine_body, msg->body, msg->body_length);
+
+    if (msg->aborted)
+        connection->coroutine_aborted = true;
+
+    if (start || msg->aborted
+     || (connection->coroutine_waits_for_body
+         && (msg->is_complete
+          || bf_buffer_length(connection->coroutine_body) > 0))) {
+        http_connection_resume_coroutine(connection);
+        return;
+    }
+
+    /* The handler does not read the body as fast as it is received */
+    if (!msg->is_complete && !connection->coroutine_blocks_input
+     && bf_buffer_length(connection->coroutine_body)
+        >= HTTP_COROUTINE_BODY_BUFSZ) {
+        event_del(connection->ev_read);
+        connection->coroutine_blocks_input = true;
+    }
+}
+
+static void
+http_connection_coroutine_main(void *arg) {
+    struct http_connection *connection;
+    const struct http_route *route;
+    struct http_msg *msg;
+    void *handler_arg;
+
+    connection = arg;
+
+    msg = connection->current_msg;
+    route = connection->current_route;
+
+    handler_arg = connection->server->route_base->msg_handler_arg;
+    route->msg_handler(connection, msg, handler_arg);
+
+    if (connection->coroutine_aborted)
+        return;
+
+    if (connection->is_streaming_response) {
+        if (http_connection_end_response(connection) == -1) {
+            http_connection_error(connection, "cannot end response: %s",
+                                  http_get_error());
+        }
+    } else if (!msg->u.request.response_sent) {
+        http_connection_error(connection,
+                              "message handler did not send a response");
+        http_connection_send_error(connection, HTTP_INTERNAL_SERVER_ERROR,
+                                   "no available response");
+    }
+}
+
+static void
+http_connection_resume_coroutine(struct http_connection *connection) {
+    connection->coroutine_waits_for_body = false;
+    connection->coroutine_waits_for_output = false;
+    connection->coroutine_suspended = false;
+
+    http_coroutine_resume(connection->coroutine);
+
+    if (http_coroutine_is_finished(connection->coroutine))
+        http_connection_on_coroutine_finished(connection);
+}
+
+static void
+http_connection_on_coroutine_finished(struct http_connection *connection) {
+    bool aborted;
+
+    http_coroutine_delete(connection->coroutine);
+    connection->coroutine = NULL;
+
+    bf_buffer_delete(connection->coroutine_body);
+    connection->coroutine_body = NULL;
+
+    aborted = connection->coroutine_aborted;
+    connection->coroutine_aborted = false;
+
+    if (aborted) {
+        /* The connection is being closed */
+        connection->coroutine_blocks_input = false;
+        connection->waits_for_coroutine = false;
+        return;
+    }
+
+    if (connection->coroutine_blocks_input) {
+        connection->coroutine_blocks_input = false;
+
+        if (!connection->shutting_down) {
+            if (event_add(connection->ev_read, NULL) == -1) {
+                http_connection_error(connection,
+                                      "cannot add read event handler: %s",
+                                      strerror(errno));
+                http_connection_discard(connection);
+                return;
+            }
+        }
+    }
+
+    /* If the request was entirely read, it can now be released and the
+     * next one, if any, processed. */
+    if (connection->waits_for_coroutine) {
+        connection->waits_for_coroutine = false;
+
+        if (!http_connection_on_msg_processed(connection))
+            return;
+
+        http_connection_process_input(connection);
+    }
+}
+
+void
+http_connection_on_batch_processed(struct http_connection *connection) {
+    if (!connection->current_msg->u.request.response_sent) {
+        http_connection_error(connection,
+                              "batch handler did not send a response");
+        http_connection_send_error(connection, HTTP_INTERNAL_SERVER_ERROR,
+                                   "no available response");
+    }
+
+    if (!connection->shutting_down) {
+        if (event_add(connection->ev_read, NULL) == -1) {
+            http_connection_error(connection,
+                                  "cannot add read event handler: %s",
+                                  strerror(errno));
+            http_connection_discard(connection);
+            return;
+        }
+    }
+
+    if (!http_connection_on_msg_processed(connection))
+        return;
+
+    /* Process pipelined requests */
+    http_connection_process_input(connection);
+}
+
+static int
+http_connection_check_coroutine(struct http_connection *connection) {
+    if (!connection->coroutine
+     || http_coroutine_current() != connection->coroutine) {
+        http_set_error("handler is not running in a coroutine");
+        return -1;
+    }
+
+    return 0;
+}
+
 static void
 http_connection_call_response_handler(struct http_connection *connection,
                                       struct http_msg *msg) {
@@ -1242,6 +2046,29 @@ http_connection_call_response_handler(struct http_connection *connection,
 
     cfg = connection->client->cfg;
 
+    if (connection->response_handler) {
+        http_response_handler handler;
+
+        handler = connection->response_handler;
+        arg = connection->response_handler_arg;
+
+        /* The handler is called for the last time */
+        if (msg->is_complete || msg->aborted)
+            connection->response_handler = NULL;
+
+        handler(connection->client, msg, arg);
+
+        connection->msg_handler_called = true;
+        return;
+    }
+
+    if (connection->client->hedger) {
+        http_hedger_on_response(connection->client->hedger,
+                                connection->client, msg);
+        connection->msg_handler_called = true;
+        return;
+    }
+
     if (!cfg->u.client.response_handler)
         return;
 
@@ -1252,6 +2079,33 @@ http_connection_call_response_handler(struct http_connection *connection,
 }
 
 static void
+http_connection_fail_response_handlers(struct http_connection *connection) {
+    struct http_request_info *info;
+
+    if (connection->response_handler) {
+        http_response_handler handler;
+
+        handler = connection->response_handler;
+        connection->response_handler = NULL;
+
+        handler(connection->client, NULL, connection->response_handler_arg);
+    }
+
+    for (info = connection->requests_first; info; info = info->next) {
+        http_response_handler handler;
+
+        handler = info->response_handler;
+        if (!handler)
+            continue;
+
+        info->response_handler = NULL;
+        handler(connection->client, NULL, info->response_handler_arg);
+    }
+}
+
+/* Return false if the connection is being closed, in which case it may
+ * already have been deleted. */
+static bool
 http_connection_on_msg_processed(struct http_connection *connection) {
     const struct http_cfg *cfg;
     struct http_msg *msg;
@@ -1263,21 +2117,15 @@ http_connection_on_msg_processed(struct http_connection *connection) {
     cfg = http_connection_get_cfg(connection);
     msg = connection->current_msg;
 
-    if (msg->version == HTTP_1_0) {
-        do_shutdown = !(msg->connection_options & HTTP_CONNECTION_KEEP_ALIVE);
-    } else if (msg->version == HTTP_1_1) {
-        do_shutdown = msg->connection_options & HTTP_CONNECTION_CLOSE;
-    } else {
+    do_shutdown = !http_msg_keeps_connection_alive(msg);
+
+    if (http_connection_is_last_request(connection))
         do_shutdown = true;
-    }
 
-    if (do_shutdown) {
-        if (http_connection_shutdown(connection) == -1) {
-            http_connection_error(connection,
-                                  "cannot shutdown connection: %s",
-                                  http_get_error());
-            return;
-        }
+    if (connection->type == HTTP_CONNECTION_CLIENT
+     && connection->client->continue_body_dropped) {
+        connection->client->continue_body_dropped = false;
+        do_shutdown = true;
     }
 
     if (connection->type == HTTP_CONNECTION_SERVER) {
@@ -1291,7 +2139,7 @@ http_connection_on_msg_processed(struct http_connection *connection) {
                               http_get_error());
         http_connection_abort(connection);
         http_connection_discard(connection);
-        return;
+        return false;
     }
 
     connection->parser.connection = connection;
@@ -1299,27 +2147,105 @@ http_connection_on_msg_processed(struct http_connection *connection) {
     connection->current_msg = NULL;
     connection->current_route = NULL;
     connection->msg_handler_called = false;
+
+    /* The message is entirely processed, there is nothing to abort */
+    if (do_shutdown) {
+        if (http_connection_shutdown(connection) == -1) {
+            http_connection_error(connection,
+                                  "cannot shutdown connection: %s",
+                                  http_get_error());
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+http_connection_is_last_request(const struct http_connection *connection) {
+    const struct http_cfg *cfg;
+    size_t max_requests;
+
+    if (connection->type != HTTP_CONNECTION_SERVER)
+        return false;
+
+    cfg = http_connection_get_cfg(connection);
+
+    /* Closing connections from time to time lets clients reconnect and be
+     * dispatched to a less loaded worker or process. */
+    max_requests = cfg->u.server.max_requests_per_connection;
+    return max_requests > 0 && connection->nb_requests >= max_requests;
+}
+
+/* Return true if the connection will be shut down once the response being
+ * sent is written. */
+static bool
+http_connection_will_close(const struct http_connection *connection) {
+    if (connection->type != HTTP_CONNECTION_SERVER)
+        return false;
+
+    if (connection->shutting_down)
+        return true;
+
+    /* Responses sent before the headers of a request have been read are
+     * errors, after which the connection is closed. */
+    if (!connection->current_msg
+     || connection->parser.state == HTTP_PARSER_ERROR) {
+        return true;
+    }
+
+    if (http_connection_is_last_request(connection))
+        return true;
+
+    return !http_msg_keeps_connection_alive(connection->current_msg);
+}
+
+/* Used when a response is sent without the request body being read */
+static void
+http_connection_disable_keep_alive(struct http_connection *connection) {
+    struct http_msg *msg;
+
+    msg = connection->current_msg;
+    if (!msg)
+        return;
+
+    msg->connection_options &= ~(uint32_t)HTTP_CONNECTION_KEEP_ALIVE;
+    msg->connection_options |= HTTP_CONNECTION_CLOSE;
+}
+
+static bool
+http_msg_keeps_connection_alive(const struct http_msg *msg) {
+    if (msg->version == HTTP_1_0) {
+        return msg->connection_options & HTTP_CONNECTION_KEEP_ALIVE;
+    } else if (msg->version == HTTP_1_1) {
+        return !(msg->connection_options & HTTP_CONNECTION_CLOSE);
+    } else {
+        return false;
+    }
 }
 
 static int
 http_connection_init_response_headers(struct http_connection *connection,
                                       struct http_headers *headers) {
-    char date[HTTP_RFC1123_DATE_BUFSZ];
     const struct http_cfg *cfg;
     const struct http_route *route;
+    const char *date;
 
     route = connection->current_route;
 
     cfg = http_connection_get_cfg(connection);
 
-    if (http_format_timestamp(date, HTTP_RFC1123_DATE_BUFSZ,
-                              time(NULL)) == -1) {
+    date = http_current_date();
+    if (!date)
         return -1;
-    }
 
     http_headers_set_header(headers, "Date", date);
     http_headers_add_headers(headers, cfg->default_headers);
 
+    if (http_connection_will_close(connection))
+        http_headers_set_header(headers, "Connection", "close");
+
     /* There is no current route if we are sending a response before finding a
      * route (for example for errors, responses to OPTIONS requests, 100
      * Continue, etc. */
@@ -1344,13 +2270,12 @@ http_connection_write_options_response(struct http_connection *connection,
     } else {
         enum http_method methods[HTTP_METHOD_MAX];
         struct http_route_base *route_base;
-        struct http_uri *uri;
         size_t nb_methods;
 
         route_base = connection->server->route_base;
-        uri = msg->u.request.uri;
 
-        if (http_route_base_find_path_methods(route_base, uri->path,
+        if (http_route_base_find_path_methods(route_base,
+                                              msg->u.request.path,
                                               methods, &nb_methods) == -1) {
             return -1;
         }
@@ -1381,15 +2306,15 @@ http_connection_write_405_error(struct http_connection *connection,
                                 struct http_msg *msg) {
     enum http_method methods[HTTP_METHOD_MAX];
     struct http_route_base *route_base;
-    struct http_uri *uri;
+    const struct http_cfg *cfg;
+    struct http_headers *headers;
     size_t nb_methods;
 
     assert(msg->type == HTTP_MSG_REQUEST);
 
     route_base = connection->server->route_base;
-    uri = msg->u.request.uri;
 
-    if (http_route_base_find_path_methods(route_base, uri->path,
+    if (http_route_base_find_path_methods(route_base, msg->u.request.path,
                                           methods, &nb_methods) == -1) {
         http_connection_error(connection, "%s", http_get_error());
         goto error;
@@ -1403,11 +2328,7 @@ http_connection_write_405_error(struct http_connection *connection,
         return 0;
     }
 
-    if (http_connection_write_response(connection, HTTP_METHOD_NOT_ALLOWED,
-                                       NULL) == -1) {
-        http_connection_error(connection, "%s", http_get_error());
-        goto error;
-    }
+    headers = http_headers_new();
 
     for (size_t i = 0; i < nb_methods; i++) {
         enum http_method method;
@@ -1416,11 +2337,16 @@ http_connection_write_405_error(struct http_connection *connection,
         method = methods[i];
         method_string = http_method_to_string(method);
 
-        http_connection_write_header(connection, "Allow", method_string);
+        http_headers_add_header(headers, "Allow", method_string);
     }
 
-    if (http_connection_send_error(connection, HTTP_METHOD_NOT_ALLOWED,
-                                   NULL) == -1) {
+    /* The Allow header is specific to the request, so the response cannot be
+     * pre-rendered. */
+    cfg = http_connection_get_cfg(connection);
+
+    if (cfg->u.server.error_sender(connection, HTTP_METHOD_NOT_ALLOWED,
+                                   headers, NULL) == -1) {
+        http_connection_error(connection, "%s", http_get_error());
         goto error;
     }
 
@@ -1431,3 +2357,69 @@ error:
     http_connection_discard(connection);
     return -1;
 }
+
+static int
+http_connection_write_error(struct http_connection *connection,
+                            enum http_status_code status_code,
+                            const struct http_error_response *response) {
+    const struct http_route *route;
+    const char *version_str, *date;
+    const char *data;
+    size_t offset;
+
+    version_str = http_version_to_string(connection->http_version);
+    if (!version_str) {
+        http_set_error("unknown http version %d", connection->http_version);
+        return -1;
+    }
+
+    date = http_current_date();
+    if (!date)
+        return -1;
+
+    route = connection->current_route;
+
+    data = response->data;
+
+    /* Skip the end of the Date header line so that route default headers can
+     * be inserted after it. */
+    offset = response->date_offset + 2;
+
+    http_connection_write(connection, version_str, strlen(version_str));
+    http_connection_write(connection, data, response->date_offset);
+    http_connection_write(connection, date, strlen(date));
+    http_connection_write(connection, "\r\n", 2);
+
+    if (http_connection_will_close(connection))
+        http_connection_write(connection, "Connection: close\r\n", 19);
+
+    if (route)
+        http_connection_write_headers(connection,
+                                      route->options.default_headers);
+
+    http_connection_write(connection, data + offset, response->sz - offset);
+
+    http_connection_on_response_sent(connection, status_code);
+    return 0;
+}
+
+static const char *
+http_connection_guess_file_content_type(struct http_connection *connection,
+                                        const char *path, int fd) {
+    const struct http_cfg *cfg;
+    char buf[HTTP_MIME_SNIFF_SZ];
+    const char *content_type;
+    ssize_t ret;
+
+    cfg = http_connection_get_cfg(connection);
+
+    content_type = http_mime_type_from_path(path);
+
+    if (!content_type && cfg->sniff_file_content_type) {
+        ret = pread(fd, buf, sizeof(buf), 0);
+        if (ret > 0)
+            content_type = http_mime_sniff_type(buf, (size_t)ret);
+    }
+
+    return content_type;
+}
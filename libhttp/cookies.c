@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+#include "internal.h"
+
+static const struct http_request *
+http_msg_request_with_cookies(const struct http_msg *);
+
+static void http_request_parse_cookies(struct http_request *,
+                                       const struct http_msg *);
+static void http_request_parse_cookie_header(struct http_request *,
+                                             const char *);
+static void http_request_add_cookie(struct http_request *,
+                                    const struct http_cookie_view *);
+static void http_request_index_cookies(struct http_request *);
+
+static int http_cookie_view_compare_name(const struct http_cookie_view *,
+                                         const char *, size_t);
+
+static bool http_is_cookie_octet(unsigned char);
+static int http_set_cookie_check(const struct http_set_cookie *);
+static int http_cookie_check_value(const char *);
+static int http_cookie_check_attribute(const char *, const char *);
+
+static char *http_cookie_append(char *, const char *, size_t);
+
+size_t
+http_request_nb_cookies(const struct http_msg *msg) {
+    return http_msg_request_with_cookies(msg)->nb_cookies;
+}
+
+const struct http_cookie_view *
+http_request_cookie(const struct http_msg *msg, size_t idx) {
+    const struct http_request *request;
+
+    request = http_msg_request_with_cookies(msg);
+
+    assert(idx < request->nb_cookies);
+    return request->cookies + idx;
+}
+
+const struct http_cookie_view *
+http_request_get_cookie(const struct http_msg *msg, const char *name) {
+    const struct http_request *request;
+    size_t name_length, low, high;
+
+    request = http_msg_request_with_cookies(msg);
+
+    name_length = strlen(name);
+
+    /* Look for the first cookie with this name in the sorted index; the
+     * index is stable, so this is also the first one in the header, which
+     * is the one with the most specific path (RFC 6265 5.4). */
+    low = 0;
+    high = request->nb_cookies;
+
+    while (low < high) {
+        const struct http_cookie_view *cookie;
+        size_t middle;
+
+        middle = low + (high - low) / 2;
+        cookie = request->cookies + request->cookie_index[middle];
+
+        if (http_cookie_view_compare_name(cookie, name, name_length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low < request->nb_cookies) {
+        const struct http_cookie_view *cookie;
+
+        cookie = request->cookies + request->cookie_index[low];
+        if (http_cookie_view_compare_name(cookie, name, name_length) == 0)
+            return cookie;
+    }
+
+    return NULL;
+}
+
+bool
+http_cookie_view_name_is(const struct http_cookie_view *cookie,
+                         const char *name) {
+    return http_cookie_view_compare_name(cookie, name, strlen(name)) == 0;
+}
+
+void
+http_set_cookie_init(struct http_set_cookie *cookie,
+                     const char *name, const char *value) {
+    memset(cookie, 0, sizeof(struct http_set_cookie));
+
+    cookie->name = name;
+    cookie->value = value;
+}
+
+char *
+http_set_cookie_format(const struct http_set_cookie *cookie) {
+    char expires[HTTP_RFC1123_DATE_BUFSZ];
+    char max_age[HTTP_SIZE_BUFSZ];
+    size_t name_length, value_length, domain_length, path_length;
+    size_t expires_length, max_age_length, same_site_length;
+    const char *same_site;
+    char *str, *ptr;
+    size_t len;
+
+    if (http_set_cookie_check(cookie) == -1)
+        return NULL;
+
+    name_length = strlen(cookie->name);
+    value_length = strlen(cookie->value);
+
+    len = name_length + 1 + value_length;
+
+#define HTTP_ATTRIBUTE_LENGTH(name_, value_length_) \
+    (sizeof("; " name_ "=") - 1 + (value_length_))
+
+    domain_length = 0;
+    if (cookie->domain) {
+        domain_length = strlen(cookie->domain);
+        len += HTTP_ATTRIBUTE_LENGTH("Domain", domain_length);
+    }
+
+    path_length = 0;
+    if (cookie->path) {
+        path_length = strlen(cookie->path);
+        len += HTTP_ATTRIBUTE_LENGTH("Path", path_length);
+    }
+
+    expires_length = 0;
+    if (cookie->expires > 0) {
+        if (http_format_timestamp(expires, sizeof(expires),
+                                  cookie->expires) == -1) {
+            return NULL;
+        }
+
+        expires_length = strlen(expires);
+        len += HTTP_ATTRIBUTE_LENGTH("Expires", expires_length);
+    }
+
+    max_age_length = 0;
+    if (cookie->has_max_age) {
+        max_age_length = http_format_size(max_age, cookie->max_age);
+        len += HTTP_ATTRIBUTE_LENGTH("Max-Age", max_age_length);
+    }
+
+    if (cookie->secure)
+        len += sizeof("; Secure") - 1;
+
+    if (cookie->http_only)
+        len += sizeof("; HttpOnly") - 1;
+
+    switch (cookie->same_site) {
+    case HTTP_COOKIE_SAME_SITE_STRICT: same_site = "Strict"; break;
+    case HTTP_COOKIE_SAME_SITE_LAX:    same_site = "Lax";    break;
+    case HTTP_COOKIE_SAME_SITE_NONE:   same_site = "None";   break;
+    default:                           same_site = NULL;     break;
+    }
+
+    same_site_length = 0;
+    if (same_site) {
+        same_site_length = strlen(same_site);
+        len += HTTP_ATTRIBUTE_LENGTH("SameSite", same_site_length);
+    }
+
+#undef HTTP_ATTRIBUTE_LENGTH
+
+    str = http_malloc(len + 1);
+    ptr = str;
+
+#define HTTP_APPEND_STRING(string_) \
+    ptr = http_cookie_append(ptr, string_, sizeof(string_) - 1)
+
+    ptr = http_cookie_append(ptr, cookie->name, name_length);
+    HTTP_APPEND_STRING("=");
+    ptr = http_cookie_append(ptr, cookie->value, value_length);
+
+    if (cookie->domain) {
+        HTTP_APPEND_STRING("; Domain=");
+        ptr = http_cookie_append(ptr, cookie->domain, domain_length);
+    }
+
+    if (cookie->path) {
+        HTTP_APPEND_STRING("; Path=");
+        ptr = http_cookie_append(ptr, cookie->path, path_length);
+    }
+
+    if (cookie->expires > 0) {
+        HTTP_APPEND_STRING("; Expires=");
+        ptr = http_cookie_append(ptr, expires, expires_length);
+    }
+
+    if (cookie->has_max_age) {
+        HTTP_APPEND_STRING("; Max-Age=");
+        ptr = http_cookie_append(ptr, max_age, max_age_length);
+    }
+
+    if (cookie->secure)
+        HTTP_APPEND_STRING("; Secure");
+
+    if (cookie->http_only)
+        HTTP_APPEND_STRING("; HttpOnly");
+
+    if (same_site) {
+        HTTP_APPEND_STRING("; SameSite=");
+        ptr = http_cookie_append(ptr, same_site, same_site_length);
+    }
+
+#undef HTTP_APPEND_STRING
+
+    assert((size_t)(ptr - str) == len);
+    *ptr = '\0';
+
+    return str;
+}
+
+int
+http_headers_add_set_cookie(struct http_headers *headers,
+                            const struct http_set_cookie *cookie) {
+    char *value;
+
+    value = http_set_cookie_format(cookie);
+    if (!value)
+        return -1;
+
+    http_headers_add_header(headers, "Set-Cookie", value);
+
+    http_free(value);
+    return 0;
+}
+
+void
+http_request_free_cookies(struct http_request *request) {
+    http_free(request->cookies);
+    http_free(request->cookie_index);
+}
+
+static const struct http_request *
+http_msg_request_with_cookies(const struct http_msg *msg) {
+    struct http_request *request;
+
+    assert(msg->type == HTTP_MSG_REQUEST);
+
+    /* Most handlers never look at cookies, so the Cookie header is only
+     * parsed the first time a cookie is accessed. The message is logically
+     * constant, hence the cast. */
+    request = (struct http_request *)&msg->u.request;
+
+    if (!request->cookies_parsed)
+        http_request_parse_cookies(request, msg);
+
+    return request;
+}
+
+static void
+http_request_parse_cookies(struct http_request *request,
+                           const struct http_msg *msg) {
+    for (size_t i = 0; i < msg->nb_headers; i++) {
+        const struct http_header *header;
+
+        header = msg->headers + i;
+
+        /* RFC 6265 5.4: clients must not send several Cookie header fields,
+         * but it does not hurt to accept them. */
+        if (strcasecmp(header->name, "Cookie") == 0)
+            http_request_parse_cookie_header(request, header->value);
+    }
+
+    http_request_index_cookies(request);
+
+    request->cookies_parsed = true;
+}
+
+static void
+http_request_parse_cookie_header(struct http_request *request,
+                                 const char *string) {
+    const char *ptr;
+
+    /* cookie-string = cookie-pair *( ";" SP cookie-pair )
+     *
+     * Clients do not always follow the grammar, so we are lenient: pairs
+     * without '=' or with an empty name are ignored, and whitespace around
+     * names and values is skipped. */
+
+    ptr = string;
+
+    while (*ptr != '\0') {
+        struct http_cookie_view cookie;
+        const char *start, *end, *equal;
+
+        start = ptr;
+
+        end = strchr(start, ';');
+        if (end) {
+            ptr = end + 1;
+        } else {
+            end = start + strlen(start);
+            ptr = end;
+        }
+
+        while (start < end && (*start == ' ' || *start == '\t'))
+            start++;
+
+        equal = memchr(start, '=', (size_t)(end - start));
+        if (!equal)
+            continue;
+
+        cookie.name = start;
+        cookie.name_length = (size_t)(equal - start);
+
+        while (cookie.name_length > 0
+            && (cookie.name[cookie.name_length - 1] == ' '
+             || cookie.name[cookie.name_length - 1] == '\t')) {
+            cookie.name_length--;
+        }
+
+        if (cookie.name_length == 0)
+            continue;
+
+        cookie.value = equal + 1;
+        while (cookie.value < end
+            && (*cookie.value == ' ' || *cookie.value == '\t')) {
+            cookie.value++;
+        }
+
+        cookie.value_length = (size_t)(end - cookie.value);
+        while (cookie.value_length > 0
+            && (cookie.value[cookie.value_length - 1] == ' '
+             || cookie.value[cookie.value_length - 1] == '\t')) {
+            cookie.value_length--;
+        }
+
+        /* cookie-value = *cookie-octet / ( DQUOTE *cookie-octet DQUOTE ) */
+        if (cookie.value_length >= 2 && cookie.value[0] == '"'
+         && cookie.value[cookie.value_length - 1] == '"') {
+            cookie.value++;
+            cookie.value_length -= 2;
+        }
+
+        http_request_add_cookie(request, &cookie);
+    }
+}
+
+static void
+http_request_add_cookie(struct http_request *request,
+                        const struct http_cookie_view *cookie) {
+    if (request->nb_cookies == 0) {
+        request->cookies_sz = 4;
+        request->cookies = http_calloc(request->cookies_sz,
+                                       sizeof(struct http_cookie_view));
+    } else if (request->nb_cookies + 1 > request->cookies_sz) {
+        size_t nsz;
+
+        request->cookies_sz *= 2;
+
+        nsz = request->cookies_sz * sizeof(struct http_cookie_view);
+        request->cookies = http_realloc(request->cookies, nsz);
+    }
+
+    request->cookies[request->nb_cookies++] = *cookie;
+}
+
+static void
+http_request_index_cookies(struct http_request *request) {
+    if (request->nb_cookies == 0)
+        return;
+
+    request->cookie_index = http_calloc(request->nb_cookies, sizeof(size_t));
+
+    /* Requests rarely contain more than a few dozen cookies, and a stable
+     * insertion sort keeps duplicate names in header order. */
+    for (size_t i = 0; i < request->nb_cookies; i++) {
+        const struct http_cookie_view *cookie;
+        size_t j;
+
+        cookie = request->cookies + i;
+
+        j = i;
+        while (j > 0) {
+            const struct http_cookie_view *previous;
+
+            previous = request->cookies + request->cookie_index[j - 1];
+            if (http_cookie_view_compare_name(previous, cookie->name,
+                                              cookie->name_length) <= 0) {
+                break;
+            }
+
+            request->cookie_index[j] = request->cookie_index[j - 1];
+            j--;
+        }
+
+        request->cookie_index[j] = i;
+    }
+}
+
+static int
+http_cookie_view_compare_name(const struct http_cookie_view *cookie,
+                              const char *name, size_t name_length) {
+    int ret;
+
+    /* Cookie names are case-sensitive */
+    ret = memcmp(cookie->name, name, MIN(cookie->name_length, name_length));
+    if (ret != 0)
+        return ret;
+
+    if (cookie->name_length < name_length) {
+        return -1;
+    } else if (cookie->name_length > name_length) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static bool
+http_is_cookie_octet(unsigned char c) {
+    /* cookie-octet = %x21 / %x23-2B / %x2D-3A / %x3C-5B / %x5D-7E */
+    return c >= 0x21 && c <= 0x7e
+        && c != '"' && c != ',' && c != ';' && c != '\\';
+}
+
+static int
+http_set_cookie_check(const struct http_set_cookie *cookie) {
+    if (!cookie->name || cookie->name[0] == '\0') {
+        http_set_error("empty cookie name");
+        return -1;
+    }
+
+    for (const char *ptr = cookie->name; *ptr != '\0'; ptr++) {
+        if (!http_is_token_char((unsigned char)*ptr)) {
+            http_set_error("invalid character \\%hhu in cookie name",
+                           (unsigned char)*ptr);
+            return -1;
+        }
+    }
+
+    if (!cookie->value) {
+        http_set_error("missing cookie value");
+        return -1;
+    }
+
+    if (http_cookie_check_value(cookie->value) == -1)
+        return -1;
+
+    if (cookie->domain
+     && http_cookie_check_attribute("domain", cookie->domain) == -1) {
+        return -1;
+    }
+
+    if (cookie->path
+     && http_cookie_check_attribute("path", cookie->path) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+http_cookie_check_value(const char *value) {
+    const char *ptr;
+    size_t len;
+
+    ptr = value;
+    len = strlen(value);
+
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        ptr++;
+        len -= 2;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (!http_is_cookie_octet((unsigned char)ptr[i])) {
+            http_set_error("invalid character \\%hhu in cookie value",
+                           (unsigned char)ptr[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+http_cookie_check_attribute(const char *name, const char *value) {
+    for (const char *ptr = value; *ptr != '\0'; ptr++) {
+        unsigned char c;
+
+        c = (unsigned char)*ptr;
+
+        if (c < 0x20 || c == 0x7f || c == ';') {
+            http_set_error("invalid character \\%hhu in cookie %s",
+                           c, name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static char *
+http_cookie_append(char *ptr, const char *str, size_t len) {
+    memcpy(ptr, str, len);
+    return ptr + len;
+}
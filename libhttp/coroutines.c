@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Size of coroutine stacks, not including the guard page */
+#define HTTP_COROUTINE_STACK_SZ (128 * 1024)
+
+/* Maximum number of unused stacks kept by each thread */
+#define HTTP_COROUTINE_STACK_POOL_SZ 64
+
+#ifndef MAP_ANONYMOUS
+#   define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Stacks are mapped with an inaccessible page below them, so that a stack
+ * overflow crashes the process instead of corrupting memory. Mapping and
+ * protecting pages is expensive, so unused stacks are kept in a per-thread
+ * pool. */
+struct http_coroutine_stack {
+    void *mapping;
+    size_t mapping_sz;
+
+    struct http_coroutine_stack *next; /* in the pool */
+};
+
+struct http_coroutine {
+    ucontext_t context;
+    ucontext_t caller_context;
+
+    struct http_coroutine_stack *stack;
+
+    http_coroutine_fn fn;
+    void *arg;
+
+    bool finished;
+};
+
+static struct http_coroutine_stack *http_coroutine_stack_get(void);
+static void http_coroutine_stack_release(struct http_coroutine_stack *);
+static void http_coroutine_stack_unmap(struct http_coroutine_stack *);
+
+static void http_coroutine_main(void);
+
+static __thread struct http_coroutine *http_coroutine_current_coroutine;
+
+static __thread struct http_coroutine_stack *http_coroutine_stack_pool;
+static __thread size_t http_coroutine_stack_pool_sz;
+
+struct http_coroutine *
+http_coroutine_new(http_coroutine_fn fn, void *arg) {
+    struct http_coroutine *coroutine;
+
+    coroutine = http_malloc0(sizeof(struct http_coroutine));
+
+    coroutine->fn = fn;
+    coroutine->arg = arg;
+
+    coroutine->stack = http_coroutine_stack_get();
+    if (!coroutine->stack)
+        goto error;
+
+    if (getcontext(&coroutine->context) == -1) {
+        http_set_error("cannot get context: %s", strerror(errno));
+        goto error;
+    }
+
+    coroutine->context.uc_stack.ss_sp =
+        (char *)coroutine->stack->mapping + (size_t)getpagesize();
+    coroutine->context.uc_stack.ss_size = HTTP_COROUTINE_STACK_SZ;
+    coroutine->context.uc_link = &coroutine->caller_context;
+
+    makecontext(&coroutine->context, http_coroutine_main, 0);
+
+    return coroutine;
+
+error:
+    http_coroutine_delete(coroutine);
+    return NULL;
+}
+
+void
+http_coroutine_delete(struct http_coroutine *coroutine) {
+    if (!coroutine)
+        return;
+
+    assert(coroutine != http_coroutine_current_coroutine);
+
+    /* If the coroutine did not finish, whatever its frames reference is
+     * lost with the stack. */
+    if (coroutine->stack)
+        http_coroutine_stack_release(coroutine->stack);
+
+    memset(coroutine, 0, sizeof(struct http_coroutine));
+    http_free(coroutine);
+}
+
+void
+http_coroutine_resume(struct http_coroutine *coroutine) {
+    struct http_coroutine *caller;
+
+    assert(!coroutine->finished);
+
+    caller = http_coroutine_current_coroutine;
+    http_coroutine_current_coroutine = coroutine;
+
+    swapcontext(&coroutine->caller_context, &coroutine->context);
+
+    http_coroutine_current_coroutine = caller;
+}
+
+void
+http_coroutine_yield(void) {
+    struct http_coroutine *coroutine;
+
+    coroutine = http_coroutine_current_coroutine;
+    assert(coroutine);
+
+    swapcontext(&coroutine->context, &coroutine->caller_context);
+}
+
+struct http_coroutine *
+http_coroutine_current(void) {
+    return http_coroutine_current_coroutine;
+}
+
+bool
+http_coroutine_is_finished(const struct http_coroutine *coroutine) {
+    return coroutine->finished;
+}
+
+void
+http_coroutine_release_stacks(void) {
+    struct http_coroutine_stack *stack;
+
+    stack = http_coroutine_stack_pool;
+    while (stack) {
+        struct http_coroutine_stack *next;
+
+        next = stack->next;
+        http_coroutine_stack_unmap(stack);
+        stack = next;
+    }
+
+    http_coroutine_stack_pool = NULL;
+    http_coroutine_stack_pool_sz = 0;
+}
+
+static struct http_coroutine_stack *
+http_coroutine_stack_get(void) {
+    struct http_coroutine_stack *stack;
+    size_t page_sz;
+
+    stack = http_coroutine_stack_pool;
+    if (stack) {
+        http_coroutine_stack_pool = stack->next;
+        http_coroutine_stack_pool_sz--;
+
+        stack->next = NULL;
+        return stack;
+    }
+
+    page_sz = (size_t)getpagesize();
+
+    stack = http_malloc0(sizeof(struct http_coroutine_stack));
+
+    stack->mapping_sz = page_sz + HTTP_COROUTINE_STACK_SZ;
+    stack->mapping = mmap(NULL, stack->mapping_sz, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack->mapping == MAP_FAILED) {
+        http_set_error("cannot map stack: %s", strerror(errno));
+        http_free(stack);
+        return NULL;
+    }
+
+    /* Stacks grow downward on all supported platforms */
+    if (mprotect(stack->mapping, page_sz, PROT_NONE) == -1) {
+        http_set_error("cannot protect stack guard page: %s",
+                       strerror(errno));
+        http_coroutine_stack_unmap(stack);
+        return NULL;
+    }
+
+    return stack;
+}
+
+static void
+http_coroutine_stack_release(struct http_coroutine_stack *stack) {
+    if (http_coroutine_stack_pool_sz >= HTTP_COROUTINE_STACK_POOL_SZ) {
+        http_coroutine_stack_unmap(stack);
+        return;
+    }
+
+    stack->next = http_coroutine_stack_pool;
+    http_coroutine_stack_pool = stack;
+    http_coroutine_stack_pool_sz++;
+}
+
+static void
+http_coroutine_stack_unmap(struct http_coroutine_stack *stack) {
+    munmap(stack->mapping, stack->mapping_sz);
+    http_free(stack);
+}
+
+static void
+http_coroutine_main(void) {
+    struct http_coroutine *coroutine;
+
+    coroutine = http_coroutine_current_coroutine;
+
+    coroutine->fn(coroutine->arg);
+
+    /* Returning switches to uc_link, i.e. to the last caller of
+     * http_coroutine_resume(). */
+    coroutine->finished = true;
+}
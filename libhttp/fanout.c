@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Once sent, a request is referenced by the connection of its client until
+ * its response has been read or the connection closed, which can happen
+ * after the fan-out completed or was deleted. Requests are then detached
+ * from the fan-out, and their response is discarded when it arrives. */
+
+struct http_fanout_request {
+    struct http_fanout *fanout; /* NULL once detached */
+    size_t idx;
+
+    struct http_client *client;
+    enum http_method method;
+    struct http_uri *uri;
+    struct http_headers *headers;
+};
+
+struct http_fanout {
+    struct event_base *ev_base;
+
+    http_fanout_response_handler response_handler;
+    http_fanout_completion_handler completion_handler;
+    void *arg;
+
+    struct http_fanout_request **requests;
+    struct http_fanout_result *results;
+    size_t nb_requests;
+
+    size_t nb_pending;
+
+    struct event *ev_deadline;
+
+    bool started;
+    bool completed;
+};
+
+static void http_fanout_on_response(struct http_client *,
+                                    const struct http_msg *, void *);
+static void http_fanout_on_deadline(evutil_socket_t, short, void *);
+static void http_fanout_complete(struct http_fanout *);
+
+static void http_fanout_detach_requests(struct http_fanout *);
+
+static void http_fanout_request_delete(struct http_fanout_request *);
+
+struct http_fanout *
+http_fanout_new(struct event_base *ev_base,
+                http_fanout_response_handler response_handler,
+                http_fanout_completion_handler completion_handler,
+                void *arg) {
+    struct http_fanout *fanout;
+
+    fanout = http_malloc0(sizeof(struct http_fanout));
+
+    fanout->ev_base = ev_base;
+
+    fanout->response_handler = response_handler;
+    fanout->completion_handler = completion_handler;
+    fanout->arg = arg;
+
+    fanout->ev_deadline = evtimer_new(ev_base, http_fanout_on_deadline,
+                                      fanout);
+    if (!fanout->ev_deadline) {
+        http_set_error("cannot create timer: %s", strerror(errno));
+        http_fanout_delete(fanout);
+        return NULL;
+    }
+
+    return fanout;
+}
+
+void
+http_fanout_delete(struct http_fanout *fanout) {
+    if (!fanout)
+        return;
+
+    http_fanout_detach_requests(fanout);
+    http_free(fanout->requests);
+
+    for (size_t i = 0; i < fanout->nb_requests; i++)
+        http_free(fanout->results[i].body);
+    http_free(fanout->results);
+
+    if (fanout->ev_deadline)
+        event_free(fanout->ev_deadline);
+
+    memset(fanout, 0, sizeof(struct http_fanout));
+    http_free(fanout);
+}
+
+int
+http_fanout_add_request(struct http_fanout *fanout,
+                        struct http_client *client, enum http_method method,
+                        const struct http_uri *uri,
+                        struct http_headers *headers) {
+    struct http_fanout_request *request;
+    char *uri_string;
+    size_t nsz;
+
+    if (fanout->started) {
+        http_set_error("fan-out already started");
+        http_headers_delete(headers);
+        return -1;
+    }
+
+    /* URIs cannot be copied directly */
+    uri_string = http_uri_encode(uri);
+    if (!uri_string) {
+        http_headers_delete(headers);
+        return -1;
+    }
+
+    request = http_malloc0(sizeof(struct http_fanout_request));
+
+    request->fanout = fanout;
+    request->idx = fanout->nb_requests;
+
+    request->client = client;
+    request->method = method;
+    request->headers = headers;
+
+    request->uri = http_uri_new(uri_string);
+    http_free(uri_string);
+    if (!request->uri) {
+        http_fanout_request_delete(request);
+        return -1;
+    }
+
+    nsz = (fanout->nb_requests + 1) * sizeof(struct http_fanout_request *);
+    fanout->requests = http_realloc(fanout->requests, nsz);
+
+    nsz = (fanout->nb_requests + 1) * sizeof(struct http_fanout_result);
+    fanout->results = http_realloc(fanout->results, nsz);
+
+    fanout->requests[fanout->nb_requests] = request;
+    memset(fanout->results + fanout->nb_requests, 0,
+           sizeof(struct http_fanout_result));
+
+    fanout->nb_requests++;
+    return 0;
+}
+
+int
+http_fanout_start(struct http_fanout *fanout, uint64_t timeout) {
+    struct timeval tv;
+
+    if (fanout->started) {
+        http_set_error("fan-out already started");
+        return -1;
+    }
+
+    fanout->started = true;
+
+    for (size_t i = 0; i < fanout->nb_requests; i++) {
+        struct http_fanout_request *request;
+        struct http_headers *headers;
+
+        request = fanout->requests[i];
+
+        headers = request->headers;
+        request->headers = NULL;
+
+        if (http_client_send_request(request->client, request->method,
+                                     request->uri, headers) == -1) {
+            http_client_error(request->client, "cannot send request: %s",
+                              http_get_error());
+
+            fanout->results[i].status = HTTP_FANOUT_FAILED;
+
+            http_fanout_request_delete(request);
+            fanout->requests[i] = NULL;
+            continue;
+        }
+
+        http_client_set_last_request_handler(request->client,
+                                             http_fanout_on_response,
+                                             request);
+
+        fanout->nb_pending++;
+    }
+
+    /* The completion handler is always called from the event loop, even
+     * if no request could be sent */
+    if (fanout->nb_pending == 0)
+        timeout = 0;
+
+    tv.tv_sec = (time_t)(timeout / 1000);
+    tv.tv_usec = (suseconds_t)((timeout % 1000) * 1000);
+
+    if (evtimer_add(fanout->ev_deadline, &tv) == -1) {
+        http_set_error("cannot start timer: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+http_fanout_on_response(struct http_client *client,
+                        const struct http_msg *msg, void *arg) {
+    struct http_fanout_request *request;
+    struct http_fanout_result *result;
+    struct http_fanout *fanout;
+    bool is_last_call;
+
+    request = arg;
+    fanout = request->fanout;
+
+    is_last_call = !msg || msg->is_complete || msg->aborted;
+
+    if (!fanout) {
+        if (is_last_call)
+            http_fanout_request_delete(request);
+        return;
+    }
+
+    result = fanout->results + request->idx;
+
+    if (msg) {
+        result->status_code = msg->u.response.status_code;
+
+        if (msg->is_complete && msg->is_bufferized && msg->body_length > 0) {
+            result->body = http_malloc(msg->body_length);
+            memcpy(result->body, msg->body, msg->body_length);
+            result->body_length = msg->body_length;
+        }
+    }
+
+    if (fanout->response_handler)
+        fanout->response_handler(fanout, request->idx, msg, fanout->arg);
+
+    if (!is_last_call)
+        return;
+
+    result->status = (msg && msg->is_complete) ? HTTP_FANOUT_COMPLETE
+                                               : HTTP_FANOUT_FAILED;
+
+    fanout->requests[request->idx] = NULL;
+    http_fanout_request_delete(request);
+
+    fanout->nb_pending--;
+    if (fanout->nb_pending > 0)
+        return;
+
+    /* Completion is signaled from the event loop so that the handler can
+     * delete clients, which is not possible from a response handler. */
+    evtimer_del(fanout->ev_deadline);
+    event_active(fanout->ev_deadline, EV_TIMEOUT, 0);
+}
+
+static void
+http_fanout_on_deadline(evutil_socket_t sock, short events, void *arg) {
+    struct http_fanout *fanout;
+
+    fanout = arg;
+
+    for (size_t i = 0; i < fanout->nb_requests; i++) {
+        if (fanout->results[i].status == HTTP_FANOUT_PENDING)
+            fanout->results[i].status = HTTP_FANOUT_TIMEOUT;
+    }
+
+    http_fanout_complete(fanout);
+}
+
+static void
+http_fanout_complete(struct http_fanout *fanout) {
+    if (fanout->completed)
+        return;
+
+    fanout->completed = true;
+
+    http_fanout_detach_requests(fanout);
+    fanout->nb_pending = 0;
+
+    /* The handler may delete the fan-out */
+    fanout->completion_handler(fanout, fanout->results, fanout->nb_requests,
+                               fanout->arg);
+}
+
+static void
+http_fanout_detach_requests(struct http_fanout *fanout) {
+    for (size_t i = 0; i < fanout->nb_requests; i++) {
+        struct http_fanout_request *request;
+
+        request = fanout->requests[i];
+        if (!request)
+            continue;
+
+        fanout->requests[i] = NULL;
+
+        if (!fanout->started) {
+            http_fanout_request_delete(request);
+            continue;
+        }
+
+        /* The request was sent and is still referenced by its connection */
+        request->fanout = NULL;
+    }
+}
+
+static void
+http_fanout_request_delete(struct http_fanout_request *request) {
+    if (!request)
+        return;
+
+    http_uri_delete(request->uri);
+    http_headers_delete(request->headers);
+
+    memset(request, 0, sizeof(struct http_fanout_request));
+    http_free(request);
+}
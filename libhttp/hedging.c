@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Number of latencies the hedging delay is computed from */
+#define HTTP_HEDGER_NB_LATENCIES 256
+
+/* Number of latencies recorded before the initial delay stops being used */
+#define HTTP_HEDGER_MIN_LATENCIES 32
+
+/* The delay is computed again every HTTP_HEDGER_DELAY_PERIOD latencies */
+#define HTTP_HEDGER_DELAY_PERIOD 16
+
+/* Maximum number of copies sent in a burst, whatever the budget saved */
+#define HTTP_HEDGER_MAX_BURST 10
+
+/* Responses arrive on each connection in the order requests were sent, so
+ * every client has a queue of the copies sent with it; the head of the queue
+ * is the copy the next response belongs to. A request is released once all
+ * its copies have been answered or lost with their connection. */
+
+struct http_hedged_request;
+
+struct http_hedged_copy {
+    struct http_hedged_request *request;
+
+    uint64_t send_time;
+
+    bool is_hedge;
+    bool is_winner;
+    bool response_received;
+
+    struct http_hedged_copy *next;
+};
+
+struct http_hedger_client {
+    struct http_client *client;
+
+    struct http_hedged_copy *copies_first;
+    struct http_hedged_copy *copies_last;
+    size_t nb_copies;
+};
+
+struct http_hedged_request {
+    struct http_hedger *hedger;
+
+    enum http_method method;
+    char *uri_string;
+    struct http_headers *headers;
+
+    void *arg;
+
+    struct http_client *primary_client;
+    struct event *ev_hedge;
+
+    size_t nb_copies; /* copies waiting for a response */
+    bool answered;
+
+    struct http_hedged_request *prev;
+    struct http_hedged_request *next;
+};
+
+struct http_hedger {
+    struct event_base *ev_base;
+    struct http_hedging_options options;
+
+    struct http_hedger_client *clients;
+    size_t nb_clients;
+    size_t next_client;
+
+    struct http_hedged_request *requests;
+
+    uint64_t latencies[HTTP_HEDGER_NB_LATENCIES];
+    size_t nb_latencies;
+    uint64_t delay;
+
+    /* Hundredths of a copy; every request adds the budget percentage */
+    uint64_t budget;
+
+    /* Copy whose response is being passed to the handler; reset if the
+     * handler causes it to be dropped */
+    struct http_hedged_copy *current_copy;
+
+    struct http_hedging_stats stats;
+};
+
+static struct http_hedger_client *
+http_hedger_find_client(struct http_hedger *, const struct http_client *);
+static struct http_hedger_client *
+http_hedger_select_client(struct http_hedger *, const struct http_client *);
+static void http_hedger_drop_copies(struct http_hedger *,
+                                    struct http_hedger_client *);
+
+static int http_hedger_send_copy(struct http_hedger *,
+                                 struct http_hedged_request *,
+                                 struct http_hedger_client *,
+                                 const struct http_uri *, bool);
+static void http_hedger_on_hedge_timer(evutil_socket_t, short, void *);
+
+static void http_hedger_record_latency(struct http_hedger *, uint64_t);
+static int http_hedger_cmp_latencies(const void *, const void *);
+
+static void http_hedged_request_delete(struct http_hedged_request *);
+static void http_hedged_request_release(struct http_hedged_request *);
+
+void
+http_hedging_options_init(struct http_hedging_options *options) {
+    memset(options, 0, sizeof(struct http_hedging_options));
+
+    options->delay_percentile = 95;
+    options->initial_delay = 50;
+    options->min_delay = 1;
+    options->budget = 5;
+}
+
+struct http_hedger *
+http_hedger_new(struct event_base *ev_base,
+                const struct http_hedging_options *options) {
+    struct http_hedger *hedger;
+
+    hedger = http_malloc0(sizeof(struct http_hedger));
+
+    hedger->ev_base = ev_base;
+    hedger->options = *options;
+
+    hedger->delay = options->initial_delay;
+
+    return hedger;
+}
+
+void
+http_hedger_delete(struct http_hedger *hedger) {
+    struct http_hedged_request *request;
+
+    if (!hedger)
+        return;
+
+    for (size_t i = 0; i < hedger->nb_clients; i++) {
+        struct http_hedger_client *hclient;
+        struct http_hedged_copy *copy;
+
+        hclient = hedger->clients + i;
+
+        copy = hclient->copies_first;
+        while (copy) {
+            struct http_hedged_copy *next;
+
+            next = copy->next;
+            http_free(copy);
+            copy = next;
+        }
+
+        hclient->client->hedger = NULL;
+    }
+
+    http_free(hedger->clients);
+
+    request = hedger->requests;
+    while (request) {
+        struct http_hedged_request *next;
+
+        next = request->next;
+        http_hedged_request_delete(request);
+        request = next;
+    }
+
+    memset(hedger, 0, sizeof(struct http_hedger));
+    http_free(hedger);
+}
+
+int
+http_hedger_add_client(struct http_hedger *hedger,
+                       struct http_client *client) {
+    struct http_hedger_client *hclient;
+    size_t nsz;
+
+    if (client->hedger) {
+        http_set_error("client already belongs to a hedger");
+        return -1;
+    }
+
+    nsz = (hedger->nb_clients + 1) * sizeof(struct http_hedger_client);
+    hedger->clients = http_realloc(hedger->clients, nsz);
+
+    hclient = hedger->clients + hedger->nb_clients;
+    memset(hclient, 0, sizeof(struct http_hedger_client));
+
+    hclient->client = client;
+    hedger->nb_clients++;
+
+    client->hedger = hedger;
+    return 0;
+}
+
+int
+http_hedger_send_request(struct http_hedger *hedger, enum http_method method,
+                         const struct http_uri *uri,
+                         struct http_headers *headers, void *arg) {
+    struct http_hedged_request *request;
+    struct http_hedger_client *hclient;
+    uint64_t max_budget;
+    struct timeval tv;
+
+    hclient = http_hedger_select_client(hedger, NULL);
+    if (!hclient) {
+        http_set_error("no connected client available");
+        http_headers_delete(headers);
+        return -1;
+    }
+
+    request = http_malloc0(sizeof(struct http_hedged_request));
+
+    request->hedger = hedger;
+    request->method = method;
+    request->arg = arg;
+
+    request->headers = http_headers_new();
+    if (headers)
+        http_headers_add_headers(request->headers, headers);
+    http_headers_delete(headers);
+
+    request->uri_string = http_uri_encode(uri);
+    if (!request->uri_string) {
+        http_hedged_request_delete(request);
+        return -1;
+    }
+
+    if (http_hedger_send_copy(hedger, request, hclient, uri, false) == -1) {
+        http_hedged_request_delete(request);
+        return -1;
+    }
+
+    request->primary_client = hclient->client;
+
+    request->next = hedger->requests;
+    if (hedger->requests)
+        hedger->requests->prev = request;
+    hedger->requests = request;
+
+    hedger->stats.nb_requests++;
+
+    /* Only requests which can safely be processed twice are hedged */
+    if ((method != HTTP_GET && method != HTTP_HEAD)
+     || hedger->nb_clients < 2 || hedger->options.budget == 0) {
+        return 0;
+    }
+
+    max_budget = HTTP_HEDGER_MAX_BURST * 100;
+    hedger->budget = MIN(hedger->budget + hedger->options.budget, max_budget);
+
+    request->ev_hedge = evtimer_new(hedger->ev_base,
+                                    http_hedger_on_hedge_timer, request);
+    if (!request->ev_hedge) {
+        http_client_error(hclient->client, "cannot create timer: %s",
+                          strerror(errno));
+        return 0;
+    }
+
+    tv.tv_sec = (time_t)(hedger->delay / 1000);
+    tv.tv_usec = (suseconds_t)((hedger->delay % 1000) * 1000);
+
+    if (evtimer_add(request->ev_hedge, &tv) == -1) {
+        http_client_error(hclient->client, "cannot start timer: %s",
+                          strerror(errno));
+        return 0;
+    }
+
+    return 0;
+}
+
+void
+http_hedger_get_stats(const struct http_hedger *hedger,
+                      struct http_hedging_stats *stats) {
+    *stats = hedger->stats;
+    stats->delay = hedger->delay;
+}
+
+void
+http_hedger_on_response(struct http_hedger *hedger,
+                        struct http_client *client,
+                        const struct http_msg *msg) {
+    struct http_hedged_request *request;
+    struct http_hedger_client *hclient;
+    struct http_hedged_copy *copy;
+
+    hclient = http_hedger_find_client(hedger, client);
+    if (!hclient || !hclient->copies_first)
+        return;
+
+    copy = hclient->copies_first;
+    request = copy->request;
+
+    if (!copy->response_received) {
+        uint64_t now;
+
+        copy->response_received = true;
+
+        if (http_now_ms(&now) == 0)
+            http_hedger_record_latency(hedger, now - copy->send_time);
+
+        if (!request->answered) {
+            request->answered = true;
+            copy->is_winner = true;
+
+            if (request->ev_hedge)
+                evtimer_del(request->ev_hedge);
+
+            if (copy->is_hedge)
+                hedger->stats.nb_hedge_wins++;
+        }
+    }
+
+    /* Responses of losing copies are read and discarded; HTTP/1.1 offers
+     * no way to cancel a request without closing the connection. */
+    if (copy->is_winner) {
+        hedger->current_copy = copy;
+        hedger->options.response_handler(hedger, msg, request->arg);
+
+        /* The handler can remove clients or close connections, which drops
+         * their copies and moves the client array */
+        copy = hedger->current_copy;
+        hedger->current_copy = NULL;
+
+        if (!copy)
+            return;
+
+        hclient = http_hedger_find_client(hedger, client);
+        assert(hclient && hclient->copies_first == copy);
+    }
+
+    if (!msg->is_complete && !msg->aborted)
+        return;
+
+    hclient->copies_first = copy->next;
+    if (!hclient->copies_first)
+        hclient->copies_last = NULL;
+    hclient->nb_copies--;
+
+    http_free(copy);
+
+    request->nb_copies--;
+    http_hedged_request_release(request);
+}
+
+void
+http_hedger_on_client_closed(struct http_hedger *hedger,
+                             struct http_client *client) {
+    struct http_hedger_client *hclient;
+
+    hclient = http_hedger_find_client(hedger, client);
+    if (hclient)
+        http_hedger_drop_copies(hedger, hclient);
+}
+
+void
+http_hedger_remove_client(struct http_hedger *hedger,
+                          struct http_client *client) {
+    struct http_hedger_client *hclient;
+    size_t idx;
+
+    hclient = http_hedger_find_client(hedger, client);
+    if (!hclient)
+        return;
+
+    http_hedger_drop_copies(hedger, hclient);
+
+    /* Dropping copies may have called the response handler */
+    hclient = http_hedger_find_client(hedger, client);
+    if (!hclient)
+        return;
+
+    idx = (size_t)(hclient - hedger->clients);
+    memmove(hclient, hclient + 1,
+            (hedger->nb_clients - idx - 1) * sizeof(struct http_hedger_client));
+    hedger->nb_clients--;
+
+    for (struct http_hedged_request *request = hedger->requests; request;
+         request = request->next) {
+        if (request->primary_client == client)
+            request->primary_client = NULL;
+    }
+
+    client->hedger = NULL;
+}
+
+static struct http_hedger_client *
+http_hedger_find_client(struct http_hedger *hedger,
+                        const struct http_client *client) {
+    for (size_t i = 0; i < hedger->nb_clients; i++) {
+        if (hedger->clients[i].client == client)
+            return hedger->clients + i;
+    }
+
+    return NULL;
+}
+
+static struct http_hedger_client *
+http_hedger_select_client(struct http_hedger *hedger,
+                          const struct http_client *excluded_client) {
+    struct http_hedger_client *selected;
+
+    if (hedger->nb_clients == 0)
+        return NULL;
+
+    /* Pick the client with the fewest outstanding requests, starting from a
+     * different client each time so that ties are spread. */
+    selected = NULL;
+
+    for (size_t i = 0; i < hedger->nb_clients; i++) {
+        struct http_hedger_client *hclient;
+        size_t idx;
+
+        idx = (hedger->next_client + i) % hedger->nb_clients;
+        hclient = hedger->clients + idx;
+
+        if (hclient->client == excluded_client || !hclient->client->connection)
+            continue;
+
+        if (!selected || hclient->nb_copies < selected->nb_copies)
+            selected = hclient;
+    }
+
+    hedger->next_client = (hedger->next_client + 1) % hedger->nb_clients;
+
+    return selected;
+}
+
+static void
+http_hedger_drop_copies(struct http_hedger *hedger,
+                        struct http_hedger_client *hclient) {
+    struct http_hedged_copy *copy;
+
+    /* The response handler can be called for failed requests and send new
+     * ones, so the queue is detached first. */
+    copy = hclient->copies_first;
+
+    hclient->copies_first = NULL;
+    hclient->copies_last = NULL;
+    hclient->nb_copies = 0;
+
+    while (copy) {
+        struct http_hedged_request *request;
+        struct http_hedged_copy *next;
+
+        next = copy->next;
+        request = copy->request;
+
+        if (copy == hedger->current_copy)
+            hedger->current_copy = NULL;
+
+        http_free(copy);
+
+        request->nb_copies--;
+        http_hedged_request_release(request);
+
+        copy = next;
+    }
+}
+
+static int
+http_hedger_send_copy(struct http_hedger *hedger,
+                      struct http_hedged_request *request,
+                      struct http_hedger_client *hclient,
+                      const struct http_uri *uri, bool is_hedge) {
+    struct http_hedged_copy *copy;
+    struct http_headers *headers;
+    uint64_t now;
+
+    if (http_now_ms(&now) == -1)
+        return -1;
+
+    headers = http_headers_new();
+    http_headers_add_headers(headers, request->headers);
+
+    if (http_client_send_request(hclient->client, request->method, uri,
+                                 headers) == -1) {
+        return -1;
+    }
+
+    copy = http_malloc0(sizeof(struct http_hedged_copy));
+
+    copy->request = request;
+    copy->send_time = now;
+    copy->is_hedge = is_hedge;
+
+    if (hclient->copies_last) {
+        hclient->copies_last->next = copy;
+    } else {
+        hclient->copies_first = copy;
+    }
+    hclient->copies_last = copy;
+    hclient->nb_copies++;
+
+    request->nb_copies++;
+    return 0;
+}
+
+static void
+http_hedger_on_hedge_timer(evutil_socket_t sock, short events, void *arg) {
+    struct http_hedged_request *request;
+    struct http_hedger_client *hclient;
+    struct http_hedger *hedger;
+    struct http_uri *uri;
+
+    request = arg;
+    hedger = request->hedger;
+
+    if (request->answered || request->nb_copies == 0)
+        return;
+
+    if (hedger->budget < 100) {
+        hedger->stats.nb_over_budget++;
+        return;
+    }
+
+    hclient = http_hedger_select_client(hedger, request->primary_client);
+    if (!hclient)
+        return;
+
+    uri = http_uri_new(request->uri_string);
+    if (!uri) {
+        http_client_error(hclient->client, "cannot parse uri: %s",
+                          http_get_error());
+        return;
+    }
+
+    if (http_hedger_send_copy(hedger, request, hclient, uri, true) == -1) {
+        http_client_error(hclient->client, "cannot send hedged request: %s",
+                          http_get_error());
+        http_uri_delete(uri);
+        return;
+    }
+
+    http_uri_delete(uri);
+
+    http_client_trace(hclient->client, "hedging %s %s",
+                      http_method_to_string(request->method),
+                      request->uri_string);
+
+    hedger->budget -= 100;
+    hedger->stats.nb_hedged++;
+}
+
+static void
+http_hedger_record_latency(struct http_hedger *hedger, uint64_t latency) {
+    uint64_t latencies[HTTP_HEDGER_NB_LATENCIES];
+    size_t nb_latencies, idx;
+
+    hedger->latencies[hedger->nb_latencies % HTTP_HEDGER_NB_LATENCIES]
+        = latency;
+    hedger->nb_latencies++;
+
+    if (hedger->nb_latencies < HTTP_HEDGER_MIN_LATENCIES
+     || hedger->nb_latencies % HTTP_HEDGER_DELAY_PERIOD != 0) {
+        return;
+    }
+
+    nb_latencies = MIN(hedger->nb_latencies, (size_t)HTTP_HEDGER_NB_LATENCIES);
+
+    memcpy(latencies, hedger->latencies, nb_latencies * sizeof(uint64_t));
+    qsort(latencies, nb_latencies, sizeof(uint64_t),
+          http_hedger_cmp_latencies);
+
+    idx = (nb_latencies - 1) * MIN(hedger->options.delay_percentile, 100u)
+        / 100;
+
+    hedger->delay = MAX(latencies[idx], hedger->options.min_delay);
+}
+
+static int
+http_hedger_cmp_latencies(const void *p1, const void *p2) {
+    uint64_t l1, l2;
+
+    l1 = *(const uint64_t *)p1;
+    l2 = *(const uint64_t *)p2;
+
+    if (l1 < l2)
+        return -1;
+    if (l1 > l2)
+        return 1;
+    return 0;
+}
+
+static void
+http_hedged_request_delete(struct http_hedged_request *request) {
+    if (!request)
+        return;
+
+    if (request->ev_hedge)
+        event_free(request->ev_hedge);
+
+    http_free(request->uri_string);
+    http_headers_delete(request->headers);
+
+    memset(request, 0, sizeof(struct http_hedged_request));
+    http_free(request);
+}
+
+static void
+http_hedged_request_release(struct http_hedged_request *request) {
+    struct http_hedger *hedger;
+
+    if (request->nb_copies > 0)
+        return;
+
+    hedger = request->hedger;
+
+    if (request->prev) {
+        request->prev->next = request->next;
+    } else {
+        hedger->requests = request->next;
+    }
+
+    if (request->next)
+        request->next->prev = request->prev;
+
+    /* All copies were lost with their connection */
+    if (!request->answered)
+        hedger->options.response_handler(hedger, NULL, request->arg);
+
+    http_hedged_request_delete(request);
+}
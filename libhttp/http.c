@@ -26,7 +26,6 @@ static int http_msg_process_headers(struct http_parser *);
 static int http_msg_finalize_body(struct http_msg *msg,
                                   const struct http_cfg *);
 
-static bool http_is_token_char(unsigned char);
 
 const char *
 http_version_to_string(enum http_version version) {
@@ -197,6 +196,15 @@ http_msg_content_type_is(const struct http_msg *msg, const char *content_type) {
     return strcmp(http_media_type_base_string(media_type), content_type) == 0;
 }
 
+bool
+http_msg_content_type_is_id(const struct http_msg *msg,
+                            enum http_media_type_id id) {
+    if (!msg->content_type)
+        return false;
+
+    return http_media_type_id(msg->content_type) == id;
+}
+
 const char *
 http_msg_body(const struct http_msg *msg) {
     return msg->body;
@@ -422,11 +430,8 @@ http_msg_content(const struct http_msg *msg) {
 
 bool
 http_msg_has_form_data(const struct http_msg *msg) {
-    if (!msg->content_type)
-        return false;
-
-    return strcmp(http_media_type_base_string(msg->content_type),
-                  "application/x-www-form-urlencoded") == 0;
+    return http_msg_content_type_is_id(msg,
+                    HTTP_MEDIA_TYPE_APPLICATION_X_WWW_FORM_URLENCODED);
 }
 
 int
@@ -490,6 +495,13 @@ http_request_named_parameter(const struct http_msg *msg, const char *name) {
     return NULL;
 }
 
+const char *
+http_request_path(const struct http_msg *msg) {
+    assert(msg->type == HTTP_MSG_REQUEST);
+
+    return msg->u.request.path;
+}
+
 bool
 http_request_has_query_parameter(const struct http_msg *msg, const char *name) {
     assert(msg->type == HTTP_MSG_REQUEST);
@@ -777,12 +789,15 @@ void
 http_request_free(struct http_request *request) {
     http_free(request->uri_string);
     http_uri_delete(request->uri);
+    http_free(request->path);
 
     for (size_t i = 0; i < request->nb_named_parameters; i++)
         http_named_parameter_free(request->named_parameters + i);
     http_free(request->named_parameters);
 
     http_ranges_free(&request->ranges);
+
+    http_request_free_cookies(request);
 }
 
 void
@@ -1165,11 +1180,23 @@ http_msg_parse_request_line(struct bf_buffer *buf, struct http_parser *parser) {
             msg->u.request.uri_string = uri_string;
 
             if (strcmp(uri_string, "*") != 0) {
+                const char *path;
+
                 msg->u.request.uri = http_uri_new(uri_string);
                 if (!msg->u.request.uri) {
                     HTTP_ERROR(HTTP_BAD_REQUEST,
                                "cannot parse uri: %s", http_get_error());
                 }
+
+                /* The canonical path is computed once and used for routing
+                 * and by handlers. */
+                path = http_uri_encoded_path(msg->u.request.uri);
+
+                msg->u.request.path = http_canonicalize_path(path);
+                if (!msg->u.request.path) {
+                    HTTP_ERROR(HTTP_BAD_REQUEST,
+                               "invalid path: %s", http_get_error());
+                }
             }
 
             found = true;
@@ -1721,26 +1748,23 @@ http_msg_process_headers(struct http_parser *parser) {
                 }
             }
         } else if (HTTP_HEADER_IS("Connection")) {
-            struct http_pvalues pvalues;
-
-            if (http_pvalues_parse(&pvalues, header->value) == -1) {
-                HTTP_ERROR(HTTP_BAD_REQUEST,
-                           "invalid Connection header: %s", http_get_error());
-            }
-
-            for (size_t i = 0; i < pvalues.nb_pvalues; i++) {
-                struct http_pvalue *pvalue;
+            struct http_pvalue_iterator it;
+            int ret;
 
-                pvalue = pvalues.pvalues + i;
+            http_pvalue_iterator_init(&it, header->value);
 
-                if (strcasecmp(pvalue->value, "keep-alive") == 0) {
+            while ((ret = http_pvalue_iterator_next(&it)) == 1) {
+                if (http_pvalue_iterator_value_is(&it, "keep-alive")) {
                     msg->connection_options |= HTTP_CONNECTION_KEEP_ALIVE;
-                } else if (strcasecmp(pvalue->value, "close") == 0) {
+                } else if (http_pvalue_iterator_value_is(&it, "close")) {
                     msg->connection_options |= HTTP_CONNECTION_CLOSE;
                 }
             }
 
-            http_pvalues_free(&pvalues);
+            if (ret == -1) {
+                HTTP_ERROR(HTTP_BAD_REQUEST,
+                           "invalid Connection header: %s", http_get_error());
+            }
         } else if (HTTP_HEADER_IS("Content-Length")) {
             if (has_transfer_encoding) {
                 /* RFC 2616 4.3: If a message is received with both a
@@ -1757,31 +1781,23 @@ http_msg_process_headers(struct http_parser *parser) {
                            http_get_error());
             }
         } else if (HTTP_HEADER_IS("Content-Type")) {
-            msg->content_type = http_media_type_new(header->value);
+            msg->content_type = http_media_type_intern(header->value);
             if (!msg->content_type) {
                 HTTP_ERROR(HTTP_BAD_REQUEST, "cannot parse Content-Type: %s",
                            http_get_error());
             }
         } else if (HTTP_HEADER_IS("Transfer-Encoding")) {
-            struct http_pvalues pvalues;
+            struct http_pvalue_iterator it;
             bool is_chunked;
+            int ret;
 
             is_chunked = false;
 
-            if (http_pvalues_parse(&pvalues, header->value) == -1) {
-                HTTP_ERROR(HTTP_BAD_REQUEST,
-                           "invalid Transfer-Encoding header: %s",
-                           http_get_error());
-            }
-
-            for (size_t i = 0; i < pvalues.nb_pvalues; i++) {
-                struct http_pvalue *pvalue;
-
-                pvalue = pvalues.pvalues + i;
+            http_pvalue_iterator_init(&it, header->value);
 
-                if (strcasecmp(pvalue->value, "chunked") == 0) {
+            while ((ret = http_pvalue_iterator_next(&it)) == 1) {
+                if (http_pvalue_iterator_value_is(&it, "chunked")) {
                     if (is_chunked) {
-                        http_pvalues_free(&pvalues);
                         HTTP_ERROR(HTTP_BAD_REQUEST,
                                    "duplicate 'chunked' token in "
                                    "Transfer-Encoding header");
@@ -1790,46 +1806,52 @@ http_msg_process_headers(struct http_parser *parser) {
                     has_transfer_encoding = true;
                     is_chunked = true;
                     msg->is_body_chunked = true;
-                } else if (strcasecmp(pvalue->value, "identity") == 0) {
+                } else if (http_pvalue_iterator_value_is(&it, "identity")) {
                     /* Default transfer encoding */
                 } else {
-                    http_pvalues_free(&pvalues);
                     HTTP_ERROR(HTTP_NOT_IMPLEMENTED,
                                "unknown transfer encoding");
                 }
             }
 
-            http_pvalues_free(&pvalues);
-        } else if (msg->type == HTTP_MSG_REQUEST && HTTP_HEADER_IS("Expect")) {
-            struct http_pvalues pvalues;
-
-            if (http_pvalues_parse(&pvalues, header->value) == -1) {
+            if (ret == -1) {
                 HTTP_ERROR(HTTP_BAD_REQUEST,
-                           "invalid Expect header: %s", http_get_error());
+                           "invalid Transfer-Encoding header: %s",
+                           http_get_error());
             }
+        } else if (msg->type == HTTP_MSG_REQUEST && HTTP_HEADER_IS("Expect")) {
+            struct http_pvalue_iterator it;
+            int ret;
 
-            for (size_t i = 0; i < pvalues.nb_pvalues; i++) {
-                struct http_pvalue *pvalue;
-
-                pvalue = pvalues.pvalues + i;
+            http_pvalue_iterator_init(&it, header->value);
 
-                if (strcasecmp(pvalue->value, "100-continue") == 0) {
+            while ((ret = http_pvalue_iterator_next(&it)) == 1) {
+                if (http_pvalue_iterator_value_is(&it, "100-continue")) {
                     msg->u.request.expects_100_continue = true;
-                } else if (strcasecmp(pvalue->value, "close") == 0) {
-                    http_pvalues_free(&pvalues);
+                } else if (http_pvalue_iterator_value_is(&it, "close")) {
                     HTTP_ERROR(HTTP_EXPECTATION_FAILED,
                                "unknown expectation value");
                 }
             }
 
-            http_pvalues_free(&pvalues);
+            if (ret == -1) {
+                HTTP_ERROR(HTTP_BAD_REQUEST,
+                           "invalid Expect header: %s", http_get_error());
+            }
         } else if (msg->type == HTTP_MSG_REQUEST && HTTP_HEADER_IS("Range")) {
+            int ret;
+
             msg->u.request.has_ranges = true;
 
-            if (http_ranges_parse(&msg->u.request.ranges,
-                                  header->value) == -1) {
+            ret = http_ranges_parse(&msg->u.request.ranges, header->value,
+                                    parser->cfg->u.server.max_ranges);
+            if (ret == -1) {
                 HTTP_ERROR(HTTP_BAD_REQUEST, "cannot parse ranges: %s",
                            http_get_error());
+            } else if (ret == 1) {
+                /* RFC 7233 3.1: a server MAY ignore the Range header field;
+                 * the whole representation is sent instead. */
+                msg->u.request.has_ranges = false;
             }
         }
 
@@ -1908,7 +1930,7 @@ http_msg_finalize_body(struct http_msg *msg, const struct http_cfg *cfg) {
     return 0;
 }
 
-static bool
+bool
 http_is_token_char(unsigned char c) {
     static uint32_t table[8] = {
         0x00000000, /*   0- 31                                          */
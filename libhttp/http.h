@@ -157,9 +157,24 @@ struct http_ranges;
 bool http_ranges_is_satisfiable(const struct http_ranges *, size_t);
 size_t http_ranges_length(const struct http_ranges *);
 
+enum http_media_type_id {
+    HTTP_MEDIA_TYPE_OTHER = 0,
+
+    HTTP_MEDIA_TYPE_APPLICATION_JSON,
+    HTTP_MEDIA_TYPE_APPLICATION_OCTET_STREAM,
+    HTTP_MEDIA_TYPE_APPLICATION_X_WWW_FORM_URLENCODED,
+    HTTP_MEDIA_TYPE_MULTIPART_BYTERANGES,
+    HTTP_MEDIA_TYPE_MULTIPART_FORM_DATA,
+    HTTP_MEDIA_TYPE_TEXT_HTML,
+    HTTP_MEDIA_TYPE_TEXT_PLAIN,
+
+    HTTP_MEDIA_TYPE_NB_IDS
+};
+
 struct http_msg;
 struct http_header;
 struct http_connection;
+struct http_cookie_view;
 
 enum http_version http_msg_version(const struct http_msg *);
 
@@ -174,6 +189,8 @@ bool http_msg_has_content_length(const struct http_msg *);
 size_t http_msg_content_length(const struct http_msg *);
 const struct http_media_type *http_msg_content_type(const struct http_msg *);
 bool http_msg_content_type_is(const struct http_msg *, const char *);
+bool http_msg_content_type_is_id(const struct http_msg *,
+                                 enum http_media_type_id);
 
 const char *http_msg_body(const struct http_msg *);
 size_t http_msg_body_length(const struct http_msg *);
@@ -185,6 +202,7 @@ int http_msg_content_disposition_filename(const struct http_msg *, char **);
 
 enum http_method http_request_method(const struct http_msg *);
 const char *http_request_uri(const struct http_msg *);
+const char *http_request_path(const struct http_msg *);
 
 const char *http_request_named_parameter(const struct http_msg *,
                                          const char *);
@@ -194,6 +212,19 @@ const char *http_request_query_parameter(const struct http_msg *, const char *);
 bool http_request_has_ranges(const struct http_msg *);
 const struct http_ranges *http_request_ranges(const struct http_msg *);
 
+const char *http_request_negotiate_media_type(const struct http_msg *,
+                                              const char * const *, size_t);
+const char *http_request_negotiate_encoding(const struct http_msg *,
+                                            const char * const *, size_t);
+const char *http_request_negotiate_language(const struct http_msg *,
+                                            const char * const *, size_t);
+
+size_t http_request_nb_cookies(const struct http_msg *);
+const struct http_cookie_view *http_request_cookie(const struct http_msg *,
+                                                   size_t);
+const struct http_cookie_view *http_request_get_cookie(const struct http_msg *,
+                                                       const char *);
+
 enum http_status_code http_response_status_code(const struct http_msg *);
 const char *http_response_reason_phrase(const struct http_msg *);
 
@@ -281,6 +312,38 @@ struct http_cfg {
             int connection_backlog;
 
             size_t max_request_uri_length;
+            size_t max_ranges; /* in a Range header, 0 for no limit */
+
+            /* Soft limits on the number of connections and on the amount
+             * of data buffered by connections, 0 for no limit. Above half
+             * of a limit, connections waiting for a new request are closed
+             * sooner, down to min_idle_timeout milliseconds when the limit
+             * is reached. Past max_connections, accepting a connection
+             * closes the one which has been idle for the longest time. */
+            size_t max_connections;
+            size_t max_buffered_data;
+            uint64_t min_idle_timeout;
+
+            /* Number of requests after which a connection is closed, 0 for
+             * no limit. */
+            size_t max_requests_per_connection;
+
+            /* Number of threads connections are dispatched to, 0 to process
+             * connections in the event loop of the server. */
+            size_t nb_workers;
+
+            /* Pin each worker thread to a CPU, and dispatch connections to
+             * the workers on the NUMA node of the CPU which received them
+             * (Linux only). Connection memory is allocated by the worker,
+             * and therefore on its node. */
+            bool pin_workers;
+
+            /* Sockets already listening to use instead of binding the
+             * host and port (e.g. sockets inherited from a supervisor or
+             * passed by the service manager). They are closed when the
+             * server is deleted. */
+            const int *listener_socks;
+            size_t nb_listener_socks;
 
             http_error_sender error_sender;
 
@@ -291,6 +354,32 @@ struct http_cfg {
         struct {
             size_t max_reason_phrase_length;
 
+            /* Requests whose body is at least expect_continue_threshold
+             * bytes long, 0 for none, are sent with "Expect: 100-continue".
+             * The body is sent when the server answers 100 (Continue), or
+             * after expect_continue_timeout milliseconds without answer.
+             * If a final response arrives first, the body is not sent and
+             * the connection is closed after the response. */
+            size_t expect_continue_threshold;
+            uint64_t expect_continue_timeout;
+
+            /* Resolved addresses are cached by all threads for
+             * dns_cache_ttl milliseconds, and unknown hosts for
+             * dns_negative_cache_ttl milliseconds (0 to disable caching).
+             * Addresses used shortly before their expiration are resolved
+             * again in the background. Successive clients for the same
+             * host start with a different address. */
+            uint64_t dns_cache_ttl;
+            uint64_t dns_negative_cache_ttl;
+
+            /* Addresses are tried in turn, alternating between IPv6 and
+             * IPv4 and starting with the family of the last successful
+             * connection to the host. A new attempt starts every
+             * connection_attempt_delay milliseconds, or as soon as one
+             * fails; the first established connection is kept. The whole
+             * process is bounded by connection_timeout. */
+            uint64_t connection_attempt_delay;
+
             http_response_handler response_handler;
             void *response_handler_arg;
         } client;
@@ -304,6 +393,10 @@ struct http_cfg {
 
     bool bufferize_body;
 
+    /* Guess the content type of files sent without a Content-Type header
+     * from their first bytes when their extension is unknown. */
+    bool sniff_file_content_type;
+
     uint64_t connection_timeout; /* milliseconds */
 
     struct http_content_decoder *content_decoders;
@@ -329,8 +422,13 @@ void http_cfg_default_header_set(struct http_cfg *, const char *, const char *);
 struct http_uri *http_uri_new(const char *);
 void http_uri_delete(struct http_uri *);
 
+const char *http_uri_scheme(const struct http_uri *);
+const char *http_uri_user(const struct http_uri *);
+const char *http_uri_password(const struct http_uri *);
 const char *http_uri_host(const struct http_uri *);
 const char *http_uri_port(const struct http_uri *);
+const char *http_uri_path(const struct http_uri *);
+const char *http_uri_fragment(const struct http_uri *);
 
 bool http_uri_has_query_parameter(const struct http_uri *, const char *);
 const char *http_uri_query_parameter(const struct http_uri *, const char *);
@@ -355,6 +453,21 @@ struct http_route_options {
 
     size_t max_content_length;
 
+    /* Maximum number of requests processed at the same time for the route,
+     * in all threads, 0 for no limit. A request is being processed from the
+     * moment its header is read until its response is sent. Requests over
+     * the limit wait, without their body being read, for up to queue_timeout
+     * milliseconds; they are then rejected with 503 Service Unavailable. */
+    size_t max_concurrency;
+    uint64_t queue_timeout;
+
+    /* Run the handler in a coroutine. The handler is called once per
+     * request, and reads the body with http_connection_read_body(), which
+     * suspends it until data are available; the body is never bufferized.
+     * The response can be streamed with http_connection_start_response()
+     * and http_connection_write_body(). */
+    bool use_coroutine;
+
     struct http_headers *default_headers;
 };
 
@@ -372,6 +485,11 @@ void http_route_options_default_header_set(struct http_route_options *,
 typedef void (*http_msg_handler)(struct http_connection *,
                                  const struct http_msg *, void *);
 
+/* When the configuration contains worker threads, the event loop of the
+ * server only accepts connections, which are then processed in the workers.
+ * Routes, error bodies and the message handler argument must then be set
+ * before the event loop is started; handlers and hooks are called from
+ * worker threads. */
 struct http_server *http_server_new(struct http_cfg *, struct event_base *);
 void http_server_delete(struct http_server *server);
 
@@ -380,16 +498,85 @@ int http_server_add_route(struct http_server *,
                           enum http_method, const char *, http_msg_handler,
                           const struct http_route_options *);
 
+/* Batch handlers are called once per iteration of the event loop with all
+ * the requests for their route which were entirely received during this
+ * iteration, on all connections of the thread, so that they can be
+ * processed together (e.g. with a single query to a backend). The handler
+ * must send a response to each request. Bodies are always bufferized. */
+typedef void (*http_batch_handler)(struct http_connection **,
+                                   const struct http_msg **, size_t, void *);
+
+int http_server_add_batch_route(struct http_server *,
+                                enum http_method, const char *,
+                                http_batch_handler,
+                                const struct http_route_options *);
+
 int http_default_error_sender(struct http_connection *,
                               enum http_status_code,
                               struct http_headers *, const char *);
 
+/* Set the body of the response sent for a 4xx or 5xx error when no error
+ * message is provided. The response is serialized once and used instead of
+ * the error sender. */
+int http_server_set_error_body(struct http_server *, enum http_status_code,
+                               const char *, const char *, size_t);
+
+struct http_route_stats {
+    size_t nb_in_flight;
+    size_t queue_length;
+
+    uint64_t nb_admitted;
+    uint64_t nb_queued; /* requests which had to wait before being admitted */
+    uint64_t nb_rejected;
+
+    uint64_t total_wait_time; /* milliseconds */
+    uint64_t max_wait_time; /* milliseconds */
+};
+
+/* Only available for routes with a concurrency limit */
+int http_server_get_route_stats(struct http_server *, enum http_method,
+                                const char *, struct http_route_stats *);
+
+/* Add a GET route describing, as plain text, every connection of every
+ * thread (age, state, traffic, buffered data, inactivity) and the number of
+ * requests being processed for each route. Each thread describes its own
+ * connections from its event loop; the route should not be exposed
+ * publicly. */
+int http_server_add_admin_route(struct http_server *, const char *);
+
+/* Tasks can be posted from any thread; they are run by the event loop of the
+ * server. Tasks still pending when the server is deleted are not run. */
+typedef void (*http_server_task)(struct http_server *, void *);
+
+int http_server_post(struct http_server *, http_server_task, void *);
+
+/* Supervisor */
+/* A supervisor binds listening sockets once, then forks processes which
+ * each run a server with its own event loop on the inherited sockets. The
+ * setup function is called in each process to register routes on the
+ * server before the event loop starts.
+ *
+ * Each process is pinned to a CPU. Processes which die are restarted. When
+ * the supervisor receives SIGINT or SIGTERM, it forwards the signal to all
+ * processes; they stop accepting connections, wait for existing connections
+ * to be closed (or for the connection timeout to expire), and exit.
+ * http_supervisor_run() returns once all processes have exited. */
+typedef int (*http_supervisor_setup)(struct http_server *, void *);
+
+struct http_supervisor *http_supervisor_new(struct http_cfg *, size_t);
+void http_supervisor_delete(struct http_supervisor *);
+
+int http_supervisor_run(struct http_supervisor *,
+                        http_supervisor_setup, void *);
+
 /* Client */
 struct http_client *http_client_new(struct http_cfg *, struct event_base *);
 void http_client_delete(struct http_client *client);
 
 struct http_connection *http_client_connection(const struct http_client *);
 
+void http_client_clear_dns_cache(void);
+
 int http_client_send_request(struct http_client *, enum http_method,
                              const struct http_uri *,
                              struct http_headers *);
@@ -402,7 +589,126 @@ int http_client_send_request_with_file(struct http_client *, enum http_method,
                                        struct http_headers *,
                                        const char *, int, size_t);
 
+/* Hedging */
+/* A hedger sends requests with a set of clients, usually connected to
+ * different replicas of the same service. When no response has been
+ * received for a GET or HEAD request after a delay, a copy of the request is
+ * sent with another client; the first response is passed to the handler and
+ * the other one is discarded when it arrives. The delay is a percentile of
+ * the latency of previous requests, or initial_delay until enough requests
+ * were made. At most budget percents of the requests are hedged.
+ *
+ * Clients must not be used to send other requests while they belong to a
+ * hedger. The handler is called with the argument of the request, possibly
+ * several times if bodies are not bufferized, and with a NULL message if
+ * the request was lost with the connection of every client it was sent
+ * with. Hedgers must not be deleted from the handler. */
+struct http_hedger;
+
+typedef void (*http_hedged_response_handler)(struct http_hedger *,
+                                             const struct http_msg *,
+                                             void *);
+
+struct http_hedging_options {
+    unsigned int delay_percentile;
+    uint64_t initial_delay; /* milliseconds */
+    uint64_t min_delay; /* milliseconds */
+
+    unsigned int budget; /* percents */
+
+    http_hedged_response_handler response_handler;
+};
+
+struct http_hedging_stats {
+    uint64_t nb_requests;
+    uint64_t nb_hedged; /* requests for which a copy was sent */
+    uint64_t nb_hedge_wins; /* requests answered first by their copy */
+    uint64_t nb_over_budget; /* requests not hedged to respect the budget */
+
+    uint64_t delay; /* milliseconds */
+};
+
+void http_hedging_options_init(struct http_hedging_options *);
+
+struct http_hedger *http_hedger_new(struct event_base *,
+                                    const struct http_hedging_options *);
+void http_hedger_delete(struct http_hedger *);
+
+int http_hedger_add_client(struct http_hedger *, struct http_client *);
+
+int http_hedger_send_request(struct http_hedger *, enum http_method,
+                             const struct http_uri *, struct http_headers *,
+                             void *);
+
+void http_hedger_get_stats(const struct http_hedger *,
+                           struct http_hedging_stats *);
+
+/* Fan-out */
+/* A fan-out sends a set of requests, possibly with different clients, and
+ * calls the completion handler once all responses have been received or
+ * the deadline passed to http_fanout_start() has expired. Requests still
+ * waiting for a response at the deadline are reported with the
+ * HTTP_FANOUT_TIMEOUT status; HTTP/1.1 cannot cancel them without closing
+ * the connection, so their response is discarded when it arrives.
+ *
+ * The response handler, if set, is called for each response as it is
+ * received (possibly several times if bodies are not bufferized), and with
+ * a NULL message if the connection was closed before. Neither handler may
+ * delete clients; the completion handler may delete the fan-out. Results
+ * remain valid until the fan-out is deleted. */
+struct http_fanout;
+
+enum http_fanout_status {
+    HTTP_FANOUT_PENDING = 0,
+    HTTP_FANOUT_COMPLETE,
+    HTTP_FANOUT_FAILED,
+    HTTP_FANOUT_TIMEOUT,
+};
+
+struct http_fanout_result {
+    enum http_fanout_status status;
+
+    enum http_status_code status_code;
+
+    /* Only available for bufferized bodies */
+    char *body;
+    size_t body_length;
+};
+
+typedef void (*http_fanout_response_handler)(struct http_fanout *, size_t,
+                                             const struct http_msg *,
+                                             void *);
+typedef void (*http_fanout_completion_handler)(
+    struct http_fanout *, const struct http_fanout_result *, size_t, void *);
+
+struct http_fanout *http_fanout_new(struct event_base *,
+                                    http_fanout_response_handler,
+                                    http_fanout_completion_handler, void *);
+void http_fanout_delete(struct http_fanout *);
+
+int http_fanout_add_request(struct http_fanout *, struct http_client *,
+                            enum http_method, const struct http_uri *,
+                            struct http_headers *);
+int http_fanout_start(struct http_fanout *, uint64_t);
+
 /* Connections */
+/* A handle identifies a server connection and can be copied to other
+ * threads. A task posted to a connection runs in the thread processing the
+ * connection; if the connection has been closed in the meantime, the task is
+ * called with a NULL connection so that its argument can be released. */
+struct http_connection_handle {
+    struct http_server *server;
+    int sock;
+    uint64_t generation;
+};
+
+typedef void (*http_connection_task)(struct http_connection *, void *);
+
+void http_connection_get_handle(const struct http_connection *,
+                                struct http_connection_handle *);
+int http_connection_post(const struct http_connection_handle *,
+                         http_connection_task, void *);
+
 void http_connection_discard(struct http_connection *);
 int http_connection_shutdown(struct http_connection *);
 
@@ -429,6 +735,118 @@ int http_connection_send_error(struct http_connection *, enum http_status_code,
                                const char *, ...)
     __attribute__((format(printf, 3, 4)));
 
+/* The following functions can only be called from handlers running in a
+ * coroutine; they suspend the handler until they can proceed. Once the
+ * request has been aborted, they fail: the handler must then return.
+ *
+ * http_connection_read_body() returns 1 when data were read, and 0 at the
+ * end of the body. Responses started with http_connection_start_response()
+ * are sent with the chunked transfer coding (or until the connection is
+ * closed for HTTP/1.0 clients) and are ended when the handler returns if
+ * they were not before. */
+int http_connection_read_body(struct http_connection *, void *, size_t,
+                              size_t *);
+
+int http_connection_start_response(struct http_connection *,
+                                   enum http_status_code,
+                                   struct http_headers *);
+int http_connection_write_body(struct http_connection *,
+                               const void *, size_t);
+int http_connection_end_response(struct http_connection *);
+
+/* Parametrized values */
+/* <token> (";" <name> "=" <value>)* ("," <token> (";" <name> "=" <value>)*)*
+ *
+ * Tokens can contain '/' characters so that media ranges can be iterated on.
+ *
+ * Iterators return views on the original string and never allocate memory.
+ * Quoted parameter values are returned without their quotes but with their
+ * escape sequences. */
+struct http_pvalue_parameter_view {
+    const char *name;
+    size_t name_length;
+
+    const char *value;
+    size_t value_length;
+    bool is_quoted;
+};
+
+struct http_pvalue_iterator {
+    const char *value;
+    size_t value_length;
+
+    /* Private */
+    const char *ptr;
+    const char *parameters;
+};
+
+void http_pvalue_iterator_init(struct http_pvalue_iterator *, const char *);
+int http_pvalue_iterator_next(struct http_pvalue_iterator *);
+int http_pvalue_iterator_next_parameter(struct http_pvalue_iterator *,
+                                        struct http_pvalue_parameter_view *);
+
+bool http_pvalue_iterator_value_is(const struct http_pvalue_iterator *,
+                                   const char *);
+bool http_pvalue_parameter_view_name_is(
+    const struct http_pvalue_parameter_view *, const char *);
+
+/* Content negotiation */
+/* Select the best offer according to the value of an Accept,
+ * Accept-Encoding or Accept-Language header. Offers are listed by order of
+ * preference of the server, which is used to select an offer when several
+ * ones have the same quality. A NULL or invalid header value makes the first
+ * offer acceptable; NULL is returned when no offer is acceptable. */
+const char *http_negotiate_media_type(const char *,
+                                      const char * const *, size_t);
+const char *http_negotiate_encoding(const char *,
+                                    const char * const *, size_t);
+const char *http_negotiate_language(const char *,
+                                    const char * const *, size_t);
+
+/* Cookies */
+/* Cookies of a request are parsed the first time they are accessed. Views
+ * point to the value of the Cookie header; values are returned as they were
+ * sent, without surrounding double quotes. */
+struct http_cookie_view {
+    const char *name;
+    size_t name_length;
+
+    const char *value;
+    size_t value_length;
+};
+
+bool http_cookie_view_name_is(const struct http_cookie_view *, const char *);
+
+enum http_cookie_same_site {
+    HTTP_COOKIE_SAME_SITE_UNSPECIFIED = 0,
+    HTTP_COOKIE_SAME_SITE_STRICT,
+    HTTP_COOKIE_SAME_SITE_LAX,
+    HTTP_COOKIE_SAME_SITE_NONE,
+};
+
+struct http_set_cookie {
+    const char *name;
+    const char *value;
+
+    const char *domain; /* optional */
+    const char *path;   /* optional */
+
+    time_t expires; /* 0 for a session cookie */
+
+    bool has_max_age;
+    size_t max_age; /* seconds */
+
+    bool secure;
+    bool http_only;
+    enum http_cookie_same_site same_site;
+};
+
+void http_set_cookie_init(struct http_set_cookie *, const char *, const char *);
+char *http_set_cookie_format(const struct http_set_cookie *);
+
+int http_headers_add_set_cookie(struct http_headers *,
+                                const struct http_set_cookie *);
+
 /* MIME */
 struct http_media_type *http_media_type_new(const char *);
 void http_media_type_delete(struct http_media_type *);
@@ -436,6 +854,9 @@ void http_media_type_delete(struct http_media_type *);
 const char *http_media_type_string(const struct http_media_type *);
 const char *http_media_type_base_string(const struct http_media_type *);
 
+enum http_media_type_id http_media_type_id(const struct http_media_type *);
+const struct http_media_type *http_media_type_get(enum http_media_type_id);
+
 const char *http_media_type_get_type(const struct http_media_type *);
 const char *http_media_type_get_subtype(const struct http_media_type *);
 
@@ -446,6 +867,13 @@ const char *http_media_type_get_parameter(const struct http_media_type *,
 
 char *http_mime_q_encode(const char *);
 
+const char *http_mime_type_from_extension(const char *);
+const char *http_mime_type_from_path(const char *);
+
+#define HTTP_MIME_SNIFF_SZ 64
+
+const char *http_mime_sniff_type(const void *, size_t);
+
 #define HTTP_MIME_BOUNDARY_SZ (32 + 1)
 
 void http_mime_generate_boundary(char [static HTTP_MIME_BOUNDARY_SZ], size_t);
@@ -21,6 +21,8 @@
 
 #include <iconv.h>
 
+#include <sys/socket.h>
+
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -47,6 +49,8 @@
 
 int http_now_ms(uint64_t *);
 
+const char *http_current_date(void);
+
 /* Error handling */
 #define HTTP_ERROR_BUFSZ 1024
 
@@ -60,7 +64,14 @@ int http_asprintf(char **, const char *, ...)
 
 int http_parse_size(const char *, size_t *);
 
+/* Decimal representation of SIZE_MAX on 64 bit platforms */
+#define HTTP_SIZE_BUFSZ 21
+
+size_t http_size_length(size_t);
+size_t http_format_size(char *, size_t);
+
 char *http_iconv(const char *, const char *, const char *);
+void http_iconv_release_descriptors(void);
 
 #ifndef NDEBUG
 const char *http_fmt_data(const char *, size_t);
@@ -78,6 +89,7 @@ struct http_stream *http_stream_new(struct http_connection *);
 void http_stream_delete(struct http_stream *);
 
 bool http_stream_is_empty(const struct http_stream *);
+size_t http_stream_buffered_size(const struct http_stream *);
 
 void http_stream_add_entry(struct http_stream *, intptr_t,
                            const struct http_stream_functions *);
@@ -87,7 +99,15 @@ void http_stream_add_printf(struct http_stream *, const char *, ...);
 void http_stream_add_file(struct http_stream *, int, size_t, const char *);
 void http_stream_add_partial_file(struct http_stream *, int, size_t,
                                   const char *, const struct http_ranges *,
-                                  char **, size_t, char *);
+                                  char *, char *);
+
+/* The next entry added to the stream and all entries after it are not
+ * written until the entry is released or dropped. Only one entry can be held
+ * at a time. */
+void http_stream_hold_next_entry(struct http_stream *);
+bool http_stream_has_held_entry(const struct http_stream *);
+void http_stream_release_held_entry(struct http_stream *);
+void http_stream_drop_held_entry(struct http_stream *);
 
 int http_stream_write(struct http_stream *, int, size_t *);
 
@@ -108,18 +128,23 @@ struct http_ranges {
 
     struct http_range *ranges;
     size_t nb_ranges;
+    size_t ranges_sz;
 };
 
 void http_ranges_init(struct http_ranges *);
 void http_ranges_free(struct http_ranges *);
 
-int http_ranges_parse(struct http_ranges *, const char *);
+int http_ranges_parse(struct http_ranges *, const char *, size_t);
 
 void http_ranges_simplify(const struct http_ranges *, size_t,
                              struct http_ranges *);
 void http_ranges_add_range(struct http_ranges *,
                               const struct http_range *);
 
+size_t http_ranges_content_range_length(const struct http_range *, size_t);
+size_t http_ranges_format_content_range(char *, const struct http_range *,
+                                        size_t);
+
 
 /* Protocol */
 char *http_decode_header_value(const char *, size_t);
@@ -149,6 +174,7 @@ struct http_request {
     char *uri_string;
 
     struct http_uri *uri;
+    char *path; /* canonical */
 
     struct http_named_parameter *named_parameters;
     size_t nb_named_parameters;
@@ -158,10 +184,17 @@ struct http_request {
     bool has_ranges;
     struct http_ranges ranges;
 
+    bool cookies_parsed;
+    struct http_cookie_view *cookies;
+    size_t nb_cookies;
+    size_t cookies_sz;
+    size_t *cookie_index; /* indexes of cookies sorted by name */
+
     bool response_sent;
 };
 
 void http_request_free(struct http_request *);
+void http_request_free_cookies(struct http_request *);
 
 struct http_response {
     enum http_status_code status_code;
@@ -208,6 +241,8 @@ void http_msg_free(struct http_msg *);
 
 void http_msg_add_header(struct http_msg *, const struct http_header *);
 
+bool http_is_token_char(unsigned char);
+
 bool http_msg_can_have_body(const struct http_msg *);
 
 /* Request/response tracking */
@@ -223,6 +258,12 @@ struct http_request_info {
     /* Response */
     enum http_status_code status_code;
 
+    /* Client requests can have their own response handler instead of the
+     * one of the configuration. It is called with a NULL message if the
+     * connection is closed before the response has been entirely read. */
+    http_response_handler response_handler;
+    void *response_handler_arg;
+
     /* Misc */
     struct http_request_info *prev;
     struct http_request_info *next;
@@ -271,6 +312,9 @@ void http_pvalues_free(struct http_pvalues *);
 
 void http_pvalues_add_pvalue(struct http_pvalues *, const struct http_pvalue *);
 
+int http_pvalue_parameter_view_read(const char **,
+                                    struct http_pvalue_parameter_view *);
+
 /* Parser */
 enum http_parser_state {
     HTTP_PARSER_START,
@@ -317,6 +361,50 @@ int http_msg_parse_headers(struct bf_buffer *, struct http_parser *);
 int http_msg_parse_body(struct bf_buffer *, struct http_parser *);
 int http_msg_parse_chunk(struct bf_buffer *, struct http_parser *);
 
+/* Route limiters */
+/* Waiters are embedded in connections waiting for a route to accept their
+ * request. */
+struct http_route_waiter {
+    struct http_connection_handle handle;
+
+    uint64_t queue_time;
+    uint64_t deadline;
+    bool queued;
+    bool notify_failed;
+
+    struct http_route_waiter *prev;
+    struct http_route_waiter *next;
+};
+
+enum http_route_admission {
+    HTTP_ROUTE_ADMITTED,
+    HTTP_ROUTE_QUEUED,
+    HTTP_ROUTE_REJECTED,
+};
+
+struct http_route_limiter *http_route_limiter_new(size_t, uint64_t);
+void http_route_limiter_delete(struct http_route_limiter *);
+
+enum http_route_admission
+http_route_limiter_admit(struct http_route_limiter *,
+                         struct http_route_waiter *, uint64_t);
+
+typedef int (*http_route_notify_fn)(const struct http_connection_handle *,
+                                    void *);
+
+/* Release a slot. If requests are waiting, the slot is given to the first
+ * one which can be notified with the notification function. */
+void http_route_limiter_release(struct http_route_limiter *, uint64_t,
+                                http_route_notify_fn, void *);
+
+/* Remove a waiter from the queue. Return false if it is not waiting anymore,
+ * i.e. if it was already given a slot. */
+bool http_route_limiter_cancel(struct http_route_limiter *,
+                               struct http_route_waiter *, bool, uint64_t);
+
+void http_route_limiter_get_stats(struct http_route_limiter *,
+                                  struct http_route_stats *);
+
 /* Connections */
 
 /* host + port + ipv6 brackets + colon */
@@ -334,6 +422,11 @@ struct http_connection {
     struct http_client *client; /* if type == HTTP_CONNECTION_CLIENT */
 
     int sock;
+    uint64_t generation; /* if type == HTTP_CONNECTION_SERVER */
+
+    /* In the connection list of the server */
+    struct http_connection *prev;
+    struct http_connection *next;
 
     SSL *ssl;
     int ssl_last_write_length;
@@ -354,14 +447,65 @@ struct http_connection {
 
     enum http_version http_version;
 
+    uint64_t creation_time;
     uint64_t last_activity;
 
+    uint64_t nb_bytes_read;
+    uint64_t nb_bytes_written;
+
     struct http_msg *current_msg;
     const struct http_route *current_route;
     bool msg_handler_called;
 
     struct http_request_info *requests_first; /* oldest */
     struct http_request_info *requests_last;
+
+    /* Handler of the request the response being read belongs to */
+    http_response_handler response_handler;
+    void *response_handler_arg;
+
+    /* Limiter of the route of the current request if it is waiting for or
+     * holding a slot */
+    struct http_route_limiter *route_limiter;
+    bool holds_route_slot;
+    bool is_parked;
+    struct http_route_waiter route_waiter;
+
+    size_t nb_requests;
+
+    /* Coroutine running the handler of the current request if its route
+     * uses one, with the part of the body it has not read yet */
+    struct http_coroutine *coroutine;
+    struct bf_buffer *coroutine_body;
+    bool coroutine_waits_for_body;
+    bool coroutine_waits_for_output;
+    bool coroutine_blocks_input; /* the read event is disabled */
+    bool coroutine_aborted;
+    bool coroutine_suspended; /* until http_connection_wake_up() */
+    bool waits_for_coroutine; /* the request was entirely read */
+
+    bool is_streaming_response;
+    enum http_status_code streaming_status_code;
+
+    /* Set when the current request waits for the batch handler of its
+     * route, in which case it is linked in the batch list of its server */
+    bool waits_for_batch;
+    struct http_connection *batch_prev;
+    struct http_connection *batch_next;
+
+    /* Set while batch handlers are being called with the connection; it
+     * cannot be deleted until they all returned, so discarding it is
+     * deferred. Discarding is also deferred when requested from the
+     * coroutine of the connection, which cannot delete itself. */
+    bool in_batch;
+    bool discard_deferred;
+
+    /* Connections waiting for a new request are linked in the idle list of
+     * their server, the oldest first. */
+    bool is_idle;
+    uint64_t idle_since;
+    struct http_connection *idle_prev;
+    struct http_connection *idle_next;
 };
 
 struct http_connection *http_connection_new(enum http_connection_type,
@@ -371,6 +515,15 @@ void http_connection_delete(struct http_connection *);
 const struct http_cfg *http_connection_get_cfg(const struct http_connection *);
 
 void http_connection_check_for_timeout(struct http_connection *, uint64_t);
+void http_connection_update_idle_state(struct http_connection *);
+void http_connection_on_batch_processed(struct http_connection *);
+size_t http_connection_buffered_size(const struct http_connection *);
+
+/* Suspend the coroutine handler of the connection until
+ * http_connection_wake_up() is called, usually by a task posted back to the
+ * connection by another thread. Fail if the request was aborted. */
+int http_connection_suspend(struct http_connection *);
+void http_connection_wake_up(struct http_connection *);
 
 void http_connection_write(struct http_connection *, const void *, size_t);
 void http_connection_printf(struct http_connection *, const char *, ...)
@@ -445,8 +598,11 @@ struct http_route {
     size_t nb_components;
 
     http_msg_handler msg_handler;
+    http_batch_handler batch_handler; /* instead of msg_handler */
 
     struct http_route_options options;
+
+    struct http_route_limiter *limiter; /* if options.max_concurrency > 0 */
 };
 
 struct http_route *http_route_new(enum http_method, const char *,
@@ -463,8 +619,6 @@ struct http_route_base {
     size_t routes_sz;
 
     void *msg_handler_arg;
-
-    bool sorted;
 };
 
 struct http_route_base *http_route_base_new(void);
@@ -483,6 +637,24 @@ int http_route_base_find_path_methods(struct http_route_base *,
                                       size_t *);
 
 /* Servers */
+/* Fully serialized error responses for status codes 400 to 599, sent when
+ * there is no error message. The data start right after the http version
+ * and do not contain the value of the Date header, which is inserted at
+ * date_offset when the response is written. */
+#define HTTP_ERROR_RESPONSE_MIN_STATUS 400
+#define HTTP_ERROR_RESPONSE_MAX_STATUS 599
+
+struct http_error_response {
+    char *data;
+    size_t sz;
+    size_t date_offset;
+
+    bool is_custom; /* registered with http_server_set_error_body() */
+};
+
+struct http_worker;
+struct http_mailbox;
+
 struct http_server {
     struct http_cfg *cfg;
 
@@ -490,13 +662,80 @@ struct http_server {
     struct event *timeout_timer;
 
     struct ht_table *listeners;
-    struct ht_table *connections;
+
+    /* Connections are indexed by socket, and linked in the order they were
+     * registered for iteration. */
+    struct http_connection **connections;
+    size_t connections_sz;
+    struct http_connection *connections_first;
+    struct http_connection *connections_last;
+    size_t nb_connections;
+    uint64_t last_connection_generation;
+
+    /* Idle connections, the one idle for the longest time first */
+    struct http_connection *idle_first;
+    struct http_connection *idle_last;
+
+    /* Connections whose request waits for a batch handler, and the event
+     * activated to call batch handlers at the end of the current iteration
+     * of the event loop */
+    struct http_connection *batch_first;
+    struct http_connection *batch_last;
+    struct event *ev_batch;
+
+    /* Computed on each tick of the timeout timer */
+    uint64_t idle_timeout;
+    size_t buffered_data; /* read by other threads */
+
+    /* Messages sent to the event loop by other threads */
+    struct http_mailbox *mailbox;
 
     struct http_route_base *route_base;
 
     SSL_CTX *ssl_ctx;
+
+    struct http_error_response *error_responses[
+        HTTP_ERROR_RESPONSE_MAX_STATUS - HTTP_ERROR_RESPONSE_MIN_STATUS + 1];
+
+    /* Worker threads connections are dispatched to, if any */
+    struct http_worker **workers;
+    size_t nb_workers;
+    size_t next_worker;
+
+    /* NUMA node of each CPU, if workers are pinned */
+    int *cpu_nodes;
+    size_t nb_cpus;
+
+    /* The server of a worker thread shares routes, listeners and the ssl
+     * context of the main server. */
+    struct http_server *main_server;
+    struct http_worker *worker;
 };
 
+struct http_server *http_server_new_worker(struct http_server *,
+                                           struct http_worker *,
+                                           struct event_base *);
+
+int http_server_open_listening_sockets(const struct http_cfg *,
+                                       int **, size_t *);
+void http_server_stop_listening(struct http_server *);
+
+size_t http_server_nb_connections(const struct http_server *);
+
+int http_server_add_batch_request(struct http_server *,
+                                  struct http_connection *);
+void http_server_remove_batch_request(struct http_server *,
+                                      struct http_connection *);
+
+void http_server_add_idle_connection(struct http_server *,
+                                     struct http_connection *);
+void http_server_remove_idle_connection(struct http_server *,
+                                        struct http_connection *);
+
+int http_server_post_connection(struct http_server *, int,
+                                const struct sockaddr_storage *, socklen_t);
+int http_server_stop_loop(struct http_server *);
+
 void http_server_error(const struct http_server *, const char *, ...)
     __attribute__((format(printf, 2, 3)));
 void http_server_trace(const struct http_server *, const char *, ...)
@@ -507,10 +746,129 @@ bool http_server_does_listen_on(const struct http_server *,
 bool http_server_does_listen_on_host_string(const struct http_server *,
                                             const char *);
 
+const struct http_error_response *
+http_server_error_response(struct http_server *, enum http_status_code);
+
+void http_server_accept_connection(struct http_server *, int,
+                                   const struct sockaddr_storage *,
+                                   socklen_t);
+
 void http_server_register_connection(struct http_server *,
                                      struct http_connection *);
 void http_server_unregister_connection(struct http_server *,
                                        struct http_connection *);
+struct http_connection *http_server_find_connection(struct http_server *,
+                                                    int);
+
+/* Delete all connections without deleting the server */
+void http_server_close_connections(struct http_server *);
+
+/* Workers */
+struct http_worker *http_worker_new(struct http_server *);
+void http_worker_delete(struct http_worker *);
+
+int http_worker_start(struct http_worker *);
+
+/* Workers read the worker list of the main server, so all workers must be
+ * stopped, then joined, before any of them is deleted */
+void http_worker_stop(struct http_worker *);
+void http_worker_join(struct http_worker *);
+
+/* Must be called once the worker has been joined */
+void http_worker_close_connections(struct http_worker *);
+
+const struct http_server *http_worker_server(const struct http_worker *);
+int http_worker_post(struct http_worker *, http_server_task, void *);
+
+/* Must be called before the worker is started */
+void http_worker_pin(struct http_worker *, int);
+int http_worker_node(const struct http_worker *);
+
+/* Return the NUMA node of a CPU, or -1 if it is unknown */
+int http_cpu_node(int);
+
+/* Return the list of CPUs the calling thread is allowed to run on, in
+ * increasing order. The list is empty if affinity is not supported. */
+int http_allowed_cpus(int **, size_t *);
+
+size_t http_worker_nb_connections(const struct http_worker *);
+int http_worker_dispatch_connection(struct http_worker *, int,
+                                    const struct sockaddr_storage *,
+                                    socklen_t);
+void http_worker_on_connection_closed(struct http_worker *);
+
+/* Mailboxes */
+/* A mailbox lets any thread send messages to an event loop. Messages are
+ * copied and processed in the thread running the loop. */
+typedef void (*http_mailbox_msg_cb)(void *, void *);
+
+struct http_mailbox *http_mailbox_new(struct event_base *, size_t, size_t,
+                                      http_mailbox_msg_cb, void *);
+void http_mailbox_delete(struct http_mailbox *);
+
+int http_mailbox_send(struct http_mailbox *, const void *);
+bool http_mailbox_receive(struct http_mailbox *, void *);
+
+/* Stop the event loop the next time it processes the mailbox */
+int http_mailbox_close(struct http_mailbox *);
+
+/* Queues */
+/* Bounded lock-free queue with any number of producers and a single
+ * consumer. Entries are copied. */
+struct http_mpsc_queue *http_mpsc_queue_new(size_t, size_t);
+void http_mpsc_queue_delete(struct http_mpsc_queue *);
+
+bool http_mpsc_queue_push(struct http_mpsc_queue *, const void *);
+bool http_mpsc_queue_pop(struct http_mpsc_queue *, void *);
+
+/* Coroutines */
+/* Stackful coroutines, resumed and suspended in the same thread. Stacks are
+ * taken from a per-thread pool, which must be released by each thread using
+ * coroutines before it exits. */
+typedef void (*http_coroutine_fn)(void *);
+
+struct http_coroutine *http_coroutine_new(http_coroutine_fn, void *);
+void http_coroutine_delete(struct http_coroutine *);
+
+void http_coroutine_resume(struct http_coroutine *);
+void http_coroutine_yield(void);
+
+struct http_coroutine *http_coroutine_current(void);
+bool http_coroutine_is_finished(const struct http_coroutine *);
+
+void http_coroutine_release_stacks(void);
+
+/* Negotiation */
+void http_accept_release_cache(void);
+
+/* Admin */
+void http_admin_on_request(struct http_connection *, const struct http_msg *,
+                           void *);
+
+/* Resolver */
+struct http_address {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    int family;
+    int socktype;
+    int protocol;
+
+    char host[NI_MAXHOST]; /* reverse resolution */
+    char numeric_host[NI_MAXHOST];
+};
+
+/* Resolve a host with getaddrinfo(). Results are cached for ttl
+ * milliseconds, and unknown hosts for negative_ttl milliseconds; temporary
+ * failures are not cached. A ttl of 0 disables the cache. The array of
+ * addresses must be freed by the caller. */
+int http_resolve(const char *, const char *, int, uint64_t, uint64_t,
+                 struct http_address **, size_t *);
+
+/* Family of the address clients last connected to for a cached host, or
+ * AF_UNSPEC if it is unknown */
+int http_resolver_preferred_family(const char *, const char *, int);
+void http_resolver_set_preferred_family(const char *, const char *, int, int);
 
 /* Clients */
 struct http_client {
@@ -528,13 +886,34 @@ struct http_client {
     char numeric_host_port[HTTP_HOST_PORT_BUFSZ];
 
     struct http_connection *connection;
+
+    /* Request whose body is held until the server answers 100 (Continue) or
+     * the timer fires */
+    const struct http_request_info *continue_request;
+    struct event *ev_continue;
+    bool continue_body_dropped; /* close the connection after the response */
+
+    struct http_hedger *hedger;
 };
 
+void http_client_set_last_request_handler(struct http_client *,
+                                          http_response_handler, void *);
+
+void http_client_on_continue(struct http_client *);
+void http_client_on_final_response(struct http_client *,
+                                   const struct http_request_info *);
+
 void http_client_error(const struct http_client *, const char *, ...)
     __attribute__((format(printf, 2, 3)));
 void http_client_trace(const struct http_client *, const char *, ...)
     __attribute__((format(printf, 2, 3)));
 
+/* Hedging */
+void http_hedger_on_response(struct http_hedger *, struct http_client *,
+                             const struct http_msg *);
+void http_hedger_on_client_closed(struct http_hedger *, struct http_client *);
+void http_hedger_remove_client(struct http_hedger *, struct http_client *);
+
 /* URIs */
 struct http_query_parameter {
     char *name;
@@ -546,22 +925,47 @@ void http_query_parameter_free(struct http_query_parameter *);
 int http_query_parameters_parse(const char *, struct http_query_parameter **,
                                 size_t *);
 
+struct http_uri_component {
+    /* Either stored in the buffer of the uri or allocated by a setter */
+    char *value;
+
+    /* Only set if the value contains escape sequences; the value is decoded
+     * on first access. */
+    char *decoded_value;
+    bool is_decoded;
+
+    bool is_allocated;
+};
+
 struct http_uri {
-    char *scheme;
-    char *user;
-    char *password;
-    char *host;
-    char *port;
-    char *path;
-    char *fragment;
+    struct http_uri_component scheme;
+    struct http_uri_component user;
+    struct http_uri_component password;
+    struct http_uri_component host;
+    struct http_uri_component port;
+    struct http_uri_component path;
+    struct http_uri_component fragment;
+
+    /* Raw query string, cleared once query parameters have been parsed */
+    char *query;
 
     struct http_query_parameter *query_parameters;
     size_t nb_query_parameters;
+
+    char *buffer; /* allocated with the uri */
+    size_t buffer_length;
 };
 
+const char *http_uri_encoded_path(const struct http_uri *);
+
+char *http_canonicalize_path(const char *);
+
 char *http_uri_decode_query_component(const char *, size_t);
 void http_uri_encode_query_component(const char *, struct bf_buffer *);
 
+/* MIME */
+struct http_media_type *http_media_type_intern(const char *);
+
 /* SSL */
 const char *http_ssl_get_error(void);
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <pthread.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* A limiter is shared by all threads processing requests for a route. The
+ * mutex is only held for a few instructions; waiters are embedded in
+ * connections, and the queue only ever contains waiters of connections
+ * which are still alive (connections cancel their waiter before being
+ * deleted). */
+struct http_route_limiter {
+    pthread_mutex_t mutex;
+
+    size_t max_concurrency;
+    uint64_t queue_timeout;
+
+    size_t nb_in_flight;
+
+    struct http_route_waiter *waiters_first;
+    struct http_route_waiter *waiters_last;
+    size_t nb_waiters;
+
+    struct http_route_stats stats;
+};
+
+static void http_route_limiter_unlink(struct http_route_limiter *,
+                                      struct http_route_waiter *);
+static void http_route_limiter_count_wait(struct http_route_limiter *,
+                                          const struct http_route_waiter *,
+                                          uint64_t);
+
+struct http_route_limiter *
+http_route_limiter_new(size_t max_concurrency, uint64_t queue_timeout) {
+    struct http_route_limiter *limiter;
+
+    limiter = http_malloc0(sizeof(struct http_route_limiter));
+
+    pthread_mutex_init(&limiter->mutex, NULL);
+
+    limiter->max_concurrency = max_concurrency;
+    limiter->queue_timeout = queue_timeout;
+
+    return limiter;
+}
+
+void
+http_route_limiter_delete(struct http_route_limiter *limiter) {
+    if (!limiter)
+        return;
+
+    pthread_mutex_destroy(&limiter->mutex);
+
+    memset(limiter, 0, sizeof(struct http_route_limiter));
+    http_free(limiter);
+}
+
+enum http_route_admission
+http_route_limiter_admit(struct http_route_limiter *limiter,
+                         struct http_route_waiter *waiter, uint64_t now) {
+    enum http_route_admission admission;
+
+    pthread_mutex_lock(&limiter->mutex);
+
+    /* Requests already waiting go first */
+    if (limiter->nb_in_flight < limiter->max_concurrency
+     && limiter->nb_waiters == 0) {
+        limiter->nb_in_flight++;
+        limiter->stats.nb_admitted++;
+
+        admission = HTTP_ROUTE_ADMITTED;
+    } else if (limiter->queue_timeout > 0) {
+        waiter->queue_time = now;
+        waiter->deadline = now + limiter->queue_timeout;
+        waiter->queued = true;
+        waiter->notify_failed = false;
+
+        waiter->prev = limiter->waiters_last;
+        waiter->next = NULL;
+
+        if (limiter->waiters_last)
+            limiter->waiters_last->next = waiter;
+        limiter->waiters_last = waiter;
+
+        if (!limiter->waiters_first)
+            limiter->waiters_first = waiter;
+
+        limiter->nb_waiters++;
+        limiter->stats.nb_queued++;
+
+        admission = HTTP_ROUTE_QUEUED;
+    } else {
+        limiter->stats.nb_rejected++;
+
+        admission = HTTP_ROUTE_REJECTED;
+    }
+
+    pthread_mutex_unlock(&limiter->mutex);
+
+    return admission;
+}
+
+void
+http_route_limiter_release(struct http_route_limiter *limiter, uint64_t now,
+                           http_route_notify_fn notify, void *arg) {
+    struct http_route_waiter *waiter;
+
+    pthread_mutex_lock(&limiter->mutex);
+
+    /* Waiters are notified with the mutex held: once unlocked, a waiter
+     * which is not queued anymore can be freed at any time. */
+    for (;;) {
+        waiter = limiter->waiters_first;
+        if (!waiter) {
+            limiter->nb_in_flight--;
+            break;
+        }
+
+        http_route_limiter_unlink(limiter, waiter);
+
+        if (notify(&waiter->handle, arg) == 0) {
+            /* The slot is transferred to the waiter */
+            http_route_limiter_count_wait(limiter, waiter, now);
+            limiter->stats.nb_admitted++;
+            break;
+        }
+
+        /* The waiter will never receive the slot; it is still waiting as
+         * far as cancellation is concerned, so that it times out normally.
+         * The slot goes to the next one. */
+        waiter->notify_failed = true;
+    }
+
+    pthread_mutex_unlock(&limiter->mutex);
+}
+
+bool
+http_route_limiter_cancel(struct http_route_limiter *limiter,
+                          struct http_route_waiter *waiter,
+                          bool timed_out, uint64_t now) {
+    bool was_waiting;
+
+    pthread_mutex_lock(&limiter->mutex);
+
+    was_waiting = waiter->queued || waiter->notify_failed;
+
+    if (waiter->queued)
+        http_route_limiter_unlink(limiter, waiter);
+    waiter->notify_failed = false;
+
+    if (was_waiting && timed_out) {
+        http_route_limiter_count_wait(limiter, waiter, now);
+        limiter->stats.nb_rejected++;
+    }
+
+    pthread_mutex_unlock(&limiter->mutex);
+
+    return was_waiting;
+}
+
+void
+http_route_limiter_get_stats(struct http_route_limiter *limiter,
+                             struct http_route_stats *stats) {
+    pthread_mutex_lock(&limiter->mutex);
+
+    *stats = limiter->stats;
+    stats->nb_in_flight = limiter->nb_in_flight;
+    stats->queue_length = limiter->nb_waiters;
+
+    pthread_mutex_unlock(&limiter->mutex);
+}
+
+static void
+http_route_limiter_unlink(struct http_route_limiter *limiter,
+                          struct http_route_waiter *waiter) {
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+
+    if (limiter->waiters_first == waiter)
+        limiter->waiters_first = waiter->next;
+    if (limiter->waiters_last == waiter)
+        limiter->waiters_last = waiter->prev;
+
+    waiter->prev = NULL;
+    waiter->next = NULL;
+    waiter->queued = false;
+
+    limiter->nb_waiters--;
+}
+
+static void
+http_route_limiter_count_wait(struct http_route_limiter *limiter,
+                              const struct http_route_waiter *waiter,
+                              uint64_t now) {
+    uint64_t wait_time;
+
+    wait_time = (now > waiter->queue_time) ? now - waiter->queue_time : 0;
+
+    limiter->stats.total_wait_time += wait_time;
+    if (wait_time > limiter->stats.max_wait_time)
+        limiter->stats.max_wait_time = wait_time;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HTTP_PLATFORM_LINUX
+#   include <sys/eventfd.h>
+#endif
+
+#include "http.h"
+#include "internal.h"
+
+struct http_mailbox {
+    struct event_base *ev_base;
+
+    struct http_mpsc_queue *queue;
+    void *msg; /* storage for the message being processed */
+
+    http_mailbox_msg_cb msg_cb;
+    void *msg_cb_arg;
+
+    /* On Linux, an eventfd is used for both ends */
+    int wakeup_read_fd;
+    int wakeup_write_fd;
+    struct event *ev_wakeup;
+
+    /* Shared with sending threads */
+    bool wakeup_pending;
+    bool closed;
+};
+
+static int http_mailbox_open_wakeup_fds(struct http_mailbox *);
+static void http_mailbox_close_wakeup_fds(struct http_mailbox *);
+static int http_mailbox_wake_up(struct http_mailbox *);
+static void http_mailbox_on_wakeup(evutil_socket_t, short, void *);
+
+struct http_mailbox *
+http_mailbox_new(struct event_base *ev_base, size_t nb_msgs, size_t msg_sz,
+                 http_mailbox_msg_cb msg_cb, void *msg_cb_arg) {
+    struct http_mailbox *mailbox;
+
+    mailbox = http_malloc0(sizeof(struct http_mailbox));
+
+    mailbox->ev_base = ev_base;
+
+    mailbox->queue = http_mpsc_queue_new(nb_msgs, msg_sz);
+    mailbox->msg = http_malloc(msg_sz);
+
+    mailbox->msg_cb = msg_cb;
+    mailbox->msg_cb_arg = msg_cb_arg;
+
+    mailbox->wakeup_read_fd = -1;
+    mailbox->wakeup_write_fd = -1;
+
+    if (http_mailbox_open_wakeup_fds(mailbox) == -1)
+        goto error;
+
+    mailbox->ev_wakeup = event_new(ev_base, mailbox->wakeup_read_fd,
+                                   EV_READ | EV_PERSIST,
+                                   http_mailbox_on_wakeup, mailbox);
+    if (!mailbox->ev_wakeup) {
+        http_set_error("cannot create wakeup event: %s", strerror(errno));
+        goto error;
+    }
+
+    if (event_add(mailbox->ev_wakeup, NULL) == -1) {
+        http_set_error("cannot add wakeup event: %s", strerror(errno));
+        goto error;
+    }
+
+    return mailbox;
+
+error:
+    http_mailbox_delete(mailbox);
+    return NULL;
+}
+
+void
+http_mailbox_delete(struct http_mailbox *mailbox) {
+    if (!mailbox)
+        return;
+
+    http_mpsc_queue_delete(mailbox->queue);
+    http_free(mailbox->msg);
+
+    if (mailbox->ev_wakeup)
+        event_free(mailbox->ev_wakeup);
+
+    http_mailbox_close_wakeup_fds(mailbox);
+
+    memset(mailbox, 0, sizeof(struct http_mailbox));
+    http_free(mailbox);
+}
+
+int
+http_mailbox_send(struct http_mailbox *mailbox, const void *msg) {
+    if (!http_mpsc_queue_push(mailbox->queue, msg)) {
+        http_set_error("mailbox full");
+        return -1;
+    }
+
+    /* The message has been queued: it belongs to the mailbox even if the
+     * receiving thread cannot be woken up, and will be processed with the
+     * next message. */
+    http_mailbox_wake_up(mailbox);
+    return 0;
+}
+
+bool
+http_mailbox_receive(struct http_mailbox *mailbox, void *msg) {
+    return http_mpsc_queue_pop(mailbox->queue, msg);
+}
+
+int
+http_mailbox_close(struct http_mailbox *mailbox) {
+    __atomic_store_n(&mailbox->closed, true, __ATOMIC_SEQ_CST);
+
+    return http_mailbox_wake_up(mailbox);
+}
+
+static int
+http_mailbox_open_wakeup_fds(struct http_mailbox *mailbox) {
+#ifdef HTTP_PLATFORM_LINUX
+    int fd;
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        http_set_error("cannot create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    mailbox->wakeup_read_fd = fd;
+    mailbox->wakeup_write_fd = fd;
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        http_set_error("cannot create pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    mailbox->wakeup_read_fd = fds[0];
+    mailbox->wakeup_write_fd = fds[1];
+
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1
+         || fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+            http_set_error("cannot set pipe flags: %s", strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static void
+http_mailbox_close_wakeup_fds(struct http_mailbox *mailbox) {
+    if (mailbox->wakeup_write_fd >= 0
+     && mailbox->wakeup_write_fd != mailbox->wakeup_read_fd) {
+        close(mailbox->wakeup_write_fd);
+    }
+
+    if (mailbox->wakeup_read_fd >= 0)
+        close(mailbox->wakeup_read_fd);
+
+    mailbox->wakeup_read_fd = -1;
+    mailbox->wakeup_write_fd = -1;
+}
+
+static int
+http_mailbox_wake_up(struct http_mailbox *mailbox) {
+#ifdef HTTP_PLATFORM_LINUX
+    uint64_t value;
+#else
+    char value;
+#endif
+
+    /* If a wakeup is already pending, the receiving thread will see new
+     * messages when it processes it. */
+    if (__atomic_exchange_n(&mailbox->wakeup_pending, true, __ATOMIC_SEQ_CST))
+        return 0;
+
+    value = 1;
+
+    if (write(mailbox->wakeup_write_fd, &value, sizeof(value)) == -1) {
+        if (errno != EAGAIN) {
+            http_set_error("cannot write wakeup fd: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+http_mailbox_on_wakeup(evutil_socket_t fd, short events, void *arg) {
+    struct http_mailbox *mailbox;
+    char buf[64];
+
+    mailbox = arg;
+
+    while (read(mailbox->wakeup_read_fd, buf, sizeof(buf)) > 0)
+        continue;
+
+    /* Clear the flag before reading the queue so that messages sent from
+     * now on trigger a new wakeup. */
+    __atomic_store_n(&mailbox->wakeup_pending, false, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&mailbox->closed, __ATOMIC_SEQ_CST)) {
+        event_base_loopbreak(mailbox->ev_base);
+        return;
+    }
+
+    while (http_mpsc_queue_pop(mailbox->queue, mailbox->msg))
+        mailbox->msg_cb(mailbox->msg, mailbox->msg_cb_arg);
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Generated by utils/gen-media-types.py from utils/media-types.txt,
+ * do not edit. */
+
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+#define HTTP_MEDIA_TYPE_EXTENSION_MAX_LENGTH 15
+#define HTTP_MEDIA_TYPE_NB_BUCKETS 128
+#define HTTP_MEDIA_TYPE_NB_SLOTS 512
+
+struct http_media_type_extension {
+    const char *extension;
+    const char *media_type;
+};
+
+static const uint16_t
+http_media_type_extension_seeds[HTTP_MEDIA_TYPE_NB_BUCKETS] = {
+      2,   1,   1,   2,   4,   0,   6,   0,
+      2,   4,   1,   1,   3,   1,   1,   5,
+      1,   1,   1,   1,   2,   1,   5,   0,
+      3,   3,   6,   2,   0,   1,   1,   2,
+      1,   5,   1,   2,   3,   1,   1,   1,
+      1,   0,   5,   4,   1,   1,   5,   2,
+      5,   2,   3,   3,  15,   3,   1,   1,
+      1,   7,   2,   1,   5,   6,   3,   9,
+      1,   9,   6,   1,   3,   2,   2,   1,
+      5,   3,   7,   2,   9,   7,   1,   4,
+      2,   1,   2,   2,   2,   1,   0,   1,
+     13,   5,   8,   4,   4,   1,   2,   2,
+      1,   1,   2,   1,   7,   2,   3,   1,
+      0,  17,   4,   4,   2,   2,   4,   1,
+      3,   3,   4,   1,   1,   0,   2,   4,
+      1,  12,   0,   3,   3,   1,  10,   1,
+};
+
+static const struct http_media_type_extension
+http_media_type_extensions[HTTP_MEDIA_TYPE_NB_SLOTS] = {
+    [2] = {"odt", "application/vnd.oasis.opendocument.text"},
+    [3] = {"appcache", "text/cache-manifest"},
+    [4] = {"deb", "application/octet-stream"},
+    [7] = {"lha", "application/x-lzh-compressed"},
+    [8] = {"tr", "application/x-troff"},
+    [10] = {"nc", "application/x-netcdf"},
+    [12] = {"cdf", "application/x-netcdf"},
+    [14] = {"xpi", "application/x-xpinstall"},
+    [15] = {"dtd", "application/xml-dtd"},
+    [16] = {"p12", "application/x-pkcs12"},
+    [18] = {"mht", "message/rfc822"},
+    [21] = {"java", "text/x-java-source"},
+    [23] = {"kml", "application/vnd.google-earth.kml+xml"},
+    [25] = {"f4v", "video/x-m4v"},
+    [26] = {"so", "application/octet-stream"},
+    [27] = {"m2ts", "video/mp2t"},
+    [30] = {"cxx", "text/x-c"},
+    [33] = {"spx", "audio/ogg"},
+    [35] = {"hqx", "application/mac-binhex40"},
+    [37] = {"ttc", "font/collection"},
+    [39] = {"nroff", "text/troff"},
+    [40] = {"shar", "application/x-shar"},
+    [42] = {"list", "text/plain"},
+    [43] = {"doc", "application/msword"},
+    [47] = {"etx", "text/x-setext"},
+    [48] = {"woff2", "font/woff2"},
+    [51] = {"uri", "text/uri-list"},
+    [53] = {"hh", "text/x-c"},
+    [54] = {"tcl", "application/x-tcl"},
+    [55] = {"manifest", "text/cache-manifest"},
+    [56] = {"vrml", "model/vrml"},
+    [59] = {"flv", "video/x-flv"},
+    [60] = {"c", "text/x-c"},
+    [61] = {"m2v", "video/mpeg"},
+    [62] = {"jpg", "image/jpeg"},
+    [63] = {"tiff", "image/tiff"},
+    [64] = {"go", "text/x-go"},
+    [65] = {"pac", "application/x-ns-proxy-autoconfig"},
+    [67] = {"me", "application/x-troff-me"},
+    [68] = {"swf", "application/x-shockwave-flash"},
+    [69] = {"prc", "application/x-mobipocket-ebook"},
+    [72] = {"srt", "application/x-subrip"},
+    [73] = {"pbm", "image/x-portable-bitmap"},
+    [74] = {"tar", "application/x-tar"},
+    [77] = {"bdf", "application/x-font-bdf"},
+    [80] = {"pdb", "application/x-pilot"},
+    [81] = {"psd", "image/vnd.adobe.photoshop"},
+    [84] = {"ras", "image/x-cmu-raster"},
+    [87] = {"pjp", "image/jpeg"},
+    [88] = {"au", "audio/basic"},
+    [93] = {"cc", "text/x-c"},
+    [94] = {"sh", "application/x-sh"},
+    [95] = {"p10", "application/pkcs10"},
+    [96] = {"t", "application/x-troff"},
+    [97] = {"icns", "image/x-icns"},
+    [98] = {"php", "application/x-httpd-php"},
+    [99] = {"rss", "application/rss+xml"},
+    [100] = {"midi", "audio/midi"},
+    [104] = {"3gpp", "video/3gpp"},
+    [106] = {"exe", "application/octet-stream"},
+    [107] = {"cer", "application/pkix-cert"},
+    [109] = {"aac", "audio/aac"},
+    [110] = {"opml", "text/x-opml"},
+    [111] = {"json", "application/json"},
+    [112] = {"pps", "application/vnd.ms-powerpoint"},
+    [113] = {"flac", "audio/flac"},
+    [114] = {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    [116] = {"xpm", "image/x-xpixmap"},
+    [117] = {"dll", "application/octet-stream"},
+    [120] = {"pjpeg", "image/jpeg"},
+    [123] = {"ppsx", "application/vnd.openxmlformats-officedocument.presentationml.slideshow"},
+    [125] = {"wmv", "video/x-ms-wmv"},
+    [126] = {"atom", "application/atom+xml"},
+    [127] = {"xlt", "application/vnd.ms-excel"},
+    [128] = {"pgm", "image/x-portable-graymap"},
+    [130] = {"uu", "text/x-uuencode"},
+    [132] = {"xht", "application/xhtml+xml"},
+    [133] = {"asm", "text/x-asm"},
+    [134] = {"mml", "text/mathml"},
+    [135] = {"ogg", "audio/ogg"},
+    [136] = {"f90", "text/x-fortran"},
+    [139] = {"mp3", "audio/mpeg"},
+    [140] = {"oga", "audio/ogg"},
+    [141] = {"pgp", "application/pgp-encrypted"},
+    [143] = {"jpeg", "image/jpeg"},
+    [144] = {"mpg", "video/mpeg"},
+    [145] = {"yaml", "application/yaml"},
+    [146] = {"mpp", "application/vnd.ms-project"},
+    [147] = {"aiff", "audio/aiff"},
+    [148] = {"otf", "font/otf"},
+    [153] = {"css", "text/css"},
+    [154] = {"sfv", "text/x-sfv"},
+    [155] = {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    [156] = {"xml", "application/xml"},
+    [158] = {"htc", "text/x-component"},
+    [159] = {"pas", "text/x-pascal"},
+    [161] = {"kar", "audio/midi"},
+    [162] = {"p", "text/x-pascal"},
+    [163] = {"text", "text/plain"},
+    [167] = {"wma", "audio/x-ms-wma"},
+    [168] = {"dmg", "application/octet-stream"},
+    [169] = {"py", "text/x-python"},
+    [170] = {"xhtml", "application/xhtml+xml"},
+    [171] = {"htm", "text/html"},
+    [173] = {"bz2", "application/x-bzip2"},
+    [174] = {"webp", "image/webp"},
+    [175] = {"mka", "audio/x-matroska"},
+    [177] = {"h", "text/x-c"},
+    [178] = {"jp2", "image/jp2"},
+    [179] = {"rar", "application/vnd.rar"},
+    [180] = {"m1v", "video/mpeg"},
+    [182] = {"xbm", "image/x-xbitmap"},
+    [183] = {"3gp", "video/3gpp"},
+    [184] = {"toml", "application/toml"},
+    [186] = {"wrl", "model/vrml"},
+    [187] = {"p7m", "application/pkcs7-mime"},
+    [189] = {"xslt", "application/xslt+xml"},
+    [190] = {"f77", "text/x-fortran"},
+    [192] = {"rs", "text/x-rust"},
+    [193] = {"rdf", "application/rdf+xml"},
+    [196] = {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    [198] = {"cpp", "text/x-c"},
+    [200] = {"cco", "application/x-cocoa"},
+    [201] = {"m4v", "video/mp4"},
+    [202] = {"gif", "image/gif"},
+    [204] = {"opus", "audio/opus"},
+    [206] = {"mobi", "application/x-mobipocket-ebook"},
+    [209] = {"texinfo", "application/x-texinfo"},
+    [210] = {"dylib", "application/octet-stream"},
+    [212] = {"rtf", "application/rtf"},
+    [213] = {"eps", "application/postscript"},
+    [215] = {"jfif", "image/jpeg"},
+    [216] = {"ra", "audio/x-realaudio"},
+    [217] = {"bmp", "image/bmp"},
+    [218] = {"mpkg", "application/vnd.apple.installer+xml"},
+    [219] = {"mov", "video/quicktime"},
+    [221] = {"log", "text/plain"},
+    [223] = {"der", "application/x-x509-ca-cert"},
+    [224] = {"mp4", "video/mp4"},
+    [225] = {"wasm", "application/wasm"},
+    [226] = {"tif", "image/tiff"},
+    [229] = {"pyo", "application/x-python-code"},
+    [231] = {"mid", "audio/midi"},
+    [232] = {"lzma", "application/x-lzma"},
+    [233] = {"obj", "model/obj"},
+    [234] = {"latex", "application/x-latex"},
+    [235] = {"dot", "application/msword"},
+    [239] = {"odp", "application/vnd.oasis.opendocument.presentation"},
+    [240] = {"asf", "video/x-ms-asf"},
+    [241] = {"p8", "application/pkcs8"},
+    [242] = {"xltx", "application/vnd.openxmlformats-officedocument.spreadsheetml.template"},
+    [244] = {"epub", "application/epub+zip"},
+    [245] = {"markdown", "text/markdown"},
+    [246] = {"png", "image/png"},
+    [248] = {"xsd", "application/xml"},
+    [249] = {"lua", "text/x-lua"},
+    [251] = {"aif", "audio/aiff"},
+    [252] = {"webmanifest", "application/manifest+json"},
+    [255] = {"xls", "application/vnd.ms-excel"},
+    [256] = {"udeb", "application/vnd.debian.binary-package"},
+    [257] = {"wml", "text/vnd.wap.wml"},
+    [259] = {"mp2", "audio/mpeg"},
+    [260] = {"html", "text/html"},
+    [261] = {"webm", "video/webm"},
+    [262] = {"sqlite3", "application/vnd.sqlite3"},
+    [264] = {"p7c", "application/pkcs7-mime"},
+    [265] = {"mpe", "video/mpeg"},
+    [266] = {"pfx", "application/x-pkcs12"},
+    [268] = {"man", "application/x-troff-man"},
+    [269] = {"mkd", "text/markdown"},
+    [270] = {"ms", "application/x-troff-ms"},
+    [274] = {"apng", "image/apng"},
+    [275] = {"msi", "application/octet-stream"},
+    [276] = {"jxl", "image/jxl"},
+    [277] = {"ear", "application/java-archive"},
+    [279] = {"uris", "text/uri-list"},
+    [281] = {"ini", "text/plain"},
+    [284] = {"jar", "application/java-archive"},
+    [285] = {"sit", "application/x-stuffit"},
+    [286] = {"odg", "application/vnd.oasis.opendocument.graphics"},
+    [287] = {"yml", "application/yaml"},
+    [288] = {"lzh", "application/x-lzh-compressed"},
+    [289] = {"asc", "application/pgp-signature"},
+    [291] = {"shtml", "text/html"},
+    [293] = {"hdf", "application/x-hdf"},
+    [294] = {"xla", "application/vnd.ms-excel"},
+    [295] = {"kmz", "application/vnd.google-earth.kmz"},
+    [298] = {"iso", "application/octet-stream"},
+    [299] = {"pdf", "application/pdf"},
+    [300] = {"eml", "message/rfc822"},
+    [301] = {"xz", "application/x-xz"},
+    [303] = {"svg", "image/svg+xml"},
+    [304] = {"jng", "image/x-jng"},
+    [306] = {"p7s", "application/pkcs7-signature"},
+    [307] = {"zip", "application/zip"},
+    [308] = {"avi", "video/x-msvideo"},
+    [310] = {"msm", "application/octet-stream"},
+    [311] = {"def", "text/plain"},
+    [312] = {"m4a", "audio/mp4"},
+    [313] = {"pem", "application/x-x509-ca-cert"},
+    [314] = {"lz", "application/x-lzip"},
+    [315] = {"ai", "application/postscript"},
+    [317] = {"bz", "application/x-bzip"},
+    [318] = {"amr", "audio/amr"},
+    [320] = {"qt", "video/quicktime"},
+    [321] = {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    [323] = {"mkv", "video/x-matroska"},
+    [324] = {"torrent", "application/x-bittorrent"},
+    [326] = {"in", "text/plain"},
+    [327] = {"img", "application/octet-stream"},
+    [329] = {"stl", "model/stl"},
+    [331] = {"mpg4", "video/mp4"},
+    [332] = {"azw", "application/vnd.amazon.ebook"},
+    [333] = {"ifb", "text/calendar"},
+    [335] = {"eot", "application/vnd.ms-fontobject"},
+    [336] = {"mng", "video/x-mng"},
+    [337] = {"sea", "application/x-sea"},
+    [338] = {"xspf", "application/xspf+xml"},
+    [339] = {"jnlp", "application/x-java-jnlp-file"},
+    [341] = {"tgz", "application/gzip"},
+    [342] = {"pm", "application/x-perl"},
+    [343] = {"war", "application/java-archive"},
+    [344] = {"odc", "application/vnd.oasis.opendocument.chart"},
+    [345] = {"djv", "image/vnd.djvu"},
+    [348] = {"heif", "image/heif"},
+    [349] = {"run", "application/x-makeself"},
+    [351] = {"ogv", "video/ogg"},
+    [354] = {"weba", "audio/webm"},
+    [355] = {"txz", "application/x-xz"},
+    [356] = {"tsv", "text/tab-separated-values"},
+    [357] = {"msp", "application/octet-stream"},
+    [358] = {"ps", "application/postscript"},
+    [359] = {"odf", "application/vnd.oasis.opendocument.formula"},
+    [360] = {"pl", "application/x-perl"},
+    [361] = {"mk3d", "video/x-matroska"},
+    [363] = {"sqlite", "application/vnd.sqlite3"},
+    [364] = {"tbz2", "application/x-bzip2"},
+    [365] = {"movie", "video/x-sgi-movie"},
+    [367] = {"s", "text/x-asm"},
+    [368] = {"3g2", "video/3gpp2"},
+    [371] = {"md", "text/markdown"},
+    [372] = {"pkpass", "application/vnd.apple.pkpass"},
+    [373] = {"ico", "image/vnd.microsoft.icon"},
+    [375] = {"sig", "application/pgp-signature"},
+    [377] = {"scss", "text/x-scss"},
+    [378] = {"wav", "audio/vnd.wave"},
+    [379] = {"texi", "application/x-texinfo"},
+    [382] = {"roff", "application/x-troff"},
+    [383] = {"rtx", "text/richtext"},
+    [384] = {"pot", "application/vnd.ms-powerpoint"},
+    [385] = {"ppm", "image/x-portable-pixmap"},
+    [386] = {"jpe", "image/jpeg"},
+    [387] = {"ogx", "application/ogg"},
+    [388] = {"7z", "application/x-7z-compressed"},
+    [389] = {"gz", "application/gzip"},
+    [391] = {"rgb", "image/x-rgb"},
+    [393] = {"db", "application/vnd.sqlite3"},
+    [395] = {"urls", "text/uri-list"},
+    [396] = {"csv", "text/csv"},
+    [398] = {"djvu", "image/vnd.djvu"},
+    [400] = {"ts", "video/mp2t"},
+    [404] = {"crt", "application/x-x509-ca-cert"},
+    [405] = {"mpga", "audio/mpeg"},
+    [406] = {"tga", "image/x-tga"},
+    [407] = {"jsonld", "application/ld+json"},
+    [408] = {"for", "text/x-fortran"},
+    [413] = {"svgz", "image/svg+xml"},
+    [415] = {"patch", "text/x-diff"},
+    [416] = {"xsl", "application/xml"},
+    [417] = {"bat", "application/x-msdownload"},
+    [418] = {"mhtml", "message/rfc822"},
+    [419] = {"tk", "application/x-tcl"},
+    [420] = {"lnk", "application/x-ms-shortcut"},
+    [421] = {"ppt", "application/vnd.ms-powerpoint"},
+    [422] = {"msg", "application/vnd.ms-outlook"},
+    [423] = {"chm", "application/vnd.ms-htmlhelp"},
+    [425] = {"glb", "model/gltf-binary"},
+    [426] = {"woff", "font/woff"},
+    [427] = {"snd", "audio/basic"},
+    [428] = {"cpio", "application/x-cpio"},
+    [430] = {"apk", "application/vnd.android.package-archive"},
+    [435] = {"m3u8", "application/vnd.apple.mpegurl"},
+    [436] = {"sql", "application/sql"},
+    [437] = {"mjs", "application/javascript"},
+    [438] = {"xwd", "image/x-xwindowdump"},
+    [440] = {"pyc", "application/x-python-code"},
+    [443] = {"heic", "image/heic"},
+    [444] = {"jad", "text/vnd.sun.j2me.app-descriptor"},
+    [445] = {"vcf", "text/vcard"},
+    [446] = {"diff", "text/x-diff"},
+    [448] = {"map", "application/json"},
+    [449] = {"m3u", "audio/x-mpegurl"},
+    [450] = {"dotx", "application/vnd.openxmlformats-officedocument.wordprocessingml.template"},
+    [451] = {"hpp", "text/x-c"},
+    [452] = {"dic", "text/x-c"},
+    [455] = {"arc", "application/x-freearc"},
+    [456] = {"mp4v", "video/mp4"},
+    [457] = {"wmlc", "application/vnd.wap.wmlc"},
+    [459] = {"pnm", "image/x-portable-anymap"},
+    [460] = {"zst", "application/zstd"},
+    [461] = {"rpm", "application/x-redhat-package-manager"},
+    [462] = {"xul", "application/vnd.mozilla.xul+xml"},
+    [464] = {"mk", "text/x-makefile"},
+    [465] = {"ttf", "font/ttf"},
+    [467] = {"ics", "text/calendar"},
+    [468] = {"mpeg", "video/mpeg"},
+    [469] = {"dvi", "application/x-dvi"},
+    [473] = {"pcf", "application/x-font-pcf"},
+    [475] = {"mts", "video/mp2t"},
+    [476] = {"sparseimage", "application/x-apple-diskimage"},
+    [477] = {"gltf", "model/gltf+json"},
+    [478] = {"crl", "application/pkix-crl"},
+    [480] = {"csh", "application/x-csh"},
+    [481] = {"com", "application/x-msdownload"},
+    [482] = {"f", "text/x-fortran"},
+    [484] = {"avif", "image/avif"},
+    [485] = {"rb", "text/x-ruby"},
+    [486] = {"gv", "text/vnd.graphviz"},
+    [487] = {"js", "application/javascript"},
+    [489] = {"conf", "text/plain"},
+    [492] = {"txt", "text/plain"},
+    [493] = {"vsd", "application/vnd.visio"},
+    [495] = {"abw", "application/x-abiword"},
+    [497] = {"jardiff", "application/x-java-archive-diff"},
+    [498] = {"vtt", "text/vtt"},
+    [499] = {"tex", "application/x-tex"},
+    [500] = {"vcs", "text/x-vcalendar"},
+    [503] = {"bin", "application/octet-stream"},
+    [508] = {"vcard", "text/vcard"},
+    [509] = {"wbmp", "image/vnd.wap.wbmp"},
+    [510] = {"asx", "video/x-ms-asf"},
+    [511] = {"aifc", "audio/aiff"},
+};
+
+static uint32_t
+http_media_type_extension_hash(const char *extension, size_t len,
+                               uint32_t seed) {
+    uint32_t h;
+
+    h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)extension[i];
+        h *= 16777619u;
+    }
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+
+    return h;
+}
+
+const char *
+http_mime_type_from_extension(const char *extension) {
+    const struct http_media_type_extension *entry;
+    char lowered[HTTP_MEDIA_TYPE_EXTENSION_MAX_LENGTH + 1];
+    uint32_t seed, h;
+    size_t len;
+
+    for (len = 0; extension[len] != '\0'; len++) {
+        unsigned char c;
+
+        if (len >= HTTP_MEDIA_TYPE_EXTENSION_MAX_LENGTH)
+            return NULL;
+
+        c = (unsigned char)extension[len];
+        lowered[len] = (c >= 'A' && c <= 'Z') ? (char)(c + 32) : (char)c;
+    }
+
+    lowered[len] = '\0';
+
+    h = http_media_type_extension_hash(lowered, len, 0);
+    seed = http_media_type_extension_seeds[h % HTTP_MEDIA_TYPE_NB_BUCKETS];
+
+    h = http_media_type_extension_hash(lowered, len, seed);
+    entry = http_media_type_extensions + h % HTTP_MEDIA_TYPE_NB_SLOTS;
+
+    if (!entry->extension || strcmp(entry->extension, lowered) != 0)
+        return NULL;
+
+    return entry->media_type;
+}
@@ -16,11 +16,13 @@
 
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http.h"
 #include "internal.h"
 
 static bool http_is_media_type_char(unsigned char);
+static bool http_mime_is_bmp(const unsigned char *, size_t);
 
 struct http_media_type_parameter {
     char *name;  /* case insensitive */
@@ -41,15 +43,99 @@ struct http_media_type {
 
     struct http_media_type_parameter *parameters;
     size_t nb_parameters;
+
+    enum http_media_type_id id;
+
+    /* Interned media types are shared and immutable; compact media types
+     * are stored with their parameter and strings in a single block. */
+    bool interned;
+    bool compact;
 };
 
 static int http_media_type_parse(struct http_media_type *, const char *);
 static void http_media_type_format_strings(struct http_media_type *);
 
+static struct http_media_type *
+http_media_type_new_multipart(const struct http_media_type *,
+                              const char *, size_t);
+static enum http_media_type_id http_media_type_id_from_base(const char *);
+
 static void
 http_media_type_add_parameter(struct http_media_type *,
                               const struct http_media_type_parameter *);
 
+#define HTTP_MEDIA_TYPE_BASE(id_, string_, type_, subtype_) \
+    [id_] = {                                               \
+        .string = string_,                                  \
+        .base_string = string_,                             \
+        .type = type_,                                      \
+        .subtype = subtype_,                                \
+        .id = id_,                                          \
+        .interned = true,                                   \
+    }
+
+static struct http_media_type
+http_media_type_bases[HTTP_MEDIA_TYPE_NB_IDS] = {
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_APPLICATION_JSON,
+                         "application/json", "application", "json"),
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_APPLICATION_OCTET_STREAM,
+                         "application/octet-stream",
+                         "application", "octet-stream"),
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_APPLICATION_X_WWW_FORM_URLENCODED,
+                         "application/x-www-form-urlencoded",
+                         "application", "x-www-form-urlencoded"),
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_MULTIPART_BYTERANGES,
+                         "multipart/byteranges", "multipart", "byteranges"),
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_MULTIPART_FORM_DATA,
+                         "multipart/form-data", "multipart", "form-data"),
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_TEXT_HTML,
+                         "text/html", "text", "html"),
+    HTTP_MEDIA_TYPE_BASE(HTTP_MEDIA_TYPE_TEXT_PLAIN,
+                         "text/plain", "text", "plain"),
+};
+
+#undef HTTP_MEDIA_TYPE_BASE
+
+static struct http_media_type_parameter
+http_media_type_charset_parameters[] = {
+    {.name = "charset", .value = "utf-8"},
+    {.name = "charset", .value = "UTF-8"},
+};
+
+static struct http_media_type
+http_media_type_charsets[] = {
+    {.string = "application/json; charset=utf-8",
+     .base_string = "application/json",
+     .type = "application", .subtype = "json",
+     .parameters = http_media_type_charset_parameters + 0, .nb_parameters = 1,
+     .id = HTTP_MEDIA_TYPE_APPLICATION_JSON, .interned = true},
+    {.string = "application/json; charset=UTF-8",
+     .base_string = "application/json",
+     .type = "application", .subtype = "json",
+     .parameters = http_media_type_charset_parameters + 1, .nb_parameters = 1,
+     .id = HTTP_MEDIA_TYPE_APPLICATION_JSON, .interned = true},
+    {.string = "text/html; charset=utf-8",
+     .base_string = "text/html",
+     .type = "text", .subtype = "html",
+     .parameters = http_media_type_charset_parameters + 0, .nb_parameters = 1,
+     .id = HTTP_MEDIA_TYPE_TEXT_HTML, .interned = true},
+    {.string = "text/html; charset=UTF-8",
+     .base_string = "text/html",
+     .type = "text", .subtype = "html",
+     .parameters = http_media_type_charset_parameters + 1, .nb_parameters = 1,
+     .id = HTTP_MEDIA_TYPE_TEXT_HTML, .interned = true},
+    {.string = "text/plain; charset=utf-8",
+     .base_string = "text/plain",
+     .type = "text", .subtype = "plain",
+     .parameters = http_media_type_charset_parameters + 0, .nb_parameters = 1,
+     .id = HTTP_MEDIA_TYPE_TEXT_PLAIN, .interned = true},
+    {.string = "text/plain; charset=UTF-8",
+     .base_string = "text/plain",
+     .type = "text", .subtype = "plain",
+     .parameters = http_media_type_charset_parameters + 1, .nb_parameters = 1,
+     .id = HTTP_MEDIA_TYPE_TEXT_PLAIN, .interned = true},
+};
+
 struct http_media_type *
 http_media_type_new(const char *string) {
     struct http_media_type *media_type;
@@ -62,13 +148,96 @@ http_media_type_new(const char *string) {
     }
 
     http_media_type_format_strings(media_type);
+    media_type->id = http_media_type_id_from_base(media_type->base_string);
+
     return media_type;
 }
 
+struct http_media_type *
+http_media_type_intern(const char *string) {
+    static const char *boundary = "; boundary=";
+
+    size_t len, boundary_len;
+
+    len = strlen(string);
+
+    /* Common media types, with or without a charset, are resolved to shared
+     * immutable objects. */
+    for (size_t i = 0; i < HTTP_MEDIA_TYPE_NB_IDS; i++) {
+        struct http_media_type *media_type;
+
+        media_type = http_media_type_bases + i;
+        if (!media_type->string)
+            continue;
+
+        if (strcasecmp(media_type->string, string) == 0)
+            return media_type;
+    }
+
+    for (size_t i = 0; i < sizeof(http_media_type_charsets)
+                          / sizeof(http_media_type_charsets[0]); i++) {
+        struct http_media_type *media_type;
+        size_t base_len;
+
+        media_type = http_media_type_charsets + i;
+
+        base_len = strlen(media_type->string)
+                 - strlen(media_type->parameters[0].value);
+
+        if (strncasecmp(media_type->string, string, base_len) == 0
+         && strcmp(media_type->parameters[0].value, string + base_len) == 0) {
+            return media_type;
+        }
+    }
+
+    /* Multipart media types only carry a boundary: the type is shared and
+     * the boundary is stored with the media type in a single block. */
+    boundary_len = strlen(boundary);
+
+    for (size_t i = 0; i < HTTP_MEDIA_TYPE_NB_IDS; i++) {
+        const struct http_media_type *base;
+        size_t base_len;
+        const char *value;
+        size_t value_len;
+
+        base = http_media_type_bases + i;
+        if (!base->string || strcmp(base->type, "multipart") != 0)
+            continue;
+
+        base_len = strlen(base->base_string);
+        if (len <= base_len + boundary_len)
+            continue;
+
+        if (strncasecmp(string, base->base_string, base_len) != 0
+         || strncasecmp(string + base_len, boundary, boundary_len) != 0) {
+            continue;
+        }
+
+        value = string + base_len + boundary_len;
+        value_len = len - base_len - boundary_len;
+
+        for (size_t j = 0; j < value_len; j++) {
+            if (!http_is_media_type_char((unsigned char)value[j]))
+                goto parse;
+        }
+
+        return http_media_type_new_multipart(base, value, value_len);
+    }
+
+parse:
+    return http_media_type_new(string);
+}
+
 void
 http_media_type_delete(struct http_media_type *media_type) {
-    if (!media_type)
+    if (!media_type || media_type->interned)
+        return;
+
+    if (media_type->compact) {
+        memset(media_type, 0, sizeof(struct http_media_type));
+        http_free(media_type);
         return;
+    }
 
     http_free(media_type->string);
     http_free(media_type->base_string);
@@ -92,6 +261,19 @@ http_media_type_base_string(const struct http_media_type *media_type) {
     return media_type->base_string;
 }
 
+enum http_media_type_id
+http_media_type_id(const struct http_media_type *media_type) {
+    return media_type->id;
+}
+
+const struct http_media_type *
+http_media_type_get(enum http_media_type_id id) {
+    if (id <= HTTP_MEDIA_TYPE_OTHER || id >= HTTP_MEDIA_TYPE_NB_IDS)
+        return NULL;
+
+    return http_media_type_bases + id;
+}
+
 const char *
 http_media_type_get_type(const struct http_media_type *media_type) {
     return media_type->type;
@@ -194,6 +376,106 @@ http_mime_q_encode(const char *string) {
     return encoded_string;
 }
 
+const char *
+http_mime_type_from_path(const char *path) {
+    const char *dot;
+
+    dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/'))
+        return NULL;
+
+    return http_mime_type_from_extension(dot + 1);
+}
+
+const char *
+http_mime_sniff_type(const void *data, size_t sz) {
+    static const struct {
+        const char *signature;
+        size_t length;
+        size_t offset;
+        const char *media_type;
+    } signatures[] = {
+#define HTTP_SIGNATURE(signature_, offset_, media_type_) \
+        {signature_, sizeof(signature_) - 1, offset_, media_type_}
+        HTTP_SIGNATURE("\x89PNG\r\n\x1a\n", 0, "image/png"),
+        HTTP_SIGNATURE("\xff\xd8\xff", 0, "image/jpeg"),
+        HTTP_SIGNATURE("GIF87a", 0, "image/gif"),
+        HTTP_SIGNATURE("GIF89a", 0, "image/gif"),
+        HTTP_SIGNATURE("WEBPVP", 8, "image/webp"),
+        HTTP_SIGNATURE("\x00\x00\x01\x00", 0, "image/vnd.microsoft.icon"),
+        HTTP_SIGNATURE("%PDF-", 0, "application/pdf"),
+        HTTP_SIGNATURE("%!PS-Adobe-", 0, "application/postscript"),
+        HTTP_SIGNATURE("PK\x03\x04", 0, "application/zip"),
+        HTTP_SIGNATURE("\x1f\x8b\x08", 0, "application/gzip"),
+        HTTP_SIGNATURE("\x28\xb5\x2f\xfd", 0, "application/zstd"),
+        HTTP_SIGNATURE("\xfd" "7zXZ\x00", 0, "application/x-xz"),
+        HTTP_SIGNATURE("7z\xbc\xaf\x27\x1c", 0, "application/x-7z-compressed"),
+        HTTP_SIGNATURE("\x00" "asm", 0, "application/wasm"),
+        HTTP_SIGNATURE("OggS\x00", 0, "application/ogg"),
+        HTTP_SIGNATURE("ID3", 0, "audio/mpeg"),
+        HTTP_SIGNATURE("fLaC", 0, "audio/flac"),
+        HTTP_SIGNATURE("WAVE", 8, "audio/vnd.wave"),
+        HTTP_SIGNATURE("ftyp", 4, "video/mp4"),
+        HTTP_SIGNATURE("\x1a\x45\xdf\xa3", 0, "video/webm"),
+        HTTP_SIGNATURE("wOFF", 0, "font/woff"),
+        HTTP_SIGNATURE("wOF2", 0, "font/woff2"),
+        HTTP_SIGNATURE("<?xml", 0, "text/xml"),
+#undef HTTP_SIGNATURE
+    };
+
+    static const char *html_prefixes[] = {
+        "<!doctype html", "<html", "<head", "<body", "<script",
+    };
+
+    const unsigned char *ptr;
+    size_t len;
+
+    ptr = data;
+
+    for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++) {
+        if (sz < signatures[i].offset + signatures[i].length)
+            continue;
+
+        if (memcmp(ptr + signatures[i].offset, signatures[i].signature,
+                   signatures[i].length) == 0) {
+            return signatures[i].media_type;
+        }
+    }
+
+    if (http_mime_is_bmp(ptr, sz))
+        return "image/bmp";
+
+    /* Textual content: skip leading whitespace and look for HTML markup */
+    len = sz;
+    while (len > 0 && (*ptr == ' ' || *ptr == '\t'
+                    || *ptr == '\r' || *ptr == '\n')) {
+        ptr++;
+        len--;
+    }
+
+    for (size_t i = 0; i < sizeof(html_prefixes) / sizeof(html_prefixes[0]);
+         i++) {
+        size_t prefix_len;
+
+        prefix_len = strlen(html_prefixes[i]);
+        if (len >= prefix_len
+         && strncasecmp((const char *)ptr, html_prefixes[i], prefix_len) == 0) {
+            return "text/html";
+        }
+    }
+
+    /* Data without any binary byte is considered to be plain text */
+    ptr = data;
+    for (size_t i = 0; i < sz; i++) {
+        if (ptr[i] < 0x20 && ptr[i] != '\t' && ptr[i] != '\n'
+         && ptr[i] != '\r' && ptr[i] != '\f' && ptr[i] != 0x1b) {
+            return NULL;
+        }
+    }
+
+    return (sz > 0) ? "text/plain" : NULL;
+}
+
 void
 http_mime_generate_boundary(char boundary[static HTTP_MIME_BOUNDARY_SZ],
                             size_t sz) {
@@ -234,6 +516,30 @@ http_is_media_type_char(unsigned char c) {
     return table[c / 32] & (uint32_t)(1 << (c % 32));
 }
 
+static bool
+http_mime_is_bmp(const unsigned char *ptr, size_t sz) {
+    uint32_t file_sz, data_offset;
+
+    /* The "BM" signature alone matches a lot of text, so the rest of the
+     * 14 byte file header must be consistent: reserved fields are zero,
+     * and pixel data start after the file and DIB headers (at least 12
+     * bytes) and before the end of the file. */
+    if (sz < 14 || ptr[0] != 'B' || ptr[1] != 'M')
+        return false;
+
+    for (size_t i = 6; i < 10; i++) {
+        if (ptr[i] != 0)
+            return false;
+    }
+
+    file_sz = (uint32_t)ptr[2] | (uint32_t)ptr[3] << 8
+            | (uint32_t)ptr[4] << 16 | (uint32_t)ptr[5] << 24;
+    data_offset = (uint32_t)ptr[10] | (uint32_t)ptr[11] << 8
+                | (uint32_t)ptr[12] << 16 | (uint32_t)ptr[13] << 24;
+
+    return data_offset >= 14 + 12 && data_offset <= file_sz;
+}
+
 static void
 http_media_type_parameter_init(struct http_media_type_parameter *parameter) {
     memset(parameter, 0, sizeof(struct http_media_type_parameter));
@@ -532,6 +838,64 @@ http_media_type_format_strings(struct http_media_type *media_type) {
     bf_buffer_delete(buf);
 }
 
+static struct http_media_type *
+http_media_type_new_multipart(const struct http_media_type *base,
+                              const char *value, size_t value_len) {
+    struct http_media_type *media_type;
+    struct http_media_type_parameter *parameter;
+    size_t base_len, string_len;
+    char *block, *ptr;
+
+    base_len = strlen(base->base_string);
+    string_len = base_len + strlen("; boundary=") + value_len;
+
+    block = http_malloc(sizeof(struct http_media_type)
+                        + sizeof(struct http_media_type_parameter)
+                        + string_len + 1 + value_len + 1);
+
+    media_type = (struct http_media_type *)block;
+    memset(media_type, 0, sizeof(struct http_media_type));
+
+    parameter = (struct http_media_type_parameter *)(media_type + 1);
+
+    ptr = (char *)(parameter + 1);
+    memcpy(ptr, base->base_string, base_len);
+    memcpy(ptr + base_len, "; boundary=", string_len - base_len - value_len);
+    memcpy(ptr + string_len - value_len, value, value_len);
+    ptr[string_len] = '\0';
+    media_type->string = ptr;
+
+    ptr += string_len + 1;
+    memcpy(ptr, value, value_len);
+    ptr[value_len] = '\0';
+
+    parameter->name = "boundary";
+    parameter->value = ptr;
+
+    media_type->base_string = base->base_string;
+    media_type->type = base->type;
+    media_type->subtype = base->subtype;
+    media_type->parameters = parameter;
+    media_type->nb_parameters = 1;
+    media_type->id = base->id;
+    media_type->compact = true;
+
+    return media_type;
+}
+
+static enum http_media_type_id
+http_media_type_id_from_base(const char *base_string) {
+    for (size_t i = 0; i < HTTP_MEDIA_TYPE_NB_IDS; i++) {
+        const struct http_media_type *base;
+
+        base = http_media_type_bases + i;
+        if (base->base_string && strcmp(base->base_string, base_string) == 0)
+            return base->id;
+    }
+
+    return HTTP_MEDIA_TYPE_OTHER;
+}
+
 static void
 http_media_type_add_parameter(struct http_media_type *media_type,
                               const struct http_media_type_parameter *param) {
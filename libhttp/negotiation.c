@@ -0,0 +1,678 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Clients tend to send the exact same Accept-* header values for every
+ * request, so parsed values are kept in a small per-thread cache, released
+ * with http_accept_release_cache() before the thread exits. */
+#define HTTP_ACCEPT_CACHE_SZ 16
+
+/* Longer header values are parsed every time */
+#define HTTP_ACCEPT_CACHE_MAX_LENGTH 1024
+
+enum http_accept_type {
+    HTTP_ACCEPT_MEDIA_TYPE,
+    HTTP_ACCEPT_ENCODING,
+    HTTP_ACCEPT_LANGUAGE,
+};
+
+struct http_accept_range {
+    const char *value;
+    size_t value_length;
+
+    /* Media type parameters, i.e. parameters located before the q
+     * parameter. */
+    const char *parameters;
+    size_t nb_parameters;
+
+    unsigned int q; /* [0, 1000] */
+};
+
+struct http_accept {
+    enum http_accept_type type;
+
+    char *string;
+    size_t length;
+    uint32_t hash;
+
+    bool is_valid;
+
+    struct http_accept_range *ranges;
+    size_t nb_ranges;
+
+    uint64_t last_use;
+};
+
+static struct http_accept *http_accept_new(enum http_accept_type,
+                                           const char *, size_t, uint32_t);
+static void http_accept_delete(struct http_accept *);
+static int http_accept_parse(struct http_accept *);
+static int http_accept_parse_qvalue(const char *, size_t, unsigned int *);
+static int http_accept_check_range(enum http_accept_type,
+                                   struct http_accept_range *);
+static void http_accept_add_range(struct http_accept *,
+                                  const struct http_accept_range *);
+
+static uint32_t http_accept_hash(enum http_accept_type, const char *, size_t);
+static struct http_accept *http_accept_cache_get(enum http_accept_type,
+                                                 const char *, size_t,
+                                                 uint32_t);
+static void http_accept_cache_add(struct http_accept *);
+
+static unsigned int http_accept_media_type_q(const struct http_accept *,
+                                             const char *);
+static unsigned int http_accept_encoding_q(const struct http_accept *,
+                                           const char *);
+static unsigned int http_accept_language_q(const struct http_accept *,
+                                           const char *);
+
+static bool http_accept_range_parameters_match(const struct http_accept_range *,
+                                               const char *);
+
+static const char *http_negotiate(enum http_accept_type, const char *,
+                                  const char * const *, size_t);
+
+static __thread struct http_accept *http_accept_cache[HTTP_ACCEPT_CACHE_SZ];
+static __thread uint64_t http_accept_cache_clock;
+
+const char *
+http_negotiate_media_type(const char *header,
+                          const char * const *offers, size_t nb_offers) {
+    return http_negotiate(HTTP_ACCEPT_MEDIA_TYPE, header, offers, nb_offers);
+}
+
+const char *
+http_negotiate_encoding(const char *header,
+                        const char * const *offers, size_t nb_offers) {
+    return http_negotiate(HTTP_ACCEPT_ENCODING, header, offers, nb_offers);
+}
+
+const char *
+http_negotiate_language(const char *header,
+                        const char * const *offers, size_t nb_offers) {
+    return http_negotiate(HTTP_ACCEPT_LANGUAGE, header, offers, nb_offers);
+}
+
+const char *
+http_request_negotiate_media_type(const struct http_msg *msg,
+                                  const char * const *offers,
+                                  size_t nb_offers) {
+    return http_negotiate_media_type(http_msg_get_header(msg, "Accept"),
+                                     offers, nb_offers);
+}
+
+const char *
+http_request_negotiate_encoding(const struct http_msg *msg,
+                                const char * const *offers,
+                                size_t nb_offers) {
+    return http_negotiate_encoding(http_msg_get_header(msg, "Accept-Encoding"),
+                                   offers, nb_offers);
+}
+
+const char *
+http_request_negotiate_language(const struct http_msg *msg,
+                                const char * const *offers,
+                                size_t nb_offers) {
+    return http_negotiate_language(http_msg_get_header(msg, "Accept-Language"),
+                                   offers, nb_offers);
+}
+
+void
+http_accept_release_cache(void) {
+    for (size_t i = 0; i < HTTP_ACCEPT_CACHE_SZ; i++) {
+        http_accept_delete(http_accept_cache[i]);
+        http_accept_cache[i] = NULL;
+    }
+
+    http_accept_cache_clock = 0;
+}
+
+static const char *
+http_negotiate(enum http_accept_type type, const char *header,
+               const char * const *offers, size_t nb_offers) {
+    struct http_accept *accept;
+    const char *best_offer;
+    unsigned int best_q;
+    size_t length;
+    uint32_t hash;
+    bool is_cached;
+
+    if (nb_offers == 0)
+        return NULL;
+
+    /* No header means that all offers are acceptable */
+    if (!header)
+        return offers[0];
+
+    length = strlen(header);
+    hash = http_accept_hash(type, header, length);
+
+    is_cached = (length <= HTTP_ACCEPT_CACHE_MAX_LENGTH);
+
+    if (is_cached) {
+        accept = http_accept_cache_get(type, header, length, hash);
+        if (!accept) {
+            accept = http_accept_new(type, header, length, hash);
+            http_accept_cache_add(accept);
+        }
+    } else {
+        accept = http_accept_new(type, header, length, hash);
+    }
+
+    /* RFC 7231 5.3: invalid header values can be ignored, in which case
+     * they are treated as if they were not present. */
+    if (!accept->is_valid) {
+        best_offer = offers[0];
+        goto end;
+    }
+
+    best_offer = NULL;
+    best_q = 0;
+
+    for (size_t i = 0; i < nb_offers; i++) {
+        unsigned int q;
+
+        switch (type) {
+        case HTTP_ACCEPT_MEDIA_TYPE:
+            q = http_accept_media_type_q(accept, offers[i]);
+            break;
+
+        case HTTP_ACCEPT_ENCODING:
+            q = http_accept_encoding_q(accept, offers[i]);
+            break;
+
+        case HTTP_ACCEPT_LANGUAGE:
+            q = http_accept_language_q(accept, offers[i]);
+            break;
+
+        default:
+            q = 0;
+            break;
+        }
+
+        /* When several offers have the same quality, the first one, i.e.
+         * the one preferred by the server, is selected. */
+        if (q > best_q) {
+            best_offer = offers[i];
+            best_q = q;
+
+            if (best_q == 1000)
+                break;
+        }
+    }
+
+end:
+    if (!is_cached)
+        http_accept_delete(accept);
+
+    return best_offer;
+}
+
+static struct http_accept *
+http_accept_new(enum http_accept_type type, const char *string, size_t length,
+                uint32_t hash) {
+    struct http_accept *accept;
+
+    accept = http_malloc0(sizeof(struct http_accept));
+
+    accept->type = type;
+
+    accept->string = http_strndup(string, length);
+    accept->length = length;
+    accept->hash = hash;
+
+    if (http_accept_parse(accept) == 0) {
+        accept->is_valid = true;
+    } else {
+        http_free(accept->ranges);
+        accept->ranges = NULL;
+        accept->nb_ranges = 0;
+    }
+
+    return accept;
+}
+
+static void
+http_accept_delete(struct http_accept *accept) {
+    if (!accept)
+        return;
+
+    http_free(accept->string);
+    http_free(accept->ranges);
+
+    memset(accept, 0, sizeof(struct http_accept));
+    http_free(accept);
+}
+
+static int
+http_accept_parse(struct http_accept *accept) {
+    struct http_pvalue_iterator it;
+    int ret;
+
+    http_pvalue_iterator_init(&it, accept->string);
+
+    while ((ret = http_pvalue_iterator_next(&it)) == 1) {
+        struct http_pvalue_parameter_view parameter;
+        struct http_accept_range range;
+
+        memset(&range, 0, sizeof(struct http_accept_range));
+
+        range.value = it.value;
+        range.value_length = it.value_length;
+        range.parameters = it.parameters;
+        range.q = 1000;
+
+        if (http_accept_check_range(accept->type, &range) == -1)
+            return -1;
+
+        while ((ret = http_pvalue_iterator_next_parameter(&it,
+                                                          &parameter)) == 1) {
+            if (http_pvalue_parameter_view_name_is(&parameter, "q")) {
+                if (http_accept_parse_qvalue(parameter.value,
+                                             parameter.value_length,
+                                             &range.q) == -1) {
+                    return -1;
+                }
+
+                /* Accept extensions are ignored */
+                break;
+            }
+
+            range.nb_parameters++;
+        }
+
+        if (ret == -1)
+            return -1;
+
+        /* Parameters other than q are only meaningful for media types */
+        if (accept->type != HTTP_ACCEPT_MEDIA_TYPE)
+            range.nb_parameters = 0;
+
+        if (range.nb_parameters == 0)
+            range.parameters = NULL;
+
+        http_accept_add_range(accept, &range);
+    }
+
+    if (ret == -1)
+        return -1;
+
+    return 0;
+}
+
+static int
+http_accept_parse_qvalue(const char *string, size_t length,
+                         unsigned int *pq) {
+    unsigned int q, scale;
+    size_t i;
+
+    /* RFC 7231 5.3.1:
+     *
+     * qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+     *
+     * Some clients omit the leading zero (e.g. "q=.5"); we accept it. */
+
+    if (length == 0)
+        goto invalid;
+
+    q = 0;
+    i = 0;
+
+    if (string[0] == '0' || string[0] == '1') {
+        q = (unsigned int)(string[0] - '0') * 1000;
+        i++;
+    } else if (string[0] != '.') {
+        goto invalid;
+    }
+
+    if (i < length) {
+        if (string[i] != '.')
+            goto invalid;
+        i++;
+
+        scale = 100;
+        for (; i < length; i++) {
+            if (string[i] < '0' || string[i] > '9' || scale == 0)
+                goto invalid;
+
+            q += (unsigned int)(string[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    if (q > 1000)
+        goto invalid;
+
+    *pq = q;
+    return 0;
+
+invalid:
+    http_set_error("invalid qvalue");
+    return -1;
+}
+
+static int
+http_accept_check_range(enum http_accept_type type,
+                        struct http_accept_range *range) {
+    const char *slash;
+    size_t type_length;
+
+    if (type != HTTP_ACCEPT_MEDIA_TYPE)
+        return 0;
+
+    /* A single '*' is not valid but is commonly used instead of '*' '/' '*'
+     * (e.g. by Java clients). */
+    if (range->value_length == 1 && range->value[0] == '*') {
+        range->value = "*/*";
+        range->value_length = 3;
+        return 0;
+    }
+
+    slash = memchr(range->value, '/', range->value_length);
+    if (!slash) {
+        http_set_error("missing '/' in media range");
+        return -1;
+    }
+
+    type_length = (size_t)(slash - range->value);
+    if (type_length == 0 || type_length + 1 == range->value_length) {
+        http_set_error("invalid media range");
+        return -1;
+    }
+
+    if (type_length == 1 && range->value[0] == '*') {
+        if (range->value_length != 3 || range->value[2] != '*') {
+            http_set_error("invalid media range");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+http_accept_add_range(struct http_accept *accept,
+                      const struct http_accept_range *range) {
+    size_t nsz;
+
+    nsz = (accept->nb_ranges + 1) * sizeof(struct http_accept_range);
+    accept->ranges = http_realloc(accept->ranges, nsz);
+
+    accept->ranges[accept->nb_ranges++] = *range;
+}
+
+static uint32_t
+http_accept_hash(enum http_accept_type type, const char *string,
+                 size_t length) {
+    uint32_t hash;
+
+    /* FNV-1a */
+    hash = 2166136261u ^ (uint32_t)type;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct http_accept *
+http_accept_cache_get(enum http_accept_type type, const char *string,
+                      size_t length, uint32_t hash) {
+    for (size_t i = 0; i < HTTP_ACCEPT_CACHE_SZ; i++) {
+        struct http_accept *accept;
+
+        accept = http_accept_cache[i];
+        if (!accept)
+            continue;
+
+        if (accept->hash != hash || accept->type != type
+         || accept->length != length) {
+            continue;
+        }
+
+        if (memcmp(accept->string, string, length) != 0)
+            continue;
+
+        accept->last_use = ++http_accept_cache_clock;
+        return accept;
+    }
+
+    return NULL;
+}
+
+static void
+http_accept_cache_add(struct http_accept *accept) {
+    size_t idx;
+
+    /* Use a free slot if there is one, or evict the least recently used
+     * entry. */
+    idx = 0;
+
+    for (size_t i = 0; i < HTTP_ACCEPT_CACHE_SZ; i++) {
+        if (!http_accept_cache[i]) {
+            idx = i;
+            break;
+        }
+
+        if (http_accept_cache[i]->last_use
+          < http_accept_cache[idx]->last_use) {
+            idx = i;
+        }
+    }
+
+    http_accept_delete(http_accept_cache[idx]);
+
+    accept->last_use = ++http_accept_cache_clock;
+    http_accept_cache[idx] = accept;
+}
+
+static unsigned int
+http_accept_media_type_q(const struct http_accept *accept, const char *offer) {
+    struct http_pvalue_iterator it;
+    const char *offer_parameters, *slash;
+    size_t offer_length, type_length;
+    unsigned int q;
+    int specificity;
+
+    http_pvalue_iterator_init(&it, offer);
+    if (http_pvalue_iterator_next(&it) != 1)
+        return 0;
+
+    offer = it.value;
+    offer_length = it.value_length;
+    offer_parameters = it.parameters;
+
+    slash = memchr(offer, '/', offer_length);
+    if (!slash)
+        return 0;
+
+    type_length = (size_t)(slash - offer);
+
+    /* RFC 7231 5.3.2: the most specific media range matching the offer
+     * determines its quality. */
+    q = 0;
+    specificity = -1;
+
+    for (size_t i = 0; i < accept->nb_ranges; i++) {
+        const struct http_accept_range *range;
+        int range_specificity;
+
+        range = accept->ranges + i;
+
+        if (range->value[0] == '*') {
+            range_specificity = 0;
+        } else if (range->value[range->value_length - 1] == '*'
+                && range->value_length == type_length + 2
+                && range->value[type_length] == '/') {
+            if (strncasecmp(range->value, offer, type_length) != 0)
+                continue;
+
+            range_specificity = 1;
+        } else if (range->value_length == offer_length) {
+            if (strncasecmp(range->value, offer, offer_length) != 0)
+                continue;
+
+            if (!http_accept_range_parameters_match(range, offer_parameters))
+                continue;
+
+            range_specificity = 2 + (int)range->nb_parameters;
+        } else {
+            continue;
+        }
+
+        if (range_specificity > specificity) {
+            q = range->q;
+            specificity = range_specificity;
+        }
+    }
+
+    return q;
+}
+
+static unsigned int
+http_accept_encoding_q(const struct http_accept *accept, const char *offer) {
+    unsigned int wildcard_q, min_q;
+    bool has_wildcard;
+    size_t offer_length;
+
+    offer_length = strlen(offer);
+
+    wildcard_q = 0;
+    has_wildcard = false;
+
+    min_q = 1000;
+
+    for (size_t i = 0; i < accept->nb_ranges; i++) {
+        const struct http_accept_range *range;
+
+        range = accept->ranges + i;
+
+        if (range->value_length == 1 && range->value[0] == '*') {
+            wildcard_q = range->q;
+            has_wildcard = true;
+        } else if (range->value_length == offer_length
+                && strncasecmp(range->value, offer, offer_length) == 0) {
+            return range->q;
+        }
+
+        if (range->q > 0)
+            min_q = MIN(min_q, range->q);
+    }
+
+    if (has_wildcard)
+        return wildcard_q;
+
+    /* RFC 7231 5.3.4: the identity encoding is always acceptable unless
+     * explicitly excluded. Since the client did not list it, we assume it
+     * prefers all the encodings it did list. */
+    if (strcasecmp(offer, "identity") == 0)
+        return min_q;
+
+    return 0;
+}
+
+static unsigned int
+http_accept_language_q(const struct http_accept *accept, const char *offer) {
+    size_t offer_length;
+    unsigned int q;
+    int specificity;
+
+    offer_length = strlen(offer);
+
+    /* RFC 4647 3.3.1 (basic filtering): a language range matches a tag if
+     * it is equal to the tag or to one of its prefixes ending before a '-'
+     * character. The longest matching range determines the quality. */
+    q = 0;
+    specificity = -1;
+
+    for (size_t i = 0; i < accept->nb_ranges; i++) {
+        const struct http_accept_range *range;
+        int range_specificity;
+
+        range = accept->ranges + i;
+
+        if (range->value_length == 1 && range->value[0] == '*') {
+            range_specificity = 0;
+        } else if (range->value_length <= offer_length
+                && strncasecmp(range->value, offer, range->value_length) == 0
+                && (range->value_length == offer_length
+                    || offer[range->value_length] == '-')) {
+            range_specificity = (int)range->value_length;
+        } else {
+            continue;
+        }
+
+        if (range_specificity > specificity) {
+            q = range->q;
+            specificity = range_specificity;
+        }
+    }
+
+    return q;
+}
+
+static bool
+http_accept_range_parameters_match(const struct http_accept_range *range,
+                                   const char *offer_parameters) {
+    const char *ptr;
+
+    ptr = range->parameters;
+
+    for (size_t i = 0; i < range->nb_parameters; i++) {
+        struct http_pvalue_parameter_view parameter, offer_parameter;
+        const char *offer_ptr;
+        bool found;
+
+        if (http_pvalue_parameter_view_read(&ptr, &parameter) != 1)
+            return false;
+
+        found = false;
+
+        offer_ptr = offer_parameters;
+        while (offer_ptr
+            && http_pvalue_parameter_view_read(&offer_ptr,
+                                               &offer_parameter) == 1) {
+            if (offer_parameter.name_length != parameter.name_length
+             || offer_parameter.value_length != parameter.value_length) {
+                continue;
+            }
+
+            if (strncasecmp(offer_parameter.name, parameter.name,
+                            parameter.name_length) != 0) {
+                continue;
+            }
+
+            if (strncasecmp(offer_parameter.value, parameter.value,
+                            parameter.value_length) != 0) {
+                continue;
+            }
+
+            found = true;
+            break;
+        }
+
+        if (!found)
+            return false;
+    }
+
+    return true;
+}
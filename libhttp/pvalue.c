@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http.h"
 #include "internal.h"
@@ -180,7 +181,8 @@ http_pvalue_parse(struct http_pvalue *pvalue, const char *string,
             /* Token */
             start = ptr;
             for (;;) {
-                if (*ptr == ';' || *ptr == ' ' || *ptr == '\t' || *ptr == '\0') {
+                if (*ptr == ';' || *ptr == ',' || *ptr == ' ' || *ptr == '\t'
+                 || *ptr == '\0') {
                     toklen = (size_t)(ptr - start);
                     if (toklen == 0) {
                         http_set_error("empty parameter value");
@@ -348,6 +350,222 @@ http_pvalues_add_pvalue(struct http_pvalues *pvalues,
     pvalues->pvalues[pvalues->nb_pvalues++] = *pvalue;
 }
 
+void
+http_pvalue_iterator_init(struct http_pvalue_iterator *it, const char *str) {
+    memset(it, 0, sizeof(struct http_pvalue_iterator));
+
+    it->ptr = str;
+}
+
+int
+http_pvalue_iterator_next(struct http_pvalue_iterator *it) {
+    struct http_pvalue_parameter_view parameter;
+    const char *ptr, *start;
+    int ret;
+
+    ptr = it->ptr;
+
+    it->value = NULL;
+    it->value_length = 0;
+    it->parameters = NULL;
+
+    if (*ptr == '\0')
+        return 0;
+
+    /* Value */
+    start = ptr;
+    while (*ptr != ' ' && *ptr != '\t' && *ptr != ';' && *ptr != ','
+        && *ptr != '\0') {
+        /* Accept media ranges (e.g. "text/html") as values */
+        if (!http_is_pvalue_char((unsigned char)*ptr) && *ptr != '/') {
+            http_set_error_invalid_character((unsigned char)*ptr, " in value");
+            return -1;
+        }
+
+        ptr++;
+    }
+
+    if (ptr == start) {
+        http_set_error("empty value");
+        return -1;
+    }
+
+    it->value = start;
+    it->value_length = (size_t)(ptr - start);
+
+    while (*ptr == ' ' || *ptr == '\t')
+        ptr++;
+
+    /* Parameters are validated now so that the caller does not have to care
+     * about errors when iterating on them. */
+    if (*ptr == ';') {
+        it->parameters = ptr;
+
+        while ((ret = http_pvalue_parameter_view_read(&ptr, &parameter)) == 1)
+            continue;
+
+        if (ret == -1)
+            return -1;
+    }
+
+    /* Separator */
+    if (*ptr == ',') {
+        ptr++; /* skip ',' */
+
+        while (*ptr == ' ' || *ptr == '\t')
+            ptr++;
+
+        if (*ptr == '\0') {
+            http_set_error("truncated value list");
+            return -1;
+        }
+    } else if (*ptr != '\0') {
+        http_set_error("invalid separator");
+        return -1;
+    }
+
+    it->ptr = ptr;
+    return 1;
+}
+
+int
+http_pvalue_iterator_next_parameter(struct http_pvalue_iterator *it,
+                                    struct http_pvalue_parameter_view *param) {
+    int ret;
+
+    if (!it->parameters)
+        return 0;
+
+    ret = http_pvalue_parameter_view_read(&it->parameters, param);
+    if (ret != 1)
+        it->parameters = NULL;
+
+    return ret;
+}
+
+bool
+http_pvalue_iterator_value_is(const struct http_pvalue_iterator *it,
+                              const char *value) {
+    return strlen(value) == it->value_length
+        && strncasecmp(it->value, value, it->value_length) == 0;
+}
+
+bool
+http_pvalue_parameter_view_name_is(
+    const struct http_pvalue_parameter_view *param, const char *name) {
+    return strlen(name) == param->name_length
+        && strncasecmp(param->name, name, param->name_length) == 0;
+}
+
+int
+http_pvalue_parameter_view_read(const char **pptr,
+                                struct http_pvalue_parameter_view *param) {
+    const char *ptr, *start;
+
+    ptr = *pptr;
+
+    if (*ptr != ';')
+        return 0;
+
+    ptr++; /* skip ';' */
+
+    memset(param, 0, sizeof(struct http_pvalue_parameter_view));
+
+    while (*ptr == ' ' || *ptr == '\t')
+        ptr++;
+
+    /* Name */
+    start = ptr;
+    while (*ptr != '=' && *ptr != '\0') {
+        if (!http_is_pvalue_char((unsigned char)*ptr)) {
+            http_set_error_invalid_character((unsigned char)*ptr,
+                                             " in parameter name");
+            return -1;
+        }
+
+        ptr++;
+    }
+
+    if (ptr == start) {
+        http_set_error("empty parameter name");
+        return -1;
+    }
+
+    param->name = start;
+    param->name_length = (size_t)(ptr - start);
+
+    if (*ptr != '=') {
+        http_set_error("missing separator after parameter name");
+        return -1;
+    }
+
+    ptr++; /* skip '=' */
+
+    /* Value */
+    if (*ptr == '"') {
+        ptr++; /* skip '"' */
+
+        start = ptr;
+        while (*ptr != '"') {
+            if (*ptr == '\0') {
+                http_set_error("truncated quoted parameter value");
+                return -1;
+            } else if (*ptr == '\\') {
+                ptr++;
+                if (*ptr == '\0') {
+                    http_set_error("truncated escape sequence "
+                                   "in parameter value");
+                    return -1;
+                } else if (*ptr != '"' && *ptr != '\\') {
+                    http_set_error_invalid_character((unsigned char)*ptr,
+                                                     " in parameter value");
+                    return -1;
+                }
+            }
+
+            ptr++;
+        }
+
+        param->value = start;
+        param->value_length = (size_t)(ptr - start);
+        param->is_quoted = true;
+
+        ptr++; /* skip '"' */
+    } else {
+        start = ptr;
+        while (*ptr != ';' && *ptr != ',' && *ptr != ' ' && *ptr != '\t'
+            && *ptr != '\0') {
+            if (!http_is_pvalue_char((unsigned char)*ptr)) {
+                http_set_error_invalid_character((unsigned char)*ptr,
+                                                 " in parameter");
+                return -1;
+            }
+
+            ptr++;
+        }
+
+        if (ptr == start) {
+            http_set_error("empty parameter value");
+            return -1;
+        }
+
+        param->value = start;
+        param->value_length = (size_t)(ptr - start);
+    }
+
+    while (*ptr == ' ' || *ptr == '\t')
+        ptr++;
+
+    if (*ptr != ';' && *ptr != ',' && *ptr != '\0') {
+        http_set_error_invalid_character((unsigned char)*ptr,
+                                         " after parameter value");
+        return -1;
+    }
+
+    *pptr = ptr;
+    return 1;
+}
+
 static bool
 http_is_pvalue_char(unsigned char c) {
     static uint32_t table[8] = {
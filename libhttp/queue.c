@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Bounded queue based on an array of cells, each one with a sequence number
+ * indicating whether it can be written (sequence == position) or read
+ * (sequence == position + 1). Producers reserve a position with a
+ * compare-and-swap; there is a single consumer, so reading does not require
+ * any atomic read-modify-write operation.
+ *
+ * See Dmitry Vyukov's bounded MPMC queue for the original design. */
+
+#define HTTP_CACHE_LINE_SZ 64
+
+struct http_mpsc_queue {
+    char *cells;
+    size_t cell_sz;
+    size_t entry_sz;
+    uint64_t mask;
+
+    char padding1[HTTP_CACHE_LINE_SZ];
+    uint64_t push_position;
+
+    char padding2[HTTP_CACHE_LINE_SZ];
+    uint64_t pop_position;
+
+    char padding3[HTTP_CACHE_LINE_SZ];
+};
+
+static uint64_t *http_mpsc_queue_cell(const struct http_mpsc_queue *,
+                                      uint64_t);
+
+struct http_mpsc_queue *
+http_mpsc_queue_new(size_t nb_entries, size_t entry_sz) {
+    struct http_mpsc_queue *queue;
+    size_t nb_cells;
+
+    assert(nb_entries > 0);
+
+    nb_cells = 1;
+    while (nb_cells < nb_entries)
+        nb_cells *= 2;
+
+    queue = http_malloc0(sizeof(struct http_mpsc_queue));
+
+    queue->entry_sz = entry_sz;
+    queue->cell_sz = sizeof(uint64_t) + entry_sz;
+    queue->cell_sz = (queue->cell_sz + 7) & ~(size_t)7;
+    queue->mask = nb_cells - 1;
+
+    queue->cells = http_calloc(nb_cells, queue->cell_sz);
+
+    for (uint64_t i = 0; i < nb_cells; i++)
+        *http_mpsc_queue_cell(queue, i) = i;
+
+    return queue;
+}
+
+void
+http_mpsc_queue_delete(struct http_mpsc_queue *queue) {
+    if (!queue)
+        return;
+
+    http_free(queue->cells);
+
+    memset(queue, 0, sizeof(struct http_mpsc_queue));
+    http_free(queue);
+}
+
+bool
+http_mpsc_queue_push(struct http_mpsc_queue *queue, const void *entry) {
+    uint64_t *cell, position, sequence;
+
+    position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int64_t diff;
+
+        cell = http_mpsc_queue_cell(queue, position);
+        sequence = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+
+        diff = (int64_t)(sequence - position);
+        if (diff == 0) {
+            /* The cell is free, try to reserve it */
+            if (__atomic_compare_exchange_n(&queue->push_position,
+                                            &position, position + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The cell still contains an entry from the previous round */
+            return false;
+        } else {
+            /* Another producer reserved the cell */
+            position = __atomic_load_n(&queue->push_position,
+                                       __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(cell + 1, entry, queue->entry_sz);
+    __atomic_store_n(cell, position + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool
+http_mpsc_queue_pop(struct http_mpsc_queue *queue, void *entry) {
+    uint64_t *cell, position, sequence;
+
+    position = queue->pop_position;
+
+    cell = http_mpsc_queue_cell(queue, position);
+    sequence = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+
+    if (sequence != position + 1)
+        return false;
+
+    memcpy(entry, cell + 1, queue->entry_sz);
+    __atomic_store_n(cell, position + queue->mask + 1, __ATOMIC_RELEASE);
+
+    queue->pop_position = position + 1;
+    return true;
+}
+
+static uint64_t *
+http_mpsc_queue_cell(const struct http_mpsc_queue *queue, uint64_t position) {
+    size_t idx;
+
+    idx = (size_t)(position & queue->mask);
+    return (uint64_t *)(queue->cells + idx * queue->cell_sz);
+}
@@ -37,7 +37,8 @@ http_ranges_free(struct http_ranges *set) {
 }
 
 int
-http_ranges_parse(struct http_ranges *set, const char *str) {
+http_ranges_parse(struct http_ranges *set, const char *str,
+                  size_t max_ranges) {
     const char *ptr, *start;
     size_t toklen;
 
@@ -161,6 +162,9 @@ http_ranges_parse(struct http_ranges *set, const char *str) {
                 goto error;
             }
 
+            if (max_ranges > 0 && set->nb_ranges >= max_ranges)
+                goto too_many_ranges;
+
             http_ranges_add_range(set, &range);
 
             if (*ptr == ',') {
@@ -211,6 +215,9 @@ http_ranges_parse(struct http_ranges *set, const char *str) {
             goto error;
         }
 
+        if (max_ranges > 0 && set->nb_ranges >= max_ranges)
+            goto too_many_ranges;
+
         http_ranges_add_range(set, &range);
 
         while (*ptr == ' ' || *ptr == '\t')
@@ -225,6 +232,10 @@ http_ranges_parse(struct http_ranges *set, const char *str) {
 
     return 0;
 
+too_many_ranges:
+    http_ranges_free(set);
+    return 1;
+
 error:
     http_ranges_free(set);
     return -1;
@@ -233,85 +244,79 @@ error:
 void
 http_ranges_simplify(const struct http_ranges *set, size_t entity_sz,
                      struct http_ranges *dest) {
+    size_t nb_ranges;
+
     memset(dest, 0, sizeof(struct http_ranges));
 
     dest->unit = set->unit;
 
+    if (set->nb_ranges == 0)
+        return;
+
     dest->ranges = http_malloc(set->nb_ranges * sizeof(struct http_range));
-    memcpy(dest->ranges, set->ranges, set->nb_ranges * sizeof(struct http_range));
-    dest->nb_ranges = set->nb_ranges;
+    dest->ranges_sz = set->nb_ranges;
 
-    /* Replace partial ranges with complete ones and clamp offsets */
-    for (size_t i = 0; i < dest->nb_ranges; i++) {
-        struct http_range *range;
+    /* Replace partial ranges with complete ones, clamp offsets and drop
+     * ranges starting after the end of the entity */
+    nb_ranges = 0;
 
-        range = dest->ranges + i;
+    for (size_t i = 0; i < set->nb_ranges; i++) {
+        struct http_range range;
 
-        if (!range->has_first) {
-            range->has_first = true;
+        range = set->ranges[i];
+
+        if (!range.has_first) {
+            range.has_first = true;
 
-            if (range->last > entity_sz) {
-                range->first = 0;
+            if (range.last > entity_sz) {
+                range.first = 0;
             } else {
-                range->first = entity_sz - range->last;
+                range.first = entity_sz - range.last;
             }
 
-            range->last = entity_sz - 1;
+            range.last = entity_sz - 1;
         }
 
-        if (!range->has_last) {
-            range->has_last = true;
-            range->last = entity_sz - 1;
+        if (!range.has_last) {
+            range.has_last = true;
+            range.last = entity_sz - 1;
         }
 
-        if (range->first < entity_sz && range->last >= entity_sz)
-            range->last = entity_sz - 1;
-    }
+        if (range.first >= entity_sz)
+            continue;
 
-    /* Join ranges which overlap */
-    if (dest->nb_ranges >= 2) {
-        qsort(dest->ranges, dest->nb_ranges, sizeof(struct http_range),
-              http_range_cmp);
+        if (range.last >= entity_sz)
+            range.last = entity_sz - 1;
 
-        for (size_t i = 0; i < dest->nb_ranges - 1; i++) {
-            struct http_range *range;
-            size_t nb_merged;
+        dest->ranges[nb_ranges++] = range;
+    }
 
-            range = dest->ranges + i;
+    dest->nb_ranges = nb_ranges;
 
-            /* Count how many ranges can be merged with the current one */
-            nb_merged = 0;
-            for (size_t j = i + 1; j < dest->nb_ranges; j++) {
-                struct http_range *other_range;
+    if (nb_ranges < 2)
+        return;
 
-                other_range = dest->ranges + j;
+    /* Join ranges which overlap or are contiguous in a single pass over the
+     * sorted set */
+    qsort(dest->ranges, nb_ranges, sizeof(struct http_range), http_range_cmp);
 
-                if (range->last >= other_range->first) {
-                    if (other_range->last > range->last)
-                        range->last = other_range->last;
-                    nb_merged++;
-                } else {
-                    break;
-                }
-            }
+    nb_ranges = 1;
 
-            /* Merge */
-            if (nb_merged > 0) {
-                size_t nb_moved;
+    for (size_t i = 1; i < dest->nb_ranges; i++) {
+        struct http_range *last, *range;
 
-                nb_moved = dest->nb_ranges - i - 1 - nb_merged;
-                if (nb_moved > 0) {
-                    memmove(range + 1, range + 1 + nb_merged,
-                            nb_moved * sizeof(struct http_range));
-                }
+        last = dest->ranges + nb_ranges - 1;
+        range = dest->ranges + i;
 
-                dest->nb_ranges -= nb_merged;
-            }
+        if (range->first <= last->last + 1) {
+            if (range->last > last->last)
+                last->last = range->last;
+        } else {
+            dest->ranges[nb_ranges++] = *range;
         }
-
-        dest->ranges = http_realloc(dest->ranges,
-                                    dest->nb_ranges * sizeof(struct http_range));
     }
+
+    dest->nb_ranges = nb_ranges;
 }
 
 bool
@@ -350,18 +355,43 @@ http_ranges_length(const struct http_ranges *set) {
 void
 http_ranges_add_range(struct http_ranges *set,
                       const struct http_range *range) {
-    if (set->nb_ranges == 0) {
-        set->ranges = http_malloc(sizeof(struct http_range));
-    } else {
+    if (set->nb_ranges == set->ranges_sz) {
         size_t nsz;
 
-        nsz = (set->nb_ranges + 1) * sizeof(struct http_range);
+        set->ranges_sz = (set->ranges_sz == 0) ? 4 : set->ranges_sz * 2;
+
+        nsz = set->ranges_sz * sizeof(struct http_range);
         set->ranges = http_realloc(set->ranges, nsz);
     }
 
     set->ranges[set->nb_ranges++] = *range;
 }
 
+size_t
+http_ranges_content_range_length(const struct http_range *range,
+                                 size_t entity_sz) {
+    /* <first> "-" <last> "/" <entity-size> */
+    return http_size_length(range->first) + 1
+         + http_size_length(range->last) + 1
+         + http_size_length(entity_sz);
+}
+
+size_t
+http_ranges_format_content_range(char *buf, const struct http_range *range,
+                                 size_t entity_sz) {
+    char *ptr;
+
+    ptr = buf;
+
+    ptr += http_format_size(ptr, range->first);
+    *ptr++ = '-';
+    ptr += http_format_size(ptr, range->last);
+    *ptr++ = '/';
+    ptr += http_format_size(ptr, entity_sz);
+
+    return (size_t)(ptr - buf);
+}
+
 static int
 http_range_cmp(const void *arg1, const void *arg2) {
     struct http_range *r1, *r2;
@@ -369,10 +399,15 @@ http_range_cmp(const void *arg1, const void *arg2) {
     r1 = (struct http_range *)arg1;
     r2 = (struct http_range *)arg2;
 
-    if (r1->first != r2->first) {
-        return r1->first - r2->first;
-    } else {
-        return r1->last - r2->last;
+    if (r1->first < r2->first) {
+        return -1;
+    } else if (r1->first > r2->first) {
+        return 1;
+    } else if (r1->last < r2->last) {
+        return -1;
+    } else if (r1->last > r2->last) {
+        return 1;
     }
+
     return 0;
 }
@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <netdb.h>
+#include <pthread.h>
+
+#include "http.h"
+#include "internal.h"
+
+/* Number of (host, port, family) entries kept by the cache */
+#define HTTP_RESOLVER_CACHE_SZ 64
+
+/* Entries used during the last tenth of their lifetime are resolved again
+ * in the background, so that hosts used continuously never expire. */
+#define HTTP_RESOLVER_REFRESH_RATIO 10
+
+/* The cache is shared by all threads. Resolutions are never performed with
+ * the mutex held: concurrent misses for the same host may resolve it more
+ * than once, the last result replacing the others. */
+struct http_resolver_entry {
+    char *host;
+    char *port;
+    int family;
+
+    struct http_address *addresses;
+    size_t nb_addresses;
+    size_t next_address; /* rotated on each lookup */
+
+    int error; /* getaddrinfo() error code if the resolution failed */
+
+    /* Family of the address of the last successful connection */
+    int preferred_family;
+
+    uint64_t ttl;
+    uint64_t expiration_time;
+    bool is_refreshing;
+
+    uint64_t last_use;
+};
+
+struct http_resolver_refresh {
+    char *host;
+    char *port;
+    int family;
+
+    uint64_t ttl;
+};
+
+static int http_resolver_lookup(const char *, const char *, int,
+                                struct http_address **, size_t *, int *);
+static bool http_resolver_error_is_definitive(int);
+
+static struct http_resolver_entry *http_resolver_cache_get(const char *,
+                                                           const char *, int);
+static void http_resolver_cache_add(const char *, const char *, int,
+                                    const struct http_address *, size_t, int,
+                                    uint64_t, uint64_t);
+
+static void http_resolver_entry_delete(struct http_resolver_entry *);
+static void http_resolver_entry_copy(struct http_resolver_entry *,
+                                     struct http_address **, size_t *);
+static void http_resolver_entry_set(struct http_resolver_entry *,
+                                    const struct http_address *, size_t, int,
+                                    uint64_t, uint64_t);
+
+static void http_resolver_start_refresh(const char *, const char *, int,
+                                        uint64_t);
+static void *http_resolver_refresh_main(void *);
+
+static pthread_mutex_t http_resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct http_resolver_entry *http_resolver_cache[HTTP_RESOLVER_CACHE_SZ];
+static uint64_t http_resolver_cache_clock;
+
+int
+http_resolve(const char *host, const char *port, int family,
+             uint64_t ttl, uint64_t negative_ttl,
+             struct http_address **paddresses, size_t *p_nb_addresses) {
+    struct http_resolver_entry *entry;
+    struct http_address *addresses;
+    size_t nb_addresses;
+    bool refresh;
+    uint64_t now;
+    int ret, error;
+
+    if (ttl == 0 && negative_ttl == 0) {
+        return http_resolver_lookup(host, port, family,
+                                    paddresses, p_nb_addresses, &error);
+    }
+
+    if (http_now_ms(&now) == -1)
+        return -1;
+
+    addresses = NULL;
+    nb_addresses = 0;
+
+    refresh = false;
+    error = 0;
+
+    pthread_mutex_lock(&http_resolver_mutex);
+
+    entry = http_resolver_cache_get(host, port, family);
+    if (entry && now < entry->expiration_time) {
+        if (entry->error == 0) {
+            http_resolver_entry_copy(entry, paddresses, p_nb_addresses);
+
+            if (!entry->is_refreshing
+             && entry->expiration_time - now
+                < entry->ttl / HTTP_RESOLVER_REFRESH_RATIO) {
+                entry->is_refreshing = true;
+                refresh = true;
+            }
+        } else {
+            error = entry->error;
+        }
+    } else {
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock(&http_resolver_mutex);
+
+    if (entry) {
+        if (error != 0) {
+            http_set_error("cannot resolve address %s:%s: %s",
+                           host, port, gai_strerror(error));
+            return -1;
+        }
+
+        if (refresh)
+            http_resolver_start_refresh(host, port, family, ttl);
+
+        return 0;
+    }
+
+    ret = http_resolver_lookup(host, port, family,
+                               &addresses, &nb_addresses, &error);
+
+    /* Only failures of the resolution itself are cached, and only when the
+     * name server gave a definitive answer; temporary failures are retried
+     * by the next lookup. */
+    if (error != 0 && !http_resolver_error_is_definitive(error))
+        negative_ttl = 0;
+
+    if ((ret == 0 && ttl > 0) || (error != 0 && negative_ttl > 0)) {
+        pthread_mutex_lock(&http_resolver_mutex);
+        http_resolver_cache_add(host, port, family, addresses, nb_addresses,
+                                error, error ? negative_ttl : ttl, now);
+        pthread_mutex_unlock(&http_resolver_mutex);
+    }
+
+    if (ret == -1)
+        return -1;
+
+    *paddresses = addresses;
+    *p_nb_addresses = nb_addresses;
+    return 0;
+}
+
+int
+http_resolver_preferred_family(const char *host, const char *port,
+                                int family) {
+    struct http_resolver_entry *entry;
+    int preferred_family;
+
+    preferred_family = AF_UNSPEC;
+
+    pthread_mutex_lock(&http_resolver_mutex);
+
+    entry = http_resolver_cache_get(host, port, family);
+    if (entry)
+        preferred_family = entry->preferred_family;
+
+    pthread_mutex_unlock(&http_resolver_mutex);
+
+    return preferred_family;
+}
+
+void
+http_resolver_set_preferred_family(const char *host, const char *port,
+                                   int family, int preferred_family) {
+    struct http_resolver_entry *entry;
+
+    pthread_mutex_lock(&http_resolver_mutex);
+
+    entry = http_resolver_cache_get(host, port, family);
+    if (entry)
+        entry->preferred_family = preferred_family;
+
+    pthread_mutex_unlock(&http_resolver_mutex);
+}
+
+void
+http_client_clear_dns_cache(void) {
+    pthread_mutex_lock(&http_resolver_mutex);
+
+    for (size_t i = 0; i < HTTP_RESOLVER_CACHE_SZ; i++) {
+        http_resolver_entry_delete(http_resolver_cache[i]);
+        http_resolver_cache[i] = NULL;
+    }
+
+    pthread_mutex_unlock(&http_resolver_mutex);
+}
+
+static int
+http_resolver_lookup(const char *host, const char *port, int family,
+                     struct http_address **paddresses,
+                     size_t *p_nb_addresses, int *perror) {
+    struct http_address *addresses;
+    struct addrinfo hints, *res;
+    size_t nb_addresses;
+    int ret;
+
+    *perror = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_flags = 0;
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_addrlen = 0;
+
+    ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        http_set_error("cannot resolve address %s:%s: %s",
+                       host, port, gai_strerror(ret));
+        *perror = ret;
+        return -1;
+    }
+
+    nb_addresses = 0;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+        nb_addresses++;
+
+    addresses = http_calloc(nb_addresses, sizeof(struct http_address));
+
+    nb_addresses = 0;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        struct http_address *address;
+
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        address = addresses + nb_addresses;
+
+        memcpy(&address->addr, ai->ai_addr, ai->ai_addrlen);
+        address->addrlen = ai->ai_addrlen;
+
+        address->family = ai->ai_family;
+        address->socktype = ai->ai_socktype;
+        address->protocol = ai->ai_protocol;
+
+        /* The reverse resolution is the most expensive part, and is cached
+         * with the address. */
+        ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
+                          address->host, NI_MAXHOST, NULL, 0, 0);
+        if (ret != 0) {
+            http_set_error("cannot resolve address: %s", gai_strerror(ret));
+            freeaddrinfo(res);
+            http_free(addresses);
+            return -1;
+        }
+
+        ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
+                          address->numeric_host, NI_MAXHOST, NULL, 0,
+                          NI_NUMERICHOST);
+        if (ret != 0) {
+            http_set_error("cannot format address: %s", gai_strerror(ret));
+            freeaddrinfo(res);
+            http_free(addresses);
+            return -1;
+        }
+
+        nb_addresses++;
+    }
+
+    freeaddrinfo(res);
+
+    *paddresses = addresses;
+    *p_nb_addresses = nb_addresses;
+    return 0;
+}
+
+static bool
+http_resolver_error_is_definitive(int error) {
+    switch (error) {
+    case EAI_NONAME:
+#if defined(EAI_NODATA) && EAI_NODATA != EAI_NONAME
+    case EAI_NODATA:
+#endif
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static struct http_resolver_entry *
+http_resolver_cache_get(const char *host, const char *port, int family) {
+    for (size_t i = 0; i < HTTP_RESOLVER_CACHE_SZ; i++) {
+        struct http_resolver_entry *entry;
+
+        entry = http_resolver_cache[i];
+        if (!entry)
+            continue;
+
+        if (entry->family != family || strcmp(entry->host, host) != 0
+         || strcmp(entry->port, port) != 0) {
+            continue;
+        }
+
+        entry->last_use = ++http_resolver_cache_clock;
+        return entry;
+    }
+
+    return NULL;
+}
+
+static void
+http_resolver_cache_add(const char *host, const char *port, int family,
+                        const struct http_address *addresses,
+                        size_t nb_addresses, int error,
+                        uint64_t ttl, uint64_t now) {
+    struct http_resolver_entry *entry;
+    size_t idx;
+
+    entry = http_resolver_cache_get(host, port, family);
+    if (entry) {
+        http_resolver_entry_set(entry, addresses, nb_addresses, error,
+                                ttl, now);
+        return;
+    }
+
+    /* Use a free slot if there is one, or evict the least recently used
+     * entry. */
+    idx = 0;
+
+    for (size_t i = 0; i < HTTP_RESOLVER_CACHE_SZ; i++) {
+        if (!http_resolver_cache[i]) {
+            idx = i;
+            break;
+        }
+
+        if (http_resolver_cache[i]->last_use
+            < http_resolver_cache[idx]->last_use) {
+            idx = i;
+        }
+    }
+
+    http_resolver_entry_delete(http_resolver_cache[idx]);
+
+    entry = http_malloc0(sizeof(struct http_resolver_entry));
+
+    entry->host = http_strdup(host);
+    entry->port = http_strdup(port);
+    entry->family = family;
+
+    entry->preferred_family = AF_UNSPEC;
+
+    http_resolver_entry_set(entry, addresses, nb_addresses, error, ttl, now);
+
+    entry->last_use = ++http_resolver_cache_clock;
+
+    http_resolver_cache[idx] = entry;
+}
+
+static void
+http_resolver_entry_delete(struct http_resolver_entry *entry) {
+    if (!entry)
+        return;
+
+    http_free(entry->host);
+    http_free(entry->port);
+    http_free(entry->addresses);
+
+    memset(entry, 0, sizeof(struct http_resolver_entry));
+    http_free(entry);
+}
+
+static void
+http_resolver_entry_copy(struct http_resolver_entry *entry,
+                         struct http_address **paddresses,
+                         size_t *p_nb_addresses) {
+    struct http_address *addresses;
+    size_t nb_addresses;
+
+    nb_addresses = entry->nb_addresses;
+    addresses = http_calloc(nb_addresses, sizeof(struct http_address));
+
+    /* Each lookup starts with the next address, spreading connections
+     * over all the addresses of the host. */
+    for (size_t i = 0; i < nb_addresses; i++) {
+        addresses[i] =
+            entry->addresses[(entry->next_address + i) % nb_addresses];
+    }
+
+    if (nb_addresses > 0)
+        entry->next_address = (entry->next_address + 1) % nb_addresses;
+
+    *paddresses = addresses;
+    *p_nb_addresses = nb_addresses;
+}
+
+static void
+http_resolver_entry_set(struct http_resolver_entry *entry,
+                        const struct http_address *addresses,
+                        size_t nb_addresses, int error,
+                        uint64_t ttl, uint64_t now) {
+    http_free(entry->addresses);
+    entry->addresses = NULL;
+    entry->nb_addresses = 0;
+
+    if (error == 0) {
+        entry->addresses = http_calloc(nb_addresses,
+                                       sizeof(struct http_address));
+        memcpy(entry->addresses, addresses,
+               nb_addresses * sizeof(struct http_address));
+        entry->nb_addresses = nb_addresses;
+    }
+
+    /* The first lookup used the first address */
+    entry->next_address = (nb_addresses > 1) ? 1 : 0;
+
+    entry->error = error;
+
+    entry->ttl = ttl;
+    entry->expiration_time = now + ttl;
+}
+
+static void
+http_resolver_start_refresh(const char *host, const char *port, int family,
+                            uint64_t ttl) {
+    struct http_resolver_refresh *refresh;
+    struct http_resolver_entry *entry;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    refresh = http_malloc0(sizeof(struct http_resolver_refresh));
+
+    refresh->host = http_strdup(host);
+    refresh->port = http_strdup(port);
+    refresh->family = family;
+    refresh->ttl = ttl;
+
+    ret = pthread_attr_init(&attr);
+    if (ret == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, http_resolver_refresh_main,
+                             refresh);
+        pthread_attr_destroy(&attr);
+    }
+
+    if (ret == 0)
+        return;
+
+    /* The entry will simply expire */
+    pthread_mutex_lock(&http_resolver_mutex);
+
+    entry = http_resolver_cache_get(host, port, family);
+    if (entry)
+        entry->is_refreshing = false;
+
+    pthread_mutex_unlock(&http_resolver_mutex);
+
+    http_free(refresh->host);
+    http_free(refresh->port);
+    http_free(refresh);
+}
+
+static void *
+http_resolver_refresh_main(void *arg) {
+    struct http_resolver_refresh *refresh;
+    struct http_resolver_entry *entry;
+    struct http_address *addresses;
+    size_t nb_addresses;
+    uint64_t now;
+    int ret, error;
+
+    refresh = arg;
+
+    now = 0;
+
+    ret = http_resolver_lookup(refresh->host, refresh->port, refresh->family,
+                               &addresses, &nb_addresses, &error);
+    if (ret == 0 && http_now_ms(&now) == -1) {
+        http_free(addresses);
+        ret = -1;
+    }
+
+    pthread_mutex_lock(&http_resolver_mutex);
+
+    /* The entry may have been evicted in the meantime. If the resolution
+     * failed, the current addresses are used until they expire. */
+    entry = http_resolver_cache_get(refresh->host, refresh->port,
+                                    refresh->family);
+    if (entry) {
+        if (ret == 0) {
+            http_resolver_entry_set(entry, addresses, nb_addresses, 0,
+                                    refresh->ttl, now);
+        }
+
+        entry->is_refreshing = false;
+    }
+
+    pthread_mutex_unlock(&http_resolver_mutex);
+
+    if (ret == 0)
+        http_free(addresses);
+
+    http_free(refresh->host);
+    http_free(refresh->port);
+    http_free(refresh);
+
+    return NULL;
+}
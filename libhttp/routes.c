@@ -24,9 +24,11 @@ static bool http_route_matches_path(const struct http_route *, char **, size_t);
 static bool http_route_matches_request(const struct http_route *,
                                        enum http_method, char **, size_t,
                                        enum http_route_match_result *);
-static int http_route_cmp(const void *, const void *);
+static int http_route_cmp(const struct http_route *,
+                          const struct http_route *);
+static bool http_route_precedes(const struct http_route *,
+                                const struct http_route *);
 
-static void http_route_base_sort_routes(struct http_route_base *);
 
 static int http_path_parse(const char *, char ***, size_t *);
 static void http_path_free(char **, size_t);
@@ -72,7 +74,7 @@ http_route_components_parse(const char *path,
                 goto error;
             }
 
-            if (memcmp(start, "*", toklen) == 0) {
+            if (toklen == 1 && *start == '*') {
                 component.type = HTTP_ROUTE_COMPONENT_WILDCARD;
             } else if (*start == ':') {
                 component.type = HTTP_ROUTE_COMPONENT_NAMED;
@@ -178,6 +180,8 @@ http_route_delete(struct http_route *route) {
 
     http_route_options_free(&route->options);
 
+    http_route_limiter_delete(route->limiter);
+
     memset(route, 0, sizeof(struct http_route));
     http_free(route);
 }
@@ -191,6 +195,18 @@ http_route_apply_options(struct http_route *route,
     } else {
         http_route_options_init(&route->options, cfg);
     }
+
+    /* Coroutine handlers read the body themselves, and batch handlers are
+     * only called with complete requests. */
+    if (route->options.use_coroutine)
+        route->options.bufferize_body = false;
+    if (route->batch_handler)
+        route->options.bufferize_body = true;
+
+    if (route->options.max_concurrency > 0) {
+        route->limiter = http_route_limiter_new(route->options.max_concurrency,
+                                                route->options.queue_timeout);
+    }
 }
 
 struct http_route_base *
@@ -199,8 +215,6 @@ http_route_base_new(void) {
 
     base = http_malloc0(sizeof(struct http_route_base));
 
-    base->sorted = true;
-
     return base;
 }
 
@@ -220,12 +234,14 @@ http_route_base_delete(struct http_route_base *base) {
 void
 http_route_base_add_route(struct http_route_base *base,
                           struct http_route *route) {
+    size_t idx;
+
     assert(*route->path == '/');
 
     if (base->nb_routes == 0) {
         base->routes_sz = 1;
         base->routes = http_malloc(sizeof(struct http_route *));
-    } else {
+    } else if (base->nb_routes + 1 > base->routes_sz) {
         size_t nsz;
 
         base->routes_sz *= 2;
@@ -234,9 +250,21 @@ http_route_base_add_route(struct http_route_base *base,
         base->routes = http_realloc(base->routes, nsz);
     }
 
-    base->routes[base->nb_routes++] = route;
+    /* Routes are kept sorted so that looking up a route never modifies the
+     * route base, which can then be shared by several threads. */
+    idx = base->nb_routes;
+    for (size_t i = 0; i < base->nb_routes; i++) {
+        if (http_route_precedes(route, base->routes[i])) {
+            idx = i;
+            break;
+        }
+    }
+
+    memmove(base->routes + idx + 1, base->routes + idx,
+            (base->nb_routes - idx) * sizeof(struct http_route *));
+    base->routes[idx] = route;
 
-    base->sorted = false;
+    base->nb_routes++;
 }
 
 int
@@ -253,9 +281,6 @@ http_route_base_find_route(struct http_route_base *base,
     char **path_components;
     size_t nb_path_components, idx;
 
-    if (!base->sorted)
-        http_route_base_sort_routes(base);
-
     if (*path != '/') {
         *proute = NULL;
         *p_match_result = HTTP_ROUTE_MATCH_WRONG_PATH;
@@ -419,12 +444,7 @@ http_route_matches_request(const struct http_route *route,
 }
 
 static int
-http_route_cmp(const void *arg1, const void *arg2) {
-    const struct http_route *r1, *r2;
-
-    r1 = *(const struct http_route **)arg1;
-    r2 = *(const struct http_route **)arg2;
-
+http_route_cmp(const struct http_route *r1, const struct http_route *r2) {
     if (r1->nb_components > r2->nb_components) {
         return -1;
     } else if (r1->nb_components < r2->nb_components) {
@@ -451,12 +471,10 @@ http_route_cmp(const void *arg1, const void *arg2) {
     }
 }
 
-static void
-http_route_base_sort_routes(struct http_route_base *base) {
-    qsort(base->routes, base->nb_routes, sizeof(struct http_route *),
-          http_route_cmp);
-
-    base->sorted = true;
+static bool
+http_route_precedes(const struct http_route *r1, const struct http_route *r2) {
+    /* Routes which cannot be ordered stay in insertion order */
+    return http_route_cmp(r1, r2) < 0 && http_route_cmp(r2, r1) > 0;
 }
 
 static int
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -28,7 +29,60 @@
 #include "http.h"
 #include "internal.h"
 
+/* Maximum number of messages waiting to be processed by the event loop */
+#define HTTP_SERVER_MAILBOX_SZ 1024
+
+enum http_server_msg_type {
+    HTTP_SERVER_MSG_CONNECTION,
+    HTTP_SERVER_MSG_TASK,
+    HTTP_SERVER_MSG_CONNECTION_TASK,
+};
+
+struct http_server_msg {
+    enum http_server_msg_type type;
+
+    union {
+        struct {
+            int sock;
+            struct sockaddr_storage addr;
+            socklen_t addrlen;
+        } connection;
+
+        struct {
+            http_server_task fn;
+            void *arg;
+        } task;
+
+        struct {
+            int sock;
+            uint64_t generation;
+
+            http_connection_task fn;
+            void *arg;
+        } connection_task;
+    } u;
+};
+
+static int http_server_start_timeout_timer(struct http_server *);
+static int http_server_open_mailbox(struct http_server *);
+static void http_server_on_msg(void *, void *);
+static void http_server_discard_msg(struct http_server *,
+                                    const struct http_server_msg *);
 static void http_server_on_timeout_timer(evutil_socket_t, short, void *);
+static void http_server_update_idle_timeout(struct http_server *);
+static void http_server_close_idle_connection(struct http_server *);
+static void http_server_on_batch_event(evutil_socket_t, short, void *);
+
+static int http_server_start_workers(struct http_server *);
+static void http_server_dispatch_connection(struct http_server *, int,
+                                            const struct sockaddr_storage *,
+                                            socklen_t);
+static struct http_worker *http_server_select_worker(struct http_server *,
+                                                     int);
+static int http_server_incoming_node(const struct http_server *, int);
+
+static const struct ht_table *
+http_server_listeners(const struct http_server *);
 
 struct http_listener {
     struct http_server *server;
@@ -43,12 +97,19 @@ struct http_listener {
     char numeric_host_port[HTTP_HOST_PORT_BUFSZ];
 };
 
-static struct http_listener *http_listener_new(struct http_server *,
-                                               const struct addrinfo *);
+static struct http_listener *http_listener_new(struct http_server *, int);
 static void http_listener_delete(struct http_listener *);
 
+static int http_open_listening_socket(const struct http_cfg *,
+                                      const struct addrinfo *);
+
 static void http_listener_on_sock_event(evutil_socket_t, short, void *);
 
+static struct http_error_response *
+http_error_response_new(const struct http_cfg *, enum http_status_code,
+                        const char *, const char *, size_t);
+static void http_error_response_delete(struct http_error_response *);
+
 void
 http_route_options_init(struct http_route_options *options,
                         const struct http_cfg *cfg) {
@@ -93,10 +154,9 @@ http_route_options_default_header_set(struct http_route_options *options,
 
 struct http_server *
 http_server_new(struct http_cfg *cfg, struct event_base *ev_base) {
-    struct timeval tv;
     struct http_server *server;
-    struct addrinfo hints, *res;
-    int ret;
+    int *socks;
+    size_t nb_socks;
 
     server = http_malloc0(sizeof(struct http_server));
 
@@ -105,7 +165,6 @@ http_server_new(struct http_cfg *cfg, struct event_base *ev_base) {
     server->ev_base = ev_base;
 
     server->listeners = ht_table_new(ht_hash_int32, ht_equal_int32);
-    server->connections = ht_table_new(ht_hash_int32, ht_equal_int32);
 
     if (cfg->use_ssl) {
         const char *crt_path, *key_path;
@@ -141,26 +200,22 @@ http_server_new(struct http_cfg *cfg, struct event_base *ev_base) {
         }
     }
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_flags = 0;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_addrlen = 0;
-
-    ret = getaddrinfo(cfg->host, cfg->port, &hints, &res);
-    if (ret != 0) {
-        http_set_error("cannot resolve address %s:%s: %s",
-                       cfg->host, cfg->port, gai_strerror(ret));
-        goto error;
+    if (cfg->u.server.nb_listener_socks > 0) {
+        nb_socks = cfg->u.server.nb_listener_socks;
+        socks = http_calloc(nb_socks, sizeof(int));
+        memcpy(socks, cfg->u.server.listener_socks, nb_socks * sizeof(int));
+    } else {
+        if (http_server_open_listening_sockets(cfg, &socks, &nb_socks) == -1)
+            goto error;
     }
 
-    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    for (size_t i = 0; i < nb_socks; i++) {
         struct http_listener *listener;
 
-        listener = http_listener_new(server, ai);
+        listener = http_listener_new(server, socks[i]);
         if (!listener) {
             http_server_error(server, "%s", http_get_error());
+            close(socks[i]);
             continue;
         }
 
@@ -173,7 +228,7 @@ http_server_new(struct http_cfg *cfg, struct event_base *ev_base) {
         }
     }
 
-    freeaddrinfo(res);
+    http_free(socks);
 
     if (ht_table_nb_entries(server->listeners) == 0) {
         http_set_error("cannot listen on any address");
@@ -184,18 +239,15 @@ http_server_new(struct http_cfg *cfg, struct event_base *ev_base) {
     if (!server->route_base)
         goto error;
 
-    server->timeout_timer = evtimer_new(ev_base, http_server_on_timeout_timer,
-                                        server);
-    if (!server->timeout_timer) {
-        http_set_error("cannot create timer: %s", strerror(errno));
+    if (http_server_start_timeout_timer(server) == -1)
         goto error;
-    }
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 100 * 1000;
-    if (evtimer_add(server->timeout_timer, &tv) == -1) {
-        http_set_error("cannot start timer: %s", strerror(errno));
+    if (http_server_open_mailbox(server) == -1)
         goto error;
+
+    if (cfg->u.server.nb_workers > 0) {
+        if (http_server_start_workers(server) == -1)
+            goto error;
     }
 
     return server;
@@ -205,6 +257,33 @@ error:
     return NULL;
 }
 
+struct http_server *
+http_server_new_worker(struct http_server *main_server,
+                       struct http_worker *worker,
+                       struct event_base *ev_base) {
+    struct http_server *server;
+
+    server = http_malloc0(sizeof(struct http_server));
+
+    server->cfg = main_server->cfg;
+
+    server->ev_base = ev_base;
+
+    server->route_base = main_server->route_base;
+    server->ssl_ctx = main_server->ssl_ctx;
+
+    server->main_server = main_server;
+    server->worker = worker;
+
+    if (http_server_start_timeout_timer(server) == -1
+     || http_server_open_mailbox(server) == -1) {
+        http_server_delete(server);
+        return NULL;
+    }
+
+    return server;
+}
+
 void
 http_server_delete(struct http_server *server) {
     struct ht_table_iterator *it;
@@ -212,24 +291,52 @@ http_server_delete(struct http_server *server) {
     if (!server)
         return;
 
+    /* Stop worker threads first, they use resources of the main server,
+     * including the worker list */
+    for (size_t i = 0; i < server->nb_workers; i++)
+        http_worker_stop(server->workers[i]);
+    for (size_t i = 0; i < server->nb_workers; i++)
+        http_worker_join(server->workers[i]);
+
+    /* Closing a connection which holds a route slot hands the slot to a
+     * waiting connection, possibly of another worker, through the mailbox
+     * of its server. Waiting connections cancel their wait when they are
+     * closed, so once all connections are closed, no message can be sent
+     * anymore and mailboxes can be deleted. */
+    for (size_t i = 0; i < server->nb_workers; i++)
+        http_worker_close_connections(server->workers[i]);
+    http_server_close_connections(server);
+
+    for (size_t i = 0; i < server->nb_workers; i++)
+        http_worker_delete(server->workers[i]);
+    http_free(server->workers);
+    http_free(server->cpu_nodes);
+
+    if (server->mailbox) {
+        struct http_server_msg msg;
+
+        while (http_mailbox_receive(server->mailbox, &msg))
+            http_server_discard_msg(server, &msg);
+
+        http_mailbox_delete(server->mailbox);
+    }
+
     if (server->timeout_timer)
         event_free(server->timeout_timer);
 
-    http_route_base_delete(server->route_base);
-
-    it = ht_table_iterate(server->connections);
-    if (it) {
-        struct http_connection *connection;
+    if (server->ev_batch)
+        event_free(server->ev_batch);
 
-        while (ht_table_iterator_next(it, NULL, (void **)&connection) == 1)
-            http_connection_delete(connection);
-        ht_table_iterator_delete(it);
+    http_free(server->connections);
 
-        ht_table_delete(server->connections);
+    /* Connections use the limiters of their route */
+    if (!server->main_server)
+        http_route_base_delete(server->route_base);
 
-    }
+    if (!server->main_server)
+        http_coroutine_release_stacks();
 
-    it = ht_table_iterate(server->listeners);
+    it = server->listeners ? ht_table_iterate(server->listeners) : NULL;
     if (it) {
         struct http_listener *listener;
 
@@ -240,13 +347,137 @@ http_server_delete(struct http_server *server) {
         ht_table_delete(server->listeners);
     }
 
-    if (server->ssl_ctx)
+    if (server->ssl_ctx && !server->main_server)
         SSL_CTX_free(server->ssl_ctx);
 
+    for (size_t i = 0; i < HTTP_ARRAY_NB_ELEMENTS(server->error_responses); i++)
+        http_error_response_delete(server->error_responses[i]);
+
     memset(server, 0, sizeof(struct http_server));
     http_free(server);
 }
 
+void
+http_server_close_connections(struct http_server *server) {
+    struct http_connection *connection;
+
+    connection = server->connections_first;
+    while (connection) {
+        struct http_connection *next;
+
+        next = connection->next;
+
+        http_server_unregister_connection(server, connection);
+        http_connection_delete(connection);
+
+        connection = next;
+    }
+}
+
+int
+http_server_get_route_stats(struct http_server *server,
+                            enum http_method method, const char *path,
+                            struct http_route_stats *stats) {
+    struct http_route_base *base;
+
+    base = server->route_base;
+
+    for (size_t i = 0; i < base->nb_routes; i++) {
+        struct http_route *route;
+
+        route = base->routes[i];
+
+        if (route->method != method || strcmp(route->path, path) != 0)
+            continue;
+
+        if (!route->limiter) {
+            http_set_error("route has no concurrency limit");
+            return -1;
+        }
+
+        http_route_limiter_get_stats(route->limiter, stats);
+        return 0;
+    }
+
+    http_set_error("unknown route");
+    return -1;
+}
+
+int
+http_server_add_admin_route(struct http_server *server, const char *path) {
+    struct http_route_options options;
+    int ret;
+
+    http_route_options_init(&options, server->cfg);
+    options.use_coroutine = true;
+
+    ret = http_server_add_route(server, HTTP_GET, path,
+                                http_admin_on_request, &options);
+    http_route_options_free(&options);
+
+    return ret;
+}
+
+int
+http_server_post(struct http_server *server, http_server_task fn, void *arg) {
+    struct http_server_msg msg;
+
+    memset(&msg, 0, sizeof(struct http_server_msg));
+
+    msg.type = HTTP_SERVER_MSG_TASK;
+    msg.u.task.fn = fn;
+    msg.u.task.arg = arg;
+
+    return http_mailbox_send(server->mailbox, &msg);
+}
+
+int
+http_server_post_connection(struct http_server *server, int sock,
+                            const struct sockaddr_storage *addr,
+                            socklen_t addrlen) {
+    struct http_server_msg msg;
+
+    memset(&msg, 0, sizeof(struct http_server_msg));
+
+    msg.type = HTTP_SERVER_MSG_CONNECTION;
+    msg.u.connection.sock = sock;
+    memcpy(&msg.u.connection.addr, addr, addrlen);
+    msg.u.connection.addrlen = addrlen;
+
+    return http_mailbox_send(server->mailbox, &msg);
+}
+
+int
+http_server_stop_loop(struct http_server *server) {
+    return http_mailbox_close(server->mailbox);
+}
+
+void
+http_connection_get_handle(const struct http_connection *connection,
+                           struct http_connection_handle *handle) {
+    assert(connection->type == HTTP_CONNECTION_SERVER);
+
+    handle->server = connection->server;
+    handle->sock = connection->sock;
+    handle->generation = connection->generation;
+}
+
+int
+http_connection_post(const struct http_connection_handle *handle,
+                     http_connection_task fn, void *arg) {
+    struct http_server_msg msg;
+
+    memset(&msg, 0, sizeof(struct http_server_msg));
+
+    msg.type = HTTP_SERVER_MSG_CONNECTION_TASK;
+    msg.u.connection_task.sock = handle->sock;
+    msg.u.connection_task.generation = handle->generation;
+    msg.u.connection_task.fn = fn;
+    msg.u.connection_task.arg = arg;
+
+    return http_mailbox_send(handle->server->mailbox, &msg);
+}
+
 void
 http_server_set_msg_handler_arg(struct http_server *server, void *arg) {
     server->route_base->msg_handler_arg = arg;
@@ -268,6 +499,109 @@ http_server_add_route(struct http_server *server,
     return 0;
 }
 
+int
+http_server_add_batch_route(struct http_server *server,
+                            enum http_method method, const char *path,
+                            http_batch_handler batch_handler,
+                            const struct http_route_options *options) {
+    struct http_route *route;
+
+    route = http_route_new(method, path, NULL);
+    if (!route)
+        return -1;
+
+    route->batch_handler = batch_handler;
+
+    http_route_apply_options(route, options, server->cfg);
+    http_route_base_add_route(server->route_base, route);
+    return 0;
+}
+
+int
+http_server_set_error_body(struct http_server *server,
+                           enum http_status_code status_code,
+                           const char *content_type,
+                           const char *body, size_t bodysz) {
+    struct http_error_response *response;
+    size_t idx;
+
+    if (status_code < HTTP_ERROR_RESPONSE_MIN_STATUS
+     || status_code > HTTP_ERROR_RESPONSE_MAX_STATUS) {
+        http_set_error("status code %d is not an error status code",
+                       status_code);
+        return -1;
+    }
+
+    response = http_error_response_new(server->cfg, status_code,
+                                       content_type, body, bodysz);
+    if (!response)
+        return -1;
+
+    response->is_custom = true;
+
+    idx = (size_t)(status_code - HTTP_ERROR_RESPONSE_MIN_STATUS);
+
+    http_error_response_delete(server->error_responses[idx]);
+    server->error_responses[idx] = response;
+
+    return 0;
+}
+
+const struct http_error_response *
+http_server_error_response(struct http_server *server,
+                           enum http_status_code status_code) {
+    struct http_error_response *response;
+    const char *reason_phrase;
+    char *body;
+    size_t idx;
+    int ret;
+
+    if (status_code < HTTP_ERROR_RESPONSE_MIN_STATUS
+     || status_code > HTTP_ERROR_RESPONSE_MAX_STATUS) {
+        return NULL;
+    }
+
+    idx = (size_t)(status_code - HTTP_ERROR_RESPONSE_MIN_STATUS);
+
+    /* Custom responses are registered on the main server */
+    if (server->main_server) {
+        response = server->main_server->error_responses[idx];
+        if (response && response->is_custom)
+            return response;
+    }
+
+    response = server->error_responses[idx];
+    if (response && response->is_custom)
+        return response;
+
+    /* Only the default error sender can be replaced by a pre-rendered
+     * response. */
+    if (server->cfg->u.server.error_sender != http_default_error_sender)
+        return NULL;
+
+    if (response)
+        return response;
+
+    reason_phrase = http_status_code_to_reason_phrase(status_code);
+    if (!reason_phrase)
+        return NULL;
+
+    ret = http_asprintf(&body, "<h1>%d %s</h1>\n",
+                        status_code, reason_phrase);
+    if (ret == -1)
+        return NULL;
+
+    response = http_error_response_new(server->cfg, status_code,
+                                       "text/html", body, (size_t)ret);
+    http_free(body);
+
+    if (!response)
+        return NULL;
+
+    server->error_responses[idx] = response;
+    return response;
+}
+
 int http_default_error_sender(struct http_connection *connection,
                               enum http_status_code status_code,
                               struct http_headers *headers,
@@ -341,7 +675,7 @@ http_server_does_listen_on(const struct http_server *server,
     struct ht_table_iterator *it;
     bool found;
 
-    it = ht_table_iterate(server->listeners);
+    it = ht_table_iterate(http_server_listeners(server));
     if (!it) {
         http_server_error(server, "cannot iterate on listeners: %s",
                           ht_get_error());
@@ -369,7 +703,7 @@ http_server_does_listen_on_host_string(const struct http_server *server,
     struct ht_table_iterator *it;
     bool found;
 
-    it = ht_table_iterate(server->listeners);
+    it = ht_table_iterate(http_server_listeners(server));
     if (!it) {
         http_server_error(server, "cannot iterate on listeners: %s",
                           ht_get_error());
@@ -396,193 +730,199 @@ http_server_register_connection(struct http_server *server,
                                 struct http_connection *connection) {
     assert(connection->sock >= 0);
 
-    ht_table_insert(server->connections, HT_INT32_TO_POINTER(connection->sock),
-                    connection);
-}
-
-void
-http_server_unregister_connection(struct http_server *server,
-                                  struct http_connection *connection) {
-    assert(connection->sock >= 0);
+    /* Socket numbers are reused: the generation lets handles detect that
+     * the connection they refer to has been closed. */
+    connection->generation = ++server->last_connection_generation;
 
-    ht_table_remove(server->connections,
-                    HT_INT32_TO_POINTER(connection->sock));
-}
+    if ((size_t)connection->sock >= server->connections_sz) {
+        size_t old_sz, nsz;
 
-static void
-http_server_on_timeout_timer(evutil_socket_t fd, short events, void *arg) {
-    struct ht_table_iterator *it;
-    struct http_server *server;
-    struct timeval tv;
-    uint64_t now;
+        old_sz = server->connections_sz;
 
-    server = arg;
+        nsz = (old_sz > 0) ? old_sz : 64;
+        while (nsz <= (size_t)connection->sock)
+            nsz *= 2;
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 500 * 1000;
-    if (evtimer_add(server->timeout_timer, &tv) == -1)
-        http_server_error(server, "cannot start timer: %s", strerror(errno));
+        server->connections =
+            http_realloc(server->connections,
+                         nsz * sizeof(struct http_connection *));
+        memset(server->connections + old_sz, 0,
+               (nsz - old_sz) * sizeof(struct http_connection *));
 
-    if (http_now_ms(&now) == -1) {
-        http_server_error(server, "%s", http_get_error());
-        return;
+        server->connections_sz = nsz;
     }
 
-    it = ht_table_iterate(server->connections);
-    if (it) {
-        struct http_connection *connection;
+    assert(!server->connections[connection->sock]);
+    server->connections[connection->sock] = connection;
 
-        while (ht_table_iterator_next(it, NULL, (void **)&connection) == 1)
-            http_connection_check_for_timeout(connection, now);
+    connection->prev = server->connections_last;
+    connection->next = NULL;
 
-        ht_table_iterator_delete(it);
-    }
+    if (server->connections_last)
+        server->connections_last->next = connection;
+    server->connections_last = connection;
+
+    if (!server->connections_first)
+        server->connections_first = connection;
+
+    server->nb_connections++;
 }
 
-static struct http_listener *
-http_listener_new(struct http_server *server, const struct addrinfo *ai) {
-    struct http_listener *listener;
-    struct http_cfg *cfg;
-    int ret, opt;
+int
+http_server_add_batch_request(struct http_server *server,
+                              struct http_connection *connection) {
+    assert(!connection->waits_for_batch);
+
+    if (!server->ev_batch) {
+        server->ev_batch = event_new(server->ev_base, -1, 0,
+                                     http_server_on_batch_event, server);
+        if (!server->ev_batch) {
+            http_set_error("cannot create batch event: %s", strerror(errno));
+            return -1;
+        }
+    }
 
-    listener = http_malloc(sizeof(struct http_listener));
-    memset(listener, 0, sizeof(struct http_listener));
+    /* Activating the event puts it at the end of the list of active
+     * events: it runs after the events already triggered during this
+     * iteration, e.g. reads on other connections. */
+    if (!server->batch_first)
+        event_active(server->ev_batch, 0, 0);
 
-    listener->server = server;
+    connection->batch_prev = server->batch_last;
+    connection->batch_next = NULL;
 
-    cfg = server->cfg;
+    if (server->batch_last)
+        server->batch_last->batch_next = connection;
+    server->batch_last = connection;
 
-    listener->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (listener->sock == -1) {
-        http_set_error("cannot create socket: %s", strerror(errno));
-        goto error;
-    }
+    if (!server->batch_first)
+        server->batch_first = connection;
 
-    opt = 1;
-    if (setsockopt(listener->sock, SOL_SOCKET, SO_REUSEADDR,
-                   &opt, sizeof(opt)) == -1) {
-        http_set_error("cannot set SO_REUSEADDR socket option: %s",
-                       strerror(errno));
-        goto error;
-    }
+    connection->waits_for_batch = true;
+    return 0;
+}
 
-    if (bind(listener->sock, ai->ai_addr, ai->ai_addrlen) == -1) {
-        http_set_error("cannot bind socket: %s", strerror(errno));
-        goto error;
-    }
+void
+http_server_remove_batch_request(struct http_server *server,
+                                 struct http_connection *connection) {
+    assert(connection->waits_for_batch);
 
-    if (listen(listener->sock, cfg->u.server.connection_backlog) == -1) {
-        http_set_error("cannot listen on socket: %s", strerror(errno));
-        goto error;
-    }
+    if (connection->batch_prev)
+        connection->batch_prev->batch_next = connection->batch_next;
+    if (connection->batch_next)
+        connection->batch_next->batch_prev = connection->batch_prev;
 
-    ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-                      listener->numeric_host, NI_MAXHOST,
-                      listener->port, NI_MAXSERV,
-                      NI_NUMERICHOST | NI_NUMERICSERV);
-    if (ret != 0) {
-        http_set_error("cannot resolve address: %s", gai_strerror(ret));
-        goto error;
-    }
+    if (server->batch_first == connection)
+        server->batch_first = connection->batch_next;
+    if (server->batch_last == connection)
+        server->batch_last = connection->batch_prev;
 
-    ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-                      listener->host, NI_MAXHOST,
-                      NULL, 0,
-                      0);
-    if (ret != 0) {
-        http_set_error("cannot resolve address: %s", gai_strerror(ret));
-        goto error;
-    }
+    connection->batch_prev = NULL;
+    connection->batch_next = NULL;
 
-    snprintf(listener->host_port, HTTP_HOST_PORT_BUFSZ,
-             "%s:%s", listener->host, listener->port);
+    connection->waits_for_batch = false;
+}
 
-    if (ai->ai_family == AF_INET) {
-        snprintf(listener->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
-                 "%s:%s", listener->numeric_host, listener->port);
-    } else if (ai->ai_family == AF_INET6) {
-        snprintf(listener->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
-                 "[%s]:%s", listener->numeric_host, listener->port);
-    } else {
-        http_set_error("unknown address family %d", ai->ai_family);
-        goto error;
-    }
+void
+http_server_add_idle_connection(struct http_server *server,
+                                struct http_connection *connection) {
+    assert(!connection->is_idle);
 
-    listener->ev_sock = event_new(server->ev_base, listener->sock,
-                                  EV_READ | EV_PERSIST,
-                                  http_listener_on_sock_event,
-                                  listener);
-    if (!listener->ev_sock) {
-        http_set_error("cannot create read event: %s", strerror(errno));
-        goto error;
-    }
+    connection->idle_prev = server->idle_last;
+    connection->idle_next = NULL;
 
-    if (event_add(listener->ev_sock, NULL) == -1) {
-        http_set_error("cannot add read event: %s", strerror(errno));
-        goto error;
-    }
+    if (server->idle_last)
+        server->idle_last->idle_next = connection;
+    server->idle_last = connection;
 
-    http_server_trace(listener->server, "listening on %s (%s)",
-                      listener->numeric_host_port, listener->host_port);
-    return listener;
+    if (!server->idle_first)
+        server->idle_first = connection;
 
-error:
-    http_listener_delete(listener);
-    return NULL;
+    connection->is_idle = true;
 }
 
-static void
-http_listener_delete(struct http_listener *listener) {
-    if (!listener)
-        return;
+void
+http_server_remove_idle_connection(struct http_server *server,
+                                   struct http_connection *connection) {
+    assert(connection->is_idle);
 
-    if (listener->ev_sock)
-        event_free(listener->ev_sock);
+    if (connection->idle_prev)
+        connection->idle_prev->idle_next = connection->idle_next;
+    if (connection->idle_next)
+        connection->idle_next->idle_prev = connection->idle_prev;
 
-    if (listener->sock >= 0)
-        close(listener->sock);
-    listener->sock = -1;
+    if (server->idle_first == connection)
+        server->idle_first = connection->idle_next;
+    if (server->idle_last == connection)
+        server->idle_last = connection->idle_prev;
 
-    memset(listener, 0, sizeof(struct http_listener));
-    http_free(listener);
+    connection->idle_prev = NULL;
+    connection->idle_next = NULL;
+
+    connection->is_idle = false;
 }
 
-static void
-http_listener_on_sock_event(evutil_socket_t sock, short events, void *arg) {
-    struct http_server *server;
-    struct http_listener *listener;
+void
+http_server_unregister_connection(struct http_server *server,
+                                  struct http_connection *connection) {
+    assert(connection->sock >= 0);
+
+    /* The connection may have been discarded before being registered */
+    if (http_server_find_connection(server, connection->sock) == connection) {
+        server->connections[connection->sock] = NULL;
+
+        if (connection->prev)
+            connection->prev->next = connection->next;
+        if (connection->next)
+            connection->next->prev = connection->prev;
+
+        if (server->connections_first == connection)
+            server->connections_first = connection->next;
+        if (server->connections_last == connection)
+            server->connections_last = connection->prev;
+
+        connection->prev = NULL;
+        connection->next = NULL;
+
+        server->nb_connections--;
+    }
+
+    if (server->worker)
+        http_worker_on_connection_closed(server->worker);
+}
+
+struct http_connection *
+http_server_find_connection(struct http_server *server, int sock) {
+    if (sock < 0 || (size_t)sock >= server->connections_sz)
+        return NULL;
+
+    return server->connections[sock];
+}
+
+void
+http_server_accept_connection(struct http_server *server, int sock,
+                              const struct sockaddr_storage *addr,
+                              socklen_t addrlen) {
     struct http_connection *connection;
-    struct http_cfg *cfg;
+    const struct http_cfg *cfg;
     char host[NI_MAXHOST];
     char port[NI_MAXSERV];
-    struct sockaddr_storage addr;
-    socklen_t addrlen;
-    int client_sock;
     int ret;
 
-    listener = arg;
-    server = listener->server;
-
     cfg = server->cfg;
 
-    addrlen = sizeof(struct sockaddr_storage);
-    client_sock = accept(listener->sock, (struct sockaddr *)&addr, &addrlen);
-    if (client_sock == -1) {
-        http_server_error(server, "cannot accept connection: %s",
-                          strerror(errno));
-        return;
-    }
-
-    connection = http_connection_new(HTTP_CONNECTION_SERVER, server,
-                                     client_sock);
+    connection = http_connection_new(HTTP_CONNECTION_SERVER, server, sock);
     if (!connection) {
         http_server_error(server, "cannot create connection: %s",
                           http_get_error());
         close(sock);
+
+        if (server->worker)
+            http_worker_on_connection_closed(server->worker);
         return;
     }
 
-    ret = getnameinfo((struct sockaddr *)&addr, addrlen,
+    ret = getnameinfo((const struct sockaddr *)addr, addrlen,
                       host, NI_MAXHOST,
                       port, NI_MAXSERV,
                       NI_NUMERICHOST | NI_NUMERICSERV);
@@ -593,15 +933,15 @@ http_listener_on_sock_event(evutil_socket_t sock, short events, void *arg) {
         return;
     }
 
-    if (addr.ss_family == AF_INET) {
+    if (addr->ss_family == AF_INET) {
         snprintf(connection->address, HTTP_HOST_PORT_BUFSZ,
                  "%s:%s", host, port);
-    } else if (addr.ss_family == AF_INET6) {
+    } else if (addr->ss_family == AF_INET6) {
         snprintf(connection->address, HTTP_HOST_PORT_BUFSZ,
                  "[%s]:%s", host, port);
     } else {
         http_server_error(server, "unknown address family %d",
-                          addr.ss_family);
+                          addr->ss_family);
         http_connection_discard(connection);
         return;
     }
@@ -616,4 +956,780 @@ http_listener_on_sock_event(evutil_socket_t sock, short events, void *arg) {
     }
 
     http_server_register_connection(server, connection);
+
+    /* The new connection is the most recently idle one, it is not the one
+     * closed to make room. */
+    if (cfg->u.server.max_connections > 0) {
+        const struct http_server *main_server;
+
+        main_server = server->main_server ? server->main_server : server;
+
+        if (http_server_nb_connections(main_server)
+            > cfg->u.server.max_connections) {
+            http_server_close_idle_connection(server);
+        }
+    }
+
+    http_connection_update_idle_state(connection);
+}
+
+int
+http_server_open_listening_sockets(const struct http_cfg *cfg,
+                                   int **psocks, size_t *p_nb_socks) {
+    struct addrinfo hints, *res;
+    int *socks;
+    size_t nb_socks;
+    int ret;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_flags = 0;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_addrlen = 0;
+
+    ret = getaddrinfo(cfg->host, cfg->port, &hints, &res);
+    if (ret != 0) {
+        http_set_error("cannot resolve address %s:%s: %s",
+                       cfg->host, cfg->port, gai_strerror(ret));
+        return -1;
+    }
+
+    nb_socks = 0;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+        nb_socks++;
+
+    socks = http_calloc(nb_socks, sizeof(int));
+    nb_socks = 0;
+
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        int sock;
+
+        sock = http_open_listening_socket(cfg, ai);
+        if (sock == -1) {
+            if (cfg->error_hook)
+                cfg->error_hook(http_get_error(), cfg->hook_arg);
+            continue;
+        }
+
+        socks[nb_socks++] = sock;
+    }
+
+    freeaddrinfo(res);
+
+    if (nb_socks == 0) {
+        http_free(socks);
+        http_set_error("cannot listen on any address");
+        return -1;
+    }
+
+    *psocks = socks;
+    *p_nb_socks = nb_socks;
+    return 0;
+}
+
+void
+http_server_stop_listening(struct http_server *server) {
+    struct ht_table_iterator *it;
+    struct http_listener *listener;
+
+    it = ht_table_iterate(server->listeners);
+    if (!it) {
+        http_server_error(server, "cannot iterate on listeners: %s",
+                          ht_get_error());
+        return;
+    }
+
+    while (ht_table_iterator_next(it, NULL, (void **)&listener) == 1)
+        http_listener_delete(listener);
+    ht_table_iterator_delete(it);
+
+    ht_table_delete(server->listeners);
+    server->listeners = ht_table_new(ht_hash_int32, ht_equal_int32);
+}
+
+size_t
+http_server_nb_connections(const struct http_server *server) {
+    size_t nb_connections;
+
+    nb_connections = server->nb_connections;
+
+    for (size_t i = 0; i < server->nb_workers; i++)
+        nb_connections += http_worker_nb_connections(server->workers[i]);
+
+    return nb_connections;
+}
+
+static int
+http_server_start_timeout_timer(struct http_server *server) {
+    struct timeval tv;
+
+    server->timeout_timer = evtimer_new(server->ev_base,
+                                        http_server_on_timeout_timer, server);
+    if (!server->timeout_timer) {
+        http_set_error("cannot create timer: %s", strerror(errno));
+        return -1;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 100 * 1000;
+    if (evtimer_add(server->timeout_timer, &tv) == -1) {
+        http_set_error("cannot start timer: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+http_server_on_timeout_timer(evutil_socket_t fd, short events, void *arg) {
+    struct http_connection *connection;
+    struct http_server *server;
+    struct timeval tv;
+    size_t buffered_data;
+    uint64_t now;
+
+    server = arg;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 500 * 1000;
+    if (evtimer_add(server->timeout_timer, &tv) == -1)
+        http_server_error(server, "cannot start timer: %s", strerror(errno));
+
+    if (http_now_ms(&now) == -1) {
+        http_server_error(server, "%s", http_get_error());
+        return;
+    }
+
+    http_server_update_idle_timeout(server);
+
+    buffered_data = 0;
+
+    /* Checking a connection may close it */
+    connection = server->connections_first;
+    while (connection) {
+        struct http_connection *next;
+
+        next = connection->next;
+
+        buffered_data += http_connection_buffered_size(connection);
+        http_connection_check_for_timeout(connection, now);
+
+        connection = next;
+    }
+
+    __atomic_store_n(&server->buffered_data, buffered_data, __ATOMIC_RELAXED);
+}
+
+static void
+http_server_update_idle_timeout(struct http_server *server) {
+    const struct http_server *main_server;
+    const struct http_cfg *cfg;
+    uint64_t timeout, min_timeout;
+    size_t max_connections, max_buffered_data;
+    size_t pressure;
+
+    cfg = server->cfg;
+    main_server = server->main_server ? server->main_server : server;
+
+    max_connections = cfg->u.server.max_connections;
+    max_buffered_data = cfg->u.server.max_buffered_data;
+
+    /* The pressure is the usage of the most used resource, in percents */
+    pressure = 0;
+
+    if (max_connections > 0) {
+        size_t nb_connections;
+
+        nb_connections = http_server_nb_connections(main_server);
+        pressure = MAX(pressure, nb_connections * 100 / max_connections);
+    }
+
+    if (max_buffered_data > 0) {
+        size_t buffered_data;
+
+        buffered_data = __atomic_load_n(&main_server->buffered_data,
+                                        __ATOMIC_RELAXED);
+        for (size_t i = 0; i < main_server->nb_workers; i++) {
+            const struct http_server *worker_server;
+
+            worker_server = http_worker_server(main_server->workers[i]);
+            buffered_data += __atomic_load_n(&worker_server->buffered_data,
+                                             __ATOMIC_RELAXED);
+        }
+
+        pressure = MAX(pressure, buffered_data * 100 / max_buffered_data);
+    }
+
+    /* The idle timeout decreases linearly from half of the limits */
+    timeout = cfg->connection_timeout;
+    min_timeout = MIN(cfg->u.server.min_idle_timeout, timeout);
+
+    if (pressure > 50) {
+        pressure = MIN(pressure, (size_t)100);
+        timeout -= (timeout - min_timeout) * (pressure - 50) / 50;
+    }
+
+    server->idle_timeout = timeout;
+}
+
+static void
+http_server_on_batch_event(evutil_socket_t fd, short events, void *arg) {
+    struct http_connection **batch, **connections, **group;
+    const struct http_msg **msgs;
+    struct http_connection *connection;
+    struct http_server *server;
+    size_t nb_connections;
+    void *handler_arg;
+
+    server = arg;
+
+    /* Requests completed while handlers run (e.g. pipelined requests read
+     * once a connection is released) go to the next batch. */
+    nb_connections = 0;
+    for (connection = server->batch_first; connection;
+         connection = connection->batch_next) {
+        nb_connections++;
+    }
+
+    if (nb_connections == 0)
+        return;
+
+    batch = http_calloc(nb_connections, sizeof(struct http_connection *));
+    connections = http_calloc(nb_connections, sizeof(struct http_connection *));
+    group = http_calloc(nb_connections, sizeof(struct http_connection *));
+    msgs = http_calloc(nb_connections, sizeof(struct http_msg *));
+
+    /* Handlers can close any connection of the batch, including ones of
+     * other groups; connections are only discarded once all handlers
+     * returned. */
+    for (size_t i = 0; i < nb_connections; i++) {
+        connection = server->batch_first;
+        http_server_remove_batch_request(server, connection);
+
+        connection->in_batch = true;
+
+        batch[i] = connection;
+        connections[i] = connection;
+    }
+
+    handler_arg = server->route_base->msg_handler_arg;
+
+    /* Requests are grouped by route, in the order they were received */
+    for (size_t i = 0; i < nb_connections; i++) {
+        const struct http_route *route;
+        size_t group_sz;
+
+        if (!connections[i])
+            continue;
+
+        route = connections[i]->current_route;
+
+        group_sz = 0;
+        for (size_t j = i; j < nb_connections; j++) {
+            if (connections[j] && connections[j]->discard_deferred) {
+                connections[j] = NULL;
+                continue;
+            }
+
+            if (connections[j] && connections[j]->current_route == route) {
+                group[group_sz] = connections[j];
+                msgs[group_sz] = connections[j]->current_msg;
+                group_sz++;
+
+                connections[j] = NULL;
+            }
+        }
+
+        if (group_sz == 0)
+            continue;
+
+        route->batch_handler(group, msgs, group_sz, handler_arg);
+
+        for (size_t j = 0; j < group_sz; j++) {
+            if (!group[j]->discard_deferred)
+                http_connection_on_batch_processed(group[j]);
+        }
+    }
+
+    for (size_t i = 0; i < nb_connections; i++) {
+        connection = batch[i];
+
+        connection->in_batch = false;
+
+        if (connection->discard_deferred) {
+            connection->discard_deferred = false;
+            http_connection_discard(connection);
+        }
+    }
+
+    http_free(batch);
+    http_free(connections);
+    http_free(group);
+    http_free(msgs);
+}
+
+static void
+http_server_close_idle_connection(struct http_server *server) {
+    struct http_connection *connection;
+
+    connection = server->idle_first;
+    if (!connection)
+        return;
+
+    http_connection_trace(connection, "closing idle connection");
+
+    if (http_connection_shutdown(connection) == -1) {
+        http_connection_error(connection, "cannot shutdown connection: %s",
+                              http_get_error());
+    }
+}
+
+static struct http_listener *
+http_listener_new(struct http_server *server, int sock) {
+    struct http_listener *listener;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int flags, ret;
+
+    listener = http_malloc(sizeof(struct http_listener));
+    memset(listener, 0, sizeof(struct http_listener));
+
+    listener->server = server;
+    listener->sock = sock;
+
+    /* Listening sockets can be shared between processes which all wake up
+     * when a connection arrives; only one of them gets it, and the others
+     * must not block in accept(). */
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        http_set_error("cannot set socket non-blocking: %s",
+                       strerror(errno));
+        goto error;
+    }
+
+    addrlen = sizeof(struct sockaddr_storage);
+    if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) == -1) {
+        http_set_error("cannot get socket address: %s", strerror(errno));
+        goto error;
+    }
+
+    ret = getnameinfo((struct sockaddr *)&addr, addrlen,
+                      listener->numeric_host, NI_MAXHOST,
+                      listener->port, NI_MAXSERV,
+                      NI_NUMERICHOST | NI_NUMERICSERV);
+    if (ret != 0) {
+        http_set_error("cannot resolve address: %s", gai_strerror(ret));
+        goto error;
+    }
+
+    ret = getnameinfo((struct sockaddr *)&addr, addrlen,
+                      listener->host, NI_MAXHOST,
+                      NULL, 0,
+                      0);
+    if (ret != 0) {
+        http_set_error("cannot resolve address: %s", gai_strerror(ret));
+        goto error;
+    }
+
+    snprintf(listener->host_port, HTTP_HOST_PORT_BUFSZ,
+             "%s:%s", listener->host, listener->port);
+
+    if (addr.ss_family == AF_INET) {
+        snprintf(listener->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
+                 "%s:%s", listener->numeric_host, listener->port);
+    } else if (addr.ss_family == AF_INET6) {
+        snprintf(listener->numeric_host_port, HTTP_HOST_PORT_BUFSZ,
+                 "[%s]:%s", listener->numeric_host, listener->port);
+    } else {
+        http_set_error("unknown address family %d", addr.ss_family);
+        goto error;
+    }
+
+    listener->ev_sock = event_new(server->ev_base, listener->sock,
+                                  EV_READ | EV_PERSIST,
+                                  http_listener_on_sock_event,
+                                  listener);
+    if (!listener->ev_sock) {
+        http_set_error("cannot create read event: %s", strerror(errno));
+        goto error;
+    }
+
+    if (event_add(listener->ev_sock, NULL) == -1) {
+        http_set_error("cannot add read event: %s", strerror(errno));
+        goto error;
+    }
+
+    http_server_trace(listener->server, "listening on %s (%s)",
+                      listener->numeric_host_port, listener->host_port);
+    return listener;
+
+error:
+    /* The socket is owned by the caller until the listener is created */
+    listener->sock = -1;
+    http_listener_delete(listener);
+    return NULL;
+}
+
+static void
+http_listener_delete(struct http_listener *listener) {
+    if (!listener)
+        return;
+
+    if (listener->ev_sock)
+        event_free(listener->ev_sock);
+
+    if (listener->sock >= 0)
+        close(listener->sock);
+    listener->sock = -1;
+
+    memset(listener, 0, sizeof(struct http_listener));
+    http_free(listener);
+}
+
+static int
+http_open_listening_socket(const struct http_cfg *cfg,
+                           const struct addrinfo *ai) {
+    int sock, opt;
+
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock == -1) {
+        http_set_error("cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                   &opt, sizeof(opt)) == -1) {
+        http_set_error("cannot set SO_REUSEADDR socket option: %s",
+                       strerror(errno));
+        goto error;
+    }
+
+    if (bind(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
+        http_set_error("cannot bind socket: %s", strerror(errno));
+        goto error;
+    }
+
+    if (listen(sock, cfg->u.server.connection_backlog) == -1) {
+        http_set_error("cannot listen on socket: %s", strerror(errno));
+        goto error;
+    }
+
+    return sock;
+
+error:
+    close(sock);
+    return -1;
+}
+
+static int
+http_server_open_mailbox(struct http_server *server) {
+    server->mailbox = http_mailbox_new(server->ev_base,
+                                       HTTP_SERVER_MAILBOX_SZ,
+                                       sizeof(struct http_server_msg),
+                                       http_server_on_msg, server);
+    if (!server->mailbox)
+        return -1;
+
+    return 0;
+}
+
+static void
+http_server_on_msg(void *msg_, void *arg) {
+    struct http_server_msg *msg;
+    struct http_connection *connection;
+    struct http_server *server;
+
+    msg = msg_;
+    server = arg;
+
+    switch (msg->type) {
+    case HTTP_SERVER_MSG_CONNECTION:
+        http_server_accept_connection(server, msg->u.connection.sock,
+                                      &msg->u.connection.addr,
+                                      msg->u.connection.addrlen);
+        break;
+
+    case HTTP_SERVER_MSG_TASK:
+        msg->u.task.fn(server, msg->u.task.arg);
+        break;
+
+    case HTTP_SERVER_MSG_CONNECTION_TASK:
+        connection = http_server_find_connection(server,
+                                                 msg->u.connection_task.sock);
+        if (connection
+         && connection->generation != msg->u.connection_task.generation) {
+            connection = NULL;
+        }
+
+        msg->u.connection_task.fn(connection, msg->u.connection_task.arg);
+        break;
+    }
+}
+
+static void
+http_server_discard_msg(struct http_server *server,
+                        const struct http_server_msg *msg) {
+    switch (msg->type) {
+    case HTTP_SERVER_MSG_CONNECTION:
+        close(msg->u.connection.sock);
+        break;
+
+    case HTTP_SERVER_MSG_TASK:
+        break;
+
+    case HTTP_SERVER_MSG_CONNECTION_TASK:
+        msg->u.connection_task.fn(NULL, msg->u.connection_task.arg);
+        break;
+    }
+}
+
+static void
+http_listener_on_sock_event(evutil_socket_t sock, short events, void *arg) {
+    struct http_server *server;
+    struct http_listener *listener;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int client_sock;
+#ifdef HTTP_PLATFORM_FREEBSD
+    int flags;
+#endif
+
+    listener = arg;
+    server = listener->server;
+
+    addrlen = sizeof(struct sockaddr_storage);
+    client_sock = accept(listener->sock, (struct sockaddr *)&addr, &addrlen);
+    if (client_sock == -1) {
+        /* Another process sharing the socket took the connection, or the
+         * client went away before we accepted it */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+            return;
+
+        http_server_error(server, "cannot accept connection: %s",
+                          strerror(errno));
+        return;
+    }
+
+#ifdef HTTP_PLATFORM_FREEBSD
+    /* Accepted sockets inherit O_NONBLOCK from the listening socket on
+     * FreeBSD; connections use blocking sockets. */
+    flags = fcntl(client_sock, F_GETFL, 0);
+    if (flags == -1
+     || fcntl(client_sock, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        http_server_error(server, "cannot set socket blocking: %s",
+                          strerror(errno));
+        close(client_sock);
+        return;
+    }
+#endif
+
+    if (server->nb_workers > 0) {
+        http_server_dispatch_connection(server, client_sock, &addr, addrlen);
+    } else {
+        http_server_accept_connection(server, client_sock, &addr, addrlen);
+    }
+}
+
+static int
+http_server_start_workers(struct http_server *server) {
+    size_t nb_workers, nb_allowed_cpus;
+    int *allowed_cpus;
+    bool pin_workers;
+    long ret;
+
+    nb_workers = server->cfg->u.server.nb_workers;
+    pin_workers = server->cfg->u.server.pin_workers;
+
+    server->workers = http_calloc(nb_workers, sizeof(struct http_worker *));
+
+    allowed_cpus = NULL;
+    nb_allowed_cpus = 0;
+
+    if (pin_workers) {
+        if (http_allowed_cpus(&allowed_cpus, &nb_allowed_cpus) == -1) {
+            http_server_error(server, "cannot pin workers: %s",
+                              http_get_error());
+        }
+
+        ret = sysconf(_SC_NPROCESSORS_CONF);
+        server->nb_cpus = (ret > 0) ? (size_t)ret : 0;
+
+        server->cpu_nodes = http_calloc(server->nb_cpus + 1, sizeof(int));
+        for (size_t i = 0; i < server->nb_cpus; i++)
+            server->cpu_nodes[i] = http_cpu_node((int)i);
+    }
+
+    for (size_t i = 0; i < nb_workers; i++) {
+        struct http_worker *worker;
+
+        worker = http_worker_new(server);
+        if (!worker) {
+            http_free(allowed_cpus);
+            return -1;
+        }
+
+        server->workers[server->nb_workers++] = worker;
+
+        if (nb_allowed_cpus > 0)
+            http_worker_pin(worker, allowed_cpus[i % nb_allowed_cpus]);
+    }
+
+    http_free(allowed_cpus);
+
+    /* Running workers read the worker list, which must be complete before
+     * the first one starts; thread creation orders the writes above before
+     * anything the threads read. */
+    for (size_t i = 0; i < server->nb_workers; i++) {
+        if (http_worker_start(server->workers[i]) == -1)
+            return -1;
+    }
+
+    http_server_trace(server, "started %zu worker threads", nb_workers);
+    return 0;
+}
+
+static void
+http_server_dispatch_connection(struct http_server *server, int sock,
+                                const struct sockaddr_storage *addr,
+                                socklen_t addrlen) {
+    struct http_worker *worker;
+    int node;
+
+    /* Prefer the workers on the node which received the connection: its
+     * packets are then processed where the memory of the connection is. */
+    node = http_server_incoming_node(server, sock);
+
+    worker = NULL;
+    if (node >= 0)
+        worker = http_server_select_worker(server, node);
+    if (!worker)
+        worker = http_server_select_worker(server, -1);
+
+    server->next_worker = (server->next_worker + 1) % server->nb_workers;
+
+    if (http_worker_dispatch_connection(worker, sock, addr, addrlen) == -1) {
+        http_server_error(server, "cannot dispatch connection: %s",
+                          http_get_error());
+        close(sock);
+    }
+}
+
+static struct http_worker *
+http_server_select_worker(struct http_server *server, int node) {
+    struct http_worker *worker;
+    size_t min_nb_connections;
+
+    /* Select the worker with the smallest number of connections, on the
+     * node if there is one. Start with a different worker each time so that
+     * ties do not always favour the same one. */
+    worker = NULL;
+    min_nb_connections = SIZE_MAX;
+
+    for (size_t i = 0; i < server->nb_workers; i++) {
+        struct http_worker *candidate;
+        size_t nb_connections;
+
+        candidate = server->workers[(server->next_worker + i)
+                                    % server->nb_workers];
+
+        if (node >= 0 && http_worker_node(candidate) != node)
+            continue;
+
+        nb_connections = http_worker_nb_connections(candidate);
+        if (nb_connections < min_nb_connections) {
+            worker = candidate;
+            min_nb_connections = nb_connections;
+        }
+    }
+
+    return worker;
+}
+
+static int
+http_server_incoming_node(const struct http_server *server, int sock) {
+#ifdef SO_INCOMING_CPU
+    socklen_t len;
+    int cpu;
+
+    if (!server->cpu_nodes)
+        return -1;
+
+    /* The cpu which processed the last packets of the connection, i.e. for
+     * a new connection the one the network card queue is bound to */
+    len = sizeof(int);
+    if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+        return -1;
+
+    if (cpu < 0 || (size_t)cpu >= server->nb_cpus)
+        return -1;
+
+    return server->cpu_nodes[cpu];
+#else
+    return -1;
+#endif
+}
+
+static const struct ht_table *
+http_server_listeners(const struct http_server *server) {
+    if (server->main_server)
+        return server->main_server->listeners;
+
+    return server->listeners;
+}
+
+static struct http_error_response *
+http_error_response_new(const struct http_cfg *cfg,
+                        enum http_status_code status_code,
+                        const char *content_type,
+                        const char *body, size_t bodysz) {
+    struct http_error_response *response;
+    const char *reason_phrase;
+    struct bf_buffer *buf;
+
+    reason_phrase = http_status_code_to_reason_phrase(status_code);
+    if (!reason_phrase) {
+        http_set_error("unknown status code %d", status_code);
+        return NULL;
+    }
+
+    buf = bf_buffer_new(0);
+
+    bf_buffer_add_printf(buf, " %d %s\r\nDate: ", status_code, reason_phrase);
+
+    response = http_malloc0(sizeof(struct http_error_response));
+    response->date_offset = bf_buffer_length(buf);
+
+    bf_buffer_add_string(buf, "\r\n");
+
+    for (size_t i = 0; i < cfg->default_headers->nb_headers; i++) {
+        const struct http_header *header;
+
+        header = cfg->default_headers->headers + i;
+        bf_buffer_add_printf(buf, "%s: %s\r\n", header->name, header->value);
+    }
+
+    if (content_type)
+        bf_buffer_add_printf(buf, "Content-Type: %s\r\n", content_type);
+    bf_buffer_add_printf(buf, "Content-Length: %zu\r\n\r\n", bodysz);
+    bf_buffer_add(buf, body, bodysz);
+
+    response->sz = bf_buffer_length(buf);
+    response->data = http_malloc(response->sz);
+    memcpy(response->data, bf_buffer_data(buf), response->sz);
+
+    bf_buffer_delete(buf);
+    return response;
+}
+
+static void
+http_error_response_delete(struct http_error_response *response) {
+    if (!response)
+        return;
+
+    http_free(response->data);
+
+    memset(response, 0, sizeof(struct http_error_response));
+    http_free(response);
 }
@@ -20,6 +20,15 @@
 
 #include <unistd.h>
 
+#if defined(HTTP_PLATFORM_LINUX)
+#   include <sys/sendfile.h>
+#   define HTTP_HAVE_SENDFILE
+#elif defined(HTTP_PLATFORM_FREEBSD)
+#   include <sys/socket.h>
+#   include <sys/uio.h>
+#   define HTTP_HAVE_SENDFILE
+#endif
+
 #include "http.h"
 #include "internal.h"
 
@@ -40,9 +49,15 @@ struct http_stream {
 
     struct http_stream_entry *first_entry;
     struct http_stream_entry *last_entry;
+
+    /* Neither the held entry nor the entries after it are written until it
+     * is released */
+    struct http_stream_entry *held_entry;
+    bool hold_next_entry;
 };
 
 static void http_stream_remove_first_entry(struct http_stream *);
+static struct bf_buffer *http_stream_last_buffer(struct http_stream *);
 
 
 static void http_stream_buffer_delete(intptr_t);
@@ -55,6 +70,9 @@ struct http_stream_functions http_stream_buffer_functions = {
 };
 
 
+/* Maximum number of bytes sent with a single call to sendfile() */
+#define HTTP_STREAM_SENDFILE_SZ (64 * 1024)
+
 struct http_stream_file {
     int fd;
     size_t file_sz;
@@ -63,18 +81,27 @@ struct http_stream_file {
 
     struct http_ranges ranges;
     size_t range_idx;        /* current range */
-    size_t range_read_sz;    /* number of bytes read in the current range */
+    size_t range_offset;     /* number of bytes read in the current range */
+    bool range_started;
 
     bool done_reading;
+    bool use_sendfile;
 
-    /* For multipart/byteranges documents */
-    char **mime_part_headers;
-    size_t nb_mime_parts;
+    /* For multipart/byteranges documents, the header of each part is made
+     * of the prefix followed by the Content-Range value of the part. */
+    char *mime_part_prefix;
+    size_t mime_part_prefix_len;
     char *mime_footer;
 };
 
 static struct http_stream_file *http_stream_file_new(int, size_t, const char *);
 
+static void http_stream_file_add_part_header(struct http_stream_file *);
+static int http_stream_file_read(struct http_stream_file *);
+static ssize_t http_stream_file_flush(struct http_stream *,
+                                      struct http_stream_file *, int);
+static ssize_t http_sendfile(int, int, size_t, size_t);
+
 static void http_stream_file_delete(intptr_t);
 static int http_stream_file_write(struct http_stream *,
                                   intptr_t, int, size_t *);
@@ -121,6 +148,22 @@ http_stream_is_empty(const struct http_stream *stream) {
     return stream->first_entry == NULL;
 }
 
+size_t
+http_stream_buffered_size(const struct http_stream *stream) {
+    struct http_stream_entry *entry;
+    size_t sz;
+
+    /* Files are read as they are sent and do not count */
+    sz = 0;
+
+    for (entry = stream->first_entry; entry; entry = entry->next) {
+        if (entry->functions.write_func == http_stream_buffer_write)
+            sz += bf_buffer_length((struct bf_buffer *)entry->arg);
+    }
+
+    return sz;
+}
+
 void
 http_stream_add_entry(struct http_stream *stream, intptr_t arg,
                        const struct http_stream_functions *functions) {
@@ -129,6 +172,11 @@ http_stream_add_entry(struct http_stream *stream, intptr_t arg,
     entry = http_stream_entry_new(arg);
     entry->functions = *functions;
 
+    if (stream->hold_next_entry) {
+        stream->held_entry = entry;
+        stream->hold_next_entry = false;
+    }
+
     entry->prev = stream->last_entry;
     entry->next = NULL;
 
@@ -143,37 +191,13 @@ http_stream_add_entry(struct http_stream *stream, intptr_t arg,
 
 void
 http_stream_add_data(struct http_stream *stream, const void *data, size_t sz) {
-    struct http_stream_entry *entry;
-    struct bf_buffer *buf;
-
-    entry = stream->last_entry;
-    if (entry && entry->functions.write_func == http_stream_buffer_write) {
-        buf = (struct bf_buffer *)entry->arg;
-    } else {
-        buf = bf_buffer_new(0);
-        http_stream_add_entry(stream, (intptr_t)buf,
-                              &http_stream_buffer_functions);
-    }
-
-    bf_buffer_add(buf, data, sz);
+    bf_buffer_add(http_stream_last_buffer(stream), data, sz);
 }
 
 void
 http_stream_add_vprintf(struct http_stream *stream,
                         const char *fmt, va_list ap) {
-    struct http_stream_entry *entry;
-    struct bf_buffer *buf;
-
-    entry = stream->last_entry;
-    if (entry && entry->functions.write_func == http_stream_buffer_write) {
-        buf = (struct bf_buffer *)entry->arg;
-    } else {
-        buf = bf_buffer_new(0);
-        http_stream_add_entry(stream, (intptr_t)buf,
-                              &http_stream_buffer_functions);
-    }
-
-    bf_buffer_add_vprintf(buf, fmt, ap);
+    bf_buffer_add_vprintf(http_stream_last_buffer(stream), fmt, ap);
 }
 
 void
@@ -209,27 +233,67 @@ void
 http_stream_add_partial_file(struct http_stream *stream,
                              int fd, size_t file_sz, const char *path,
                              const struct http_ranges *ranges,
-                             char **mime_part_headers, size_t nb_mime_parts,
-                             char *mime_footer) {
+                             char *mime_part_prefix, char *mime_footer) {
     struct http_stream_file *file;
 
     file = http_stream_file_new(fd, file_sz, path);
     file->ranges = *ranges;
 
-    file->mime_part_headers = mime_part_headers;
-    file->nb_mime_parts = nb_mime_parts;
+    file->mime_part_prefix = mime_part_prefix;
+    if (mime_part_prefix)
+        file->mime_part_prefix_len = strlen(mime_part_prefix);
     file->mime_footer = mime_footer;
 
     http_stream_add_entry(stream, (intptr_t)file, &http_stream_file_functions);
 }
 
+void
+http_stream_hold_next_entry(struct http_stream *stream) {
+    assert(!stream->held_entry);
+
+    stream->hold_next_entry = true;
+}
+
+bool
+http_stream_has_held_entry(const struct http_stream *stream) {
+    return stream->held_entry != NULL;
+}
+
+void
+http_stream_release_held_entry(struct http_stream *stream) {
+    stream->held_entry = NULL;
+}
+
+void
+http_stream_drop_held_entry(struct http_stream *stream) {
+    struct http_stream_entry *entry;
+
+    entry = stream->held_entry;
+    if (!entry)
+        return;
+
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+
+    if (stream->first_entry == entry)
+        stream->first_entry = entry->next;
+    if (stream->last_entry == entry)
+        stream->last_entry = entry->prev;
+
+    stream->held_entry = NULL;
+
+    http_stream_entry_delete(entry);
+}
+
 int
 http_stream_write(struct http_stream *stream, int fd, size_t *psz) {
     struct http_stream_entry *entry;
     int ret;
 
     entry = stream->first_entry;
-    if (!entry)
+    if (!entry || entry == stream->held_entry)
         return 0;
 
     ret = entry->functions.write_func(stream, entry->arg, fd, psz);
@@ -272,6 +336,25 @@ http_stream_entry_delete(struct http_stream_entry *entry) {
     http_free(entry);
 }
 
+static struct bf_buffer *
+http_stream_last_buffer(struct http_stream *stream) {
+    struct http_stream_entry *entry;
+    struct bf_buffer *buf;
+
+    /* Data are appended to the last buffer unless it is held: it must only
+     * contain what was written while it was held. */
+    entry = stream->last_entry;
+    if (entry && entry->functions.write_func == http_stream_buffer_write
+     && entry != stream->held_entry && !stream->hold_next_entry) {
+        return (struct bf_buffer *)entry->arg;
+    }
+
+    buf = bf_buffer_new(0);
+    http_stream_add_entry(stream, (intptr_t)buf, &http_stream_buffer_functions);
+
+    return buf;
+}
+
 static void
 http_stream_remove_first_entry(struct http_stream *stream) {
     if (!stream->first_entry)
@@ -340,6 +423,10 @@ http_stream_file_new(int fd, size_t file_sz, const char *path) {
     file->path = http_strdup(path);
     file->buf = bf_buffer_new(0);
 
+#ifdef HTTP_HAVE_SENDFILE
+    file->use_sendfile = true;
+#endif
+
     return file;
 }
 
@@ -358,9 +445,7 @@ http_stream_file_delete(intptr_t arg) {
 
     http_ranges_free(&file->ranges);
 
-    for (size_t i = 0; i < file->nb_mime_parts; i++)
-        http_free(file->mime_part_headers[i]);
-    http_free(file->mime_part_headers);
+    http_free(file->mime_part_prefix);
     http_free(file->mime_footer);
 
     memset(file, 0, sizeof(struct http_stream_file));
@@ -370,82 +455,167 @@ http_stream_file_delete(intptr_t arg) {
 static int
 http_stream_file_write(struct http_stream *stream,
                        intptr_t arg, int fd, size_t *psz) {
-    struct http_connection *connection;
     const struct http_cfg *cfg;
     struct http_stream_file *file;
+    struct http_range *range;
+    size_t range_sz;
     ssize_t ret;
 
     file = (struct http_stream_file *)arg;
 
-    connection = stream->connection;
-    cfg = http_connection_get_cfg(connection);
+    cfg = http_connection_get_cfg(stream->connection);
 
-    /* If we have no data ready to write, we need to read the file */
-    if (bf_buffer_length(file->buf) == 0) {
-        struct http_range *range;
-        size_t range_sz, read_sz;
+    *psz = 0;
 
-        range = file->ranges.ranges + file->range_idx;
-        range_sz = range->last - range->first + 1;
-        read_sz = MIN(range_sz - file->range_read_sz, (size_t)BUFSIZ);
+    /* Data waiting in the buffer (part headers, footer or file content read
+     * for SSL connections) are always written first */
+    if (bf_buffer_length(file->buf) > 0) {
+        ret = http_stream_file_flush(stream, file, fd);
+        if (ret == -1)
+            return -1;
 
-        /* If we are just starting to read the current range, we need to move
-         * to the right offset */
-        if (file->range_read_sz == 0) {
-            if (lseek(file->fd, (off_t)range->first, SEEK_SET) == -1) {
-                http_set_error("cannot seek %s: %s",
-                               file->path, strerror(errno));
-                return -1;
-            }
+        *psz = (size_t)ret;
+        goto end;
+    }
 
-            /* Write the MIME header for this part if necessary */
-            if (file->nb_mime_parts > 0) {
-                char *header;
+    if (file->done_reading)
+        return 0;
 
-                header = file->mime_part_headers[file->range_idx];
-                bf_buffer_add_string(file->buf, header);
-            }
-        }
+    range = file->ranges.ranges + file->range_idx;
+    range_sz = range->last - range->first + 1;
 
-        ret = bf_buffer_read(file->buf, file->fd, read_sz);
-        if (ret == -1) {
-            http_set_error("cannot read %s: %s", file->path, strerror(errno));
-            return -1;
+    if (!file->range_started) {
+        file->range_started = true;
+
+        if (file->mime_part_prefix) {
+            http_stream_file_add_part_header(file);
+            return 1;
         }
+    }
+
+    if (file->range_offset < range_sz) {
+        if (file->use_sendfile && !cfg->use_ssl) {
+            size_t sz;
 
-        file->range_read_sz += (size_t)ret;
+            sz = MIN(range_sz - file->range_offset,
+                     (size_t)HTTP_STREAM_SENDFILE_SZ);
 
-        if (ret == 0 && file->range_read_sz < range_sz) {
-            if (file->range_read_sz > 0) {
-                /* Invalid range */
+            ret = http_sendfile(fd, file->fd,
+                                range->first + file->range_offset, sz);
+            if (ret == -1) {
+                if (errno == EAGAIN || errno == EINTR)
+                    return 1;
+
+                if (errno == EINVAL || errno == ENOSYS) {
+                    /* The file cannot be sent with sendfile(), fallback to
+                     * regular reads. */
+                    file->use_sendfile = false;
+                    return 1;
+                }
+
+                if (errno == ECONNRESET || errno == EPIPE)
+                    stream->connection->closed_by_peer = true;
+
+                http_set_error("cannot send %s: %s",
+                               file->path, strerror(errno));
+                return -1;
+            } else if (ret == 0) {
                 http_set_error("range ends after the end of the file");
                 return -1;
             }
+
+            file->range_offset += (size_t)ret;
+            *psz = (size_t)ret;
+        } else {
+            if (http_stream_file_read(file) == -1)
+                return -1;
         }
+    }
 
-        if (file->range_read_sz == range_sz) {
-            /* We entirely read the current range */
-            if (file->range_idx == file->ranges.nb_ranges - 1) {
-                /* We read all ranges */
-                if (file->nb_mime_parts > 0)
-                    bf_buffer_add_string(file->buf, file->mime_footer);
-
-                file->done_reading = true;
-                close(file->fd);
-                file->fd = -1;
-            } else {
-                /* Next range */
-                file->range_idx++;
-                file->range_read_sz = 0;
-            }
+    if (file->range_offset == range_sz) {
+        /* We entirely read the current range */
+        file->range_idx++;
+        file->range_offset = 0;
+        file->range_started = false;
+
+        if (file->range_idx == file->ranges.nb_ranges) {
+            /* We read all ranges */
+            if (file->mime_footer)
+                bf_buffer_add_string(file->buf, file->mime_footer);
+
+            file->done_reading = true;
+            close(file->fd);
+            file->fd = -1;
         }
     }
 
-    /* Write as much as possible */
+end:
+    if (bf_buffer_length(file->buf) == 0 && file->done_reading) {
+        /* We read and wrote all ranges */
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+http_stream_file_add_part_header(struct http_stream_file *file) {
+    char content_range[HTTP_SIZE_BUFSZ * 3 + 2];
+    struct http_range *range;
+    size_t len;
+
+    range = file->ranges.ranges + file->range_idx;
+
+    len = http_ranges_format_content_range(content_range, range,
+                                           file->file_sz);
+
+    bf_buffer_add(file->buf, file->mime_part_prefix,
+                  file->mime_part_prefix_len);
+    bf_buffer_add(file->buf, content_range, len);
+    bf_buffer_add(file->buf, "\r\n\r\n", 4);
+}
+
+static int
+http_stream_file_read(struct http_stream_file *file) {
+    struct http_range *range;
+    size_t range_sz, read_sz;
+    ssize_t ret;
+    char *ptr;
+
+    range = file->ranges.ranges + file->range_idx;
+    range_sz = range->last - range->first + 1;
+    read_sz = MIN(range_sz - file->range_offset, (size_t)BUFSIZ);
+
+    ptr = bf_buffer_reserve(file->buf, read_sz);
+
+    ret = pread(file->fd, ptr, read_sz,
+                (off_t)(range->first + file->range_offset));
+    if (ret == -1) {
+        http_set_error("cannot read %s: %s", file->path, strerror(errno));
+        return -1;
+    } else if (ret == 0) {
+        http_set_error("range ends after the end of the file");
+        return -1;
+    }
+
+    bf_buffer_increase_length(file->buf, (size_t)ret);
+    file->range_offset += (size_t)ret;
+
+    return 0;
+}
+
+static ssize_t
+http_stream_file_flush(struct http_stream *stream,
+                       struct http_stream_file *file, int fd) {
+    const struct http_cfg *cfg;
+    ssize_t ret;
+
+    cfg = http_connection_get_cfg(stream->connection);
+
     if (cfg->use_ssl) {
-        ret = http_connection_ssl_write(connection, file->buf);
-        if (ret <= 0)
-            return ret;
+        ret = http_connection_ssl_write(stream->connection, file->buf);
+        if (ret == -1)
+            return -1;
     } else {
         ret = bf_buffer_write(file->buf, fd);
         if (ret == -1) {
@@ -457,11 +627,30 @@ http_stream_file_write(struct http_stream *stream,
         }
     }
 
-    if (bf_buffer_length(file->buf) == 0 && file->done_reading) {
-        /* We read and wrote all ranges */
-        return 0;
+    return ret;
+}
+
+static ssize_t
+http_sendfile(int sock, int fd, size_t offset, size_t sz) {
+#if defined(HTTP_PLATFORM_LINUX)
+    off_t off;
+
+    off = (off_t)offset;
+    return sendfile(sock, fd, &off, sz);
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    off_t sbytes;
+
+    sbytes = 0;
+    if (sendfile(fd, sock, (off_t)offset, sz, NULL, &sbytes, 0) == -1) {
+        if ((errno == EAGAIN || errno == EINTR) && sbytes > 0)
+            return sbytes;
+
+        return -1;
     }
 
-    *psz = (size_t)ret;
-    return 1;
+    return sbytes;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
 }
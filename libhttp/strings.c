@@ -18,10 +18,36 @@
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http.h"
 #include "internal.h"
 
+/* Opening an iconv descriptor is expensive (the C library may have to load
+ * and initialize conversion modules), so descriptors are kept in a small
+ * per-thread cache and reset between conversions. Threads must close them
+ * with http_iconv_release_descriptors() before exiting. */
+#define HTTP_ICONV_CACHE_SZ 8
+#define HTTP_ICONV_CHARSET_MAX_LENGTH 32
+
+struct http_iconv_descriptor {
+    char from[HTTP_ICONV_CHARSET_MAX_LENGTH];
+    char to[HTTP_ICONV_CHARSET_MAX_LENGTH];
+
+    iconv_t conv;
+    uint64_t last_use;
+};
+
+static bool http_is_ascii_string(const char *, size_t);
+static bool http_charset_is_ascii_compatible(const char *);
+
+static iconv_t http_iconv_descriptor_get(const char *, const char *, bool *);
+static void http_iconv_descriptor_release(iconv_t, bool);
+
+static __thread struct http_iconv_descriptor
+    http_iconv_cache[HTTP_ICONV_CACHE_SZ];
+static __thread uint64_t http_iconv_cache_clock;
+
 char *
 http_strdup(const char *str) {
     return http_strndup(str, strlen(str));
@@ -98,67 +124,249 @@ http_parse_size(const char *str, size_t *pval) {
     return 0;
 }
 
+size_t
+http_size_length(size_t val) {
+    size_t len;
+
+    len = 1;
+    while (val >= 10) {
+        val /= 10;
+        len++;
+    }
+
+    return len;
+}
+
+size_t
+http_format_size(char *buf, size_t val) {
+    size_t len;
+
+    len = http_size_length(val);
+
+    for (size_t i = len; i > 0; i--) {
+        buf[i - 1] = (char)('0' + val % 10);
+        val /= 10;
+    }
+
+    return len;
+}
+
 char *
 http_iconv(const char *str, const char *from, const char *to) {
     const char *input;
-    char *output;
-    size_t ilen, olen, str_length;
+    char *output, *optr;
+    size_t ilen, olen, output_sz, str_length;
     iconv_t conv;
+    bool is_cached, flushing;
 
-    conv = iconv_open(to, from);
-    if (conv == (iconv_t)-1) {
-        http_set_error("cannot create iconv conversion descriptor "
-                       "from %s to %s: %s",
-                       from, to, strerror(errno));
-        return NULL;
+    str_length = strlen(str);
+
+    /* ASCII is a subset of most charsets in use on the web, so ASCII
+     * strings do not need any conversion. */
+    if (http_is_ascii_string(str, str_length)
+     && http_charset_is_ascii_compatible(from)
+     && http_charset_is_ascii_compatible(to)) {
+        return http_strndup(str, str_length);
     }
 
-    str_length = strlen(str);
+    conv = http_iconv_descriptor_get(from, to, &is_cached);
+    if (conv == (iconv_t)-1)
+        return NULL;
 
-    olen = str_length;
-    output = http_malloc(olen + 1);
+    output_sz = (str_length < 16) ? 16 : str_length;
+    output = http_malloc(output_sz + 1);
 
-    for (;;) {
-        size_t ret;
+    input = str;
+    ilen = str_length;
 
-        char *tmp;
-        size_t tmp_len;
+    optr = output;
+    olen = output_sz;
 
-        input = str;
-        ilen = str_length;
+    flushing = false;
 
-        tmp = output;
-        tmp_len = olen;
+    for (;;) {
+        size_t ret;
 
+        if (flushing) {
+            /* Write the sequence returning to the initial shift state, if
+             * there is one. */
+            ret = iconv(conv, NULL, NULL, &optr, &olen);
+        } else {
 #ifdef HTTP_PLATFORM_FREEBSD
-        ret = iconv(conv, (const char **)&input, &ilen, &tmp, &tmp_len);
+            ret = iconv(conv, (const char **)&input, &ilen, &optr, &olen);
 #else
-        ret = iconv(conv, (char **)&input, &ilen, &tmp, &tmp_len);
+            ret = iconv(conv, (char **)&input, &ilen, &optr, &olen);
 #endif
+        }
 
         if (ret == (size_t)-1) {
-            if (errno == E2BIG) {
-                olen *= 2;
-                output = http_realloc(output, olen + 1);
-                continue;
-            } else {
+            size_t offset;
+
+            if (errno != E2BIG) {
                 http_set_error("cannot convert string from %s to %s: %s",
                                from, to, strerror(errno));
-                printf("%s\n", http_get_error());
                 http_free(output);
-                iconv_close(conv);
+                http_iconv_descriptor_release(conv, is_cached);
                 return NULL;
             }
+
+            /* Grow the output buffer and continue where the conversion
+             * stopped. */
+            offset = (size_t)(optr - output);
+
+            output_sz *= 2;
+            output = http_realloc(output, output_sz + 1);
+
+            optr = output + offset;
+            olen = output_sz - offset;
+            continue;
         }
 
-        *tmp = '\0';
-        break;
+        if (flushing)
+            break;
+
+        flushing = true;
     }
 
-    iconv_close(conv);
+    *optr = '\0';
+
+    http_iconv_descriptor_release(conv, is_cached);
     return output;
 }
 
+void
+http_iconv_release_descriptors(void) {
+    for (size_t i = 0; i < HTTP_ICONV_CACHE_SZ; i++) {
+        struct http_iconv_descriptor *descriptor;
+
+        descriptor = http_iconv_cache + i;
+        if (descriptor->from[0] != '\0')
+            iconv_close(descriptor->conv);
+
+        memset(descriptor, 0, sizeof(struct http_iconv_descriptor));
+    }
+
+    http_iconv_cache_clock = 0;
+}
+
+static bool
+http_is_ascii_string(const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)str[i] >= 0x80)
+            return false;
+    }
+
+    return true;
+}
+
+static bool
+http_charset_is_ascii_compatible(const char *charset) {
+    static const char *names[] = {
+        "ASCII", "US-ASCII", "UTF-8", "UTF8",
+    };
+
+    static const char *families[] = {
+        "ISO-8859-", "ISO8859-", "ISO_8859-", "LATIN", "WINDOWS-125", "CP125",
+    };
+
+    for (size_t i = 0; i < HTTP_ARRAY_NB_ELEMENTS(names); i++) {
+        size_t len;
+
+        len = strlen(names[i]);
+
+        /* Allow suffixes such as "//TRANSLIT" */
+        if (strncasecmp(charset, names[i], len) == 0
+         && (charset[len] == '\0' || charset[len] == '/')) {
+            return true;
+        }
+    }
+
+    for (size_t i = 0; i < HTTP_ARRAY_NB_ELEMENTS(families); i++) {
+        if (strncasecmp(charset, families[i], strlen(families[i])) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static iconv_t
+http_iconv_descriptor_get(const char *from, const char *to, bool *pcached) {
+    struct http_iconv_descriptor *descriptor;
+    iconv_t conv;
+
+    *pcached = false;
+    descriptor = NULL;
+
+    if (strlen(from) < HTTP_ICONV_CHARSET_MAX_LENGTH
+     && strlen(to) < HTTP_ICONV_CHARSET_MAX_LENGTH) {
+        size_t free_idx, lru_idx;
+
+        free_idx = SIZE_MAX;
+        lru_idx = 0;
+
+        for (size_t i = 0; i < HTTP_ICONV_CACHE_SZ; i++) {
+            descriptor = http_iconv_cache + i;
+
+            if (descriptor->from[0] == '\0') {
+                if (free_idx == SIZE_MAX)
+                    free_idx = i;
+                continue;
+            }
+
+            if (strcmp(descriptor->from, from) == 0
+             && strcmp(descriptor->to, to) == 0) {
+                descriptor->last_use = ++http_iconv_cache_clock;
+                *pcached = true;
+                return descriptor->conv;
+            }
+
+            if (descriptor->last_use < http_iconv_cache[lru_idx].last_use)
+                lru_idx = i;
+        }
+
+        /* Use a free slot if there is one, or evict the least recently used
+         * descriptor. */
+        if (free_idx != SIZE_MAX) {
+            descriptor = http_iconv_cache + free_idx;
+        } else {
+            descriptor = http_iconv_cache + lru_idx;
+        }
+    }
+
+    conv = iconv_open(to, from);
+    if (conv == (iconv_t)-1) {
+        http_set_error("cannot create iconv conversion descriptor "
+                       "from %s to %s: %s",
+                       from, to, strerror(errno));
+        return conv;
+    }
+
+    if (descriptor) {
+        if (descriptor->from[0] != '\0')
+            iconv_close(descriptor->conv);
+
+        strcpy(descriptor->from, from);
+        strcpy(descriptor->to, to);
+
+        descriptor->conv = conv;
+        descriptor->last_use = ++http_iconv_cache_clock;
+
+        *pcached = true;
+    }
+
+    return conv;
+}
+
+static void
+http_iconv_descriptor_release(iconv_t conv, bool is_cached) {
+    if (is_cached) {
+        /* Return to the initial conversion state for the next user */
+        iconv(conv, NULL, NULL, NULL, NULL);
+    } else {
+        iconv_close(conv);
+    }
+}
+
 #ifndef NDEBUG
 const char *
 http_fmt_data(const char *buf, size_t sz) {
@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HTTP_PLATFORM_LINUX
+/* sched_setaffinity() */
+#   define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#if defined(HTTP_PLATFORM_LINUX)
+#   include <sched.h>
+#elif defined(HTTP_PLATFORM_FREEBSD)
+#   include <sys/param.h>
+#   include <sys/cpuset.h>
+#endif
+
+#include "http.h"
+#include "internal.h"
+
+/* Processes which die before running for this long are restarted after the
+ * same delay, so that a process crashing at startup does not make the
+ * supervisor fork in a loop. */
+#define HTTP_SUPERVISOR_MIN_UPTIME 1000 /* milliseconds */
+
+struct http_supervisor_process {
+    pid_t pid; /* -1 if the process is not running */
+
+    uint64_t start_time;
+    uint64_t restart_time; /* 0 if no restart is scheduled */
+};
+
+struct http_supervisor {
+    struct http_cfg *cfg;
+
+    int *socks;
+    size_t nb_socks;
+
+    struct http_supervisor_process *processes;
+    size_t nb_processes;
+
+    http_supervisor_setup setup;
+    void *setup_arg;
+
+    sigset_t old_sigmask;
+    bool stopping;
+};
+
+/* State of a supervised process */
+struct http_supervised {
+    struct http_supervisor *supervisor;
+
+    struct event_base *ev_base;
+    struct event *ev_sigint;
+    struct event *ev_sigterm;
+    struct event *drain_timer;
+
+    struct http_server *server;
+
+    uint64_t drain_deadline;
+};
+
+static int http_supervisor_start_process(struct http_supervisor *, size_t);
+static void http_supervisor_reap_processes(struct http_supervisor *);
+static void http_supervisor_stop(struct http_supervisor *, int);
+static size_t http_supervisor_nb_running_processes(
+    const struct http_supervisor *);
+static int http_supervisor_next_restart_delay(const struct http_supervisor *,
+                                              struct timespec *);
+
+static void http_supervisor_error(const struct http_supervisor *,
+                                  const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+static void http_supervisor_trace(const struct http_supervisor *,
+                                  const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int http_supervised_main(struct http_supervisor *, size_t);
+static void http_supervised_on_signal(evutil_socket_t, short, void *);
+static void http_supervised_on_drain_timer(evutil_socket_t, short, void *);
+
+static int http_pin_process(size_t);
+
+static uint64_t http_supervisor_now(void);
+
+struct http_supervisor *
+http_supervisor_new(struct http_cfg *cfg, size_t nb_processes) {
+    struct http_supervisor *supervisor;
+
+    if (nb_processes == 0) {
+        long nb_cpus;
+
+        nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_processes = (nb_cpus > 0) ? (size_t)nb_cpus : 1;
+    }
+
+    supervisor = http_malloc0(sizeof(struct http_supervisor));
+
+    supervisor->cfg = cfg;
+
+    if (http_server_open_listening_sockets(cfg, &supervisor->socks,
+                                           &supervisor->nb_socks) == -1) {
+        http_free(supervisor);
+        return NULL;
+    }
+
+    supervisor->processes = http_calloc(nb_processes,
+                                        sizeof(struct http_supervisor_process));
+    supervisor->nb_processes = nb_processes;
+
+    for (size_t i = 0; i < nb_processes; i++)
+        supervisor->processes[i].pid = -1;
+
+    return supervisor;
+}
+
+void
+http_supervisor_delete(struct http_supervisor *supervisor) {
+    if (!supervisor)
+        return;
+
+    for (size_t i = 0; i < supervisor->nb_socks; i++)
+        close(supervisor->socks[i]);
+    http_free(supervisor->socks);
+
+    http_free(supervisor->processes);
+
+    memset(supervisor, 0, sizeof(struct http_supervisor));
+    http_free(supervisor);
+}
+
+int
+http_supervisor_run(struct http_supervisor *supervisor,
+                    http_supervisor_setup setup, void *arg) {
+    sigset_t set;
+
+    supervisor->setup = setup;
+    supervisor->setup_arg = arg;
+
+    /* Signals are blocked and consumed with sigtimedwait(); processes
+     * restore the original mask after fork(). */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, &set, &supervisor->old_sigmask) == -1) {
+        http_set_error("cannot block signals: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < supervisor->nb_processes; i++) {
+        if (http_supervisor_start_process(supervisor, i) == -1) {
+            http_supervisor_error(supervisor, "%s", http_get_error());
+            http_supervisor_stop(supervisor, SIGTERM);
+            break;
+        }
+    }
+
+    while (!supervisor->stopping
+        || http_supervisor_nb_running_processes(supervisor) > 0) {
+        struct timespec timeout;
+        uint64_t now;
+        int signo;
+
+        if (http_supervisor_next_restart_delay(supervisor, &timeout) == 0) {
+            signo = sigtimedwait(&set, NULL, &timeout);
+        } else {
+            signo = sigwaitinfo(&set, NULL);
+        }
+
+        if (signo == -1 && errno != EAGAIN && errno != EINTR) {
+            http_supervisor_error(supervisor, "cannot wait for signals: %s",
+                                  strerror(errno));
+            http_supervisor_stop(supervisor, SIGKILL);
+            break;
+        }
+
+        if (signo == SIGCHLD) {
+            http_supervisor_reap_processes(supervisor);
+        } else if (signo == SIGINT || signo == SIGTERM) {
+            http_supervisor_trace(supervisor, "signal %d received, stopping",
+                                  signo);
+            http_supervisor_stop(supervisor, SIGTERM);
+        }
+
+        if (supervisor->stopping)
+            continue;
+
+        now = http_supervisor_now();
+
+        for (size_t i = 0; i < supervisor->nb_processes; i++) {
+            struct http_supervisor_process *process;
+
+            process = supervisor->processes + i;
+            if (process->pid != -1 || process->restart_time > now)
+                continue;
+
+            if (http_supervisor_start_process(supervisor, i) == -1) {
+                http_supervisor_error(supervisor, "%s", http_get_error());
+                process->restart_time = now + HTTP_SUPERVISOR_MIN_UPTIME;
+            }
+        }
+    }
+
+    /* Wait for the processes we may have killed */
+    while (http_supervisor_nb_running_processes(supervisor) > 0) {
+        if (sigwaitinfo(&set, NULL) == SIGCHLD)
+            http_supervisor_reap_processes(supervisor);
+    }
+
+    sigprocmask(SIG_SETMASK, &supervisor->old_sigmask, NULL);
+    return 0;
+}
+
+static int
+http_supervisor_start_process(struct http_supervisor *supervisor,
+                              size_t idx) {
+    struct http_supervisor_process *process;
+    pid_t pid;
+
+    process = supervisor->processes + idx;
+
+    /* Do not let the process inherit buffered output */
+    fflush(NULL);
+
+    pid = fork();
+    if (pid == -1) {
+        http_set_error("cannot fork process: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        int ret;
+
+        sigprocmask(SIG_SETMASK, &supervisor->old_sigmask, NULL);
+
+        /* The child must not run atexit handlers or flush stdio buffers
+         * inherited from the parent */
+        ret = http_supervised_main(supervisor, idx);
+        _exit((ret == 0) ? 0 : 1);
+    }
+
+    process->pid = pid;
+    process->start_time = http_supervisor_now();
+    process->restart_time = 0;
+
+    http_supervisor_trace(supervisor, "process %zu started (pid %d)",
+                          idx, (int)pid);
+    return 0;
+}
+
+static void
+http_supervisor_reap_processes(struct http_supervisor *supervisor) {
+    for (;;) {
+        struct http_supervisor_process *process;
+        uint64_t now, uptime;
+        int status;
+        pid_t pid;
+        size_t idx;
+
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != ECHILD) {
+                http_supervisor_error(supervisor,
+                                      "cannot wait for processes: %s",
+                                      strerror(errno));
+            }
+
+            return;
+        } else if (pid == 0) {
+            return;
+        }
+
+        process = NULL;
+        for (idx = 0; idx < supervisor->nb_processes; idx++) {
+            if (supervisor->processes[idx].pid == pid) {
+                process = supervisor->processes + idx;
+                break;
+            }
+        }
+
+        if (!process)
+            continue;
+
+        process->pid = -1;
+
+        if (WIFSIGNALED(status)) {
+            http_supervisor_trace(supervisor,
+                                  "process %zu (pid %d) killed by signal %d",
+                                  idx, (int)pid, WTERMSIG(status));
+        } else {
+            http_supervisor_trace(supervisor,
+                                  "process %zu (pid %d) exited with status %d",
+                                  idx, (int)pid, WEXITSTATUS(status));
+        }
+
+        if (supervisor->stopping)
+            continue;
+
+        now = http_supervisor_now();
+        uptime = now - process->start_time;
+
+        if (uptime < HTTP_SUPERVISOR_MIN_UPTIME) {
+            process->restart_time = now + HTTP_SUPERVISOR_MIN_UPTIME;
+        } else {
+            process->restart_time = now;
+        }
+    }
+}
+
+static void
+http_supervisor_stop(struct http_supervisor *supervisor, int signo) {
+    supervisor->stopping = true;
+
+    for (size_t i = 0; i < supervisor->nb_processes; i++) {
+        pid_t pid;
+
+        pid = supervisor->processes[i].pid;
+        if (pid == -1)
+            continue;
+
+        if (kill(pid, signo) == -1) {
+            http_supervisor_error(supervisor,
+                                  "cannot send signal to process %d: %s",
+                                  (int)pid, strerror(errno));
+        }
+    }
+}
+
+static size_t
+http_supervisor_nb_running_processes(const struct http_supervisor *supervisor) {
+    size_t nb_processes;
+
+    nb_processes = 0;
+    for (size_t i = 0; i < supervisor->nb_processes; i++) {
+        if (supervisor->processes[i].pid != -1)
+            nb_processes++;
+    }
+
+    return nb_processes;
+}
+
+static int
+http_supervisor_next_restart_delay(const struct http_supervisor *supervisor,
+                                   struct timespec *delay) {
+    uint64_t now, next_time;
+
+    if (supervisor->stopping)
+        return -1;
+
+    next_time = 0;
+
+    for (size_t i = 0; i < supervisor->nb_processes; i++) {
+        const struct http_supervisor_process *process;
+
+        process = supervisor->processes + i;
+        if (process->pid != -1)
+            continue;
+
+        if (next_time == 0 || process->restart_time < next_time)
+            next_time = process->restart_time;
+    }
+
+    if (next_time == 0)
+        return -1;
+
+    now = http_supervisor_now();
+    if (next_time < now)
+        next_time = now;
+
+    delay->tv_sec = (time_t)((next_time - now) / 1000);
+    delay->tv_nsec = (long)((next_time - now) % 1000) * 1000000;
+    return 0;
+}
+
+static void
+http_supervisor_error(const struct http_supervisor *supervisor,
+                      const char *fmt, ...) {
+    char buf[HTTP_ERROR_BUFSZ];
+    va_list ap;
+
+    if (!supervisor->cfg->error_hook)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, HTTP_ERROR_BUFSZ, fmt, ap);
+    va_end(ap);
+
+    supervisor->cfg->error_hook(buf, supervisor->cfg->hook_arg);
+}
+
+static void
+http_supervisor_trace(const struct http_supervisor *supervisor,
+                      const char *fmt, ...) {
+    char buf[HTTP_ERROR_BUFSZ];
+    va_list ap;
+
+    if (!supervisor->cfg->trace_hook)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, HTTP_ERROR_BUFSZ, fmt, ap);
+    va_end(ap);
+
+    supervisor->cfg->trace_hook(buf, supervisor->cfg->hook_arg);
+}
+
+static int
+http_supervised_main(struct http_supervisor *supervisor, size_t idx) {
+    struct http_supervised supervised;
+    struct http_cfg cfg;
+    int ret;
+
+    ret = -1;
+
+    memset(&supervised, 0, sizeof(struct http_supervised));
+    supervised.supervisor = supervisor;
+
+    if (http_pin_process(idx) == -1)
+        http_supervisor_error(supervisor, "%s", http_get_error());
+
+    /* The server takes ownership of our copy of the listening sockets */
+    cfg = *supervisor->cfg;
+    cfg.u.server.listener_socks = supervisor->socks;
+    cfg.u.server.nb_listener_socks = supervisor->nb_socks;
+
+    supervised.ev_base = event_base_new();
+    if (!supervised.ev_base) {
+        http_set_error("cannot create event base: %s", strerror(errno));
+        goto error;
+    }
+
+    supervised.server = http_server_new(&cfg, supervised.ev_base);
+    if (!supervised.server)
+        goto error;
+
+    if (supervisor->setup) {
+        if (supervisor->setup(supervised.server, supervisor->setup_arg) == -1)
+            goto error;
+    }
+
+#define HTTP_SETUP_SIGNAL_HANDLER(ev_, signo_)                             \
+    do {                                                                   \
+        ev_ = evsignal_new(supervised.ev_base, signo_,                     \
+                           http_supervised_on_signal, &supervised);        \
+        if (!ev_) {                                                        \
+            http_set_error("cannot create signal handler: %s",             \
+                           strerror(errno));                               \
+            goto error;                                                    \
+        }                                                                  \
+                                                                           \
+        if (evsignal_add(ev_, NULL) == -1) {                               \
+            http_set_error("cannot add signal handler: %s",                \
+                           strerror(errno));                               \
+            goto error;                                                    \
+        }                                                                  \
+    } while (0)
+
+    HTTP_SETUP_SIGNAL_HANDLER(supervised.ev_sigint, SIGINT);
+    HTTP_SETUP_SIGNAL_HANDLER(supervised.ev_sigterm, SIGTERM);
+
+#undef HTTP_SETUP_SIGNAL_HANDLER
+
+    if (event_base_dispatch(supervised.ev_base) == -1) {
+        http_set_error("cannot run event loop: %s", strerror(errno));
+        goto error;
+    }
+
+    ret = 0;
+
+error:
+    if (ret == -1)
+        http_supervisor_error(supervisor, "process %zu: %s",
+                              idx, http_get_error());
+
+    http_server_delete(supervised.server);
+
+    if (supervised.drain_timer)
+        event_free(supervised.drain_timer);
+    if (supervised.ev_sigint)
+        event_free(supervised.ev_sigint);
+    if (supervised.ev_sigterm)
+        event_free(supervised.ev_sigterm);
+
+    if (supervised.ev_base)
+        event_base_free(supervised.ev_base);
+
+    return ret;
+}
+
+static void
+http_supervised_on_signal(evutil_socket_t signo, short events, void *arg) {
+    struct http_supervised *supervised;
+    const struct http_cfg *cfg;
+    struct timeval tv;
+
+    supervised = arg;
+    cfg = supervised->supervisor->cfg;
+
+    if (supervised->drain_timer)
+        return;
+
+    http_server_trace(supervised->server,
+                      "signal %d received, draining connections", signo);
+
+    /* Stop accepting connections; other processes still listen on the
+     * same sockets if they are not stopping. */
+    http_server_stop_listening(supervised->server);
+
+    supervised->drain_deadline = http_supervisor_now()
+                               + cfg->connection_timeout;
+
+    supervised->drain_timer = event_new(supervised->ev_base, -1, EV_PERSIST,
+                                        http_supervised_on_drain_timer,
+                                        supervised);
+    if (!supervised->drain_timer) {
+        http_server_error(supervised->server, "cannot create timer: %s",
+                          strerror(errno));
+        event_base_loopbreak(supervised->ev_base);
+        return;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 100 * 1000;
+    if (evtimer_add(supervised->drain_timer, &tv) == -1) {
+        http_server_error(supervised->server, "cannot start timer: %s",
+                          strerror(errno));
+        event_base_loopbreak(supervised->ev_base);
+        return;
+    }
+
+    http_supervised_on_drain_timer(-1, 0, supervised);
+}
+
+static void
+http_supervised_on_drain_timer(evutil_socket_t fd, short events, void *arg) {
+    struct http_supervised *supervised;
+
+    supervised = arg;
+
+    if (http_server_nb_connections(supervised->server) > 0
+     && http_supervisor_now() < supervised->drain_deadline) {
+        return;
+    }
+
+    event_base_loopbreak(supervised->ev_base);
+}
+
+static int
+http_pin_process(size_t idx) {
+#if defined(HTTP_PLATFORM_LINUX)
+    cpu_set_t set;
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    cpuset_t set;
+#endif
+    size_t nb_cpus;
+    int *cpus;
+    int cpu;
+
+    if (http_allowed_cpus(&cpus, &nb_cpus) == -1)
+        return -1;
+
+    if (nb_cpus == 0)
+        return 0;
+
+    /* Processes are spread over the CPUs we are allowed to run on, which
+     * are not necessarily numbered from 0 */
+    cpu = cpus[idx % nb_cpus];
+    http_free(cpus);
+
+#if defined(HTTP_PLATFORM_LINUX)
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set) == -1) {
+        http_set_error("cannot pin process to cpu %d: %s",
+                       cpu, strerror(errno));
+        return -1;
+    }
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+                           sizeof(cpuset_t), &set) == -1) {
+        http_set_error("cannot pin process to cpu %d: %s",
+                       cpu, strerror(errno));
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+static uint64_t
+http_supervisor_now(void) {
+    uint64_t now;
+
+    /* Reading the monotonic clock does not fail in practice */
+    if (http_now_ms(&now) == -1)
+        return 0;
+
+    return now;
+}
@@ -45,3 +45,22 @@ http_format_timestamp(char buf[static HTTP_RFC1123_DATE_BUFSZ], size_t sz,
     http_format_date(buf, sz, tm);
     return 0;
 }
+
+const char *
+http_current_date(void) {
+    static __thread char date[HTTP_RFC1123_DATE_BUFSZ];
+    static __thread time_t date_time = (time_t)-1;
+    time_t now;
+
+    /* Formatting dates is surprisingly expensive, and the value only changes
+     * once per second. */
+    now = time(NULL);
+    if (now != date_time) {
+        if (http_format_timestamp(date, sizeof(date), now) == -1)
+            return NULL;
+
+        date_time = now;
+    }
+
+    return date;
+}
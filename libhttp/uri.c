@@ -16,15 +16,35 @@
 
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http.h"
 #include "internal.h"
 
+/* Components are copied in a buffer allocated with the uri; each one is
+ * followed by a null character, and by room for its decoded value if it
+ * contains escape sequences. We also need room for the default path and
+ * port. */
+#define HTTP_URI_BUFFER_EXTRA_SZ (2 * 8 + sizeof("/") + sizeof("443"))
+
 static int http_uri_parse(const char *, struct http_uri *);
-static char *http_uri_decode_component(const char *, size_t);
+static int http_uri_check_query(const char *, size_t);
+static int http_uri_check_escape_sequence(const char *);
+static void http_uri_decode_component(const char *, char *);
 static void http_uri_encode_component(const char *, struct bf_buffer *);
 static int http_uri_finalize(struct http_uri *);
 
+static void http_uri_component_set(struct http_uri_component *,
+                                   const char *);
+static void http_uri_component_set_span(struct http_uri *,
+                                        struct http_uri_component *,
+                                        const char *, size_t, bool);
+static void http_uri_component_free(struct http_uri_component *);
+static const char *
+http_uri_component_value(const struct http_uri_component *);
+
+static void http_uri_parse_query_parameters(const struct http_uri *);
+
 static int http_read_hex_digit(unsigned char, int *);
 
 static bool http_uri_is_scheme_char(unsigned char);
@@ -36,8 +56,13 @@ static bool http_uri_is_query_component_char(unsigned char);
 struct http_uri *
 http_uri_new(const char *str) {
     struct http_uri *uri;
+    size_t length;
 
-    uri = http_malloc0(sizeof(struct http_uri));
+    length = str ? strlen(str) : 0;
+
+    uri = http_malloc0(sizeof(struct http_uri)
+                       + 2 * length + HTTP_URI_BUFFER_EXTRA_SZ);
+    uri->buffer = (char *)(uri + 1);
 
     if (str) {
         if (http_uri_parse(str, uri) == -1) {
@@ -54,13 +79,13 @@ http_uri_delete(struct http_uri *uri) {
     if (!uri)
         return;
 
-    http_free(uri->scheme);
-    http_free(uri->user);
-    http_free(uri->password);
-    http_free(uri->host);
-    http_free(uri->port);
-    http_free(uri->path);
-    http_free(uri->fragment);
+    http_uri_component_free(&uri->scheme);
+    http_uri_component_free(&uri->user);
+    http_uri_component_free(&uri->password);
+    http_uri_component_free(&uri->host);
+    http_uri_component_free(&uri->port);
+    http_uri_component_free(&uri->path);
+    http_uri_component_free(&uri->fragment);
 
     for (size_t i = 0; i < uri->nb_query_parameters; i++)
         http_query_parameter_free(uri->query_parameters + i);
@@ -70,18 +95,50 @@ http_uri_delete(struct http_uri *uri) {
     http_free(uri);
 }
 
+const char *
+http_uri_scheme(const struct http_uri *uri) {
+    return http_uri_component_value(&uri->scheme);
+}
+
+const char *
+http_uri_user(const struct http_uri *uri) {
+    return http_uri_component_value(&uri->user);
+}
+
+const char *
+http_uri_password(const struct http_uri *uri) {
+    return http_uri_component_value(&uri->password);
+}
+
 const char *
 http_uri_host(const struct http_uri *uri) {
-    return uri->host;
+    return http_uri_component_value(&uri->host);
 }
 
 const char *
 http_uri_port(const struct http_uri *uri) {
-    return uri->port;
+    return http_uri_component_value(&uri->port);
+}
+
+const char *
+http_uri_path(const struct http_uri *uri) {
+    return http_uri_component_value(&uri->path);
+}
+
+const char *
+http_uri_fragment(const struct http_uri *uri) {
+    return http_uri_component_value(&uri->fragment);
+}
+
+const char *
+http_uri_encoded_path(const struct http_uri *uri) {
+    return uri->path.value;
 }
 
 bool
 http_uri_has_query_parameter(const struct http_uri *uri, const char *name) {
+    http_uri_parse_query_parameters(uri);
+
     for (size_t i = 0; i < uri->nb_query_parameters; i++) {
         if (strcmp(uri->query_parameters[i].name, name) == 0)
             return true;
@@ -103,6 +160,8 @@ http_uri_query_parameter(const struct http_uri *uri, const char *name) {
      *
      * We choose the first solution because it is the simpler. */
 
+    http_uri_parse_query_parameters(uri);
+
     for (size_t i = 0; i < uri->nb_query_parameters; i++) {
         struct http_query_parameter *parameter;
 
@@ -117,58 +176,37 @@ http_uri_query_parameter(const struct http_uri *uri, const char *name) {
 
 void
 http_uri_set_scheme(struct http_uri *uri, const char *scheme) {
-    if (uri->scheme)
-        http_free(uri->scheme);
-
-    uri->scheme = http_strdup(scheme);
+    http_uri_component_set(&uri->scheme, scheme);
 }
 
 void
 http_uri_set_user(struct http_uri *uri, const char *user) {
-    if (uri->user)
-        http_free(uri->user);
-
-    uri->user = http_strdup(user);
+    http_uri_component_set(&uri->user, user);
 }
 
 void
 http_uri_set_password(struct http_uri *uri, const char *password) {
-    if (uri->password)
-        http_free(uri->password);
-
-    uri->password = http_strdup(password);
+    http_uri_component_set(&uri->password, password);
 }
 
 void
 http_uri_set_host(struct http_uri *uri, const char *host) {
-    if (uri->host)
-        http_free(uri->host);
-
-    uri->host = http_strdup(host);
+    http_uri_component_set(&uri->host, host);
 }
 
 void
 http_uri_set_port(struct http_uri *uri, const char *port) {
-    if (uri->port)
-        http_free(uri->port);
-
-    uri->port = http_strdup(port);
+    http_uri_component_set(&uri->port, port);
 }
 
 void
 http_uri_set_path(struct http_uri *uri, const char *path) {
-    if (uri->path)
-        http_free(uri->path);
-
-    uri->path = http_strdup(path);
+    http_uri_component_set(&uri->path, path);
 }
 
 void
 http_uri_set_fragment(struct http_uri *uri, const char *fragment) {
-    if (uri->fragment)
-        http_free(uri->fragment);
-
-    uri->fragment = http_strdup(fragment);
+    http_uri_component_set(&uri->fragment, fragment);
 }
 
 void
@@ -176,6 +214,8 @@ http_uri_add_query_parameter(struct http_uri *uri,
                              const char *name, const char *value) {
     struct http_query_parameter *parameters, *parameter;
 
+    http_uri_parse_query_parameters(uri);
+
     if (uri->nb_query_parameters == 0) {
         parameters = http_malloc(sizeof(struct http_query_parameter));
     } else {
@@ -196,10 +236,12 @@ http_uri_add_query_parameter(struct http_uri *uri,
 
 static int
 http_uri_parse(const char *str, struct http_uri *uri) {
-    const char *ptr, *start, *colon;
-    size_t toklen;
+    const char *ptr, *start, *end, *at, *colon;
+    bool is_encoded, user_is_encoded;
 
-    memset(uri, 0, sizeof(struct http_uri));
+    /* The string is read once from left to right. Each component is copied
+     * to the buffer of the uri as soon as its end is found, and is only
+     * decoded when accessed if it contains escape sequences. */
 
     ptr = str;
 
@@ -221,16 +263,14 @@ http_uri_parse(const char *str, struct http_uri *uri) {
         return -1;
     }
 
-    for (;;) {
-        if (*ptr == ':' || *ptr == '\0') {
-            toklen = (size_t)(ptr - start);
-            uri->scheme = http_uri_decode_component(start, toklen);
-            if (!uri->scheme)
+    is_encoded = false;
+    while (*ptr != ':' && *ptr != '\0') {
+        if (*ptr == '%') {
+            if (http_uri_check_escape_sequence(ptr) == -1)
                 return -1;
 
-            break;
-        } else if (!http_uri_is_scheme_char((unsigned char)*ptr)
-                && *ptr != '%') {
+            is_encoded = true;
+        } else if (!http_uri_is_scheme_char((unsigned char)*ptr)) {
             http_set_error("invalid character \\%hhu in scheme",
                            (unsigned char)*ptr);
             return -1;
@@ -239,6 +279,9 @@ http_uri_parse(const char *str, struct http_uri *uri) {
         ptr++;
     }
 
+    http_uri_component_set_span(uri, &uri->scheme, start,
+                                (size_t)(ptr - start), is_encoded);
+
     /* Skip '://' */
     if (ptr[0] != ':' || ptr[1] != '/' || ptr[2] != '/') {
         http_set_error("invalid characters after scheme");
@@ -247,93 +290,63 @@ http_uri_parse(const char *str, struct http_uri *uri) {
 
     ptr += 3;
 
-    /* User (optional) */
+    /* Authority: we look for the end of the user information while reading
+     * the host and the port, so that we do not have to backtrack. */
     start = ptr;
+    at = NULL;
     colon = NULL;
-    while (*ptr != '\0') {
-        if (*ptr == ':') {
+    is_encoded = false;
+    user_is_encoded = false;
+
+    while (*ptr != '/' && *ptr != '?' && *ptr != '#' && *ptr != '\0') {
+        if (*ptr == '@' && !at) {
+            at = ptr;
+            user_is_encoded = is_encoded;
+            is_encoded = false;
+        } else if (*ptr == ':' && !at && !colon) {
             colon = ptr;
-        } else if (*ptr == '@') {
-            if (colon) {
-                toklen = (size_t)(colon - start);
-            } else {
-                toklen = (size_t)(ptr - start);
-            }
-
-            uri->user = http_uri_decode_component(start, toklen);
-            if (!uri->user)
+        } else if (*ptr == '%') {
+            if (http_uri_check_escape_sequence(ptr) == -1)
                 return -1;
 
-            if (colon)
-                ptr = colon;
-            break;
-        } else if (*ptr == '/') {
-            /* End of authority, no user found */
-            break;
+            is_encoded = true;
         }
 
         ptr++;
     }
 
-    if (!uri->user) {
-        /* Since we did not find a username, we backtrack to read the host. */
-        ptr = start;
-    }
-
-    /* Password (optional) */
-    if (uri->user && *ptr == ':') {
-        start = ptr;
-
-        for (;;) {
-            if (*ptr == '@' || *ptr == '\0') {
-                toklen = (size_t)(ptr - start - 1);
-                if (toklen == 0) {
-                    http_set_error("empty password");
-                    return -1;
-                }
-
-                uri->password = http_uri_decode_component(start + 1, toklen);
-                if (!uri->password)
-                    return -1;
+    end = ptr;
 
-                break;
-            } else if (*ptr == '/') {
-                /* End of authority, no password found */
-                break;
+    /* User and password (optional) */
+    if (at) {
+        if (colon) {
+            if (at - colon == 1) {
+                http_set_error("empty password");
+                return -1;
             }
 
-            ptr++;
+            http_uri_component_set_span(uri, &uri->user, start,
+                                        (size_t)(colon - start),
+                                        user_is_encoded);
+            http_uri_component_set_span(uri, &uri->password, colon + 1,
+                                        (size_t)(at - colon - 1),
+                                        user_is_encoded);
+        } else {
+            http_uri_component_set_span(uri, &uri->user, start,
+                                        (size_t)(at - start),
+                                        user_is_encoded);
         }
 
-        if (!uri->password) {
-            http_set_error("empty password");
-            return -1;
-        }
-    }
-
-    if (uri->user) {
-        /* Skip '@' */
-        ptr++;
+        start = at + 1;
     }
 
     /* Host */
-    start = ptr;
-    if (*start >= '0' && *start <= '9') {
-        /* IPv4 address */
-        for (;;) {
-            if (*ptr == '/' || *ptr == ':' || *ptr == '\0') {
-                toklen = (size_t)(ptr - start);
-                if (toklen == 0) {
-                    http_set_error("empty host");
-                    return -1;
-                }
-
-                uri->host = http_uri_decode_component(start, toklen);
-                if (!uri->host)
-                    return -1;
+    ptr = start;
 
-                break;
-            } else if (!http_uri_is_ipv4_addr_char((unsigned char)*ptr)) {
+    if (*ptr >= '0' && *ptr <= '9') {
+        /* IPv4 address */
+        while (ptr < end && *ptr != ':') {
+            if (!http_uri_is_ipv4_addr_char((unsigned char)*ptr)) {
                 http_set_error("invalid character \\%hhu in ipv4 address",
                                (unsigned char)*ptr);
                 return -1;
@@ -341,29 +354,20 @@ http_uri_parse(const char *str, struct http_uri *uri) {
 
             ptr++;
         }
-    } else if (*start == '[') {
+
+        http_uri_component_set_span(uri, &uri->host, start,
+                                    (size_t)(ptr - start), false);
+    } else if (*ptr == '[') {
         ptr++; /* '[' */
         start = ptr;
 
         /* IPv6 address */
         for (;;) {
-            if (*ptr == ']') {
-                toklen = (size_t)(ptr - start);
-                if (toklen == 0) {
-                    http_set_error("empty host");
-                    return -1;
-                }
-
-                uri->host = http_uri_decode_component(start, toklen);
-                if (!uri->host)
-                    return -1;
-
-                ptr++; /* ']' */
-
-                break;
-            } else if (*ptr == '\0') {
+            if (ptr == end) {
                 http_set_error("truncated ipv6 address");
                 return -1;
+            } else if (*ptr == ']') {
+                break;
             } else if (!http_uri_is_ipv6_addr_char((unsigned char)*ptr)) {
                 http_set_error("invalid character \\%hhu in ipv6 address",
                                (unsigned char)*ptr);
@@ -372,47 +376,44 @@ http_uri_parse(const char *str, struct http_uri *uri) {
 
             ptr++;
         }
-    } else {
-        /* Hostname */
-        for (;;) {
-            if (*ptr == '/' || *ptr == ':' || *ptr == '#' || *ptr == '\0') {
-                toklen = (size_t)(ptr - start);
-                if (toklen == 0) {
-                    http_set_error("empty host");
-                    return -1;
-                }
 
-                uri->host = http_uri_decode_component(start, toklen);
-                if (!uri->host)
-                    return -1;
+        if (ptr == start) {
+            http_set_error("empty host");
+            return -1;
+        }
 
-                break;
-            }
+        http_uri_component_set_span(uri, &uri->host, start,
+                                    (size_t)(ptr - start), false);
+
+        ptr++; /* ']' */
 
+        if (ptr < end && *ptr != ':') {
+            http_set_error("invalid character \\%hhu after ipv6 address",
+                           (unsigned char)*ptr);
+            return -1;
+        }
+    } else {
+        /* Hostname */
+        while (ptr < end && *ptr != ':')
             ptr++;
+
+        if (ptr == start) {
+            http_set_error("empty host");
+            return -1;
         }
+
+        http_uri_component_set_span(uri, &uri->host, start,
+                                    (size_t)(ptr - start), is_encoded);
     }
 
     /* Port (optional) */
-    if (*ptr == ':') {
-        ptr++;
+    if (ptr < end) {
+        ptr++; /* ':' */
 
         start = ptr;
 
-        for (;;) {
-            if (*ptr == '/' || *ptr == '#' || *ptr == '\0') {
-                toklen = (size_t)(ptr - start);
-                if (toklen == 0) {
-                    http_set_error("empty port");
-                    return -1;
-                }
-
-                uri->port = http_uri_decode_component(start, toklen);
-                if (!uri->port)
-                    return -1;
-
-                break;
-            } else if (!http_uri_is_port_char((unsigned char)*ptr)) {
+        while (ptr < end) {
+            if (!http_uri_is_port_char((unsigned char)*ptr)) {
                 http_set_error("invalid character \\%hhu in port",
                                (unsigned char)*ptr);
                 return -1;
@@ -420,51 +421,62 @@ http_uri_parse(const char *str, struct http_uri *uri) {
 
             ptr++;
         }
+
+        if (ptr == start) {
+            http_set_error("empty port");
+            return -1;
+        }
+
+        http_uri_component_set_span(uri, &uri->port, start,
+                                    (size_t)(ptr - start), false);
     }
 
     /* Path (optional, default '/') */
 path:
     if (*ptr == '/') {
         start = ptr;
+        is_encoded = false;
 
-        for (;;) {
-            if (*ptr == '?' || *ptr == '#' || *ptr == '\0') {
-                toklen = (size_t)(ptr - start);
-                uri->path = http_uri_decode_component(start, toklen);
-                if (!uri->path)
+        while (*ptr != '?' && *ptr != '#' && *ptr != '\0') {
+            if (*ptr == '%') {
+                if (http_uri_check_escape_sequence(ptr) == -1)
                     return -1;
 
-                break;
+                is_encoded = true;
             }
 
             ptr++;
         }
+
+        http_uri_component_set_span(uri, &uri->path, start,
+                                    (size_t)(ptr - start), is_encoded);
     } else {
-        uri->path = http_strdup("/");
+        http_uri_component_set_span(uri, &uri->path, "/", 1, false);
     }
 
     /* Query (optional) */
     if (*ptr == '?') {
-        char *query;
-
         ptr++;
 
         start = ptr;
 
-        while (*ptr != '#' && *ptr != '\0')
-            ptr++;
+        while (*ptr != '#' && *ptr != '\0') {
+            if (*ptr == '%') {
+                if (http_uri_check_escape_sequence(ptr) == -1)
+                    return -1;
+            }
 
-        toklen = (size_t)(ptr - start);
-        query = http_strndup(start, toklen);
+            ptr++;
+        }
 
-        if (http_query_parameters_parse(query,
-                                        &uri->query_parameters,
-                                        &uri->nb_query_parameters) == -1) {
-            http_free(query);
+        if (http_uri_check_query(start, (size_t)(ptr - start)) == -1)
             return -1;
-        }
 
-        http_free(query);
+        /* Query parameters are only decoded when accessed */
+        uri->query = uri->buffer + uri->buffer_length;
+        memcpy(uri->query, start, (size_t)(ptr - start));
+        uri->query[ptr - start] = '\0';
+        uri->buffer_length += (size_t)(ptr - start) + 1;
     }
 
     /* Fragment (optional) */
@@ -472,14 +484,21 @@ path:
         ptr++;
 
         start = ptr;
+        is_encoded = false;
+
+        while (*ptr != '\0') {
+            if (*ptr == '%') {
+                if (http_uri_check_escape_sequence(ptr) == -1)
+                    return -1;
+
+                is_encoded = true;
+            }
 
-        while (*ptr != '\0')
             ptr++;
+        }
 
-        toklen = (size_t)(ptr - start);
-        uri->fragment = http_uri_decode_component(start, toklen);
-        if (!uri->fragment)
-            return -1;
+        http_uri_component_set_span(uri, &uri->fragment, start,
+                                    (size_t)(ptr - start), is_encoded);
     }
 
     if (http_uri_finalize(uri) == -1)
@@ -488,6 +507,253 @@ path:
     return 1;
 }
 
+static int
+http_uri_check_query(const char *query, size_t length) {
+    const char *ptr, *end, *start;
+
+    /* This function reports the same errors as http_query_parameters_parse()
+     * without decoding anything. */
+
+    if (length == 0)
+        return 0;
+
+    ptr = query;
+    end = query + length;
+
+    for (;;) {
+        /* Name */
+        start = ptr;
+        while (ptr < end && *ptr != '&' && *ptr != ';' && *ptr != '=')
+            ptr++;
+
+        if (ptr == start) {
+            http_set_error("empty query parameter name");
+            return -1;
+        }
+
+        /* Value (optional) */
+        if (ptr < end && *ptr == '=') {
+            ptr++; /* skip '=' */
+
+            start = ptr;
+            while (ptr < end && *ptr != '&' && *ptr != ';')
+                ptr++;
+
+            if (ptr == start) {
+                http_set_error("empty query parameter value");
+                return -1;
+            }
+        }
+
+        if (ptr == end)
+            break;
+
+        ptr++; /* skip '&' or ';' */
+    }
+
+    return 0;
+}
+
+static int
+http_uri_check_escape_sequence(const char *ptr) {
+    int d;
+
+    if (ptr[1] == '\0' || ptr[2] == '\0') {
+        http_set_error("truncated escape sequence");
+        return -1;
+    }
+
+    if (http_read_hex_digit((unsigned char)ptr[1], &d) == -1
+     || http_read_hex_digit((unsigned char)ptr[2], &d) == -1) {
+        http_set_error("invalid escape sequence");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+http_uri_component_set(struct http_uri_component *component,
+                       const char *value) {
+    http_uri_component_free(component);
+
+    component->value = http_strdup(value);
+    component->is_allocated = true;
+}
+
+static void
+http_uri_component_set_span(struct http_uri *uri,
+                            struct http_uri_component *component,
+                            const char *str, size_t length, bool is_encoded) {
+    char *value;
+
+    value = uri->buffer + uri->buffer_length;
+
+    memcpy(value, str, length);
+    value[length] = '\0';
+
+    uri->buffer_length += length + 1;
+
+    component->value = value;
+    component->decoded_value = NULL;
+    component->is_decoded = false;
+    component->is_allocated = false;
+
+    if (is_encoded) {
+        /* The decoded value is never longer than the encoded one */
+        component->decoded_value = uri->buffer + uri->buffer_length;
+        uri->buffer_length += length + 1;
+    }
+}
+
+static void
+http_uri_component_free(struct http_uri_component *component) {
+    if (component->is_allocated)
+        http_free(component->value);
+
+    memset(component, 0, sizeof(struct http_uri_component));
+}
+
+static const char *
+http_uri_component_value(const struct http_uri_component *component) {
+    if (!component->decoded_value)
+        return component->value;
+
+    if (!component->is_decoded) {
+        struct http_uri_component *mcomponent;
+
+        /* Escape sequences were validated during parsing, decoding cannot
+         * fail. */
+        mcomponent = (struct http_uri_component *)component;
+
+        http_uri_decode_component(mcomponent->value,
+                                  mcomponent->decoded_value);
+        mcomponent->is_decoded = true;
+    }
+
+    return component->decoded_value;
+}
+
+static void
+http_uri_parse_query_parameters(const struct http_uri *uri) {
+    struct http_uri *muri;
+
+    if (!uri->query)
+        return;
+
+    /* Query parameters are parsed on first access; the query was validated
+     * by http_uri_parse(). */
+    muri = (struct http_uri *)uri;
+
+    if (http_query_parameters_parse(muri->query, &muri->query_parameters,
+                                    &muri->nb_query_parameters) == -1) {
+        muri->query_parameters = NULL;
+        muri->nb_query_parameters = 0;
+    }
+
+    muri->query = NULL;
+}
+
+char *
+http_canonicalize_path(const char *path) {
+    const char *ptr;
+    char *canonical, *optr;
+
+    /* Produce a single representation for all the paths designating the
+     * same resource:
+     *
+     * - Escape sequences are decoded. Encoded separators and null characters
+     *   are rejected since they would change the meaning of the path once
+     *   decoded.
+     * - Empty segments are removed.
+     * - Dot segments are resolved (RFC 3986 5.2.4) after decoding, so that
+     *   "%2e%2e" cannot be used to escape a directory. ".." segments never
+     *   go above the root.
+     *
+     * The canonical path is never longer than the original path. */
+
+    if (*path != '/') {
+        http_set_error("path is not absolute");
+        return NULL;
+    }
+
+    canonical = http_malloc(strlen(path) + 1);
+
+    optr = canonical;
+    *optr++ = '/';
+
+    ptr = path;
+    for (;;) {
+        char *segment;
+        size_t length;
+
+        while (*ptr == '/')
+            ptr++;
+
+        if (*ptr == '\0')
+            break;
+
+        /* Segment */
+        segment = optr;
+
+        while (*ptr != '/' && *ptr != '\0') {
+            if (*ptr == '%') {
+                int d1, d2;
+                char c;
+
+                if (ptr[1] == '\0' || ptr[2] == '\0') {
+                    http_set_error("truncated escape sequence");
+                    goto error;
+                }
+
+                if (http_read_hex_digit((unsigned char)ptr[1], &d1) == -1
+                 || http_read_hex_digit((unsigned char)ptr[2], &d2) == -1) {
+                    http_set_error("invalid escape sequence");
+                    goto error;
+                }
+
+                c = (char)((d1 << 4) | d2);
+                if (c == '/' || c == '\\') {
+                    http_set_error("encoded separator in path");
+                    goto error;
+                } else if (c == '\0') {
+                    http_set_error("encoded null character in path");
+                    goto error;
+                }
+
+                *optr++ = c;
+                ptr += 3;
+            } else {
+                *optr++ = *ptr++;
+            }
+        }
+
+        length = (size_t)(optr - segment);
+
+        if (length == 1 && segment[0] == '.') {
+            optr = segment;
+        } else if (length == 2 && segment[0] == '.' && segment[1] == '.') {
+            optr = segment;
+
+            /* Remove the previous segment if there is one */
+            if (optr - canonical > 1) {
+                optr--;
+                while (optr[-1] != '/')
+                    optr--;
+            }
+        } else if (*ptr == '/') {
+            *optr++ = '/';
+        }
+    }
+
+    *optr = '\0';
+    return canonical;
+
+error:
+    http_free(canonical);
+    return NULL;
+}
+
 char *
 http_uri_decode_query_component(const char *str, size_t sz) {
     const char *iptr;
@@ -640,7 +906,7 @@ http_uri_encode(const struct http_uri *uri) {
     struct bf_buffer *buf;
     char *str;
 
-    if (!uri->host) {
+    if (!http_uri_host(uri)) {
         http_set_error("uri does not have a host");
         return NULL;
     }
@@ -648,36 +914,38 @@ http_uri_encode(const struct http_uri *uri) {
     buf = bf_buffer_new(0);
 
     /* Scheme */
-    if (uri->scheme) {
-        http_uri_encode_component(uri->scheme, buf);
+    if (http_uri_scheme(uri)) {
+        http_uri_encode_component(http_uri_scheme(uri), buf);
         bf_buffer_add_string(buf, "://");
     }
 
     /* User and password */
-    if (uri->user) {
-        http_uri_encode_component(uri->user, buf);
+    if (http_uri_user(uri)) {
+        http_uri_encode_component(http_uri_user(uri), buf);
 
-        if (uri->password) {
+        if (http_uri_password(uri)) {
             bf_buffer_add(buf, ":", 1);
-            http_uri_encode_component(uri->password, buf);
+            http_uri_encode_component(http_uri_password(uri), buf);
         }
     }
 
     /* Host and port */
-    http_uri_encode_component(uri->host, buf);
+    http_uri_encode_component(http_uri_host(uri), buf);
 
-    if (uri->port) {
+    if (http_uri_port(uri)) {
         bf_buffer_add(buf, ":", 1);
-        http_uri_encode_component(uri->port, buf);
+        http_uri_encode_component(http_uri_port(uri), buf);
     }
 
     /* Path, query and fragment */
-    if (uri->path) {
-        http_uri_encode_component(uri->path, buf);
+    if (http_uri_path(uri)) {
+        http_uri_encode_component(http_uri_path(uri), buf);
     } else {
         bf_buffer_add(buf, "/", 1);
     }
 
+    http_uri_parse_query_parameters(uri);
+
     if (uri->nb_query_parameters > 0) {
         bf_buffer_add(buf, "?", 1);
 
@@ -695,9 +963,9 @@ http_uri_encode(const struct http_uri *uri) {
         }
     }
 
-    if (uri->fragment) {
+    if (http_uri_fragment(uri)) {
         bf_buffer_add(buf, "#", 1);
-        http_uri_encode_component(uri->fragment, buf);
+        http_uri_encode_component(http_uri_fragment(uri), buf);
     }
 
     str = bf_buffer_dup_string(buf);
@@ -716,7 +984,7 @@ http_uri_encode_path_and_query(const struct http_uri *uri) {
     struct bf_buffer *buf;
     char *str;
 
-    if (!uri->host) {
+    if (!http_uri_host(uri)) {
         http_set_error("uri does not have a host");
         return NULL;
     }
@@ -726,12 +994,14 @@ http_uri_encode_path_and_query(const struct http_uri *uri) {
         http_set_error("%s", bf_get_error());
         return NULL;
     }
-    if (uri->path) {
-        http_uri_encode_component(uri->path, buf);
+    if (http_uri_path(uri)) {
+        http_uri_encode_component(http_uri_path(uri), buf);
     } else {
         bf_buffer_add(buf, "/", 1);
     }
 
+    http_uri_parse_query_parameters(uri);
+
     if (uri->nb_query_parameters > 0) {
         bf_buffer_add(buf, "?", 1);
 
@@ -749,11 +1019,11 @@ http_uri_encode_path_and_query(const struct http_uri *uri) {
         }
     }
 
-    if (uri->fragment) {
+    if (http_uri_fragment(uri)) {
         if (bf_buffer_add(buf, "#", 1) == -1)
             goto error;
 
-        http_uri_encode_component(uri->fragment, buf);
+        http_uri_encode_component(http_uri_fragment(uri), buf);
     }
 
     str = bf_buffer_dup_string(buf);
@@ -771,59 +1041,42 @@ error:
     return NULL;
 }
 
-static char *
-http_uri_decode_component(const char *str, size_t sz) {
+static void
+http_uri_decode_component(const char *str, char *buf) {
     const char *iptr;
-    char *component, *optr;
-    size_t str_length, ilen;
-
-    str_length = strlen(str);
-    component = http_malloc(str_length + 1);
+    char *optr;
 
     iptr = str;
-    ilen = sz;
+    optr = buf;
 
-    optr = component;
-
-    while (ilen > 0) {
+    while (*iptr != '\0') {
         if (*iptr == '%') {
-            int d1, d2;
+            int d1 = 0, d2 = 0;
 
-            if (ilen < 3) {
-                http_set_error("truncated escape sequence");
-                goto error;
-            }
+            http_read_hex_digit((unsigned char)iptr[1], &d1);
+            http_read_hex_digit((unsigned char)iptr[2], &d2);
 
-            if (http_read_hex_digit((unsigned char)iptr[1], &d1) == -1
-             || http_read_hex_digit((unsigned char)iptr[2], &d2) == -1) {
-                http_set_error("invalid escape sequence");
-                goto error;
-            }
-
-            *optr++ = (d1 << 4) | d2;
+            *optr++ = (char)((d1 << 4) | d2);
             iptr += 3;
-            ilen -= 3;
         } else {
             *optr++ = *iptr++;
-            ilen--;
         }
     }
 
     *optr = '\0';
-    return component;
-
-error:
-    http_free(component);
-    return NULL;
 }
 
 static int
 http_uri_finalize(struct http_uri *uri) {
-    if (!uri->port && uri->scheme) {
-        if (strcasecmp(uri->scheme, "http") == 0) {
-            uri->port = http_strdup("80");
-        } else if (strcasecmp(uri->scheme, "https") == 0) {
-            uri->port = http_strdup("443");
+    const char *scheme;
+
+    scheme = http_uri_scheme(uri);
+
+    if (!uri->port.value && scheme) {
+        if (strcasecmp(scheme, "http") == 0) {
+            http_uri_component_set_span(uri, &uri->port, "80", 2, false);
+        } else if (strcasecmp(scheme, "https") == 0) {
+            http_uri_component_set_span(uri, &uri->port, "443", 3, false);
         }
     }
 
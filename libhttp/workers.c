@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HTTP_PLATFORM_LINUX
+/* pthread_attr_setaffinity_np() */
+#   define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#if defined(HTTP_PLATFORM_LINUX)
+#   include <dirent.h>
+#   include <sched.h>
+#elif defined(HTTP_PLATFORM_FREEBSD)
+#   include <pthread_np.h>
+#   include <sys/param.h>
+#   include <sys/cpuset.h>
+#endif
+
+#include "http.h"
+#include "internal.h"
+
+struct http_worker {
+    struct http_server *main_server;
+    struct http_server *server;
+
+    struct event_base *ev_base;
+
+    pthread_t thread;
+    bool thread_started;
+    bool thread_stopping;
+
+    int cpu; /* -1 if the thread is not pinned */
+    int node; /* -1 if unknown */
+
+    /* Shared with the thread of the main server */
+    size_t nb_connections; /* including queued connections */
+};
+
+static int http_worker_init_thread_attr(struct http_worker *,
+                                        pthread_attr_t *);
+static void *http_worker_main(void *);
+
+struct http_worker *
+http_worker_new(struct http_server *main_server) {
+    struct http_worker *worker;
+
+    worker = http_malloc0(sizeof(struct http_worker));
+
+    worker->main_server = main_server;
+
+    worker->cpu = -1;
+    worker->node = -1;
+
+    worker->ev_base = event_base_new();
+    if (!worker->ev_base) {
+        http_set_error("cannot create event base: %s", strerror(errno));
+        goto error;
+    }
+
+    worker->server = http_server_new_worker(main_server, worker,
+                                            worker->ev_base);
+    if (!worker->server)
+        goto error;
+
+    return worker;
+
+error:
+    http_worker_delete(worker);
+    return NULL;
+}
+
+void
+http_worker_delete(struct http_worker *worker) {
+    if (!worker)
+        return;
+
+    http_worker_stop(worker);
+    http_worker_join(worker);
+
+    /* The thread has stopped, the worker can be destroyed from the current
+     * thread. Connections which were not processed yet are closed. */
+    http_server_delete(worker->server);
+
+    if (worker->ev_base)
+        event_base_free(worker->ev_base);
+
+    memset(worker, 0, sizeof(struct http_worker));
+    http_free(worker);
+}
+
+int
+http_worker_start(struct http_worker *worker) {
+    sigset_t set, old_set;
+    pthread_attr_t attr;
+    int ret;
+
+    if (http_worker_init_thread_attr(worker, &attr) == -1)
+        return -1;
+
+    /* Signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old_set);
+
+    ret = pthread_create(&worker->thread, &attr, http_worker_main, worker);
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        http_set_error("cannot create thread: %s", strerror(ret));
+        return -1;
+    }
+
+    worker->thread_started = true;
+    return 0;
+}
+
+void
+http_worker_stop(struct http_worker *worker) {
+    if (!worker->thread_started || worker->thread_stopping)
+        return;
+
+    if (http_server_stop_loop(worker->server) == -1) {
+        http_server_error(worker->main_server, "cannot stop worker: %s",
+                          http_get_error());
+    }
+
+    worker->thread_stopping = true;
+}
+
+void
+http_worker_join(struct http_worker *worker) {
+    if (!worker->thread_started)
+        return;
+
+    pthread_join(worker->thread, NULL);
+
+    worker->thread_started = false;
+    worker->thread_stopping = false;
+}
+
+void
+http_worker_close_connections(struct http_worker *worker) {
+    assert(!worker->thread_started);
+
+    http_server_close_connections(worker->server);
+}
+
+void
+http_worker_pin(struct http_worker *worker, int cpu) {
+    assert(!worker->thread_started);
+
+    worker->cpu = cpu;
+    worker->node = http_cpu_node(cpu);
+}
+
+int
+http_worker_node(const struct http_worker *worker) {
+    return worker->node;
+}
+
+const struct http_server *
+http_worker_server(const struct http_worker *worker) {
+    return worker->server;
+}
+
+int
+http_worker_post(struct http_worker *worker, http_server_task fn, void *arg) {
+    return http_server_post(worker->server, fn, arg);
+}
+
+size_t
+http_worker_nb_connections(const struct http_worker *worker) {
+    return __atomic_load_n(&worker->nb_connections, __ATOMIC_RELAXED);
+}
+
+int
+http_worker_dispatch_connection(struct http_worker *worker, int sock,
+                                const struct sockaddr_storage *addr,
+                                socklen_t addrlen) {
+    /* Count the connection before it is queued: the worker may close it
+     * before we return. */
+    __atomic_add_fetch(&worker->nb_connections, 1, __ATOMIC_RELAXED);
+
+    if (http_server_post_connection(worker->server, sock,
+                                    addr, addrlen) == -1) {
+        __atomic_sub_fetch(&worker->nb_connections, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+http_worker_on_connection_closed(struct http_worker *worker) {
+    __atomic_sub_fetch(&worker->nb_connections, 1, __ATOMIC_RELAXED);
+}
+
+int
+http_cpu_node(int cpu) {
+#if defined(HTTP_PLATFORM_LINUX)
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+    int node;
+
+    /* The directory of each cpu contains a link to its node */
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    node = -1;
+
+    while ((entry = readdir(dir))) {
+        unsigned long value;
+        const char *ptr;
+        char *end;
+
+        if (strncmp(entry->d_name, "node", 4) != 0)
+            continue;
+
+        ptr = entry->d_name + 4;
+        if (*ptr < '0' || *ptr > '9')
+            continue;
+
+        value = strtoul(ptr, &end, 10);
+        if (*end != '\0' || value > INT_MAX)
+            continue;
+
+        node = (int)value;
+        break;
+    }
+
+    closedir(dir);
+    return node;
+#else
+    return -1;
+#endif
+}
+
+int
+http_allowed_cpus(int **pcpus, size_t *pnb_cpus) {
+#if defined(HTTP_PLATFORM_LINUX)
+    cpu_set_t set;
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    cpuset_t set;
+#endif
+#if defined(HTTP_PLATFORM_LINUX) || defined(HTTP_PLATFORM_FREEBSD)
+    int *cpus;
+    size_t nb_cpus;
+#endif
+
+    *pcpus = NULL;
+    *pnb_cpus = 0;
+
+#if defined(HTTP_PLATFORM_LINUX)
+    CPU_ZERO(&set);
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == -1) {
+        http_set_error("cannot get cpu affinity: %s", strerror(errno));
+        return -1;
+    }
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    CPU_ZERO(&set);
+
+    if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+                           sizeof(cpuset_t), &set) == -1) {
+        http_set_error("cannot get cpu affinity: %s", strerror(errno));
+        return -1;
+    }
+#endif
+
+#if defined(HTTP_PLATFORM_LINUX) || defined(HTTP_PLATFORM_FREEBSD)
+    /* Allowed CPUs are not necessarily contiguous (cpusets, offline CPUs) */
+    nb_cpus = (size_t)CPU_COUNT(&set);
+    if (nb_cpus == 0)
+        return 0;
+
+    cpus = http_calloc(nb_cpus, sizeof(int));
+    nb_cpus = 0;
+
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[nb_cpus++] = (int)cpu;
+    }
+
+    *pcpus = cpus;
+    *pnb_cpus = nb_cpus;
+#endif
+
+    return 0;
+}
+
+static int
+http_worker_init_thread_attr(struct http_worker *worker,
+                             pthread_attr_t *attr) {
+#if defined(HTTP_PLATFORM_LINUX)
+    cpu_set_t set;
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    cpuset_t set;
+#endif
+    int ret;
+
+    ret = pthread_attr_init(attr);
+    if (ret != 0) {
+        http_set_error("cannot initialize thread attributes: %s",
+                       strerror(ret));
+        return -1;
+    }
+
+    if (worker->cpu == -1)
+        return 0;
+
+    /* Pin the thread before it runs, so that the memory it allocates for
+     * connections is placed on its node from the start. */
+#if defined(HTTP_PLATFORM_LINUX)
+    CPU_ZERO(&set);
+    CPU_SET((size_t)worker->cpu, &set);
+
+    ret = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set);
+#elif defined(HTTP_PLATFORM_FREEBSD)
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+
+    ret = pthread_attr_setaffinity_np(attr, sizeof(cpuset_t), &set);
+#else
+    ret = 0;
+#endif
+
+    if (ret != 0) {
+        http_set_error("cannot pin thread to cpu %d: %s",
+                       worker->cpu, strerror(ret));
+        pthread_attr_destroy(attr);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *
+http_worker_main(void *arg) {
+    struct http_worker *worker;
+
+    worker = arg;
+
+    if (event_base_dispatch(worker->ev_base) == -1) {
+        http_server_error(worker->server, "cannot run event loop: %s",
+                          strerror(errno));
+    }
+
+    /* Connections still running a handler are deleted by the main thread,
+     * which releases their stacks to its own pool. */
+    http_coroutine_release_stacks();
+
+    http_iconv_release_descriptors();
+    http_accept_release_cache();
+
+    return NULL;
+}
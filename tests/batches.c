@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <unistd.h>
+
+#include "http.h"
+#include "internal.h"
+
+#include "tests.h"
+
+#define HTTPT_NB_CLIENTS 3
+
+struct httpt_batch_state {
+    size_t nb_a_calls;
+    size_t nb_a_requests;
+    size_t nb_b_calls;
+};
+
+static void httpt_on_batch_a(struct http_connection **,
+                             const struct http_msg **, size_t, void *);
+static void httpt_on_batch_b(struct http_connection **,
+                             const struct http_msg **, size_t, void *);
+
+TEST(close_during_batch) {
+    const char *paths[HTTPT_NB_CLIENTS] = {"/a", "/a", "/b"};
+    struct httpt_batch_state state;
+    struct event_base *ev_base;
+    struct http_server *server;
+    struct http_cfg cfg;
+    int socks[HTTPT_NB_CLIENTS];
+    char buf[1024];
+    uint16_t port;
+    int lsock;
+
+    memset(&state, 0, sizeof(struct httpt_batch_state));
+
+    ev_base = event_base_new();
+    TEST_PTR_NOT_NULL(ev_base);
+
+    lsock = httpt_open_listener(&port);
+    TEST_TRUE(lsock >= 0);
+
+    http_cfg_init_server(&cfg);
+    cfg.u.server.listener_socks = &lsock;
+    cfg.u.server.nb_listener_socks = 1;
+
+    server = http_server_new(&cfg, ev_base);
+    TEST_PTR_NOT_NULL(server);
+
+    http_server_set_msg_handler_arg(server, &state);
+    TEST_INT_EQ(http_server_add_batch_route(server, HTTP_GET, "/a",
+                                            httpt_on_batch_a, NULL), 0);
+    TEST_INT_EQ(http_server_add_batch_route(server, HTTP_GET, "/b",
+                                            httpt_on_batch_b, NULL), 0);
+
+    /* Accept all connections first, so that all requests are read during
+     * the same iteration of the event loop and end up in the same batch */
+    for (size_t i = 0; i < HTTPT_NB_CLIENTS; i++) {
+        socks[i] = httpt_connect(port);
+        TEST_TRUE(socks[i] >= 0);
+    }
+
+    for (int i = 0; i < 100 && server->nb_connections < HTTPT_NB_CLIENTS; i++)
+        event_base_loop(ev_base, EVLOOP_NONBLOCK);
+    TEST_UINT_EQ(server->nb_connections, HTTPT_NB_CLIENTS);
+
+    for (size_t i = 0; i < HTTPT_NB_CLIENTS; i++) {
+        int len;
+
+        len = snprintf(buf, sizeof(buf),
+                       "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                       paths[i]);
+        TEST_INT_EQ(write(socks[i], buf, (size_t)len), len);
+    }
+
+    /* Let the kernel deliver the requests before polling */
+    usleep(50000);
+    event_base_loop(ev_base, EVLOOP_ONCE);
+
+    for (int i = 0; i < 10; i++)
+        event_base_loop(ev_base, EVLOOP_NONBLOCK);
+
+    /* The handler of /a answered the first request, and closed the second
+     * connection of its group and the connection waiting for /b */
+    TEST_UINT_EQ(state.nb_a_calls, 1);
+    TEST_UINT_EQ(state.nb_a_requests, 2);
+    TEST_UINT_EQ(state.nb_b_calls, 0);
+
+    TEST_UINT_EQ(server->nb_connections, 1);
+
+    TEST_TRUE(httpt_read_response(socks[0], buf, sizeof(buf)) > 0);
+    TEST_TRUE(strncmp(buf, "HTTP/1.1 200 ", 13) == 0);
+
+    TEST_INT_EQ(httpt_read_response(socks[1], buf, sizeof(buf)), 0);
+    TEST_INT_EQ(httpt_read_response(socks[2], buf, sizeof(buf)), 0);
+
+    for (size_t i = 0; i < HTTPT_NB_CLIENTS; i++)
+        close(socks[i]);
+
+    http_server_delete(server);
+    http_cfg_free(&cfg);
+    event_base_free(ev_base);
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    suite = test_suite_new("batches");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    TEST_RUN(suite, close_during_batch);
+
+    test_suite_print_results_and_exit(suite);
+}
+
+static void
+httpt_on_batch_a(struct http_connection **connections,
+                 const struct http_msg **msgs, size_t nb_connections,
+                 void *arg) {
+    struct httpt_batch_state *state;
+    struct http_connection *connection;
+    struct http_server *server;
+
+    state = arg;
+    server = connections[0]->server;
+
+    state->nb_a_calls++;
+    state->nb_a_requests += nb_connections;
+
+    /* Close the connection of another group before its handler is called */
+    for (connection = server->connections_first; connection;
+         connection = connection->next) {
+        if (connection->current_route
+         && strcmp(connection->current_route->path, "/b") == 0) {
+            http_connection_shutdown(connection);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < nb_connections; i++) {
+        if (i == 0) {
+            http_connection_send_response(connections[i], HTTP_OK, NULL);
+        } else {
+            http_connection_shutdown(connections[i]);
+        }
+    }
+}
+
+static void
+httpt_on_batch_b(struct http_connection **connections,
+                 const struct http_msg **msgs, size_t nb_connections,
+                 void *arg) {
+    struct httpt_batch_state *state;
+
+    state = arg;
+
+    state->nb_b_calls++;
+
+    for (size_t i = 0; i < nb_connections; i++)
+        http_connection_send_response(connections[i], HTTP_OK, NULL);
+}
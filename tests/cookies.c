@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+#include "tests.h"
+
+#define HTTPT_BEGIN(...)                                              \
+    do {                                                              \
+        const char *values[] = {__VA_ARGS__};                         \
+                                                                      \
+        http_msg_init(&msg, HTTP_MSG_REQUEST);                        \
+                                                                      \
+        for (size_t i = 0; i < HTTP_ARRAY_NB_ELEMENTS(values); i++) { \
+            struct http_header header;                                \
+                                                                      \
+            header.name = http_strdup("Cookie");                      \
+            header.value = http_strdup(values[i]);                    \
+            http_msg_add_header(&msg, &header);                       \
+        }                                                             \
+    } while (0)
+
+#define HTTPT_END() http_msg_free(&msg)
+
+#define HTTPT_COOKIE_EQ(cookie_, name_, value_)                          \
+    do {                                                                 \
+        const struct http_cookie_view *cookie;                           \
+                                                                         \
+        cookie = cookie_;                                                \
+        TEST_TRUE(cookie != NULL);                                       \
+        TEST_UINT_EQ(cookie->name_length, strlen(name_));                \
+        TEST_TRUE(memcmp(cookie->name, name_, strlen(name_)) == 0);      \
+        TEST_UINT_EQ(cookie->value_length, strlen(value_));              \
+        TEST_TRUE(memcmp(cookie->value, value_, strlen(value_)) == 0);   \
+    } while (0)
+
+TEST(parsing) {
+    struct http_msg msg;
+
+    HTTPT_BEGIN("a=1");
+    TEST_UINT_EQ(http_request_nb_cookies(&msg), 1);
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 0), "a", "1");
+    HTTPT_END();
+
+    HTTPT_BEGIN("a=1; b=2;c=3");
+    TEST_UINT_EQ(http_request_nb_cookies(&msg), 3);
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 0), "a", "1");
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 1), "b", "2");
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 2), "c", "3");
+    HTTPT_END();
+
+    /* Empty values and quoted values */
+    HTTPT_BEGIN("a=; b=\"x y\"; c=\"\"");
+    TEST_UINT_EQ(http_request_nb_cookies(&msg), 3);
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 0), "a", "");
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 1), "b", "x y");
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 2), "c", "");
+    HTTPT_END();
+
+    /* Values can contain '=' characters */
+    HTTPT_BEGIN("token=YWJj==");
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 0), "token", "YWJj==");
+    HTTPT_END();
+
+    /* Whitespace and invalid pairs */
+    HTTPT_BEGIN("  a = 1 ;; b;=2; c=3  ; ");
+    TEST_UINT_EQ(http_request_nb_cookies(&msg), 2);
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 0), "a", "1");
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 1), "c", "3");
+    HTTPT_END();
+
+    /* Several header fields */
+    HTTPT_BEGIN("a=1; b=2", "c=3");
+    TEST_UINT_EQ(http_request_nb_cookies(&msg), 3);
+    HTTPT_COOKIE_EQ(http_request_cookie(&msg, 2), "c", "3");
+    HTTPT_END();
+
+    /* No cookie */
+    HTTPT_BEGIN("");
+    TEST_UINT_EQ(http_request_nb_cookies(&msg), 0);
+    TEST_PTR_NULL(http_request_get_cookie(&msg, "a"));
+    HTTPT_END();
+}
+
+TEST(lookup) {
+    struct http_msg msg;
+
+    HTTPT_BEGIN("session=abc; theme=dark; lang=fr; Session=def; session=xyz; "
+                "a=1; sessions=2; sessio=3");
+
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "session"),
+                    "session", "abc");
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "Session"),
+                    "Session", "def");
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "theme"), "theme", "dark");
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "lang"), "lang", "fr");
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "a"), "a", "1");
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "sessions"),
+                    "sessions", "2");
+    HTTPT_COOKIE_EQ(http_request_get_cookie(&msg, "sessio"), "sessio", "3");
+
+    TEST_PTR_NULL(http_request_get_cookie(&msg, "SESSION"));
+    TEST_PTR_NULL(http_request_get_cookie(&msg, "b"));
+    TEST_PTR_NULL(http_request_get_cookie(&msg, "zzz"));
+    TEST_PTR_NULL(http_request_get_cookie(&msg, ""));
+
+    TEST_TRUE(http_cookie_view_name_is(http_request_cookie(&msg, 1),
+                                       "theme"));
+    TEST_TRUE(!http_cookie_view_name_is(http_request_cookie(&msg, 1),
+                                        "them"));
+
+    HTTPT_END();
+}
+
+TEST(set_cookies) {
+    struct http_set_cookie cookie;
+
+#define HTTPT_SET_COOKIE_EQ(expected_)                \
+    do {                                              \
+        char *value;                                  \
+                                                      \
+        value = http_set_cookie_format(&cookie);      \
+        if (!value)                                   \
+            TEST_ABORT("%s", http_get_error());       \
+                                                      \
+        TEST_STRING_EQ(value, expected_);             \
+        http_free(value);                             \
+    } while (0)
+
+#define HTTPT_INVALID_SET_COOKIE()                      \
+    TEST_PTR_NULL(http_set_cookie_format(&cookie))
+
+    http_set_cookie_init(&cookie, "a", "1");
+    HTTPT_SET_COOKIE_EQ("a=1");
+
+    http_set_cookie_init(&cookie, "a", "");
+    HTTPT_SET_COOKIE_EQ("a=");
+
+    http_set_cookie_init(&cookie, "a", "\"x\"");
+    HTTPT_SET_COOKIE_EQ("a=\"x\"");
+
+    http_set_cookie_init(&cookie, "session", "abc");
+    cookie.domain = "example.com";
+    cookie.path = "/";
+    cookie.has_max_age = true;
+    cookie.max_age = 3600;
+    cookie.secure = true;
+    cookie.http_only = true;
+    cookie.same_site = HTTP_COOKIE_SAME_SITE_LAX;
+    HTTPT_SET_COOKIE_EQ("session=abc; Domain=example.com; Path=/; "
+                        "Max-Age=3600; Secure; HttpOnly; SameSite=Lax");
+
+    http_set_cookie_init(&cookie, "session", "");
+    cookie.has_max_age = true;
+    cookie.max_age = 0;
+    HTTPT_SET_COOKIE_EQ("session=; Max-Age=0");
+
+    http_set_cookie_init(&cookie, "a", "1");
+    cookie.expires = 1;
+    HTTPT_SET_COOKIE_EQ("a=1; Expires=Thu, 01 Jan 1970 00:00:01 +0000");
+
+    /* Invalid cookies */
+    http_set_cookie_init(&cookie, "", "1");
+    HTTPT_INVALID_SET_COOKIE();
+
+    http_set_cookie_init(&cookie, "a b", "1");
+    HTTPT_INVALID_SET_COOKIE();
+
+    http_set_cookie_init(&cookie, "a", "1;b=2");
+    HTTPT_INVALID_SET_COOKIE();
+
+    http_set_cookie_init(&cookie, "a", "x y");
+    HTTPT_INVALID_SET_COOKIE();
+
+    http_set_cookie_init(&cookie, "a", "1");
+    cookie.path = "/; Secure";
+    HTTPT_INVALID_SET_COOKIE();
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    suite = test_suite_new("cookies");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    TEST_RUN(suite, parsing);
+    TEST_RUN(suite, lookup);
+    TEST_RUN(suite, set_cookies);
+
+    test_suite_print_results_and_exit(suite);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <unistd.h>
+
+#include "http.h"
+#include "internal.h"
+
+#include "tests.h"
+
+struct httpt_coroutine_state {
+    size_t nb_calls;
+    bool send_after_shutdown_failed;
+};
+
+static void httpt_on_close(struct http_connection *,
+                           const struct http_msg *, void *);
+
+TEST(shutdown_from_handler) {
+    const char *request = "GET /close HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    struct httpt_coroutine_state state;
+    struct http_route_options options;
+    struct event_base *ev_base;
+    struct http_server *server;
+    struct http_cfg cfg;
+    char buf[1024];
+    uint16_t port;
+    int lsock, sock;
+
+    memset(&state, 0, sizeof(struct httpt_coroutine_state));
+
+    ev_base = event_base_new();
+    TEST_PTR_NOT_NULL(ev_base);
+
+    lsock = httpt_open_listener(&port);
+    TEST_TRUE(lsock >= 0);
+
+    http_cfg_init_server(&cfg);
+    cfg.u.server.listener_socks = &lsock;
+    cfg.u.server.nb_listener_socks = 1;
+
+    server = http_server_new(&cfg, ev_base);
+    TEST_PTR_NOT_NULL(server);
+
+    http_server_set_msg_handler_arg(server, &state);
+
+    http_route_options_init(&options, &cfg);
+    options.use_coroutine = true;
+    TEST_INT_EQ(http_server_add_route(server, HTTP_GET, "/close",
+                                      httpt_on_close, &options), 0);
+    http_route_options_free(&options);
+
+    sock = httpt_connect(port);
+    TEST_TRUE(sock >= 0);
+
+    TEST_INT_EQ(write(sock, request, strlen(request)),
+                (ssize_t)strlen(request));
+
+    /* Let the kernel deliver the request before polling */
+    usleep(50000);
+
+    for (int i = 0; i < 20; i++)
+        event_base_loop(ev_base, EVLOOP_NONBLOCK);
+
+    /* The handler ran once, saw the request aborted, and the connection was
+     * closed once it returned */
+    TEST_UINT_EQ(state.nb_calls, 1);
+    TEST_TRUE(state.send_after_shutdown_failed);
+    TEST_UINT_EQ(server->nb_connections, 0);
+
+    TEST_INT_EQ(httpt_read_response(sock, buf, sizeof(buf)), 0);
+
+    close(sock);
+
+    http_server_delete(server);
+    http_cfg_free(&cfg);
+    event_base_free(ev_base);
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    suite = test_suite_new("coroutines");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    TEST_RUN(suite, shutdown_from_handler);
+
+    test_suite_print_results_and_exit(suite);
+}
+
+static void
+httpt_on_close(struct http_connection *connection,
+               const struct http_msg *msg, void *arg) {
+    struct httpt_coroutine_state *state;
+
+    state = arg;
+
+    state->nb_calls++;
+
+    http_connection_shutdown(connection);
+
+    /* The request was aborted by the shutdown */
+    if (http_connection_send_response_with_body(connection, HTTP_OK, NULL,
+                                                "ok", 2) == -1
+     || http_connection_suspend(connection) == -1) {
+        state->send_after_shutdown_failed = true;
+    }
+}
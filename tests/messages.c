@@ -93,6 +93,8 @@ TEST(request_lines) {
     HTTPT_INVALID_REQUEST_LINE("GET /abcdefgh HTTP/1.0\r\n\r\n",
                                HTTP_REQUEST_URI_TOO_LONG);
     HTTPT_INVALID_REQUEST_LINE("GET /abcdefgh", HTTP_REQUEST_URI_TOO_LONG);
+    HTTPT_INVALID_REQUEST_LINE("GET /a%2Fb HTTP/1.0\r\n\r\n",
+                               HTTP_BAD_REQUEST);
 
     /* Invalid version */
     HTTPT_INVALID_REQUEST_LINE("GET / \r\n\r\n", HTTP_BAD_REQUEST);
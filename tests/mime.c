@@ -138,6 +138,145 @@ TEST(invalid_media_types) {
     HTTPT_INVALID_MEDIA_TYPE("text/plain; a=\"foo\";");
 }
 
+TEST(interned_media_types) {
+    struct http_media_type *media_type, *media_type2;
+
+#define HTTPT_INTERNED_MEDIA_TYPE_IS(str_, id_)                           \
+    do {                                                                 \
+        media_type = http_media_type_intern(str_);                       \
+        if (!media_type)                                                 \
+            TEST_ABORT("cannot parse media type: %s", http_get_error()); \
+        TEST_INT_EQ(http_media_type_id(media_type), id_);                \
+    } while (0)
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("application/json",
+                                 HTTP_MEDIA_TYPE_APPLICATION_JSON);
+    TEST_PTR_EQ(media_type,
+                http_media_type_get(HTTP_MEDIA_TYPE_APPLICATION_JSON));
+    media_type2 = http_media_type_intern("Application/JSON");
+    TEST_PTR_EQ(media_type2, media_type);
+    http_media_type_delete(media_type);
+    http_media_type_delete(media_type2);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("application/x-www-form-urlencoded",
+                        HTTP_MEDIA_TYPE_APPLICATION_X_WWW_FORM_URLENCODED);
+    TEST_STRING_EQ(http_media_type_base_string(media_type),
+                   "application/x-www-form-urlencoded");
+    http_media_type_delete(media_type);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("text/plain; charset=utf-8",
+                                 HTTP_MEDIA_TYPE_TEXT_PLAIN);
+    media_type2 = http_media_type_intern("TEXT/plain; Charset=utf-8");
+    TEST_PTR_EQ(media_type2, media_type);
+    TEST_STRING_EQ(http_media_type_string(media_type),
+                   "text/plain; charset=utf-8");
+    TEST_STRING_EQ(http_media_type_get_parameter(media_type, "charset"),
+                   "utf-8");
+    http_media_type_delete(media_type);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("text/plain; charset=UTF-8",
+                                 HTTP_MEDIA_TYPE_TEXT_PLAIN);
+    TEST_STRING_EQ(http_media_type_get_parameter(media_type, "charset"),
+                   "UTF-8");
+    http_media_type_delete(media_type);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("multipart/form-data; boundary=a1b2c3",
+                                 HTTP_MEDIA_TYPE_MULTIPART_FORM_DATA);
+    TEST_STRING_EQ(http_media_type_string(media_type),
+                   "multipart/form-data; boundary=a1b2c3");
+    TEST_STRING_EQ(http_media_type_base_string(media_type),
+                   "multipart/form-data");
+    TEST_STRING_EQ(http_media_type_get_subtype(media_type), "form-data");
+    TEST_STRING_EQ(http_media_type_get_parameter(media_type, "boundary"),
+                   "a1b2c3");
+    http_media_type_delete(media_type);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("multipart/form-data; boundary=\"a b\"",
+                                 HTTP_MEDIA_TYPE_MULTIPART_FORM_DATA);
+    TEST_STRING_EQ(http_media_type_get_parameter(media_type, "boundary"),
+                   "a b");
+    http_media_type_delete(media_type);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("text/plain; charset=iso-8859-1",
+                                 HTTP_MEDIA_TYPE_TEXT_PLAIN);
+    TEST_STRING_EQ(http_media_type_get_parameter(media_type, "charset"),
+                   "iso-8859-1");
+    http_media_type_delete(media_type);
+
+    HTTPT_INTERNED_MEDIA_TYPE_IS("text/csv", HTTP_MEDIA_TYPE_OTHER);
+    TEST_STRING_EQ(http_media_type_string(media_type), "text/csv");
+    http_media_type_delete(media_type);
+
+    TEST_PTR_NULL(http_media_type_intern("text/"));
+}
+
+TEST(extensions) {
+#define HTTPT_EXTENSION_IS(extension_, media_type_)                      \
+    do {                                                                \
+        const char *media_type;                                         \
+                                                                        \
+        media_type = http_mime_type_from_extension(extension_);         \
+        if (!media_type)                                                \
+            TEST_ABORT("unknown extension %s", extension_);             \
+        TEST_STRING_EQ(media_type, media_type_);                        \
+    } while (0)
+
+    HTTPT_EXTENSION_IS("html", "text/html");
+    HTTPT_EXTENSION_IS("HTML", "text/html");
+    HTTPT_EXTENSION_IS("css", "text/css");
+    HTTPT_EXTENSION_IS("js", "application/javascript");
+    HTTPT_EXTENSION_IS("json", "application/json");
+    HTTPT_EXTENSION_IS("png", "image/png");
+    HTTPT_EXTENSION_IS("JPeG", "image/jpeg");
+    HTTPT_EXTENSION_IS("svg", "image/svg+xml");
+    HTTPT_EXTENSION_IS("woff2", "font/woff2");
+    HTTPT_EXTENSION_IS("mp4", "video/mp4");
+    HTTPT_EXTENSION_IS("7z", "application/x-7z-compressed");
+    HTTPT_EXTENSION_IS("docx", "application/vnd.openxmlformats-"
+                       "officedocument.wordprocessingml.document");
+
+    TEST_PTR_NULL(http_mime_type_from_extension(""));
+    TEST_PTR_NULL(http_mime_type_from_extension("foo"));
+    TEST_PTR_NULL(http_mime_type_from_extension("htmlx"));
+    TEST_PTR_NULL(http_mime_type_from_extension("averyveryverylongextension"));
+
+    TEST_STRING_EQ(http_mime_type_from_path("/var/www/index.html"),
+                   "text/html");
+    TEST_STRING_EQ(http_mime_type_from_path("archive.tar.gz"),
+                   "application/gzip");
+    TEST_PTR_NULL(http_mime_type_from_path("/var/www/README"));
+    TEST_PTR_NULL(http_mime_type_from_path("/var/www.html/README"));
+}
+
+TEST(sniffing) {
+#define HTTPT_SNIFFED_TYPE_IS(data_, media_type_)                        \
+    do {                                                                \
+        const char *media_type;                                         \
+                                                                        \
+        media_type = http_mime_sniff_type(data_, sizeof(data_) - 1);    \
+        if (!media_type)                                                \
+            TEST_ABORT("cannot sniff media type");                      \
+        TEST_STRING_EQ(media_type, media_type_);                        \
+    } while (0)
+
+    HTTPT_SNIFFED_TYPE_IS("\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR", "image/png");
+    HTTPT_SNIFFED_TYPE_IS("\xff\xd8\xff\xe0\x00\x10JFIF", "image/jpeg");
+    HTTPT_SNIFFED_TYPE_IS("GIF89a\x01\x00", "image/gif");
+    HTTPT_SNIFFED_TYPE_IS("RIFF\x24\x00\x00\x00WEBPVP8 ", "image/webp");
+    HTTPT_SNIFFED_TYPE_IS("BM\x46\x00\x00\x00\x00\x00\x00\x00"
+                          "\x36\x00\x00\x00\x28\x00\x00\x00", "image/bmp");
+    HTTPT_SNIFFED_TYPE_IS("%PDF-1.4\n", "application/pdf");
+    HTTPT_SNIFFED_TYPE_IS("\x1f\x8b\x08\x00", "application/gzip");
+    HTTPT_SNIFFED_TYPE_IS("\x00\x00\x00\x18" "ftypmp42", "video/mp4");
+    HTTPT_SNIFFED_TYPE_IS("  \n<!DOCTYPE html><html>", "text/html");
+    HTTPT_SNIFFED_TYPE_IS("<HTML><BODY>", "text/html");
+    HTTPT_SNIFFED_TYPE_IS("hello world\n", "text/plain");
+    HTTPT_SNIFFED_TYPE_IS("BMW 320d, 2014, 150000 km\n", "text/plain");
+
+    TEST_PTR_NULL(http_mime_sniff_type("", 0));
+    TEST_PTR_NULL(http_mime_sniff_type("\x01\x02\x03\x04", 4));
+}
+
 TEST(q_encoding) {
 #define HTTPT_QENCODING_IS(string_, encoded_string_)            \
     do {                                                        \
@@ -165,6 +304,9 @@ main(int argc, char **argv) {
 
     TEST_RUN(suite, media_types);
     TEST_RUN(suite, invalid_media_types);
+    TEST_RUN(suite, interned_media_types);
+    TEST_RUN(suite, extensions);
+    TEST_RUN(suite, sniffing);
     TEST_RUN(suite, q_encoding);
 
     test_suite_print_results_and_exit(suite);
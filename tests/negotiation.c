@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "http.h"
+#include "internal.h"
+
+#include "tests.h"
+
+#define HTTPT_NEGOTIATE(func_, header_, expected_, ...)                     \
+    do {                                                                    \
+        const char *offers[] = {__VA_ARGS__};                               \
+        const char *expected, *offer;                                       \
+                                                                            \
+        expected = expected_;                                               \
+        offer = func_(header_, offers, HTTP_ARRAY_NB_ELEMENTS(offers));     \
+        if (expected) {                                                     \
+            TEST_STRING_EQ(offer, expected);                                \
+        } else {                                                            \
+            TEST_PTR_NULL(offer);                                           \
+        }                                                                   \
+    } while (0)
+
+TEST(media_types) {
+#define HTTPT_MEDIA_TYPE(header_, expected_, ...) \
+    HTTPT_NEGOTIATE(http_negotiate_media_type, header_, expected_, __VA_ARGS__)
+
+    /* No header */
+    HTTPT_MEDIA_TYPE(NULL, "text/html", "text/html", "text/plain");
+
+    /* Exact match */
+    HTTPT_MEDIA_TYPE("text/plain", "text/plain", "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("TEXT/Plain", "text/plain", "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("image/png", NULL, "text/html", "text/plain");
+
+    /* Quality values */
+    HTTPT_MEDIA_TYPE("text/html;q=0.5, text/plain", "text/plain",
+                     "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("text/html;q=0.5, text/plain;q=0.25", "text/html",
+                     "text/plain", "text/html");
+    HTTPT_MEDIA_TYPE("text/html;q=0, */*", "text/plain",
+                     "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("text/*;q=0.3, text/plain;q=0.7, */*;q=0.1",
+                     "text/plain", "application/json", "text/csv",
+                     "text/plain");
+
+    /* Server preference */
+    HTTPT_MEDIA_TYPE("text/html, application/json", "application/json",
+                     "application/json", "text/html");
+    HTTPT_MEDIA_TYPE("*/*", "application/json",
+                     "application/json", "text/html");
+
+    /* Wildcard precedence */
+    HTTPT_MEDIA_TYPE("text/*, text/html;q=0", "text/plain",
+                     "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("*/*;q=0.1, text/*;q=0", "application/json",
+                     "text/html", "application/json");
+    HTTPT_MEDIA_TYPE("text/*;q=0", NULL, "text/html", "text/plain");
+
+    /* Media type parameters */
+    HTTPT_MEDIA_TYPE("text/html;level=1, text/html;q=0.1",
+                     "text/html;level=1", "text/html", "text/html;level=1");
+    HTTPT_MEDIA_TYPE("text/html;level=1;q=0, text/*", "text/html",
+                     "text/html;level=1", "text/html");
+
+    /* Browser headers */
+    HTTPT_MEDIA_TYPE("text/html,application/xhtml+xml,application/xml;q=0.9,"
+                     "image/avif,image/webp,*/*;q=0.8",
+                     "text/html", "application/json", "text/html");
+    HTTPT_MEDIA_TYPE("text/html, image/gif, image/jpeg, *; q=.2, */*; q=.2",
+                     "image/gif", "application/json", "image/gif");
+
+    /* Invalid header values are ignored */
+    HTTPT_MEDIA_TYPE("text", "text/html", "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("text/plain;q=2", "text/html", "text/html", "text/plain");
+    HTTPT_MEDIA_TYPE("*/plain", "text/html", "text/html", "text/plain");
+}
+
+TEST(encodings) {
+#define HTTPT_ENCODING(header_, expected_, ...) \
+    HTTPT_NEGOTIATE(http_negotiate_encoding, header_, expected_, __VA_ARGS__)
+
+    HTTPT_ENCODING(NULL, "gzip", "gzip", "identity");
+
+    HTTPT_ENCODING("gzip, deflate, br", "br", "br", "gzip", "identity");
+    HTTPT_ENCODING("gzip;q=0.5, br;q=0.2", "gzip", "br", "gzip", "identity");
+
+    /* Identity is acceptable unless explicitly excluded */
+    HTTPT_ENCODING("", "identity", "gzip", "identity");
+    HTTPT_ENCODING("deflate", "identity", "gzip", "identity");
+    HTTPT_ENCODING("identity;q=0", NULL, "gzip", "identity");
+    HTTPT_ENCODING("*;q=0", NULL, "gzip", "identity");
+    HTTPT_ENCODING("*;q=0, identity", "identity", "gzip", "identity");
+
+    /* Wildcard */
+    HTTPT_ENCODING("*", "br", "br", "identity");
+    HTTPT_ENCODING("*, br;q=0", "gzip", "br", "gzip");
+}
+
+TEST(languages) {
+#define HTTPT_LANGUAGE(header_, expected_, ...) \
+    HTTPT_NEGOTIATE(http_negotiate_language, header_, expected_, __VA_ARGS__)
+
+    HTTPT_LANGUAGE(NULL, "en", "en", "fr");
+
+    HTTPT_LANGUAGE("fr", "fr", "en", "fr");
+    HTTPT_LANGUAGE("fr-FR, fr;q=0.9, en;q=0.5", "fr-FR",
+                   "en-US", "fr", "fr-FR");
+    HTTPT_LANGUAGE("fr-FR, fr;q=0.9, en;q=0.5", "fr",
+                   "en-US", "fr", "fr-CA");
+    HTTPT_LANGUAGE("de", NULL, "en", "fr");
+
+    /* Prefix matching */
+    HTTPT_LANGUAGE("en", "en-US", "fr", "en-US");
+    HTTPT_LANGUAGE("en", NULL, "fr", "eng");
+    HTTPT_LANGUAGE("en-US", NULL, "en");
+
+    /* Wildcard */
+    HTTPT_LANGUAGE("*", "en", "en", "fr");
+    HTTPT_LANGUAGE("fr, *;q=0.5", "fr", "en", "fr");
+    HTTPT_LANGUAGE("en;q=0, *", "fr", "en-GB", "fr");
+}
+
+TEST(cache) {
+    char header[2048];
+
+    /* Cached values must not depend on the negotiation type */
+    for (int i = 0; i < 3; i++) {
+        HTTPT_MEDIA_TYPE("*", "text/html", "text/html");
+        HTTPT_ENCODING("*", "gzip", "gzip");
+        HTTPT_LANGUAGE("*", "en", "en");
+    }
+
+    /* Eviction */
+    for (int i = 0; i < 100; i++) {
+        char language[16];
+
+        snprintf(language, sizeof(language), "l%d", i);
+
+        HTTPT_LANGUAGE(language, language, "en", language);
+        HTTPT_LANGUAGE("fr", "fr", "en", "fr");
+    }
+
+    /* Values which are too large to be cached */
+    memset(header, 0, sizeof(header));
+    for (int i = 0; i < 100; i++)
+        strcat(header, "text/plain;q=0.1, ");
+    strcat(header, "text/html");
+
+    HTTPT_MEDIA_TYPE(header, "text/html", "text/plain", "text/html");
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    suite = test_suite_new("negotiation");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    TEST_RUN(suite, media_types);
+    TEST_RUN(suite, encodings);
+    TEST_RUN(suite, languages);
+    TEST_RUN(suite, cache);
+
+    test_suite_print_results_and_exit(suite);
+}
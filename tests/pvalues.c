@@ -134,6 +134,12 @@ TEST(list) {
     TEST_STRING_EQ(pvalues.pvalues[2].value, "c");
     HTTPT_LIST_PVALUE_PARAMETER_IS(2, "c", "3");
     HTTPT_END_LIST();
+
+    HTTPT_BEGIN_LIST("a;x=1,b");
+    TEST_STRING_EQ(pvalues.pvalues[0].value, "a");
+    HTTPT_LIST_PVALUE_PARAMETER_IS(0, "x", "1");
+    TEST_STRING_EQ(pvalues.pvalues[1].value, "b");
+    HTTPT_END_LIST();
 }
 
 TEST(invalid_list) {
@@ -153,6 +159,93 @@ TEST(invalid_list) {
     HTTPT_INVALID_PVALUES("foo, ,bar");
 }
 
+TEST(iterator) {
+    struct http_pvalue_parameter_view param;
+    struct http_pvalue_iterator it;
+
+#define HTTPT_ITERATOR_NEXT_VALUE(value_)                                \
+    do {                                                                 \
+        if (http_pvalue_iterator_next(&it) != 1)                         \
+            TEST_ABORT("cannot read value: %s", http_get_error());       \
+        TEST_UINT_EQ(it.value_length, strlen(value_));                   \
+        TEST_TRUE(memcmp(it.value, value_, it.value_length) == 0);       \
+    } while (0)
+
+#define HTTPT_ITERATOR_NEXT_PARAMETER(name_, value_)                     \
+    do {                                                                 \
+        if (http_pvalue_iterator_next_parameter(&it, &param) != 1)       \
+            TEST_ABORT("cannot read parameter: %s", http_get_error());   \
+        TEST_TRUE(http_pvalue_parameter_view_name_is(&param, name_));    \
+        TEST_UINT_EQ(param.value_length, strlen(value_));                \
+        TEST_TRUE(memcmp(param.value, value_, param.value_length) == 0); \
+    } while (0)
+
+    http_pvalue_iterator_init(&it, "");
+    TEST_INT_EQ(http_pvalue_iterator_next(&it), 0);
+
+    http_pvalue_iterator_init(&it, "a,b , c");
+    HTTPT_ITERATOR_NEXT_VALUE("a");
+    HTTPT_ITERATOR_NEXT_VALUE("b");
+    HTTPT_ITERATOR_NEXT_VALUE("c");
+    TEST_INT_EQ(http_pvalue_iterator_next(&it), 0);
+
+    http_pvalue_iterator_init(&it, "Keep-Alive, Upgrade");
+    HTTPT_ITERATOR_NEXT_VALUE("Keep-Alive");
+    TEST_TRUE(http_pvalue_iterator_value_is(&it, "keep-alive"));
+    TEST_BOOL_EQ(http_pvalue_iterator_value_is(&it, "keep"), false);
+    HTTPT_ITERATOR_NEXT_VALUE("Upgrade");
+    TEST_INT_EQ(http_pvalue_iterator_next(&it), 0);
+
+    http_pvalue_iterator_init(&it,
+                              "a ;A=1 ,\tb ;b1=\"foo,bar\"; b2=2\t,  c; c=3");
+    HTTPT_ITERATOR_NEXT_VALUE("a");
+    HTTPT_ITERATOR_NEXT_PARAMETER("a", "1");
+    TEST_INT_EQ(http_pvalue_iterator_next_parameter(&it, &param), 0);
+    HTTPT_ITERATOR_NEXT_VALUE("b");
+    HTTPT_ITERATOR_NEXT_PARAMETER("b1", "foo,bar");
+    TEST_TRUE(param.is_quoted);
+    HTTPT_ITERATOR_NEXT_PARAMETER("b2", "2");
+    TEST_BOOL_EQ(param.is_quoted, false);
+    TEST_INT_EQ(http_pvalue_iterator_next_parameter(&it, &param), 0);
+    HTTPT_ITERATOR_NEXT_VALUE("c");
+    TEST_INT_EQ(http_pvalue_iterator_next(&it), 0);
+
+    /* Parameters can be skipped */
+    http_pvalue_iterator_init(&it, "a;x=1,b;y=2");
+    HTTPT_ITERATOR_NEXT_VALUE("a");
+    HTTPT_ITERATOR_NEXT_VALUE("b");
+    HTTPT_ITERATOR_NEXT_PARAMETER("y", "2");
+    TEST_INT_EQ(http_pvalue_iterator_next(&it), 0);
+
+#define HTTPT_INVALID_ITERATION(str_)                              \
+    do {                                                           \
+        int ret;                                                   \
+                                                                   \
+        http_pvalue_iterator_init(&it, str_);                      \
+        while ((ret = http_pvalue_iterator_next(&it)) == 1)        \
+            continue;                                              \
+                                                                   \
+        if (ret != -1)                                             \
+            TEST_ABORT("iterated on invalid pvalue list " str_);   \
+    } while (0)
+
+    HTTPT_INVALID_ITERATION(",foo");
+    HTTPT_INVALID_ITERATION(" , foo");
+    HTTPT_INVALID_ITERATION("foo,");
+    HTTPT_INVALID_ITERATION("foo, ");
+    HTTPT_INVALID_ITERATION("foo,,bar");
+    HTTPT_INVALID_ITERATION("foo?");
+    HTTPT_INVALID_ITERATION("foo;");
+    HTTPT_INVALID_ITERATION("foo; name");
+    HTTPT_INVALID_ITERATION("foo; name=");
+    HTTPT_INVALID_ITERATION("foo bar");
+    HTTPT_INVALID_ITERATION("foo;a=1 bar");
+    HTTPT_INVALID_ITERATION("foo; a=1;");
+    HTTPT_INVALID_ITERATION("foo; a=\"");
+    HTTPT_INVALID_ITERATION("foo; a=\"\\x\"");
+    HTTPT_INVALID_ITERATION("foo, bar; a=v@lue");
+}
+
 int
 main(int argc, char **argv) {
     struct test_suite *suite;
@@ -166,6 +259,7 @@ main(int argc, char **argv) {
     TEST_RUN(suite, invalid);
     TEST_RUN(suite, list);
     TEST_RUN(suite, invalid_list);
+    TEST_RUN(suite, iterator);
 
     test_suite_print_results_and_exit(suite);
 }
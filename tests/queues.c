@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "http.h"
+#include "internal.h"
+
+#include "tests.h"
+
+#define HTTPT_NB_PRODUCERS 4
+#define HTTPT_NB_ENTRIES_PER_PRODUCER 100000
+
+struct httpt_entry {
+    size_t producer;
+    size_t value;
+};
+
+struct httpt_producer {
+    struct http_mpsc_queue *queue;
+    size_t id;
+};
+
+static void *httpt_producer_main(void *);
+
+TEST(base) {
+    struct http_mpsc_queue *queue;
+    struct httpt_entry entry;
+
+    /* The number of entries is rounded to the next power of 2 */
+    queue = http_mpsc_queue_new(3, sizeof(struct httpt_entry));
+
+    TEST_TRUE(!http_mpsc_queue_pop(queue, &entry));
+
+    for (size_t i = 0; i < 4; i++) {
+        entry.producer = 0;
+        entry.value = i;
+        TEST_TRUE(http_mpsc_queue_push(queue, &entry));
+    }
+
+    entry.value = 4;
+    TEST_TRUE(!http_mpsc_queue_push(queue, &entry));
+
+    for (size_t i = 0; i < 4; i++) {
+        TEST_TRUE(http_mpsc_queue_pop(queue, &entry));
+        TEST_UINT_EQ(entry.value, i);
+    }
+
+    TEST_TRUE(!http_mpsc_queue_pop(queue, &entry));
+
+    /* Wrap around several times */
+    for (size_t i = 0; i < 10; i++) {
+        entry.value = i;
+        TEST_TRUE(http_mpsc_queue_push(queue, &entry));
+        entry.value = i * 10;
+        TEST_TRUE(http_mpsc_queue_push(queue, &entry));
+
+        TEST_TRUE(http_mpsc_queue_pop(queue, &entry));
+        TEST_UINT_EQ(entry.value, i);
+        TEST_TRUE(http_mpsc_queue_pop(queue, &entry));
+        TEST_UINT_EQ(entry.value, i * 10);
+    }
+
+    TEST_TRUE(!http_mpsc_queue_pop(queue, &entry));
+
+    http_mpsc_queue_delete(queue);
+}
+
+TEST(producers) {
+    struct httpt_producer producers[HTTPT_NB_PRODUCERS];
+    pthread_t threads[HTTPT_NB_PRODUCERS];
+    size_t next_values[HTTPT_NB_PRODUCERS];
+    struct http_mpsc_queue *queue;
+    struct httpt_entry entry;
+    size_t nb_entries;
+
+    queue = http_mpsc_queue_new(64, sizeof(struct httpt_entry));
+
+    for (size_t i = 0; i < HTTPT_NB_PRODUCERS; i++) {
+        int ret;
+
+        producers[i].queue = queue;
+        producers[i].id = i;
+
+        ret = pthread_create(&threads[i], NULL, httpt_producer_main,
+                             &producers[i]);
+        if (ret != 0)
+            TEST_ABORT("cannot create thread: %s", strerror(ret));
+
+        next_values[i] = 0;
+    }
+
+    /* Entries of each producer must be received in order */
+    nb_entries = 0;
+    while (nb_entries < HTTPT_NB_PRODUCERS * HTTPT_NB_ENTRIES_PER_PRODUCER) {
+        if (!http_mpsc_queue_pop(queue, &entry)) {
+            sched_yield();
+            continue;
+        }
+
+        TEST_TRUE(entry.producer < HTTPT_NB_PRODUCERS);
+        TEST_UINT_EQ(entry.value, next_values[entry.producer]);
+
+        next_values[entry.producer]++;
+        nb_entries++;
+    }
+
+    for (size_t i = 0; i < HTTPT_NB_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+
+    TEST_TRUE(!http_mpsc_queue_pop(queue, &entry));
+
+    http_mpsc_queue_delete(queue);
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    suite = test_suite_new("queues");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    TEST_RUN(suite, base);
+    TEST_RUN(suite, producers);
+
+    test_suite_print_results_and_exit(suite);
+}
+
+static void *
+httpt_producer_main(void *arg) {
+    struct httpt_producer *producer;
+    struct httpt_entry entry;
+
+    producer = arg;
+
+    entry.producer = producer->id;
+
+    for (size_t i = 0; i < HTTPT_NB_ENTRIES_PER_PRODUCER; i++) {
+        entry.value = i;
+
+        while (!http_mpsc_queue_push(producer->queue, &entry))
+            sched_yield();
+    }
+
+    return NULL;
+}
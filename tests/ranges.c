@@ -21,7 +21,7 @@
 
 #define HTTPT_BEGIN_RANGE_SET(str_, nb_ranges_)                         \
     do {                                                                \
-        if (http_ranges_parse(&set, str_) == -1)                        \
+        if (http_ranges_parse(&set, str_, 0) == -1)                     \
             TEST_ABORT("cannot parse range set: %s", http_get_error()); \
         TEST_UINT_EQ(set.nb_ranges, nb_ranges_);                        \
     } while (0)
@@ -31,7 +31,7 @@
 
 #define HTTPT_INVALID_RANGE_SET(str_)                                   \
     do {                                                                \
-        if (http_ranges_parse(&set, str_) == 0)                         \
+        if (http_ranges_parse(&set, str_, 0) == 0)                      \
             TEST_ABORT("parsed invalid range set");                     \
     } while (0)
 
@@ -176,7 +176,7 @@ TEST(simplify) {
 #define HTTPT_BEGIN_SIMPLIFIED_RANGE_SET(str_, nb_ranges_, entity_sz_,  \
                                          nb_sranges_)                   \
     do {                                                                \
-        if (http_ranges_parse(&set, str_) == -1)                        \
+        if (http_ranges_parse(&set, str_, 0) == -1)                     \
             TEST_ABORT("cannot parse range set: %s", http_get_error()); \
         TEST_UINT_EQ(set.nb_ranges, nb_ranges_);                        \
         http_ranges_simplify(&set, entity_sz_, &sset);                  \
@@ -258,6 +258,63 @@ TEST(simplify) {
     HTTPT_SIMPLIFIED_RANGE_EQ(&sset.ranges[1], 5, 8);
     HTTPT_SIMPLIFIED_RANGE_EQ(&sset.ranges[2], 14, 19);
     HTTPT_END_SIMPLIFIED_RANGE_SET();
+
+    HTTPT_BEGIN_SIMPLIFIED_RANGE_SET("bytes=16-18,0-3,9-12,5-8", 4, 20, 3);
+    HTTPT_SIMPLIFIED_RANGE_EQ(&sset.ranges[0], 0, 3);
+    HTTPT_SIMPLIFIED_RANGE_EQ(&sset.ranges[1], 5, 12);
+    HTTPT_SIMPLIFIED_RANGE_EQ(&sset.ranges[2], 16, 18);
+    HTTPT_END_SIMPLIFIED_RANGE_SET();
+
+    HTTPT_BEGIN_SIMPLIFIED_RANGE_SET("bytes=0-3,25-30,4-5", 3, 20, 1);
+    HTTPT_SIMPLIFIED_RANGE_EQ(&sset.ranges[0], 0, 5);
+    HTTPT_END_SIMPLIFIED_RANGE_SET();
+
+    HTTPT_BEGIN_SIMPLIFIED_RANGE_SET("bytes=20-25,30-", 2, 20, 0);
+    HTTPT_END_SIMPLIFIED_RANGE_SET();
+}
+
+TEST(limit) {
+    struct http_ranges set;
+
+    if (http_ranges_parse(&set, "bytes=0-1,2-3,4-5", 3) == -1)
+        TEST_ABORT("cannot parse range set: %s", http_get_error());
+    TEST_UINT_EQ(set.nb_ranges, 3);
+    http_ranges_free(&set);
+
+    TEST_INT_EQ(http_ranges_parse(&set, "bytes=0-1,2-3,4-5,6-", 3), 1);
+    TEST_UINT_EQ(set.nb_ranges, 0);
+
+    TEST_INT_EQ(http_ranges_parse(&set, "bytes=0-1,2-3,4-5,-6", 3), 1);
+    TEST_UINT_EQ(set.nb_ranges, 0);
+
+    if (http_ranges_parse(&set, "bytes=0-1,2-3,4-5,6-", 0) != 0)
+        TEST_ABORT("cannot parse range set: %s", http_get_error());
+    TEST_UINT_EQ(set.nb_ranges, 4);
+    http_ranges_free(&set);
+}
+
+TEST(content_range) {
+    struct http_range range;
+    char buf[128];
+    size_t len;
+
+#define HTTPT_CONTENT_RANGE_IS(first_, last_, entity_sz_, string_)         \
+    do {                                                                  \
+        range.has_first = true;                                           \
+        range.first = first_;                                             \
+        range.has_last = true;                                            \
+        range.last = last_;                                               \
+                                                                          \
+        len = http_ranges_format_content_range(buf, &range, entity_sz_);  \
+        buf[len] = '\0';                                                  \
+        TEST_STRING_EQ(buf, string_);                                     \
+        TEST_UINT_EQ(http_ranges_content_range_length(&range, entity_sz_), \
+                     len);                                                \
+    } while (0)
+
+    HTTPT_CONTENT_RANGE_IS(0, 0, 1, "0-0/1");
+    HTTPT_CONTENT_RANGE_IS(0, 9, 10, "0-9/10");
+    HTTPT_CONTENT_RANGE_IS(100, 1999, 123456, "100-1999/123456");
 }
 
 TEST(unsatisfiable) {
@@ -266,7 +323,7 @@ TEST(unsatisfiable) {
 #define HTTPT_RANGE_SET_IS_SATISFIABLE(str_, nb_ranges_, entity_sz_,    \
                                        is_satisfiable_)                 \
     do {                                                                \
-        if (http_ranges_parse(&set, str_) == -1)                        \
+        if (http_ranges_parse(&set, str_, 0) == -1)                     \
             TEST_ABORT("cannot parse range set: %s", http_get_error()); \
         TEST_UINT_EQ(set.nb_ranges, nb_ranges_);                        \
         TEST_BOOL_EQ(http_ranges_is_satisfiable(&set, entity_sz_),      \
@@ -290,7 +347,7 @@ TEST(length) {
 
 #define HTTPT_RANGE_SET_LENGTH_EQ(str_, entity_sz_, length_)             \
     do {                                                                 \
-        if (http_ranges_parse(&set, str_) == -1)                         \
+        if (http_ranges_parse(&set, str_, 0) == -1)                      \
             TEST_ABORT("cannot parse range set: %s", http_get_error());  \
         http_ranges_simplify(&set, entity_sz_, &sset);                   \
         TEST_UINT_EQ(http_ranges_length(&sset), length_);                \
@@ -324,6 +381,8 @@ main(int argc, char **argv) {
     TEST_RUN(suite, simplify);
     TEST_RUN(suite, unsatisfiable);
     TEST_RUN(suite, length);
+    TEST_RUN(suite, limit);
+    TEST_RUN(suite, content_range);
 
     test_suite_print_results_and_exit(suite);
 }
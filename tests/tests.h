@@ -22,6 +22,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
 #include <utest.h>
 
 #define HTTPT_DIE(fmt_, ...)                      \
@@ -129,4 +134,73 @@
         }                                                                     \
     } while (0)
 
+/* Sockets used to talk to a server running in the test process */
+static inline int
+httpt_open_listener(uint16_t *pport) {
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    addrlen = sizeof(struct sockaddr_in);
+
+    if (bind(sock, (struct sockaddr *)&addr, addrlen) == -1
+     || listen(sock, 16) == -1
+     || getsockname(sock, (struct sockaddr *)&addr, &addrlen) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    *pport = ntohs(addr.sin_port);
+    return sock;
+}
+
+static inline int
+httpt_connect(uint16_t port) {
+    struct sockaddr_in addr;
+    struct timeval tv;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Return the number of bytes read, 0 if the connection was closed, or -1
+ * on error (including timeouts) */
+static inline ssize_t
+httpt_read_response(int sock, char *buf, size_t sz) {
+    ssize_t ret;
+
+    ret = read(sock, buf, sz - 1);
+    if (ret >= 0)
+        buf[ret] = '\0';
+
+    return ret;
+}
+
 #endif
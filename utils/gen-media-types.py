@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2014 Nicolas Martyanoff
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Generate a perfect hash table mapping file extensions to media types.
+#
+# Usage: gen-media-types.py <media-types.txt> <media-types.c>
+#
+# Keys are first hashed with a seed of zero to select a bucket; each bucket
+# stores the seed used to hash its keys a second time, chosen so that every
+# key ends up in its own slot ("hash and displace").
+
+import sys
+
+MAX_EXTENSION_LENGTH = 15
+NB_BUCKETS = 128
+NB_SLOTS = 512
+
+
+def hash_extension(extension, seed):
+    h = (2166136261 ^ seed) & 0xffffffff
+    for c in extension.encode("ascii"):
+        h ^= c
+        h = (h * 16777619) & 0xffffffff
+    h ^= h >> 15
+    h = (h * 0x2c1b3c6d) & 0xffffffff
+    h ^= h >> 12
+    return h
+
+
+def read_table(path):
+    table = {}
+
+    with open(path) as file:
+        for line in file:
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+
+            media_type, *extensions = line.split()
+            for extension in extensions:
+                extension = extension.lower()
+                if len(extension) > MAX_EXTENSION_LENGTH:
+                    sys.exit("extension too long: %s" % extension)
+                if extension in table:
+                    sys.exit("duplicate extension: %s" % extension)
+                table[extension] = media_type
+
+    return table
+
+
+def generate_hash(extensions):
+    if len(extensions) > NB_SLOTS:
+        sys.exit("too many extensions")
+
+    buckets = [[] for i in range(NB_BUCKETS)]
+    for extension in extensions:
+        buckets[hash_extension(extension, 0) % NB_BUCKETS].append(extension)
+
+    seeds = [0] * NB_BUCKETS
+    slots = [None] * NB_SLOTS
+
+    order = sorted(range(NB_BUCKETS), key=lambda i: -len(buckets[i]))
+    for i in order:
+        bucket = buckets[i]
+        if not bucket:
+            continue
+
+        for seed in range(1, 1 << 16):
+            indexes = [hash_extension(e, seed) % NB_SLOTS for e in bucket]
+            if len(set(indexes)) != len(indexes):
+                continue
+            if any(slots[index] is not None for index in indexes):
+                continue
+
+            for extension, index in zip(bucket, indexes):
+                slots[index] = extension
+            seeds[i] = seed
+            break
+        else:
+            sys.exit("cannot find a seed for bucket %d" % i)
+
+    return seeds, slots
+
+
+LICENSE = """\
+/*
+ * Copyright (c) 2014 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+"""
+
+
+def c_string(string):
+    return '"' + string.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def write_source(path, table, seeds, slots):
+    with open(path, "w") as file:
+        w = file.write
+
+        w(LICENSE)
+
+        w("/* Generated by utils/gen-media-types.py from utils/media-types.txt,\n"
+          " * do not edit. */\n\n")
+
+        w("#include <string.h>\n\n")
+        w('#include "http.h"\n')
+        w('#include "internal.h"\n\n')
+
+        w("#define HTTP_MEDIA_TYPE_EXTENSION_MAX_LENGTH %d\n"
+          % MAX_EXTENSION_LENGTH)
+        w("#define HTTP_MEDIA_TYPE_NB_BUCKETS %d\n" % NB_BUCKETS)
+        w("#define HTTP_MEDIA_TYPE_NB_SLOTS %d\n\n" % NB_SLOTS)
+
+        w("struct http_media_type_extension {\n"
+          "    const char *extension;\n"
+          "    const char *media_type;\n"
+          "};\n\n")
+
+        w("static const uint16_t\n"
+          "http_media_type_extension_seeds[HTTP_MEDIA_TYPE_NB_BUCKETS] = {\n")
+        for i in range(0, NB_BUCKETS, 8):
+            w("    " + ", ".join("%3d" % s for s in seeds[i:i + 8]) + ",\n")
+        w("};\n\n")
+
+        w("static const struct http_media_type_extension\n"
+          "http_media_type_extensions[HTTP_MEDIA_TYPE_NB_SLOTS] = {\n")
+        for index, extension in enumerate(slots):
+            if extension is None:
+                continue
+            w("    [%d] = {%s, %s},\n"
+              % (index, c_string(extension), c_string(table[extension])))
+        w("};\n\n")
+
+        w("""static uint32_t
+http_media_type_extension_hash(const char *extension, size_t len,
+                               uint32_t seed) {
+    uint32_t h;
+
+    h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)extension[i];
+        h *= 16777619u;
+    }
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+
+    return h;
+}
+
+const char *
+http_mime_type_from_extension(const char *extension) {
+    const struct http_media_type_extension *entry;
+    char lowered[HTTP_MEDIA_TYPE_EXTENSION_MAX_LENGTH + 1];
+    uint32_t seed, h;
+    size_t len;
+
+    for (len = 0; extension[len] != '\\0'; len++) {
+        unsigned char c;
+
+        if (len >= HTTP_MEDIA_TYPE_EXTENSION_MAX_LENGTH)
+            return NULL;
+
+        c = (unsigned char)extension[len];
+        lowered[len] = (c >= 'A' && c <= 'Z') ? (char)(c + 32) : (char)c;
+    }
+
+    lowered[len] = '\\0';
+
+    h = http_media_type_extension_hash(lowered, len, 0);
+    seed = http_media_type_extension_seeds[h % HTTP_MEDIA_TYPE_NB_BUCKETS];
+
+    h = http_media_type_extension_hash(lowered, len, seed);
+    entry = http_media_type_extensions + h % HTTP_MEDIA_TYPE_NB_SLOTS;
+
+    if (!entry->extension || strcmp(entry->extension, lowered) != 0)
+        return NULL;
+
+    return entry->media_type;
+}
+""")
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s <media-types.txt> <media-types.c>" % sys.argv[0])
+
+    table = read_table(sys.argv[1])
+    seeds, slots = generate_hash(sorted(table))
+    write_source(sys.argv[2], table, seeds, slots)
+
+
+if __name__ == "__main__":
+    main()
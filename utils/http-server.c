@@ -67,12 +67,15 @@ static void https_upload_buffered_post(struct http_connection *,
                                        const struct http_msg *, void *);
 static void https_upload_unbuffered_post(struct http_connection *,
                                          const struct http_msg *, void *);
+static void https_stream_get(struct http_connection *,
+                             const struct http_msg *, void *);
 
 int
 main(int argc, char **argv) {
     const char *ssl_crt, *ssl_key;
-    bool bufferize_body, use_ssl;
+    bool bufferize_body, use_ssl, pin_workers;
     struct http_cfg cfg;
+    size_t nb_workers;
     int opt;
 
     ssl_crt = NULL;
@@ -81,8 +84,11 @@ main(int argc, char **argv) {
     bufferize_body = true;
     use_ssl = false;
 
+    nb_workers = 0;
+    pin_workers = false;
+
     opterr = 0;
-    while ((opt = getopt(argc, argv, "bc:hk:us")) != -1) {
+    while ((opt = getopt(argc, argv, "bc:hk:psuw:")) != -1) {
         switch (opt) {
         case 'c':
             ssl_crt = optarg;
@@ -100,6 +106,10 @@ main(int argc, char **argv) {
             ssl_key = optarg;
             break;
 
+        case 'p':
+            pin_workers = true;
+            break;
+
         case 'u':
             bufferize_body = false;
             break;
@@ -108,6 +118,10 @@ main(int argc, char **argv) {
             use_ssl = true;
             break;
 
+        case 'w':
+            nb_workers = strtoul(optarg, NULL, 10);
+            break;
+
         case '?':
             https_usage(argv[0], 1);
         }
@@ -123,6 +137,8 @@ main(int argc, char **argv) {
     cfg.use_ssl = use_ssl;
     cfg.u.server.ssl_certificate = ssl_crt;
     cfg.u.server.ssl_key = ssl_key;
+    cfg.u.server.nb_workers = nb_workers;
+    cfg.u.server.pin_workers = pin_workers;
 
     cfg.error_hook = https_on_error;
     cfg.trace_hook = https_on_trace;
@@ -149,15 +165,17 @@ main(int argc, char **argv) {
 
 static void
 https_usage(const char *argv0, int exit_code) {
-    printf("Usage: %s [-bhu]\n"
+    printf("Usage: %s [-bhpusw]\n"
             "\n"
             "Options:\n"
             "  -b         bufferize requests\n"
             "  -c <path>  set the ssl certificate\n"
             "  -h         display help\n"
             "  -k <path>  set the ssl private key\n"
+            "  -p         pin worker threads to cpus\n"
             "  -u         do not bufferize requests\n"
-            "  -s         use ssl\n",
+            "  -s         use ssl\n"
+            "  -w <nb>    use <nb> worker threads\n",
             argv0);
     exit(exit_code);
 }
@@ -209,8 +227,13 @@ HTTPS_SETUP_SIGNAL_HANDLER(https.ev_sigterm, SIGTERM);
 
     http_server_add_route(https.server, HTTP_GET, "/foo",
                           https_foo_get, NULL);
+
+    http_route_options_init(&options, cfg);
+    options.use_coroutine = true;
     http_server_add_route(https.server, HTTP_POST, "/foo",
-                          https_foo_post, NULL);
+                          https_foo_post, &options);
+    http_route_options_free(&options);
+
     http_server_add_route(https.server, HTTP_GET, "/foo/bar",
                           https_foo_bar_get, NULL);
 
@@ -224,11 +247,19 @@ HTTPS_SETUP_SIGNAL_HANDLER(https.ev_sigterm, SIGTERM);
     http_route_options_free(&options);
 
     http_route_options_init(&options, cfg);
-    options.bufferize_body = false;
+    options.use_coroutine = true;
     options.max_content_length = 0;
     http_server_add_route(https.server, HTTP_POST, "/upload/unbuffered",
                           https_upload_unbuffered_post, &options);
     http_route_options_free(&options);
+
+    http_route_options_init(&options, cfg);
+    options.use_coroutine = true;
+    http_server_add_route(https.server, HTTP_GET, "/stream",
+                          https_stream_get, &options);
+    http_route_options_free(&options);
+
+    http_server_add_admin_route(https.server, "/admin/connections");
 }
 
 static void
@@ -325,19 +356,26 @@ https_foo_get(struct http_connection *connection, const struct http_msg *msg,
 static void
 https_foo_post(struct http_connection *connection, const struct http_msg *msg,
                void *arg) {
-    static size_t content_len = 0;
-
     struct http_headers *headers;
+    char buf[BUFSIZ];
     char body[128];
-    size_t bodysz;
+    size_t bodysz, content_len, sz;
+    int ret;
+
+    content_len = 0;
 
-    content_len += http_msg_body_length(msg);
+    while ((ret = http_connection_read_body(connection, buf, sizeof(buf),
+                                            &sz)) == 1) {
+        content_len += sz;
 
-    printf("%zu bytes received (total: %zu)\n",
-           http_msg_body_length(msg), content_len);
+        printf("%zu bytes received (total: %zu)\n", sz, content_len);
+    }
 
-    if (!http_msg_is_complete(msg))
+    if (ret == -1) {
+        http_connection_error(connection, "cannot read body: %s",
+                              http_get_error());
         return;
+    }
 
     snprintf(body, sizeof(body), "%zu bytes received\n", content_len);
     bodysz = strlen(body);
@@ -347,8 +385,6 @@ https_foo_post(struct http_connection *connection, const struct http_msg *msg,
 
     http_connection_send_response_with_body(connection, HTTP_OK, headers,
                                             body, bodysz);
-
-    content_len = 0;
 }
 
 static void
@@ -440,25 +476,27 @@ https_upload_buffered_post(struct http_connection *connection,
 static void
 https_upload_unbuffered_post(struct http_connection *connection,
                              const struct http_msg *msg, void *arg) {
-    static size_t content_len = 0;
-
     struct http_headers *headers;
+    char buf[BUFSIZ];
     char body[128];
-    size_t bodysz;
+    size_t bodysz, content_len, sz;
+    int ret;
 
-    if (http_msg_aborted(msg)) {
-        http_connection_error(connection, "request processing aborted");
-        content_len = 0;
-        return;
-    }
+    content_len = 0;
 
-    content_len += http_msg_body_length(msg);
+    while ((ret = http_connection_read_body(connection, buf, sizeof(buf),
+                                            &sz)) == 1) {
+        content_len += sz;
 
-    http_connection_trace(connection, "%zu/%zu bytes received",
-                          http_msg_body_length(msg), content_len);
+        http_connection_trace(connection, "%zu/%zu bytes received",
+                              sz, content_len);
+    }
 
-    if (!http_msg_is_complete(msg))
+    if (ret == -1) {
+        http_connection_error(connection, "request processing aborted: %s",
+                              http_get_error());
         return;
+    }
 
     /* Send response */
     snprintf(body, sizeof(body), "%zu bytes received\n", content_len);
@@ -469,6 +507,30 @@ https_upload_unbuffered_post(struct http_connection *connection,
 
     http_connection_send_response_with_body(connection, HTTP_OK, headers,
                                             body, bodysz);
+}
 
-    content_len = 0;
+static void
+https_stream_get(struct http_connection *connection,
+                 const struct http_msg *msg, void *arg) {
+    struct http_headers *headers;
+    char line[64];
+
+    headers = http_headers_new();
+    http_headers_set_header(headers, "Content-Type", "text/plain");
+
+    if (http_connection_start_response(connection, HTTP_OK, headers) == -1) {
+        http_connection_error(connection, "cannot start response: %s",
+                              http_get_error());
+        return;
+    }
+
+    for (int i = 0; i < 100000; i++) {
+        snprintf(line, sizeof(line), "line %d\n", i);
+
+        if (http_connection_write_body(connection, line, strlen(line)) == -1) {
+            http_connection_error(connection, "cannot write body: %s",
+                                  http_get_error());
+            return;
+        }
+    }
 }